@@ -12,11 +12,7 @@ import android.util.Log;
 import android.os.Build;
 import android.content.res.AssetManager;
 
-import java.lang.StringBuilder;
-import java.io.BufferedReader;
-import java.io.FileReader;
 import java.io.File;
-import java.io.IOException;
 
 public class LlamaContext {
   public static final String NAME = "RNLlamaContext";
@@ -27,7 +23,7 @@ public class LlamaContext {
   private int jobId = -1;
   private DeviceEventManagerModule.RCTDeviceEventEmitter eventEmitter;
 
-  public LlamaContext(int id, ReactApplicationContext reactContext, ReadableMap params) {
+  public LlamaContext(int id, ReactApplicationContext reactContext, ReadableMap params, LoadProgressCallback loadProgressCallback) {
     if (LlamaContext.isArm64V8a() == false && LlamaContext.isX86_64() == false) {
       throw new IllegalStateException("Only 64-bit architectures are supported");
     }
@@ -40,6 +36,8 @@ public class LlamaContext {
       params.getString("model"),
       // boolean embedding,
       params.hasKey("embedding") ? params.getBoolean("embedding") : false,
+      // boolean embedding_only,
+      params.hasKey("embedding_only") ? params.getBoolean("embedding_only") : false,
       // int n_ctx,
       params.hasKey("n_ctx") ? params.getInt("n_ctx") : 512,
       // int n_batch,
@@ -63,7 +61,21 @@ public class LlamaContext {
       // float rope_freq_base,
       params.hasKey("rope_freq_base") ? (float) params.getDouble("rope_freq_base") : 0.0f,
       // float rope_freq_scale
-      params.hasKey("rope_freq_scale") ? (float) params.getDouble("rope_freq_scale") : 0.0f
+      params.hasKey("rope_freq_scale") ? (float) params.getDouble("rope_freq_scale") : 0.0f,
+      // boolean flash_attn
+      params.hasKey("flash_attn") ? params.getBoolean("flash_attn") : false,
+      // boolean repack_weights
+      params.hasKey("repack_weights") ? params.getBoolean("repack_weights") : false,
+      // boolean use_hugepages
+      params.hasKey("use_hugepages") ? params.getBoolean("use_hugepages") : false,
+      // int stream_budget_mb
+      params.hasKey("stream_budget_mb") ? params.getInt("stream_budget_mb") : 0,
+      // int compute_cap_mb
+      params.hasKey("compute_cap_mb") ? params.getInt("compute_cap_mb") : 0,
+      // String model_cache_path
+      params.hasKey("model_cache_path") ? params.getString("model_cache_path") : "",
+      // LoadProgressCallback load_progress_callback
+      loadProgressCallback
     );
     this.reactContext = reactContext;
     eventEmitter = reactContext.getJSModule(DeviceEventManagerModule.RCTDeviceEventEmitter.class);
@@ -80,6 +92,40 @@ public class LlamaContext {
     eventEmitter.emit("@RNLlama_onToken", event);
   }
 
+  public static class LoadProgressCallback {
+    int contextId;
+    boolean emitNeeded;
+    DeviceEventManagerModule.RCTDeviceEventEmitter eventEmitter;
+    volatile boolean cancelled = false;
+    int lastProgress = -1;
+
+    public LoadProgressCallback(int contextId, ReactApplicationContext reactContext, boolean emitNeeded) {
+      this.contextId = contextId;
+      this.emitNeeded = emitNeeded;
+      eventEmitter = reactContext.getJSModule(DeviceEventManagerModule.RCTDeviceEventEmitter.class);
+    }
+
+    public void cancel() {
+      cancelled = true;
+    }
+
+    public boolean isCancelled() {
+      return cancelled;
+    }
+
+    // called from native while the model is loaded, returns false to cancel the load
+    boolean onLoadProgress(int progress) {
+      if (emitNeeded && progress != lastProgress) {
+        lastProgress = progress;
+        WritableMap event = Arguments.createMap();
+        event.putInt("contextId", contextId);
+        event.putInt("progress", progress);
+        eventEmitter.emit("@RNLlama_onInitContextProgress", event);
+      }
+      return !cancelled;
+    }
+  }
+
   private static class PartialCompletionCallback {
     LlamaContext context;
     boolean emitNeeded;
@@ -139,6 +185,8 @@ public class LlamaContext {
       this.context,
       // String prompt,
       params.getString("prompt"),
+      // String[] prompt_segments,
+      params.hasKey("prompt_segments") ? params.getArray("prompt_segments").toArrayList().toArray(new String[0]) : new String[0],
       // String grammar,
       params.hasKey("grammar") ? params.getString("grammar") : "",
       // float temperature,
@@ -222,28 +270,8 @@ public class LlamaContext {
 
   static {
     Log.d(NAME, "Primary ABI: " + Build.SUPPORTED_ABIS[0]);
-    if (LlamaContext.isArm64V8a()) {
-      boolean loadV8fp16 = false;
-      if (LlamaContext.isArm64V8a()) {
-        // ARMv8.2a needs runtime detection support
-        String cpuInfo = LlamaContext.cpuInfo();
-        if (cpuInfo != null) {
-          Log.d(NAME, "CPU info: " + cpuInfo);
-          if (cpuInfo.contains("fphp")) {
-            Log.d(NAME, "CPU supports fp16 arithmetic");
-            loadV8fp16 = true;
-          }
-        }
-      }
-
-      if (loadV8fp16) {
-        Log.d(NAME, "Loading librnllama_v8fp16_va.so");
-        System.loadLibrary("rnllama_v8fp16_va");
-      } else {
-        Log.d(NAME, "Loading librnllama.so");
-        System.loadLibrary("rnllama");
-      }
-    } else if (LlamaContext.isX86_64()) {
+    if (LlamaContext.isArm64V8a() || LlamaContext.isX86_64()) {
+      // kernels for the CPU features of the device are selected by the native library at runtime
       Log.d(NAME, "Loading librnllama.so");
       System.loadLibrary("rnllama");
     }
@@ -257,26 +285,10 @@ public class LlamaContext {
     return Build.SUPPORTED_ABIS[0].equals("x86_64");
   }
 
-  private static String cpuInfo() {
-    File file = new File("/proc/cpuinfo");
-    StringBuilder stringBuilder = new StringBuilder();
-    try {
-      BufferedReader bufferedReader = new BufferedReader(new FileReader(file));
-      String line;
-      while ((line = bufferedReader.readLine()) != null) {
-          stringBuilder.append(line);
-      }
-      bufferedReader.close();
-      return stringBuilder.toString();
-    } catch (IOException e) {
-      Log.w(NAME, "Couldn't read /proc/cpuinfo", e);
-      return null;
-    }
-  }
-
   protected static native long initContext(
     String model,
     boolean embedding,
+    boolean embedding_only,
     int n_ctx,
     int n_batch,
     int n_threads,
@@ -288,7 +300,14 @@ public class LlamaContext {
     float lora_scaled,
     String lora_base,
     float rope_freq_base,
-    float rope_freq_scale
+    float rope_freq_scale,
+    boolean flash_attn,
+    boolean repack_weights,
+    boolean use_hugepages,
+    int stream_budget_mb,
+    int compute_cap_mb,
+    String model_cache_path,
+    LoadProgressCallback load_progress_callback
   );
   protected static native WritableMap loadSession(
     long contextPtr,
@@ -302,6 +321,7 @@ public class LlamaContext {
   protected static native WritableMap doCompletion(
     long context_ptr,
     String prompt,
+    String[] prompt_segments,
     String grammar,
     float temperature,
     int n_threads,
@@ -330,4 +350,7 @@ public class LlamaContext {
   protected static native boolean isEmbeddingEnabled(long contextPtr);
   protected static native WritableArray embedding(long contextPtr, String text);
   protected static native void freeContext(long contextPtr);
+  protected static native void setMemoryBudget(long budget, String evictDir);
+  protected static native void setIdleTrimTimeout(int timeoutMs);
+  protected static native long trimMemory();
 }
@@ -16,6 +16,7 @@ import com.facebook.react.bridge.WritableMap;
 import com.facebook.react.bridge.Arguments;
 
 import java.util.HashMap;
+import java.util.concurrent.ConcurrentHashMap;
 import java.util.Random;
 import java.io.File;
 import java.io.FileInputStream;
@@ -35,6 +36,8 @@ public class RNLlama implements LifecycleEventListener {
 
   private HashMap<Integer, LlamaContext> contexts = new HashMap<>();
 
+  private ConcurrentHashMap<Integer, LlamaContext.LoadProgressCallback> loadingContexts = new ConcurrentHashMap<>();
+
   private int llamaContextLimit = 1;
 
   public void setContextLimit(double limit, Promise promise) {
@@ -42,27 +45,54 @@ public class RNLlama implements LifecycleEventListener {
     promise.resolve(null);
   }
 
-  public void initContext(final ReadableMap params, final Promise promise) {
+  public void setMemoryBudget(double budgetMb, Promise promise) {
+    // idle contexts over the budget are evicted to session files in the cache directory
+    File evictDir = new File(reactContext.getCacheDir(), "rnllama");
+    evictDir.mkdirs();
+    LlamaContext.setMemoryBudget((long) (budgetMb * 1024 * 1024), evictDir.getAbsolutePath());
+    promise.resolve(null);
+  }
+
+  public void setIdleTrimTimeout(double timeoutMs, Promise promise) {
+    LlamaContext.setIdleTrimTimeout((int) timeoutMs);
+    promise.resolve(null);
+  }
+
+  public void initContext(double id, final ReadableMap params, final Promise promise) {
+    final int contextId = (int) id;
+    final LlamaContext.LoadProgressCallback loadProgressCallback = new LlamaContext.LoadProgressCallback(
+      contextId,
+      reactContext,
+      params.hasKey("use_progress_callback") ? params.getBoolean("use_progress_callback") : false
+    );
+    loadingContexts.put(contextId, loadProgressCallback);
     AsyncTask task = new AsyncTask<Void, Void, WritableMap>() {
       private Exception exception;
 
       @Override
       protected WritableMap doInBackground(Void... voids) {
         try {
-          int id = Math.abs(new Random().nextInt());
-          LlamaContext llamaContext = new LlamaContext(id, reactContext, params);
+          LlamaContext llamaContext = new LlamaContext(contextId, reactContext, params, loadProgressCallback);
+          if (loadProgressCallback.isCancelled()) {
+            if (llamaContext.getContext() != 0) {
+              llamaContext.release();
+            }
+            throw new Exception("Context initialization cancelled");
+          }
           if (llamaContext.getContext() == 0) {
             throw new Exception("Failed to initialize context");
           }
-          contexts.put(id, llamaContext);
+          contexts.put(contextId, llamaContext);
           WritableMap result = Arguments.createMap();
-          result.putInt("contextId", id);
+          result.putInt("contextId", contextId);
           result.putBoolean("gpu", false);
           result.putString("reasonNoGPU", "Currently not supported");
           return result;
         } catch (Exception e) {
           exception = e;
           return null;
+        } finally {
+          loadingContexts.remove(contextId);
         }
       }
 
@@ -79,6 +109,14 @@ public class RNLlama implements LifecycleEventListener {
     tasks.put(task, "initContext");
   }
 
+  public void cancelInitContext(double id, final Promise promise) {
+    LlamaContext.LoadProgressCallback loadProgressCallback = loadingContexts.get((int) id);
+    if (loadProgressCallback != null) {
+      loadProgressCallback.cancel();
+    }
+    promise.resolve(null);
+  }
+
   public void loadSession(double id, final String path, Promise promise) {
     final int contextId = (int) id;
     AsyncTask task = new AsyncTask<Void, Void, WritableMap>() {
@@ -390,6 +428,17 @@ public class RNLlama implements LifecycleEventListener {
 
   @Override
   public void onHostPause() {
+    if (contexts.isEmpty()) {
+      return;
+    }
+    // release the compute buffers and the free KV cache pages of the idle contexts while in the background
+    new Thread(new Runnable() {
+      @Override
+      public void run() {
+        long released = LlamaContext.trimMemory();
+        Log.d(NAME, "Trimmed idle contexts: " + released + " bytes released");
+      }
+    }).start();
   }
 
   @Override
@@ -123,6 +123,7 @@ Java_com_rnllama_LlamaContext_initContext(
     jobject thiz,
     jstring model_path_str,
     jboolean embedding,
+    jboolean embedding_only,
     jint n_ctx,
     jint n_batch,
     jint n_threads,
@@ -134,7 +135,14 @@ Java_com_rnllama_LlamaContext_initContext(
     jfloat lora_scaled,
     jstring lora_base_str,
     jfloat rope_freq_base,
-    jfloat rope_freq_scale
+    jfloat rope_freq_scale,
+    jboolean flash_attn,
+    jboolean repack_weights,
+    jboolean use_hugepages,
+    jint stream_budget_mb,
+    jint compute_cap_mb,
+    jstring model_cache_path_str,
+    jobject load_progress_callback
 ) {
     UNUSED(thiz);
 
@@ -144,6 +152,7 @@ Java_com_rnllama_LlamaContext_initContext(
     defaultParams.model = model_path_chars;
 
     defaultParams.embedding = embedding;
+    defaultParams.embedding_only = embedding_only;
 
     defaultParams.n_ctx = n_ctx;
     defaultParams.n_batch = n_batch;
@@ -171,21 +180,83 @@ Java_com_rnllama_LlamaContext_initContext(
     defaultParams.rope_freq_base = rope_freq_base;
     defaultParams.rope_freq_scale = rope_freq_scale;
 
+    defaultParams.flash_attn = flash_attn;
+
+    defaultParams.repack_weights = repack_weights;
+    defaultParams.use_hugepages = use_hugepages;
+    defaultParams.stream_budget_mb = stream_budget_mb;
+    defaultParams.compute_cap_mb = compute_cap_mb;
+
+    const char *model_cache_path_chars = env->GetStringUTFChars(model_cache_path_str, nullptr);
+    defaultParams.model_cache_path = model_cache_path_chars;
+
     auto llama = new rnllama::llama_rn_context();
+
+    // the callback reports the progress to JS and returns false once the load was cancelled
+    jclass cb_class = env->GetObjectClass(load_progress_callback);
+    jmethodID onLoadProgress = env->GetMethodID(cb_class, "onLoadProgress", "(I)Z");
+    llama->on_load_progress = [env, load_progress_callback, onLoadProgress](float progress) {
+        return (bool) env->CallBooleanMethod(load_progress_callback, onLoadProgress, (jint) (progress * 100));
+    };
+
     bool is_model_loaded = llama->loadModel(defaultParams);
+    llama->on_load_progress = nullptr;
+    // the handle is the rn context: the llama_context is recreated when an evicted context is restored
+    jlong context_ptr = 0;
 
     LOGI("[RNLlama] is_model_loaded %s", (is_model_loaded ? "true" : "false"));
     if (is_model_loaded) {
-      context_map[(long) llama->ctx] = llama;
+      context_ptr = reinterpret_cast<jlong>(llama);
+      context_map[(long) context_ptr] = llama;
     } else {
-      llama_free(llama->ctx);
+      delete llama;
     }
 
     env->ReleaseStringUTFChars(model_path_str, model_path_chars);
     env->ReleaseStringUTFChars(lora_str, lora_chars);
     env->ReleaseStringUTFChars(lora_base_str, lora_base_chars);
+    env->ReleaseStringUTFChars(model_cache_path_str, model_cache_path_chars);
 
-    return reinterpret_cast<jlong>(llama->ctx);
+    return context_ptr;
+}
+
+static inline void throwRestoreError(JNIEnv *env) {
+    jclass exceptionClass = env->FindClass("java/lang/IllegalStateException");
+    env->ThrowNew(exceptionClass, "Failed to restore the evicted context");
+}
+
+JNIEXPORT void JNICALL
+Java_com_rnllama_LlamaContext_setMemoryBudget(
+    JNIEnv *env,
+    jclass clazz,
+    jlong budget,
+    jstring evict_dir
+) {
+    UNUSED(clazz);
+    const char *evict_dir_chars = env->GetStringUTFChars(evict_dir, nullptr);
+    rnllama::memory_manager().set_budget(budget, evict_dir_chars);
+    env->ReleaseStringUTFChars(evict_dir, evict_dir_chars);
+}
+
+JNIEXPORT void JNICALL
+Java_com_rnllama_LlamaContext_setIdleTrimTimeout(
+    JNIEnv *env,
+    jclass clazz,
+    jint timeout_ms
+) {
+    UNUSED(env);
+    UNUSED(clazz);
+    rnllama::memory_manager().set_idle_timeout(timeout_ms);
+}
+
+JNIEXPORT jlong JNICALL
+Java_com_rnllama_LlamaContext_trimMemory(
+    JNIEnv *env,
+    jclass clazz
+) {
+    UNUSED(env);
+    UNUSED(clazz);
+    return rnllama::memory_manager().trim_idle();
 }
 
 JNIEXPORT jobject JNICALL
@@ -197,6 +268,11 @@ Java_com_rnllama_LlamaContext_loadSession(
 ) {
     UNUSED(thiz);
     auto llama = context_map[(long) context_ptr];
+    rnllama::llama_rn_context_use use(llama);
+    if (!use.ok) {
+      throwRestoreError(env);
+      return nullptr;
+    }
     const char *path_chars = env->GetStringUTFChars(path, nullptr);
 
     auto result = createWriteableMap(env);
@@ -227,6 +303,11 @@ Java_com_rnllama_LlamaContext_saveSession(
 ) {
     UNUSED(thiz);
     auto llama = context_map[(long) context_ptr];
+    rnllama::llama_rn_context_use use(llama);
+    if (!use.ok) {
+      throwRestoreError(env);
+      return -1;
+    }
 
     const char *path_chars = env->GetStringUTFChars(path, nullptr);
 
@@ -272,6 +353,7 @@ Java_com_rnllama_LlamaContext_doCompletion(
     jobject thiz,
     jlong context_ptr,
     jstring prompt,
+    jobjectArray prompt_segments,
     jstring grammar,
     jfloat temperature,
     jint n_threads,
@@ -295,6 +377,11 @@ Java_com_rnllama_LlamaContext_doCompletion(
 ) {
     UNUSED(thiz);
     auto llama = context_map[(long) context_ptr];
+    rnllama::llama_rn_context_use use(llama);
+    if (!use.ok) {
+      throwRestoreError(env);
+      return nullptr;
+    }
 
     llama->rewind();
 
@@ -302,6 +389,14 @@ Java_com_rnllama_LlamaContext_doCompletion(
 
     llama->params.prompt = env->GetStringUTFChars(prompt, nullptr);
 
+    int prompt_segments_len = env->GetArrayLength(prompt_segments);
+    for (int i = 0; i < prompt_segments_len; i++) {
+        jstring segment_str = (jstring) env->GetObjectArrayElement(prompt_segments, i);
+        const char *segment_chars = env->GetStringUTFChars(segment_str, nullptr);
+        llama->prompt_segments.push_back(segment_chars);
+        env->ReleaseStringUTFChars(segment_str, segment_chars);
+    }
+
     int max_threads = std::thread::hardware_concurrency();
     // Use 2 threads by default on 4-core devices, 4 threads on more cores
     int default_n_threads = max_threads == 4 ? 2 : min(4, max_threads);
@@ -378,14 +473,10 @@ Java_com_rnllama_LlamaContext_doCompletion(
         if (token_with_probs.tok == -1 || llama->multibyte_pending > 0) {
             continue;
         }
-        const std::string token_text = llama_token_to_piece(llama->ctx, token_with_probs.tok);
-
         size_t pos = std::min(sent_count, llama->generated_text.size());
 
-        const std::string str_test = llama->generated_text.substr(pos);
         bool is_stop_full = false;
-        size_t stop_pos =
-            llama->findStoppingStrings(str_test, token_text.size(), rnllama::STOP_FULL);
+        size_t stop_pos = llama->findStoppingStrings(pos, rnllama::STOP_FULL);
         if (stop_pos != std::string::npos) {
             is_stop_full = true;
             llama->generated_text.erase(
@@ -394,8 +485,7 @@ Java_com_rnllama_LlamaContext_doCompletion(
             pos = std::min(sent_count, llama->generated_text.size());
         } else {
             is_stop_full = false;
-            stop_pos = llama->findStoppingStrings(str_test, token_text.size(),
-                rnllama::STOP_PARTIAL);
+            stop_pos = llama->findStoppingStrings(pos, rnllama::STOP_PARTIAL);
         }
 
         if (
@@ -484,13 +574,20 @@ Java_com_rnllama_LlamaContext_tokenize(
         JNIEnv *env, jobject thiz, jlong context_ptr, jstring text) {
     UNUSED(thiz);
     auto llama = context_map[(long) context_ptr];
+    rnllama::llama_rn_context_use use(llama);
+    if (!use.ok) {
+      throwRestoreError(env);
+      return nullptr;
+    }
 
     const char *text_chars = env->GetStringUTFChars(text, nullptr);
 
     const std::vector<llama_token> toks = llama_tokenize(
         llama->ctx,
         text_chars,
-        false
+        false,
+        false,
+        llama->params.n_threads
     );
 
     jobject result = createWritableArray(env);
@@ -507,6 +604,11 @@ Java_com_rnllama_LlamaContext_detokenize(
         JNIEnv *env, jobject thiz, jlong context_ptr, jintArray tokens) {
     UNUSED(thiz);
     auto llama = context_map[(long) context_ptr];
+    rnllama::llama_rn_context_use use(llama);
+    if (!use.ok) {
+      throwRestoreError(env);
+      return nullptr;
+    }
 
     jsize tokens_len = env->GetArrayLength(tokens);
     jint *tokens_ptr = env->GetIntArrayElements(tokens, 0);
@@ -536,6 +638,11 @@ Java_com_rnllama_LlamaContext_embedding(
         JNIEnv *env, jobject thiz, jlong context_ptr, jstring text) {
     UNUSED(thiz);
     auto llama = context_map[(long) context_ptr];
+    rnllama::llama_rn_context_use use(llama);
+    if (!use.ok) {
+      throwRestoreError(env);
+      return nullptr;
+    }
 
     const char *text_chars = env->GetStringUTFChars(text, nullptr);
 
@@ -568,17 +675,9 @@ Java_com_rnllama_LlamaContext_freeContext(
     UNUSED(env);
     UNUSED(thiz);
     auto llama = context_map[(long) context_ptr];
-    if (llama->model) {
-        llama_free_model(llama->model);
-    }
-    if (llama->ctx) {
-        llama_free(llama->ctx);
-    }
-    if (llama->ctx_sampling != nullptr)
-    {
-        llama_sampling_free(llama->ctx_sampling);
-    }
-    context_map.erase((long) llama->ctx);
+    context_map.erase((long) context_ptr);
+    // frees the context and sampling state, the model is freed with its last context
+    delete llama;
 }
 
 } // extern "C"
@@ -39,8 +39,23 @@ public class RNLlamaModule extends ReactContextBaseJavaModule {
   }
 
   @ReactMethod
-  public void initContext(final ReadableMap params, final Promise promise) {
-    rnllama.initContext(params, promise);
+  public void setMemoryBudget(double budgetMb, Promise promise) {
+    rnllama.setMemoryBudget(budgetMb, promise);
+  }
+
+  @ReactMethod
+  public void setIdleTrimTimeout(double timeoutMs, Promise promise) {
+    rnllama.setIdleTrimTimeout(timeoutMs, promise);
+  }
+
+  @ReactMethod
+  public void initContext(double id, final ReadableMap params, final Promise promise) {
+    rnllama.initContext(id, params, promise);
+  }
+
+  @ReactMethod
+  public void cancelInitContext(double id, final Promise promise) {
+    rnllama.cancelInitContext(id, promise);
   }
 
   @ReactMethod
@@ -401,6 +401,10 @@ bool gpt_params_parse(int argc, char ** argv, gpt_params & params) {
             params.interactive = true;
         } else if (arg == "--embedding") {
             params.embedding = true;
+        } else if (arg == "--embedding-only") {
+            params.embedding_only = true;
+        } else if (arg == "-fa" || arg == "--flash-attn") {
+            params.flash_attn = true;
         } else if (arg == "--interactive-first") {
             params.interactive_first = true;
         } else if (arg == "-ins" || arg == "--instruct") {
@@ -481,6 +485,22 @@ bool gpt_params_parse(int argc, char ** argv, gpt_params & params) {
 #endif // LM_GGML_USE_CUBLAS
         } else if (arg == "--no-mmap") {
             params.use_mmap = false;
+        } else if (arg == "--repack") {
+            params.repack_weights = true;
+        } else if (arg == "--hugepages") {
+            params.use_hugepages = true;
+        } else if (arg == "--stream-budget") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.stream_budget_mb = std::stoi(argv[i]);
+        } else if (arg == "--compute-cap") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.compute_cap_mb = std::stoi(argv[i]);
         } else if (arg == "--numa") {
             params.numa = true;
         } else if (arg == "--verbose-prompt") {
@@ -717,6 +737,7 @@ void gpt_print_usage(int /*argc*/, char ** argv, const gpt_params & params) {
     printf("  -np N, --parallel N   number of parallel sequences to decode (default: %d)\n", params.n_parallel);
     printf("  -ns N, --sequences N  number of sequences to decode (default: %d)\n", params.n_sequences);
     printf("  -cb, --cont-batching  enable continuous batching (a.k.a dynamic batching) (default: disabled)\n");
+    printf("  -fa, --flash-attn     use the fused attention kernel, CPU only (default: disabled)\n");
     printf("  --mmproj MMPROJ_FILE  path to a multimodal projector file for LLaVA. see examples/llava/README.md\n");
     printf("  --image IMAGE_FILE    path to an image file. use with multimodal models\n");
     if (llama_mlock_supported()) {
@@ -725,6 +746,10 @@ void gpt_print_usage(int /*argc*/, char ** argv, const gpt_params & params) {
     if (llama_mmap_supported()) {
         printf("  --no-mmap             do not memory-map model (slower load but may reduce pageouts if not using mlock)\n");
     }
+    printf("  --repack              repack Q4_0/Q8_0/Q4_K weights for faster CPU matmul, repacked weights are not memory-mapped\n");
+    printf("  --hugepages           advise the weights, KV cache and compute buffer for transparent huge pages (Linux)\n");
+    printf("  --stream-budget N     stream the layer weights from the mapping during evaluation, keeping about N MB resident\n");
+    printf("  --compute-cap N       cap the compute buffer at N MB, larger batches are split into micro-batches that fit\n");
     printf("  --numa                attempt optimizations that help on some NUMA systems\n");
     printf("                        if run without this previously, it is recommended to drop the system page cache before using this\n");
     printf("                        see https://github.com/ggerganov/llama.cpp/issues/1437\n");
@@ -800,6 +825,10 @@ struct llama_model_params llama_model_params_from_gpt_params(const gpt_params &
     mparams.tensor_split    = params.tensor_split;
     mparams.use_mmap        = params.use_mmap;
     mparams.use_mlock       = params.use_mlock;
+    mparams.repack_weights  = params.repack_weights;
+    mparams.use_hugepages   = params.use_hugepages;
+    mparams.stream_budget   = params.stream_budget_mb > 0 ? (size_t) params.stream_budget_mb*1024*1024 : 0;
+    mparams.cache_path      = params.model_cache_path.empty() ? nullptr : params.model_cache_path.c_str();
 
     return mparams;
 }
@@ -816,6 +845,10 @@ struct llama_context_params llama_context_params_from_gpt_params(const gpt_param
     cparams.f16_kv          = params.memory_f16;
     cparams.logits_all      = params.logits_all;
     cparams.embedding       = params.embedding;
+    cparams.embedding_only  = params.embedding_only;
+    cparams.flash_attn      = params.flash_attn;
+    cparams.use_hugepages   = params.use_hugepages;
+    cparams.compute_buffer_cap = params.compute_cap_mb > 0 ? (size_t) params.compute_cap_mb*1024*1024 : 0;
     cparams.rope_freq_base  = params.rope_freq_base;
     cparams.rope_freq_scale = params.rope_freq_scale;
 
@@ -903,22 +936,24 @@ std::vector<llama_token> llama_tokenize(
   const struct llama_context * ctx,
            const std::string & text,
                         bool   add_bos,
-                        bool   special) {
-    return llama_tokenize(llama_get_model(ctx), text, add_bos, special);
+                        bool   special,
+                         int   n_threads) {
+    return llama_tokenize(llama_get_model(ctx), text, add_bos, special, n_threads);
 }
 
 std::vector<llama_token> llama_tokenize(
     const struct llama_model * model,
            const std::string & text,
                         bool   add_bos,
-                        bool   special) {
+                        bool   special,
+                         int   n_threads) {
     // upper limit for the number of tokens
     int n_tokens = text.length() + add_bos;
     std::vector<llama_token> result(n_tokens);
-    n_tokens = llama_tokenize(model, text.data(), text.length(), result.data(), result.size(), add_bos, special);
+    n_tokens = llama_tokenize_parallel(model, text.data(), text.length(), result.data(), result.size(), add_bos, special, n_threads);
     if (n_tokens < 0) {
         result.resize(-n_tokens);
-        int check = llama_tokenize(model, text.data(), text.length(), result.data(), result.size(), add_bos, special);
+        int check = llama_tokenize_parallel(model, text.data(), text.length(), result.data(), result.size(), add_bos, special, n_threads);
         LM_GGML_ASSERT(check == -n_tokens);
     } else {
         result.resize(n_tokens);
@@ -927,47 +962,40 @@ std::vector<llama_token> llama_tokenize(
 }
 
 std::string llama_token_to_piece(const struct llama_context * ctx, llama_token token) {
-    std::vector<char> result(8, 0);
-    const int n_tokens = llama_token_to_piece(llama_get_model(ctx), token, result.data(), result.size());
-    if (n_tokens < 0) {
-        result.resize(-n_tokens);
-        int check = llama_token_to_piece(llama_get_model(ctx), token, result.data(), result.size());
-        LM_GGML_ASSERT(check == -n_tokens);
-    } else {
-        result.resize(n_tokens);
-    }
-
-    return std::string(result.data(), result.size());
+    int n_piece = 0;
+    const char * piece = llama_token_get_piece(llama_get_model(ctx), token, &n_piece);
+    return std::string(piece, n_piece);
 }
 
 std::string llama_detokenize_spm(llama_context * ctx, const std::vector<llama_token> & tokens) {
     const llama_token bos_id = llama_token_bos(llama_get_model(ctx));
 
-    std::string piece;
     std::string result;
 
     for (size_t i = 0; i < tokens.size(); ++i) {
-        piece = llama_token_to_piece(ctx, tokens[i]);
+        int n_piece = 0;
+        const char * piece = llama_token_get_piece(llama_get_model(ctx), tokens[i], &n_piece);
 
         // remove the leading space of the first non-BOS token
         if (((tokens[0] == bos_id && i == 1) || (tokens[0] != bos_id && i == 0)) && piece[0] == ' ') {
-            piece = piece.substr(1);
+            piece++;
+            n_piece--;
         }
 
-        result += piece;
+        result.append(piece, n_piece);
     }
 
     return result;
 }
 
 std::string llama_detokenize_bpe(llama_context * ctx, const std::vector<llama_token> & tokens) {
-    std::string piece;
     std::string result;
 
     for (size_t i = 0; i < tokens.size(); ++i) {
-        piece = llama_token_to_piece(ctx, tokens[i]);
+        int n_piece = 0;
+        const char * piece = llama_token_get_piece(llama_get_model(ctx), tokens[i], &n_piece);
 
-        result += piece;
+        result.append(piece, n_piece);
     }
 
     // NOTE: the original tokenizer decodes bytes after collecting the pieces.
@@ -1135,6 +1163,7 @@ void dump_non_result_info_yaml(FILE * stream, const gpt_params & params, const l
     fprintf(stream, "cpu_has_avx512: %s\n",      lm_ggml_cpu_has_avx512()      ? "true" : "false");
     fprintf(stream, "cpu_has_avx512_vbmi: %s\n", lm_ggml_cpu_has_avx512_vbmi() ? "true" : "false");
     fprintf(stream, "cpu_has_avx512_vnni: %s\n", lm_ggml_cpu_has_avx512_vnni() ? "true" : "false");
+    fprintf(stream, "cpu_has_avx_vnni: %s\n",    lm_ggml_cpu_has_avx_vnni()    ? "true" : "false");
     fprintf(stream, "cpu_has_blas: %s\n",        lm_ggml_cpu_has_blas()        ? "true" : "false");
     fprintf(stream, "cpu_has_cublas: %s\n",      lm_ggml_cpu_has_cublas()      ? "true" : "false");
     fprintf(stream, "cpu_has_clblast: %s\n",     lm_ggml_cpu_has_clblast()     ? "true" : "false");
@@ -1143,6 +1172,7 @@ void dump_non_result_info_yaml(FILE * stream, const gpt_params & params, const l
     fprintf(stream, "cpu_has_neon: %s\n",        lm_ggml_cpu_has_neon()        ? "true" : "false");
     fprintf(stream, "cpu_has_f16c: %s\n",        lm_ggml_cpu_has_f16c()        ? "true" : "false");
     fprintf(stream, "cpu_has_fp16_va: %s\n",     lm_ggml_cpu_has_fp16_va()     ? "true" : "false");
+    fprintf(stream, "cpu_has_dotprod: %s\n",     lm_ggml_cpu_has_dotprod()     ? "true" : "false");
     fprintf(stream, "cpu_has_wasm_simd: %s\n",   lm_ggml_cpu_has_wasm_simd()   ? "true" : "false");
     fprintf(stream, "cpu_has_blas: %s\n",        lm_ggml_cpu_has_blas()        ? "true" : "false");
     fprintf(stream, "cpu_has_sse3: %s\n",        lm_ggml_cpu_has_sse3()        ? "true" : "false");
@@ -1235,6 +1265,10 @@ void dump_non_result_info_yaml(FILE * stream, const gpt_params & params, const l
     fprintf(stream, "n_predict: %d # default: -1 (unlimited)\n", params.n_predict);
     fprintf(stream, "n_probs: %d # only used by server binary, default: 0\n", sparams.n_probs);
     fprintf(stream, "no_mmap: %s # default: false\n", !params.use_mmap ? "true" : "false");
+    fprintf(stream, "repack: %s # default: false\n", params.repack_weights ? "true" : "false");
+    fprintf(stream, "hugepages: %s # default: false\n", params.use_hugepages ? "true" : "false");
+    fprintf(stream, "stream_budget: %d # default: 0 (disabled)\n", params.stream_budget_mb);
+    fprintf(stream, "compute_cap: %d # default: 0 (disabled)\n", params.compute_cap_mb);
     fprintf(stream, "no_mul_mat_q: %s # default: false\n", !params.mul_mat_q ? "true" : "false");
     fprintf(stream, "no_penalize_nl: %s # default: false\n", !sparams.penalize_nl ? "true" : "false");
     fprintf(stream, "numa: %s # default: false\n", params.numa ? "true" : "false");
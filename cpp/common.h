@@ -54,6 +54,8 @@ struct gpt_params {
     int32_t n_beams                         = 0;    // if non-zero then use beam search of given width.
     float   rope_freq_base                  = 0.0f; // RoPE base frequency
     float   rope_freq_scale                 = 0.0f; // RoPE frequency scaling factor
+    int32_t stream_budget_mb                = 0;    // > 0: stream the layer weights keeping about this many MB resident
+    int32_t compute_cap_mb                  = 0;    // > 0: cap the compute buffer, batches are split into micro-batches that fit
 
     // // sampling parameters
     struct llama_sampling_params sparams;
@@ -68,6 +70,7 @@ struct gpt_params {
     std::string input_suffix      = "";  // string to suffix user inputs with
     std::vector<std::string> antiprompt; // string upon seeing which more user input is prompted
     std::string logdir            = "";  // directory in which to save YAML log files
+    std::string model_cache_path  = "";  // prepared-model cache file, see llama_model_params.cache_path
 
     // TODO: avoid tuple, use struct
     std::vector<std::tuple<std::string, float>> lora_adapter; // lora adapter path with user defined scale
@@ -89,6 +92,8 @@ struct gpt_params {
     bool prompt_cache_ro   = false; // open the prompt cache read-only and do not update it
 
     bool embedding         = false; // get only sentence embedding
+    bool embedding_only    = false; // build the context without the output layer (no logits)
+    bool flash_attn        = false; // use the fused attention kernel
     bool escape            = false; // escape "\n", "\r", "\t", "\'", "\"", and "\\"
     bool interactive_first = false; // wait for user input immediately
     bool multiline_input   = false; // reverse the usage of `\`
@@ -101,6 +106,8 @@ struct gpt_params {
     bool logits_all        = false; // return logits for all tokens in the batch
     bool use_mmap          = true;  // use mmap for faster loads
     bool use_mlock         = false; // use mlock to keep model in memory
+    bool repack_weights    = false; // repack the weights into interleaved layouts at load time
+    bool use_hugepages     = false; // advise the weights and context buffers for transparent huge pages
     bool numa              = false; // attempt optimizations that help on some NUMA systems
     bool verbose_prompt    = false; // print prompt tokens before generation
     bool infill            = false; // use infill mode
@@ -147,17 +154,20 @@ void llama_batch_add(
 
 // tokenizes a string into a vector of tokens
 // should work similar to Python's `tokenizer.encode`
+// large texts are tokenized on up to n_threads threads, see llama_tokenize_parallel
 std::vector<llama_token> llama_tokenize(
   const struct llama_context * ctx,
            const std::string & text,
                         bool   add_bos,
-                        bool   special = false);
+                        bool   special = false,
+                         int   n_threads = 1);
 
 std::vector<llama_token> llama_tokenize(
     const struct llama_model * model,
            const std::string & text,
                         bool   add_bos,
-                        bool   special = false);
+                        bool   special = false,
+                         int   n_threads = 1);
 
 // tokenizes a token into a piece
 // should work similar to Python's `tokenizer.id_to_piece`
@@ -108,6 +108,10 @@ typedef void * thread_ret_t;
 #include <sys/stat.h>
 #include <unistd.h>
 
+#if defined(_POSIX_MAPPED_FILES)
+#include <sys/mman.h>
+#endif
+
 #endif
 #ifdef LM_GGML_USE_CPU_HBM
 #include <hbwmalloc.h>
@@ -138,6 +142,9 @@ typedef void * thread_ret_t;
 #define LM_GGML_VEC_DOT_UNROLL  2
 #define LM_GGML_VEC_MAD_UNROLL  32
 
+// min number of src1 rows for mul_mat to use the tiled vec_dot_mxn kernels
+#define LM_GGML_MUL_MAT_MXN_MIN_NE11 4
+
 //
 // logging
 //
@@ -664,6 +671,17 @@ static inline __m256 sum_i16_pairs_float(const __m256i x) {
     return _mm256_cvtepi32_ps(summed_pairs);
 }
 
+// multiply uint8_t with int8_t, add results pairwise twice and return as int32_t vector
+static inline __m256i mul_sum_us8_pairs_i32(const __m256i ax, const __m256i sy) {
+#if __AVXVNNI__
+    const __m256i zero = _mm256_setzero_si256();
+    return _mm256_dpbusd_epi32(zero, ax, sy);
+#else
+    const __m256i ones = _mm256_set1_epi16(1);
+    return _mm256_madd_epi16(ones, _mm256_maddubs_epi16(ax, sy));
+#endif
+}
+
 static inline __m256 mul_sum_us8_pairs_float(const __m256i ax, const __m256i sy) {
 #if __AVXVNNI__
     const __m256i zero = _mm256_setzero_si256();
@@ -838,6 +856,37 @@ inline static int32x4_t vcvtnq_s32_f32(float32x4_t v) {
     return res;
 }
 
+#endif
+
+#if defined(__aarch64__)
+#if defined(__ARM_FEATURE_DOTPROD)
+#define lm_ggml_vdotq_s32(a, b, c) vdotq_s32(a, b, c)
+#else
+// adds the dot products of each group of 4 int8 of b and c to the lanes of a
+inline static int32x4_t lm_ggml_vdotq_s32(int32x4_t a, int8x16_t b, int8x16_t c) {
+    const int16x8_t p0 = vmull_s8(vget_low_s8 (b), vget_low_s8 (c));
+    const int16x8_t p1 = vmull_s8(vget_high_s8(b), vget_high_s8(c));
+
+    return vaddq_s32(a, vpaddq_s32(vpaddlq_s16(p0), vpaddlq_s16(p1)));
+}
+#endif
+#endif
+
+#if defined(LM_GGML_ARM_DISPATCH)
+// sdot without dotprod enabled for the build, only called from kernels installed when the CPU has it
+// (.arch armv8.4-a because older clang assemblers do not know .arch_extension dotprod)
+inline static int32x4_t lm_ggml_sdotq_s32(int32x4_t a, int8x16_t b, int8x16_t c) {
+    __asm__(".arch armv8.4-a\n\tsdot %0.4s, %1.16b, %2.16b" : "+w" (a) : "w" (b), "w" (c));
+    return a;
+}
+
+#if !defined(__ARM_FEATURE_FP16_VECTOR_ARITHMETIC)
+// the same for fp16 fmla, only called from kernels installed when the CPU has fp16 arithmetic
+inline static float16x8_t lm_ggml_hfmaq_f16(float16x8_t a, float16x8_t b, float16x8_t c) {
+    __asm__(".arch armv8.2-a+fp16\n\tfmla %0.8h, %1.8h, %2.8h" : "+w" (a) : "w" (b), "w" (c));
+    return a;
+}
+#endif
 #endif
 #endif
 
@@ -888,6 +937,20 @@ typedef struct {
 } block_q8_1;
 static_assert(sizeof(block_q8_1) == 2*sizeof(float) + QK8_1, "wrong q8_1 block size/padding");
 
+// 4 rows of q4_0/q8_0 blocks interleaved for the multi-row dot kernels (see lm_ggml_repack)
+// the quants of the rows are interleaved in groups of 4 bytes: qs[16*k + 4*r + j] = row r qs[4*k + j]
+typedef struct {
+    lm_ggml_fp16_t d[4];          // deltas of the 4 rows
+    uint8_t qs[4 * QK4_0 / 2]; // interleaved nibbles / quants
+} block_q4_0x4;
+static_assert(sizeof(block_q4_0x4) == 4 * sizeof(block_q4_0), "wrong q4_0x4 block size/padding");
+
+typedef struct {
+    lm_ggml_fp16_t d[4];          // deltas of the 4 rows
+    int8_t  qs[4 * QK8_0];     // interleaved quants
+} block_q8_0x4;
+static_assert(sizeof(block_q8_0x4) == 4 * sizeof(block_q8_0), "wrong q8_0x4 block size/padding");
+
 // reference implementation for deterministic creation of model files
 static void quantize_row_q4_0_reference(const float * restrict x, block_q4_0 * restrict y, int k) {
     static const int qk = QK4_0;
@@ -1652,8 +1715,19 @@ static void lm_ggml_vec_dot_q4_1_q8_1(const int n, float * restrict s, const voi
 static void lm_ggml_vec_dot_q5_0_q8_0(const int n, float * restrict s, const void * restrict vx, const void * restrict vy);
 static void lm_ggml_vec_dot_q5_1_q8_1(const int n, float * restrict s, const void * restrict vx, const void * restrict vy);
 static void lm_ggml_vec_dot_q8_0_q8_0(const int n, float * restrict s, const void * restrict vx, const void * restrict vy);
+static void lm_ggml_vec_dot_q4_0_x4_q8_0(const int n, float * restrict s, const void * restrict vx, const void * restrict vy);
+static void lm_ggml_vec_dot_q8_0_x4_q8_0(const int n, float * restrict s, const void * restrict vx, const void * restrict vy);
+
+#if defined(__ARM_NEON) || defined(__AVX2__)
+#define LM_GGML_VEC_DOT_Q4_0_Q8_0_MXN
+#define LM_GGML_VEC_DOT_Q8_0_Q8_0_MXN
+static void lm_ggml_vec_dot_q4_0_q8_0_mxn(const int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by);
+static void lm_ggml_vec_dot_q8_0_q8_0_mxn(const int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by);
+static void lm_ggml_vec_dot_q4_0_x4_q8_0_mxn(const int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by);
+static void lm_ggml_vec_dot_q8_0_x4_q8_0_mxn(const int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by);
+#endif
 
-static const lm_ggml_type_traits_t type_traits[LM_GGML_TYPE_COUNT] = {
+static lm_ggml_type_traits_t type_traits[LM_GGML_TYPE_COUNT] = {
     [LM_GGML_TYPE_I8] = {
         .type_name                = "i8",
         .blck_size                = 1,
@@ -1701,6 +1775,9 @@ static const lm_ggml_type_traits_t type_traits[LM_GGML_TYPE_COUNT] = {
         .from_float_reference     = (lm_ggml_from_float_t) quantize_row_q4_0_reference,
         .vec_dot                  = lm_ggml_vec_dot_q4_0_q8_0,
         .vec_dot_type             = LM_GGML_TYPE_Q8_0,
+#ifdef LM_GGML_VEC_DOT_Q4_0_Q8_0_MXN
+        .vec_dot_mxn              = lm_ggml_vec_dot_q4_0_q8_0_mxn,
+#endif
     },
     [LM_GGML_TYPE_Q4_1] = {
         .type_name                = "q4_1",
@@ -1745,6 +1822,9 @@ static const lm_ggml_type_traits_t type_traits[LM_GGML_TYPE_COUNT] = {
         .from_float_reference     = (lm_ggml_from_float_t) quantize_row_q8_0_reference,
         .vec_dot                  = lm_ggml_vec_dot_q8_0_q8_0,
         .vec_dot_type             = LM_GGML_TYPE_Q8_0,
+#ifdef LM_GGML_VEC_DOT_Q8_0_Q8_0_MXN
+        .vec_dot_mxn              = lm_ggml_vec_dot_q8_0_q8_0_mxn,
+#endif
     },
     [LM_GGML_TYPE_Q8_1] = {
         .type_name                = "q8_1",
@@ -1788,6 +1868,9 @@ static const lm_ggml_type_traits_t type_traits[LM_GGML_TYPE_COUNT] = {
         .from_float_reference     = (lm_ggml_from_float_t) quantize_row_q4_K_reference,
         .vec_dot                  = lm_ggml_vec_dot_q4_K_q8_K,
         .vec_dot_type             = LM_GGML_TYPE_Q8_K,
+#ifdef LM_GGML_VEC_DOT_Q4_K_Q8_K_MXN
+        .vec_dot_mxn              = lm_ggml_vec_dot_q4_K_q8_K_mxn,
+#endif
     },
     [LM_GGML_TYPE_Q5_K] = {
         .type_name                = "q5_K",
@@ -1817,7 +1900,42 @@ static const lm_ggml_type_traits_t type_traits[LM_GGML_TYPE_COUNT] = {
         .type_size                = sizeof(block_q8_K),
         .is_quantized             = true,
         .from_float               = quantize_row_q8_K,
-    }
+    },
+#endif
+    [LM_GGML_TYPE_Q4_0_X4] = {
+        .type_name                = "q4_0_x4",
+        .blck_size                = QK4_0,
+        .type_size                = sizeof(block_q4_0),
+        .is_quantized             = true,
+        .vec_dot                  = lm_ggml_vec_dot_q4_0_x4_q8_0,
+        .vec_dot_type             = LM_GGML_TYPE_Q8_0,
+#ifdef LM_GGML_VEC_DOT_Q4_0_Q8_0_MXN
+        .vec_dot_mxn              = lm_ggml_vec_dot_q4_0_x4_q8_0_mxn,
+#endif
+        .blck_rows                = 4,
+    },
+    [LM_GGML_TYPE_Q8_0_X4] = {
+        .type_name                = "q8_0_x4",
+        .blck_size                = QK8_0,
+        .type_size                = sizeof(block_q8_0),
+        .is_quantized             = true,
+        .vec_dot                  = lm_ggml_vec_dot_q8_0_x4_q8_0,
+        .vec_dot_type             = LM_GGML_TYPE_Q8_0,
+#ifdef LM_GGML_VEC_DOT_Q8_0_Q8_0_MXN
+        .vec_dot_mxn              = lm_ggml_vec_dot_q8_0_x4_q8_0_mxn,
+#endif
+        .blck_rows                = 4,
+    },
+#if defined(LM_GGML_USE_K_QUANTS) && QK_K == 256
+    [LM_GGML_TYPE_Q4_K_X4] = {
+        .type_name                = "q4_K_x4",
+        .blck_size                = QK_K,
+        .type_size                = sizeof(block_q4_K),
+        .is_quantized             = true,
+        .vec_dot                  = lm_ggml_vec_dot_q4_K_x4_q8_K,
+        .vec_dot_type             = LM_GGML_TYPE_Q8_K,
+        .blck_rows                = 4,
+    },
 #endif
 };
 
@@ -2455,8 +2573,8 @@ static void lm_ggml_vec_dot_q4_0_q8_0(const int n, float * restrict s, const voi
     float32x4_t sumv0 = vdupq_n_f32(0.0f);
     float32x4_t sumv1 = vdupq_n_f32(0.0f);
 
-    LM_GGML_ASSERT(nb % 2 == 0); // TODO: handle odd nb
-    for (int i = 0; i < nb; i += 2) {
+    int i = 0;
+    for (; i + 1 < nb; i += 2) {
         const block_q4_0 * restrict x0 = &x[i + 0];
         const block_q4_0 * restrict x1 = &x[i + 1];
         const block_q8_0 * restrict y0 = &y[i + 0];
@@ -2514,7 +2632,23 @@ static void lm_ggml_vec_dot_q4_0_q8_0(const int n, float * restrict s, const voi
 #endif
     }
 
-    *s = vaddvq_f32(sumv0) + vaddvq_f32(sumv1);
+    float sumf = vaddvq_f32(sumv0) + vaddvq_f32(sumv1);
+
+    // the last block of an odd number of blocks
+    for (; i < nb; ++i) {
+        int sumi = 0;
+
+        for (int j = 0; j < qk/2; ++j) {
+            const int v0 = (x[i].qs[j] & 0x0F) - 8;
+            const int v1 = (x[i].qs[j] >>   4) - 8;
+
+            sumi += (v0 * y[i].qs[j]) + (v1 * y[i].qs[j + qk/2]);
+        }
+
+        sumf += sumi*LM_GGML_FP16_TO_FP32(x[i].d)*LM_GGML_FP16_TO_FP32(y[i].d);
+    }
+
+    *s = sumf;
 #elif defined(__AVX2__)
     // Initialize accumulator with zeros
     __m256 acc = _mm256_setzero_ps();
@@ -2582,60 +2716,9 @@ static void lm_ggml_vec_dot_q4_0_q8_0(const int n, float * restrict s, const voi
     __m128 acc_2 = _mm_setzero_ps();
     __m128 acc_3 = _mm_setzero_ps();
 
-    // First round without accumulation
-    {
-        _mm_prefetch(&x[0] + sizeof(block_q4_0), _MM_HINT_T0);
-        _mm_prefetch(&y[0] + sizeof(block_q8_0), _MM_HINT_T0);
-
-        // Compute combined scale for the block 0 and 1
-        const __m128 d_0_1 = _mm_set1_ps( LM_GGML_FP16_TO_FP32(x[0].d) * LM_GGML_FP16_TO_FP32(y[0].d) );
-
-        const __m128i tmp_0_1 = _mm_loadu_si128((const __m128i *)x[0].qs);
-
-        __m128i bx_0 = _mm_and_si128(lowMask, tmp_0_1);
-        __m128i by_0 = _mm_loadu_si128((const __m128i *)y[0].qs);
-        bx_0 = _mm_sub_epi8(bx_0, off);
-        const __m128i i32_0 = mul_sum_i8_pairs(bx_0, by_0);
-
-        __m128i bx_1 = _mm_and_si128(lowMask, _mm_srli_epi64(tmp_0_1, 4));
-        __m128i by_1 = _mm_loadu_si128((const __m128i *)(y[0].qs + 16));
-        bx_1 = _mm_sub_epi8(bx_1, off);
-        const __m128i i32_1 = mul_sum_i8_pairs(bx_1, by_1);
-
-        _mm_prefetch(&x[1] + sizeof(block_q4_0), _MM_HINT_T0);
-        _mm_prefetch(&y[1] + sizeof(block_q8_0), _MM_HINT_T0);
-
-        // Compute combined scale for the block 2 and 3
-        const __m128 d_2_3 = _mm_set1_ps( LM_GGML_FP16_TO_FP32(x[1].d) * LM_GGML_FP16_TO_FP32(y[1].d) );
-
-        const __m128i tmp_2_3 = _mm_loadu_si128((const __m128i *)x[1].qs);
-
-        __m128i bx_2 = _mm_and_si128(lowMask, tmp_2_3);
-        __m128i by_2 = _mm_loadu_si128((const __m128i *)y[1].qs);
-        bx_2 = _mm_sub_epi8(bx_2, off);
-        const __m128i i32_2 = mul_sum_i8_pairs(bx_2, by_2);
-
-        __m128i bx_3 = _mm_and_si128(lowMask, _mm_srli_epi64(tmp_2_3, 4));
-        __m128i by_3 = _mm_loadu_si128((const __m128i *)(y[1].qs + 16));
-        bx_3 = _mm_sub_epi8(bx_3, off);
-        const __m128i i32_3 = mul_sum_i8_pairs(bx_3, by_3);
-
-        // Convert int32_t to float
-        __m128 p0 = _mm_cvtepi32_ps(i32_0);
-        __m128 p1 = _mm_cvtepi32_ps(i32_1);
-        __m128 p2 = _mm_cvtepi32_ps(i32_2);
-        __m128 p3 = _mm_cvtepi32_ps(i32_3);
-
-        // Apply the scale
-        acc_0 = _mm_mul_ps( d_0_1, p0 );
-        acc_1 = _mm_mul_ps( d_0_1, p1 );
-        acc_2 = _mm_mul_ps( d_2_3, p2 );
-        acc_3 = _mm_mul_ps( d_2_3, p3 );
-    }
-
     // Main loop
-    LM_GGML_ASSERT(nb % 2 == 0); // TODO: handle odd nb
-    for (int i = 2; i < nb; i+=2) {
+    int i = 0;
+    for (; i + 1 < nb; i += 2) {
         _mm_prefetch(&x[i] + sizeof(block_q4_0), _MM_HINT_T0);
         _mm_prefetch(&y[i] + sizeof(block_q8_0), _MM_HINT_T0);
 
@@ -2691,7 +2774,23 @@ static void lm_ggml_vec_dot_q4_0_q8_0(const int n, float * restrict s, const voi
         acc_3 = _mm_add_ps(p3_d, acc_3);
     }
 
-    *s = hsum_float_4x4(acc_0, acc_1, acc_2, acc_3);
+    float sumf = hsum_float_4x4(acc_0, acc_1, acc_2, acc_3);
+
+    // the last block of an odd number of blocks
+    for (; i < nb; ++i) {
+        int sumi = 0;
+
+        for (int j = 0; j < qk/2; ++j) {
+            const int v0 = (x[i].qs[j] & 0x0F) - 8;
+            const int v1 = (x[i].qs[j] >>   4) - 8;
+
+            sumi += (v0 * y[i].qs[j]) + (v1 * y[i].qs[j + qk/2]);
+        }
+
+        sumf += sumi*LM_GGML_FP16_TO_FP32(x[i].d)*LM_GGML_FP16_TO_FP32(y[i].d);
+    }
+
+    *s = sumf;
 #elif defined(__riscv_v_intrinsic)
     float sumf = 0.0;
 
@@ -2750,6 +2849,149 @@ static void lm_ggml_vec_dot_q4_0_q8_0(const int n, float * restrict s, const voi
 #endif
 }
 
+#ifdef LM_GGML_VEC_DOT_Q4_0_Q8_0_MXN
+static void lm_ggml_vec_dot_q4_0_q8_0_mxn(const int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by) {
+    const int qk = QK8_0;
+    const int nb = n / qk;
+
+    assert(n % qk == 0);
+
+    const block_q4_0 * restrict x[LM_GGML_VEC_DOT_MXN_NR0];
+    const block_q8_0 * restrict y[LM_GGML_VEC_DOT_MXN_NR1];
+
+    for (int r = 0; r < LM_GGML_VEC_DOT_MXN_NR0; ++r) {
+        x[r] = (const block_q4_0 *) ((const char *) vx + r*bx);
+    }
+    for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+        y[c] = (const block_q8_0 *) ((const char *) vy + c*by);
+    }
+
+#if defined(__ARM_NEON)
+    float32x4_t sumv0[LM_GGML_VEC_DOT_MXN_NR1][LM_GGML_VEC_DOT_MXN_NR0];
+    float32x4_t sumv1[LM_GGML_VEC_DOT_MXN_NR1][LM_GGML_VEC_DOT_MXN_NR0];
+
+    for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+        for (int r = 0; r < LM_GGML_VEC_DOT_MXN_NR0; ++r) {
+            sumv0[c][r] = vdupq_n_f32(0.0f);
+            sumv1[c][r] = vdupq_n_f32(0.0f);
+        }
+    }
+
+    const uint8x16_t m4b = vdupq_n_u8(0x0F);
+    const int8x16_t  s8b = vdupq_n_s8(0x8);
+
+    int i = 0;
+    for (; i + 1 < nb; i += 2) {
+        // unpack the x blocks once and reuse them for all columns of y
+        int8x16_t v0[LM_GGML_VEC_DOT_MXN_NR0][4];
+        float     d0[LM_GGML_VEC_DOT_MXN_NR0][2];
+
+        for (int r = 0; r < LM_GGML_VEC_DOT_MXN_NR0; ++r) {
+            const uint8x16_t v0_0 = vld1q_u8(x[r][i + 0].qs);
+            const uint8x16_t v0_1 = vld1q_u8(x[r][i + 1].qs);
+
+            v0[r][0] = vsubq_s8(vreinterpretq_s8_u8(vandq_u8  (v0_0, m4b)), s8b);
+            v0[r][1] = vsubq_s8(vreinterpretq_s8_u8(vshrq_n_u8(v0_0, 4)),   s8b);
+            v0[r][2] = vsubq_s8(vreinterpretq_s8_u8(vandq_u8  (v0_1, m4b)), s8b);
+            v0[r][3] = vsubq_s8(vreinterpretq_s8_u8(vshrq_n_u8(v0_1, 4)),   s8b);
+
+            d0[r][0] = LM_GGML_FP16_TO_FP32(x[r][i + 0].d);
+            d0[r][1] = LM_GGML_FP16_TO_FP32(x[r][i + 1].d);
+        }
+
+        for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+            const block_q8_0 * restrict y0 = &y[c][i + 0];
+            const block_q8_0 * restrict y1 = &y[c][i + 1];
+
+            const int8x16_t v1_0l = vld1q_s8(y0->qs);
+            const int8x16_t v1_0h = vld1q_s8(y0->qs + 16);
+            const int8x16_t v1_1l = vld1q_s8(y1->qs);
+            const int8x16_t v1_1h = vld1q_s8(y1->qs + 16);
+
+            const float d1_0 = LM_GGML_FP16_TO_FP32(y0->d);
+            const float d1_1 = LM_GGML_FP16_TO_FP32(y1->d);
+
+            for (int r = 0; r < LM_GGML_VEC_DOT_MXN_NR0; ++r) {
+#if defined(__ARM_FEATURE_DOTPROD)
+                const int32x4_t p_0 = vdotq_s32(vdotq_s32(vdupq_n_s32(0), v0[r][0], v1_0l), v0[r][1], v1_0h);
+                const int32x4_t p_1 = vdotq_s32(vdotq_s32(vdupq_n_s32(0), v0[r][2], v1_1l), v0[r][3], v1_1h);
+#else
+                const int16x8_t pl0l = vmull_s8(vget_low_s8 (v0[r][0]), vget_low_s8 (v1_0l));
+                const int16x8_t pl0h = vmull_s8(vget_high_s8(v0[r][0]), vget_high_s8(v1_0l));
+                const int16x8_t ph0l = vmull_s8(vget_low_s8 (v0[r][1]), vget_low_s8 (v1_0h));
+                const int16x8_t ph0h = vmull_s8(vget_high_s8(v0[r][1]), vget_high_s8(v1_0h));
+
+                const int16x8_t pl1l = vmull_s8(vget_low_s8 (v0[r][2]), vget_low_s8 (v1_1l));
+                const int16x8_t pl1h = vmull_s8(vget_high_s8(v0[r][2]), vget_high_s8(v1_1l));
+                const int16x8_t ph1l = vmull_s8(vget_low_s8 (v0[r][3]), vget_low_s8 (v1_1h));
+                const int16x8_t ph1h = vmull_s8(vget_high_s8(v0[r][3]), vget_high_s8(v1_1h));
+
+                const int32x4_t p_0 = vaddq_s32(vaddq_s32(vpaddlq_s16(pl0l), vpaddlq_s16(pl0h)), vaddq_s32(vpaddlq_s16(ph0l), vpaddlq_s16(ph0h)));
+                const int32x4_t p_1 = vaddq_s32(vaddq_s32(vpaddlq_s16(pl1l), vpaddlq_s16(pl1h)), vaddq_s32(vpaddlq_s16(ph1l), vpaddlq_s16(ph1h)));
+#endif
+                sumv0[c][r] = vmlaq_n_f32(sumv0[c][r], vcvtq_f32_s32(p_0), d0[r][0]*d1_0);
+                sumv1[c][r] = vmlaq_n_f32(sumv1[c][r], vcvtq_f32_s32(p_1), d0[r][1]*d1_1);
+            }
+        }
+    }
+
+    for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+        for (int r = 0; r < LM_GGML_VEC_DOT_MXN_NR0; ++r) {
+            float sumf = vaddvq_f32(sumv0[c][r]) + vaddvq_f32(sumv1[c][r]);
+
+            // the last block of an odd number of blocks
+            if (i < nb) {
+                float tail;
+                lm_ggml_vec_dot_q4_0_q8_0(qk, &tail, x[r] + i, y[c] + i);
+                sumf += tail;
+            }
+
+            s[c*bs + r] = sumf;
+        }
+    }
+#elif defined(__AVX2__)
+    __m256 acc[LM_GGML_VEC_DOT_MXN_NR1][LM_GGML_VEC_DOT_MXN_NR0];
+
+    for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+        for (int r = 0; r < LM_GGML_VEC_DOT_MXN_NR0; ++r) {
+            acc[c][r] = _mm256_setzero_ps();
+        }
+    }
+
+    const __m256i off = _mm256_set1_epi8(8);
+
+    for (int i = 0; i < nb; ++i) {
+        // keep the x nibbles in [ 0 .. 15 ] and subtract the offset once per y block instead:
+        //   sum((x - 8)*y) = sum(x*y) - sum(8*y)
+        __m256i qx[LM_GGML_VEC_DOT_MXN_NR0];
+        float   dx[LM_GGML_VEC_DOT_MXN_NR0];
+
+        for (int r = 0; r < LM_GGML_VEC_DOT_MXN_NR0; ++r) {
+            qx[r] = bytes_from_nibbles_32(x[r][i].qs);
+            dx[r] = LM_GGML_FP16_TO_FP32(x[r][i].d);
+        }
+
+        for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+            const __m256i qy  = _mm256_loadu_si256((const __m256i *)y[c][i].qs);
+            const __m256i qy8 = mul_sum_us8_pairs_i32(off, qy);
+            const float   dy  = LM_GGML_FP16_TO_FP32(y[c][i].d);
+
+            for (int r = 0; r < LM_GGML_VEC_DOT_MXN_NR0; ++r) {
+                const __m256i p = _mm256_sub_epi32(mul_sum_us8_pairs_i32(qx[r], qy), qy8);
+                acc[c][r] = _mm256_fmadd_ps(_mm256_set1_ps(dx[r]*dy), _mm256_cvtepi32_ps(p), acc[c][r]);
+            }
+        }
+    }
+
+    for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+        for (int r = 0; r < LM_GGML_VEC_DOT_MXN_NR0; ++r) {
+            s[c*bs + r] = hsum_float_8(acc[c][r]);
+        }
+    }
+#endif
+}
+#endif
+
 static void lm_ggml_vec_dot_q4_1_q8_1(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
     const int qk = QK8_1;
     const int nb = n / qk;
@@ -2766,8 +3008,8 @@ static void lm_ggml_vec_dot_q4_1_q8_1(const int n, float * restrict s, const voi
 
     float summs = 0;
 
-    LM_GGML_ASSERT(nb % 2 == 0); // TODO: handle odd nb
-    for (int i = 0; i < nb; i += 2) {
+    int i = 0;
+    for (; i + 1 < nb; i += 2) {
         const block_q4_1 * restrict x0 = &x[i + 0];
         const block_q4_1 * restrict x1 = &x[i + 1];
         const block_q8_1 * restrict y0 = &y[i + 0];
@@ -2820,7 +3062,23 @@ static void lm_ggml_vec_dot_q4_1_q8_1(const int n, float * restrict s, const voi
 #endif
     }
 
-    *s = vaddvq_f32(sumv0) + vaddvq_f32(sumv1) + summs;
+    float sumf = vaddvq_f32(sumv0) + vaddvq_f32(sumv1) + summs;
+
+    // the last block of an odd number of blocks
+    for (; i < nb; ++i) {
+        int sumi = 0;
+
+        for (int j = 0; j < qk/2; ++j) {
+            const int v0 = (x[i].qs[j] & 0x0F);
+            const int v1 = (x[i].qs[j] >>   4);
+
+            sumi += (v0 * y[i].qs[j]) + (v1 * y[i].qs[j + qk/2]);
+        }
+
+        sumf += (LM_GGML_FP16_TO_FP32(x[i].d)*y[i].d)*sumi + LM_GGML_FP16_TO_FP32(x[i].m)*y[i].s;
+    }
+
+    *s = sumf;
 #elif defined(__AVX2__) || defined(__AVX__)
     // Initialize accumulator with zeros
     __m256 acc = _mm256_setzero_ps();
@@ -2929,8 +3187,8 @@ static void lm_ggml_vec_dot_q5_0_q8_0(const int n, float * restrict s, const voi
     uint64_t tmp0[4];
     uint64_t tmp1[4];
 
-    LM_GGML_ASSERT(nb % 2 == 0); // TODO: handle odd nb
-    for (int i = 0; i < nb; i += 2) {
+    int i = 0;
+    for (; i + 1 < nb; i += 2) {
         const block_q5_0 * restrict x0 = &x[i];
         const block_q5_0 * restrict x1 = &x[i + 1];
         const block_q8_0 * restrict y0 = &y[i];
@@ -3006,7 +3264,29 @@ static void lm_ggml_vec_dot_q5_0_q8_0(const int n, float * restrict s, const voi
 #endif
     }
 
-    *s = vaddvq_f32(sumv0) + vaddvq_f32(sumv1);
+    float sumf = vaddvq_f32(sumv0) + vaddvq_f32(sumv1);
+
+    // the last block of an odd number of blocks
+    for (; i < nb; ++i) {
+        uint32_t qh;
+        memcpy(&qh, x[i].qh, sizeof(qh));
+
+        int sumi = 0;
+
+        for (int j = 0; j < qk/2; ++j) {
+            const uint8_t xh_0 = ((qh & (1u << (j + 0 ))) >> (j + 0 )) << 4;
+            const uint8_t xh_1 = ((qh & (1u << (j + 16))) >> (j + 12));
+
+            const int32_t x0 = ((x[i].qs[j] & 0x0F) | xh_0) - 16;
+            const int32_t x1 = ((x[i].qs[j] >>   4) | xh_1) - 16;
+
+            sumi += (x0 * y[i].qs[j]) + (x1 * y[i].qs[j + qk/2]);
+        }
+
+        sumf += (LM_GGML_FP16_TO_FP32(x[i].d)*LM_GGML_FP16_TO_FP32(y[i].d)) * sumi;
+    }
+
+    *s = sumf;
 #elif defined(__wasm_simd128__)
     v128_t sumv = wasm_f32x4_splat(0.0f);
 
@@ -3237,8 +3517,8 @@ static void lm_ggml_vec_dot_q5_1_q8_1(const int n, float * restrict s, const voi
     uint64_t tmp0[4];
     uint64_t tmp1[4];
 
-    LM_GGML_ASSERT(nb % 2 == 0); // TODO: handle odd nb
-    for (int i = 0; i < nb; i += 2) {
+    int i = 0;
+    for (; i + 1 < nb; i += 2) {
         const block_q5_1 * restrict x0 = &x[i];
         const block_q5_1 * restrict x1 = &x[i + 1];
         const block_q8_1 * restrict y0 = &y[i];
@@ -3317,7 +3597,29 @@ static void lm_ggml_vec_dot_q5_1_q8_1(const int n, float * restrict s, const voi
 #endif
     }
 
-    *s = vaddvq_f32(sumv0) + vaddvq_f32(sumv1) + summs0 + summs1;
+    float sumf = vaddvq_f32(sumv0) + vaddvq_f32(sumv1) + summs0 + summs1;
+
+    // the last block of an odd number of blocks
+    for (; i < nb; ++i) {
+        uint32_t qh;
+        memcpy(&qh, x[i].qh, sizeof(qh));
+
+        int sumi = 0;
+
+        for (int j = 0; j < qk/2; ++j) {
+            const uint8_t xh_0 = ((qh >> (j +  0)) << 4) & 0x10;
+            const uint8_t xh_1 = ((qh >> (j + 12))     ) & 0x10;
+
+            const int32_t x0 = (x[i].qs[j] & 0xF) | xh_0;
+            const int32_t x1 = (x[i].qs[j] >>  4) | xh_1;
+
+            sumi += (x0 * y[i].qs[j]) + (x1 * y[i].qs[j + qk/2]);
+        }
+
+        sumf += (LM_GGML_FP16_TO_FP32(x[i].d)*y[i].d)*sumi + LM_GGML_FP16_TO_FP32(x[i].m)*y[i].s;
+    }
+
+    *s = sumf;
 #elif defined(__wasm_simd128__)
     v128_t sumv = wasm_f32x4_splat(0.0f);
 
@@ -3545,8 +3847,8 @@ static void lm_ggml_vec_dot_q8_0_q8_0(const int n, float * restrict s, const voi
     float32x4_t sumv0 = vdupq_n_f32(0.0f);
     float32x4_t sumv1 = vdupq_n_f32(0.0f);
 
-    LM_GGML_ASSERT(nb % 2 == 0); // TODO: handle odd nb
-    for (int i = 0; i < nb; i += 2) {
+    int i = 0;
+    for (; i + 1 < nb; i += 2) {
         const block_q8_0 * restrict x0 = &x[i + 0];
         const block_q8_0 * restrict x1 = &x[i + 1];
         const block_q8_0 * restrict y0 = &y[i + 0];
@@ -3593,7 +3895,20 @@ static void lm_ggml_vec_dot_q8_0_q8_0(const int n, float * restrict s, const voi
 #endif
     }
 
-    *s = vaddvq_f32(sumv0) + vaddvq_f32(sumv1);
+    float sumf = vaddvq_f32(sumv0) + vaddvq_f32(sumv1);
+
+    // the last block of an odd number of blocks
+    for (; i < nb; ++i) {
+        int sumi = 0;
+
+        for (int j = 0; j < qk; j++) {
+            sumi += x[i].qs[j]*y[i].qs[j];
+        }
+
+        sumf += sumi*(LM_GGML_FP16_TO_FP32(x[i].d)*LM_GGML_FP16_TO_FP32(y[i].d));
+    }
+
+    *s = sumf;
 #elif defined(__AVX2__) || defined(__AVX__)
     // Initialize accumulator with zeros
     __m256 acc = _mm256_setzero_ps();
@@ -3654,19 +3969,1339 @@ static void lm_ggml_vec_dot_q8_0_q8_0(const int n, float * restrict s, const voi
 #endif
 }
 
-// compute LM_GGML_VEC_DOT_UNROLL dot products at once
-// xs - x row stride in bytes
-inline static void lm_ggml_vec_dot_f16_unroll(const int n, const int xs, float * restrict s, void * restrict xv, lm_ggml_fp16_t * restrict y) {
-    lm_ggml_float sumf[LM_GGML_VEC_DOT_UNROLL] = { 0.0 };
+#ifdef LM_GGML_VEC_DOT_Q8_0_Q8_0_MXN
+static void lm_ggml_vec_dot_q8_0_q8_0_mxn(const int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by) {
+    const int qk = QK8_0;
+    const int nb = n / qk;
 
-    lm_ggml_fp16_t * restrict x[LM_GGML_VEC_DOT_UNROLL];
+    assert(n % qk == 0);
 
-    for (int i = 0; i < LM_GGML_VEC_DOT_UNROLL; ++i) {
-        x[i] = (lm_ggml_fp16_t *) ((char *) xv + i*xs);
+    const block_q8_0 * restrict x[LM_GGML_VEC_DOT_MXN_NR0];
+    const block_q8_0 * restrict y[LM_GGML_VEC_DOT_MXN_NR1];
+
+    for (int r = 0; r < LM_GGML_VEC_DOT_MXN_NR0; ++r) {
+        x[r] = (const block_q8_0 *) ((const char *) vx + r*bx);
+    }
+    for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+        y[c] = (const block_q8_0 *) ((const char *) vy + c*by);
     }
 
-#if defined(LM_GGML_SIMD)
-    const int np = (n & ~(LM_GGML_F16_STEP - 1));
+#if defined(__ARM_NEON)
+    float32x4_t sumv0[LM_GGML_VEC_DOT_MXN_NR1][LM_GGML_VEC_DOT_MXN_NR0];
+    float32x4_t sumv1[LM_GGML_VEC_DOT_MXN_NR1][LM_GGML_VEC_DOT_MXN_NR0];
+
+    for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+        for (int r = 0; r < LM_GGML_VEC_DOT_MXN_NR0; ++r) {
+            sumv0[c][r] = vdupq_n_f32(0.0f);
+            sumv1[c][r] = vdupq_n_f32(0.0f);
+        }
+    }
+
+    int i = 0;
+    for (; i + 1 < nb; i += 2) {
+        int8x16_t v0[LM_GGML_VEC_DOT_MXN_NR0][4];
+        float     d0[LM_GGML_VEC_DOT_MXN_NR0][2];
+
+        for (int r = 0; r < LM_GGML_VEC_DOT_MXN_NR0; ++r) {
+            v0[r][0] = vld1q_s8(x[r][i + 0].qs);
+            v0[r][1] = vld1q_s8(x[r][i + 0].qs + 16);
+            v0[r][2] = vld1q_s8(x[r][i + 1].qs);
+            v0[r][3] = vld1q_s8(x[r][i + 1].qs + 16);
+
+            d0[r][0] = LM_GGML_FP16_TO_FP32(x[r][i + 0].d);
+            d0[r][1] = LM_GGML_FP16_TO_FP32(x[r][i + 1].d);
+        }
+
+        for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+            const block_q8_0 * restrict y0 = &y[c][i + 0];
+            const block_q8_0 * restrict y1 = &y[c][i + 1];
+
+            const int8x16_t y0_0 = vld1q_s8(y0->qs);
+            const int8x16_t y0_1 = vld1q_s8(y0->qs + 16);
+            const int8x16_t y1_0 = vld1q_s8(y1->qs);
+            const int8x16_t y1_1 = vld1q_s8(y1->qs + 16);
+
+            const float d1_0 = LM_GGML_FP16_TO_FP32(y0->d);
+            const float d1_1 = LM_GGML_FP16_TO_FP32(y1->d);
+
+            for (int r = 0; r < LM_GGML_VEC_DOT_MXN_NR0; ++r) {
+#if defined(__ARM_FEATURE_DOTPROD)
+                const int32x4_t p_0 = vaddq_s32(vdotq_s32(vdupq_n_s32(0), v0[r][0], y0_0), vdotq_s32(vdupq_n_s32(0), v0[r][1], y0_1));
+                const int32x4_t p_1 = vaddq_s32(vdotq_s32(vdupq_n_s32(0), v0[r][2], y1_0), vdotq_s32(vdupq_n_s32(0), v0[r][3], y1_1));
+#else
+                const int16x8_t p0_0 = vmull_s8(vget_low_s8 (v0[r][0]), vget_low_s8 (y0_0));
+                const int16x8_t p0_1 = vmull_s8(vget_high_s8(v0[r][0]), vget_high_s8(y0_0));
+                const int16x8_t p0_2 = vmull_s8(vget_low_s8 (v0[r][1]), vget_low_s8 (y0_1));
+                const int16x8_t p0_3 = vmull_s8(vget_high_s8(v0[r][1]), vget_high_s8(y0_1));
+
+                const int16x8_t p1_0 = vmull_s8(vget_low_s8 (v0[r][2]), vget_low_s8 (y1_0));
+                const int16x8_t p1_1 = vmull_s8(vget_high_s8(v0[r][2]), vget_high_s8(y1_0));
+                const int16x8_t p1_2 = vmull_s8(vget_low_s8 (v0[r][3]), vget_low_s8 (y1_1));
+                const int16x8_t p1_3 = vmull_s8(vget_high_s8(v0[r][3]), vget_high_s8(y1_1));
+
+                const int32x4_t p_0 = vaddq_s32(vaddq_s32(vpaddlq_s16(p0_0), vpaddlq_s16(p0_1)), vaddq_s32(vpaddlq_s16(p0_2), vpaddlq_s16(p0_3)));
+                const int32x4_t p_1 = vaddq_s32(vaddq_s32(vpaddlq_s16(p1_0), vpaddlq_s16(p1_1)), vaddq_s32(vpaddlq_s16(p1_2), vpaddlq_s16(p1_3)));
+#endif
+                sumv0[c][r] = vmlaq_n_f32(sumv0[c][r], vcvtq_f32_s32(p_0), d0[r][0]*d1_0);
+                sumv1[c][r] = vmlaq_n_f32(sumv1[c][r], vcvtq_f32_s32(p_1), d0[r][1]*d1_1);
+            }
+        }
+    }
+
+    for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+        for (int r = 0; r < LM_GGML_VEC_DOT_MXN_NR0; ++r) {
+            float sumf = vaddvq_f32(sumv0[c][r]) + vaddvq_f32(sumv1[c][r]);
+
+            // the last block of an odd number of blocks
+            if (i < nb) {
+                float tail;
+                lm_ggml_vec_dot_q8_0_q8_0(qk, &tail, x[r] + i, y[c] + i);
+                sumf += tail;
+            }
+
+            s[c*bs + r] = sumf;
+        }
+    }
+#elif defined(__AVX2__)
+    __m256 acc[LM_GGML_VEC_DOT_MXN_NR1][LM_GGML_VEC_DOT_MXN_NR0];
+
+    for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+        for (int r = 0; r < LM_GGML_VEC_DOT_MXN_NR0; ++r) {
+            acc[c][r] = _mm256_setzero_ps();
+        }
+    }
+
+    for (int i = 0; i < nb; ++i) {
+        __m256i qx[LM_GGML_VEC_DOT_MXN_NR0];
+        float   dx[LM_GGML_VEC_DOT_MXN_NR0];
+
+        for (int r = 0; r < LM_GGML_VEC_DOT_MXN_NR0; ++r) {
+            qx[r] = _mm256_loadu_si256((const __m256i *)x[r][i].qs);
+            dx[r] = LM_GGML_FP16_TO_FP32(x[r][i].d);
+        }
+
+        for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+            const __m256i qy = _mm256_loadu_si256((const __m256i *)y[c][i].qs);
+            const float   dy = LM_GGML_FP16_TO_FP32(y[c][i].d);
+
+            for (int r = 0; r < LM_GGML_VEC_DOT_MXN_NR0; ++r) {
+                const __m256 q = mul_sum_i8_pairs_float(qx[r], qy);
+                acc[c][r] = _mm256_fmadd_ps(_mm256_set1_ps(dx[r]*dy), q, acc[c][r]);
+            }
+        }
+    }
+
+    for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+        for (int r = 0; r < LM_GGML_VEC_DOT_MXN_NR0; ++r) {
+            s[c*bs + r] = hsum_float_8(acc[c][r]);
+        }
+    }
+#endif
+}
+#endif
+
+// dot products of the 4 interleaved rows of x with y: s[r] = dot(x_r, y)
+static void lm_ggml_vec_dot_q4_0_x4_q8_0(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    const int qk = QK8_0;
+    const int nb = n / qk;
+
+    assert(n % qk == 0);
+
+    const block_q4_0x4 * restrict x = vx;
+    const block_q8_0   * restrict y = vy;
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+    const uint8x16_t m4b = vdupq_n_u8(0x0F);
+    const int8x16_t  s8b = vdupq_n_s8(0x8);
+
+    float32x4_t sumv = vdupq_n_f32(0.0f);
+
+    for (int i = 0; i < nb; ++i) {
+        const int32x4_t yl = vreinterpretq_s32_s8(vld1q_s8(y[i].qs));
+        const int32x4_t yh = vreinterpretq_s32_s8(vld1q_s8(y[i].qs + 16));
+
+        int32x4_t sumi = vdupq_n_s32(0);
+
+        // each 16 bytes of x hold the same group of 4 quants of the 4 rows, multiply them with the broadcast group of y
+#define LM_GGML_Q4_0_X4_GROUP(k) \
+        { \
+            const uint8x16_t q = vld1q_u8(x[i].qs + 16*(k)); \
+            const int8x16_t ql = vsubq_s8(vreinterpretq_s8_u8(vandq_u8  (q, m4b)), s8b); \
+            const int8x16_t qh = vsubq_s8(vreinterpretq_s8_u8(vshrq_n_u8(q, 4)),   s8b); \
+            sumi = lm_ggml_vdotq_s32(sumi, ql, vreinterpretq_s8_s32(vdupq_laneq_s32(yl, k))); \
+            sumi = lm_ggml_vdotq_s32(sumi, qh, vreinterpretq_s8_s32(vdupq_laneq_s32(yh, k))); \
+        }
+        LM_GGML_Q4_0_X4_GROUP(0)
+        LM_GGML_Q4_0_X4_GROUP(1)
+        LM_GGML_Q4_0_X4_GROUP(2)
+        LM_GGML_Q4_0_X4_GROUP(3)
+#undef LM_GGML_Q4_0_X4_GROUP
+
+        const float dx[4] = {
+            LM_GGML_FP16_TO_FP32(x[i].d[0]), LM_GGML_FP16_TO_FP32(x[i].d[1]),
+            LM_GGML_FP16_TO_FP32(x[i].d[2]), LM_GGML_FP16_TO_FP32(x[i].d[3]),
+        };
+
+        sumv = vmlaq_f32(sumv, vcvtq_f32_s32(sumi), vmulq_n_f32(vld1q_f32(dx), LM_GGML_FP16_TO_FP32(y[i].d)));
+    }
+
+    vst1q_f32(s, sumv);
+#elif defined(__AVX2__)
+    const __m256i m4  = _mm256_set1_epi8(0xF);
+    const __m256i off = _mm256_set1_epi8(8);
+
+    // broadcast 2 groups of 4 quants of y to the lanes of the 4 rows
+    const __m256i perm0 = _mm256_set_epi32(1, 1, 1, 1, 0, 0, 0, 0);
+    const __m256i perm1 = _mm256_set_epi32(3, 3, 3, 3, 2, 2, 2, 2);
+    const __m256i perm2 = _mm256_set_epi32(5, 5, 5, 5, 4, 4, 4, 4);
+    const __m256i perm3 = _mm256_set_epi32(7, 7, 7, 7, 6, 6, 6, 6);
+
+    __m256 acc = _mm256_setzero_ps();
+
+    for (int i = 0; i < nb; ++i) {
+        const __m256i by = _mm256_loadu_si256((const __m256i *)y[i].qs);
+
+        const __m256i y0 = _mm256_permutevar8x32_epi32(by, perm0); // low  nibbles of groups 0, 1
+        const __m256i y1 = _mm256_permutevar8x32_epi32(by, perm1); // low  nibbles of groups 2, 3
+        const __m256i y2 = _mm256_permutevar8x32_epi32(by, perm2); // high nibbles of groups 0, 1
+        const __m256i y3 = _mm256_permutevar8x32_epi32(by, perm3); // high nibbles of groups 2, 3
+
+        const __m256i q01 = _mm256_loadu_si256((const __m256i *)(x[i].qs +  0));
+        const __m256i q23 = _mm256_loadu_si256((const __m256i *)(x[i].qs + 32));
+
+        // the nibbles are kept in [ 0 .. 15 ], the offset is subtracted as sum(8*y)
+        __m256i sumi = mul_sum_us8_pairs_i32(_mm256_and_si256(q01, m4), y0);
+        sumi = _mm256_add_epi32(sumi, mul_sum_us8_pairs_i32(_mm256_and_si256(q23, m4), y1));
+        sumi = _mm256_add_epi32(sumi, mul_sum_us8_pairs_i32(_mm256_and_si256(_mm256_srli_epi16(q01, 4), m4), y2));
+        sumi = _mm256_add_epi32(sumi, mul_sum_us8_pairs_i32(_mm256_and_si256(_mm256_srli_epi16(q23, 4), m4), y3));
+
+        __m256i sumy = mul_sum_us8_pairs_i32(off, y0);
+        sumy = _mm256_add_epi32(sumy, mul_sum_us8_pairs_i32(off, y1));
+        sumy = _mm256_add_epi32(sumy, mul_sum_us8_pairs_i32(off, y2));
+        sumy = _mm256_add_epi32(sumy, mul_sum_us8_pairs_i32(off, y3));
+
+        const __m128 dx = _mm_set_ps(
+                LM_GGML_FP16_TO_FP32(x[i].d[3]), LM_GGML_FP16_TO_FP32(x[i].d[2]),
+                LM_GGML_FP16_TO_FP32(x[i].d[1]), LM_GGML_FP16_TO_FP32(x[i].d[0]));
+        const __m256 d = _mm256_mul_ps(_mm256_insertf128_ps(_mm256_castps128_ps256(dx), dx, 1), _mm256_set1_ps(LM_GGML_FP16_TO_FP32(y[i].d)));
+
+        acc = _mm256_fmadd_ps(d, _mm256_cvtepi32_ps(_mm256_sub_epi32(sumi, sumy)), acc);
+    }
+
+    _mm_storeu_ps(s, _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1)));
+#else
+    // scalar
+    float sumf[4] = { 0.0f };
+
+    for (int i = 0; i < nb; ++i) {
+        for (int r = 0; r < 4; ++r) {
+            int sumi = 0;
+
+            for (int k = 0; k < qk/8; ++k) {
+                for (int j = 0; j < 4; ++j) {
+                    const uint8_t q = x[i].qs[16*k + 4*r + j];
+
+                    const int v0 = (q & 0x0F) - 8;
+                    const int v1 = (q >>   4) - 8;
+
+                    sumi += (v0 * y[i].qs[4*k + j]) + (v1 * y[i].qs[4*k + j + qk/2]);
+                }
+            }
+
+            sumf[r] += sumi*LM_GGML_FP16_TO_FP32(x[i].d[r])*LM_GGML_FP16_TO_FP32(y[i].d);
+        }
+    }
+
+    for (int r = 0; r < 4; ++r) {
+        s[r] = sumf[r];
+    }
+#endif
+}
+
+static void lm_ggml_vec_dot_q8_0_x4_q8_0(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    const int qk = QK8_0;
+    const int nb = n / qk;
+
+    assert(n % qk == 0);
+
+    const block_q8_0x4 * restrict x = vx;
+    const block_q8_0   * restrict y = vy;
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+    float32x4_t sumv = vdupq_n_f32(0.0f);
+
+    for (int i = 0; i < nb; ++i) {
+        const int32x4_t y0 = vreinterpretq_s32_s8(vld1q_s8(y[i].qs));
+        const int32x4_t y1 = vreinterpretq_s32_s8(vld1q_s8(y[i].qs + 16));
+
+        int32x4_t sumi = vdupq_n_s32(0);
+
+        sumi = lm_ggml_vdotq_s32(sumi, vld1q_s8(x[i].qs +   0), vreinterpretq_s8_s32(vdupq_laneq_s32(y0, 0)));
+        sumi = lm_ggml_vdotq_s32(sumi, vld1q_s8(x[i].qs +  16), vreinterpretq_s8_s32(vdupq_laneq_s32(y0, 1)));
+        sumi = lm_ggml_vdotq_s32(sumi, vld1q_s8(x[i].qs +  32), vreinterpretq_s8_s32(vdupq_laneq_s32(y0, 2)));
+        sumi = lm_ggml_vdotq_s32(sumi, vld1q_s8(x[i].qs +  48), vreinterpretq_s8_s32(vdupq_laneq_s32(y0, 3)));
+        sumi = lm_ggml_vdotq_s32(sumi, vld1q_s8(x[i].qs +  64), vreinterpretq_s8_s32(vdupq_laneq_s32(y1, 0)));
+        sumi = lm_ggml_vdotq_s32(sumi, vld1q_s8(x[i].qs +  80), vreinterpretq_s8_s32(vdupq_laneq_s32(y1, 1)));
+        sumi = lm_ggml_vdotq_s32(sumi, vld1q_s8(x[i].qs +  96), vreinterpretq_s8_s32(vdupq_laneq_s32(y1, 2)));
+        sumi = lm_ggml_vdotq_s32(sumi, vld1q_s8(x[i].qs + 112), vreinterpretq_s8_s32(vdupq_laneq_s32(y1, 3)));
+
+        const float dx[4] = {
+            LM_GGML_FP16_TO_FP32(x[i].d[0]), LM_GGML_FP16_TO_FP32(x[i].d[1]),
+            LM_GGML_FP16_TO_FP32(x[i].d[2]), LM_GGML_FP16_TO_FP32(x[i].d[3]),
+        };
+
+        sumv = vmlaq_f32(sumv, vcvtq_f32_s32(sumi), vmulq_n_f32(vld1q_f32(dx), LM_GGML_FP16_TO_FP32(y[i].d)));
+    }
+
+    vst1q_f32(s, sumv);
+#elif defined(__AVX2__)
+    // broadcast 2 groups of 4 quants of y to the lanes of the 4 rows
+    const __m256i perm0 = _mm256_set_epi32(1, 1, 1, 1, 0, 0, 0, 0);
+    const __m256i perm1 = _mm256_set_epi32(3, 3, 3, 3, 2, 2, 2, 2);
+    const __m256i perm2 = _mm256_set_epi32(5, 5, 5, 5, 4, 4, 4, 4);
+    const __m256i perm3 = _mm256_set_epi32(7, 7, 7, 7, 6, 6, 6, 6);
+
+    __m256 acc = _mm256_setzero_ps();
+
+    for (int i = 0; i < nb; ++i) {
+        const __m256i by = _mm256_loadu_si256((const __m256i *)y[i].qs);
+
+        const __m256i y0 = _mm256_permutevar8x32_epi32(by, perm0);
+        const __m256i y1 = _mm256_permutevar8x32_epi32(by, perm1);
+        const __m256i y2 = _mm256_permutevar8x32_epi32(by, perm2);
+        const __m256i y3 = _mm256_permutevar8x32_epi32(by, perm3);
+
+        const __m256i q0 = _mm256_loadu_si256((const __m256i *)(x[i].qs +  0));
+        const __m256i q1 = _mm256_loadu_si256((const __m256i *)(x[i].qs + 32));
+        const __m256i q2 = _mm256_loadu_si256((const __m256i *)(x[i].qs + 64));
+        const __m256i q3 = _mm256_loadu_si256((const __m256i *)(x[i].qs + 96));
+
+        __m256i sumi = mul_sum_us8_pairs_i32(_mm256_sign_epi8(q0, q0), _mm256_sign_epi8(y0, q0));
+        sumi = _mm256_add_epi32(sumi, mul_sum_us8_pairs_i32(_mm256_sign_epi8(q1, q1), _mm256_sign_epi8(y1, q1)));
+        sumi = _mm256_add_epi32(sumi, mul_sum_us8_pairs_i32(_mm256_sign_epi8(q2, q2), _mm256_sign_epi8(y2, q2)));
+        sumi = _mm256_add_epi32(sumi, mul_sum_us8_pairs_i32(_mm256_sign_epi8(q3, q3), _mm256_sign_epi8(y3, q3)));
+
+        const __m128 dx = _mm_set_ps(
+                LM_GGML_FP16_TO_FP32(x[i].d[3]), LM_GGML_FP16_TO_FP32(x[i].d[2]),
+                LM_GGML_FP16_TO_FP32(x[i].d[1]), LM_GGML_FP16_TO_FP32(x[i].d[0]));
+        const __m256 d = _mm256_mul_ps(_mm256_insertf128_ps(_mm256_castps128_ps256(dx), dx, 1), _mm256_set1_ps(LM_GGML_FP16_TO_FP32(y[i].d)));
+
+        acc = _mm256_fmadd_ps(d, _mm256_cvtepi32_ps(sumi), acc);
+    }
+
+    _mm_storeu_ps(s, _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1)));
+#else
+    // scalar
+    float sumf[4] = { 0.0f };
+
+    for (int i = 0; i < nb; ++i) {
+        for (int r = 0; r < 4; ++r) {
+            int sumi = 0;
+
+            for (int k = 0; k < qk/4; ++k) {
+                for (int j = 0; j < 4; ++j) {
+                    sumi += x[i].qs[16*k + 4*r + j]*y[i].qs[4*k + j];
+                }
+            }
+
+            sumf[r] += sumi*LM_GGML_FP16_TO_FP32(x[i].d[r])*LM_GGML_FP16_TO_FP32(y[i].d);
+        }
+    }
+
+    for (int r = 0; r < 4; ++r) {
+        s[r] = sumf[r];
+    }
+#endif
+}
+
+#if defined(LM_GGML_VEC_DOT_Q4_0_Q8_0_MXN) || defined(LM_GGML_VEC_DOT_Q8_0_Q8_0_MXN)
+static_assert(LM_GGML_VEC_DOT_MXN_NR0 == 4, "the tile of the interleaved kernels must cover the 4 interleaved rows");
+#endif
+
+#ifdef LM_GGML_VEC_DOT_Q4_0_Q8_0_MXN
+// tiled version of lm_ggml_vec_dot_q4_0_x4_q8_0, the 4 rows of the tile are the interleaved rows of vx (bx is unused)
+static void lm_ggml_vec_dot_q4_0_x4_q8_0_mxn(const int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by) {
+    const int qk = QK8_0;
+    const int nb = n / qk;
+
+    assert(n % qk == 0);
+    UNUSED(bx);
+
+    const block_q4_0x4 * restrict x = vx;
+    const block_q8_0   * restrict y[LM_GGML_VEC_DOT_MXN_NR1];
+
+    for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+        y[c] = (const block_q8_0 *) ((const char *) vy + c*by);
+    }
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+    const uint8x16_t m4b = vdupq_n_u8(0x0F);
+    const int8x16_t  s8b = vdupq_n_s8(0x8);
+
+    float32x4_t sumv[LM_GGML_VEC_DOT_MXN_NR1];
+
+    for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+        sumv[c] = vdupq_n_f32(0.0f);
+    }
+
+    for (int i = 0; i < nb; ++i) {
+        // unpack the quants of x once for all columns of y
+        int8x16_t xl[4];
+        int8x16_t xh[4];
+
+        for (int k = 0; k < 4; ++k) {
+            const uint8x16_t q = vld1q_u8(x[i].qs + 16*k);
+            xl[k] = vsubq_s8(vreinterpretq_s8_u8(vandq_u8  (q, m4b)), s8b);
+            xh[k] = vsubq_s8(vreinterpretq_s8_u8(vshrq_n_u8(q, 4)),   s8b);
+        }
+
+        const float dx[4] = {
+            LM_GGML_FP16_TO_FP32(x[i].d[0]), LM_GGML_FP16_TO_FP32(x[i].d[1]),
+            LM_GGML_FP16_TO_FP32(x[i].d[2]), LM_GGML_FP16_TO_FP32(x[i].d[3]),
+        };
+        const float32x4_t d = vld1q_f32(dx);
+
+        for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+            const int32x4_t yl = vreinterpretq_s32_s8(vld1q_s8(y[c][i].qs));
+            const int32x4_t yh = vreinterpretq_s32_s8(vld1q_s8(y[c][i].qs + 16));
+
+            int32x4_t sumi = vdupq_n_s32(0);
+
+            sumi = lm_ggml_vdotq_s32(sumi, xl[0], vreinterpretq_s8_s32(vdupq_laneq_s32(yl, 0)));
+            sumi = lm_ggml_vdotq_s32(sumi, xh[0], vreinterpretq_s8_s32(vdupq_laneq_s32(yh, 0)));
+            sumi = lm_ggml_vdotq_s32(sumi, xl[1], vreinterpretq_s8_s32(vdupq_laneq_s32(yl, 1)));
+            sumi = lm_ggml_vdotq_s32(sumi, xh[1], vreinterpretq_s8_s32(vdupq_laneq_s32(yh, 1)));
+            sumi = lm_ggml_vdotq_s32(sumi, xl[2], vreinterpretq_s8_s32(vdupq_laneq_s32(yl, 2)));
+            sumi = lm_ggml_vdotq_s32(sumi, xh[2], vreinterpretq_s8_s32(vdupq_laneq_s32(yh, 2)));
+            sumi = lm_ggml_vdotq_s32(sumi, xl[3], vreinterpretq_s8_s32(vdupq_laneq_s32(yl, 3)));
+            sumi = lm_ggml_vdotq_s32(sumi, xh[3], vreinterpretq_s8_s32(vdupq_laneq_s32(yh, 3)));
+
+            sumv[c] = vmlaq_f32(sumv[c], vcvtq_f32_s32(sumi), vmulq_n_f32(d, LM_GGML_FP16_TO_FP32(y[c][i].d)));
+        }
+    }
+
+    for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+        vst1q_f32(s + c*bs, sumv[c]);
+    }
+#elif defined(__AVX2__)
+    const __m256i m4  = _mm256_set1_epi8(0xF);
+    const __m256i off = _mm256_set1_epi8(8);
+
+    const __m256i perm[4] = {
+        _mm256_set_epi32(1, 1, 1, 1, 0, 0, 0, 0),
+        _mm256_set_epi32(3, 3, 3, 3, 2, 2, 2, 2),
+        _mm256_set_epi32(5, 5, 5, 5, 4, 4, 4, 4),
+        _mm256_set_epi32(7, 7, 7, 7, 6, 6, 6, 6),
+    };
+
+    __m256 acc[LM_GGML_VEC_DOT_MXN_NR1];
+
+    for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+        acc[c] = _mm256_setzero_ps();
+    }
+
+    for (int i = 0; i < nb; ++i) {
+        const __m256i q01 = _mm256_loadu_si256((const __m256i *)(x[i].qs +  0));
+        const __m256i q23 = _mm256_loadu_si256((const __m256i *)(x[i].qs + 32));
+
+        // unpack the quants of x to [ -8 .. 7 ] once for all columns of y, in the order of the y permutations
+        __m256i qx[4];
+        qx[0] = _mm256_sub_epi8(_mm256_and_si256(q01, m4), off);
+        qx[1] = _mm256_sub_epi8(_mm256_and_si256(q23, m4), off);
+        qx[2] = _mm256_sub_epi8(_mm256_and_si256(_mm256_srli_epi16(q01, 4), m4), off);
+        qx[3] = _mm256_sub_epi8(_mm256_and_si256(_mm256_srli_epi16(q23, 4), m4), off);
+
+        __m256i ax[4];
+        for (int k = 0; k < 4; ++k) {
+            ax[k] = _mm256_sign_epi8(qx[k], qx[k]);
+        }
+
+        const __m128 dx = _mm_set_ps(
+                LM_GGML_FP16_TO_FP32(x[i].d[3]), LM_GGML_FP16_TO_FP32(x[i].d[2]),
+                LM_GGML_FP16_TO_FP32(x[i].d[1]), LM_GGML_FP16_TO_FP32(x[i].d[0]));
+        const __m256 d = _mm256_insertf128_ps(_mm256_castps128_ps256(dx), dx, 1);
+
+        for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+            const __m256i qy = _mm256_loadu_si256((const __m256i *)y[c][i].qs);
+
+            // low nibbles pair with groups 0 .. 3 of y, high nibbles with groups 4 .. 7
+            const __m256i yq[4] = {
+                _mm256_permutevar8x32_epi32(qy, perm[0]),
+                _mm256_permutevar8x32_epi32(qy, perm[1]),
+                _mm256_permutevar8x32_epi32(qy, perm[2]),
+                _mm256_permutevar8x32_epi32(qy, perm[3]),
+            };
+
+            __m256i sumi = mul_sum_us8_pairs_i32(ax[0], _mm256_sign_epi8(yq[0], qx[0]));
+            sumi = _mm256_add_epi32(sumi, mul_sum_us8_pairs_i32(ax[1], _mm256_sign_epi8(yq[1], qx[1])));
+            sumi = _mm256_add_epi32(sumi, mul_sum_us8_pairs_i32(ax[2], _mm256_sign_epi8(yq[2], qx[2])));
+            sumi = _mm256_add_epi32(sumi, mul_sum_us8_pairs_i32(ax[3], _mm256_sign_epi8(yq[3], qx[3])));
+
+            acc[c] = _mm256_fmadd_ps(_mm256_mul_ps(d, _mm256_set1_ps(LM_GGML_FP16_TO_FP32(y[c][i].d))), _mm256_cvtepi32_ps(sumi), acc[c]);
+        }
+    }
+
+    for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+        _mm_storeu_ps(s + c*bs, _mm_add_ps(_mm256_castps256_ps128(acc[c]), _mm256_extractf128_ps(acc[c], 1)));
+    }
+#endif
+}
+#endif
+
+#ifdef LM_GGML_VEC_DOT_Q8_0_Q8_0_MXN
+// tiled version of lm_ggml_vec_dot_q8_0_x4_q8_0, the 4 rows of the tile are the interleaved rows of vx (bx is unused)
+static void lm_ggml_vec_dot_q8_0_x4_q8_0_mxn(const int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by) {
+    const int qk = QK8_0;
+    const int nb = n / qk;
+
+    assert(n % qk == 0);
+    UNUSED(bx);
+
+    const block_q8_0x4 * restrict x = vx;
+    const block_q8_0   * restrict y[LM_GGML_VEC_DOT_MXN_NR1];
+
+    for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+        y[c] = (const block_q8_0 *) ((const char *) vy + c*by);
+    }
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+    float32x4_t sumv[LM_GGML_VEC_DOT_MXN_NR1];
+
+    for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+        sumv[c] = vdupq_n_f32(0.0f);
+    }
+
+    for (int i = 0; i < nb; ++i) {
+        int8x16_t xq[8];
+
+        for (int k = 0; k < 8; ++k) {
+            xq[k] = vld1q_s8(x[i].qs + 16*k);
+        }
+
+        const float dx[4] = {
+            LM_GGML_FP16_TO_FP32(x[i].d[0]), LM_GGML_FP16_TO_FP32(x[i].d[1]),
+            LM_GGML_FP16_TO_FP32(x[i].d[2]), LM_GGML_FP16_TO_FP32(x[i].d[3]),
+        };
+        const float32x4_t d = vld1q_f32(dx);
+
+        for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+            const int32x4_t y0 = vreinterpretq_s32_s8(vld1q_s8(y[c][i].qs));
+            const int32x4_t y1 = vreinterpretq_s32_s8(vld1q_s8(y[c][i].qs + 16));
+
+            int32x4_t sumi = vdupq_n_s32(0);
+
+            sumi = lm_ggml_vdotq_s32(sumi, xq[0], vreinterpretq_s8_s32(vdupq_laneq_s32(y0, 0)));
+            sumi = lm_ggml_vdotq_s32(sumi, xq[1], vreinterpretq_s8_s32(vdupq_laneq_s32(y0, 1)));
+            sumi = lm_ggml_vdotq_s32(sumi, xq[2], vreinterpretq_s8_s32(vdupq_laneq_s32(y0, 2)));
+            sumi = lm_ggml_vdotq_s32(sumi, xq[3], vreinterpretq_s8_s32(vdupq_laneq_s32(y0, 3)));
+            sumi = lm_ggml_vdotq_s32(sumi, xq[4], vreinterpretq_s8_s32(vdupq_laneq_s32(y1, 0)));
+            sumi = lm_ggml_vdotq_s32(sumi, xq[5], vreinterpretq_s8_s32(vdupq_laneq_s32(y1, 1)));
+            sumi = lm_ggml_vdotq_s32(sumi, xq[6], vreinterpretq_s8_s32(vdupq_laneq_s32(y1, 2)));
+            sumi = lm_ggml_vdotq_s32(sumi, xq[7], vreinterpretq_s8_s32(vdupq_laneq_s32(y1, 3)));
+
+            sumv[c] = vmlaq_f32(sumv[c], vcvtq_f32_s32(sumi), vmulq_n_f32(d, LM_GGML_FP16_TO_FP32(y[c][i].d)));
+        }
+    }
+
+    for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+        vst1q_f32(s + c*bs, sumv[c]);
+    }
+#elif defined(__AVX2__)
+    const __m256i perm[4] = {
+        _mm256_set_epi32(1, 1, 1, 1, 0, 0, 0, 0),
+        _mm256_set_epi32(3, 3, 3, 3, 2, 2, 2, 2),
+        _mm256_set_epi32(5, 5, 5, 5, 4, 4, 4, 4),
+        _mm256_set_epi32(7, 7, 7, 7, 6, 6, 6, 6),
+    };
+
+    __m256 acc[LM_GGML_VEC_DOT_MXN_NR1];
+
+    for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+        acc[c] = _mm256_setzero_ps();
+    }
+
+    for (int i = 0; i < nb; ++i) {
+        __m256i qx[4];
+        __m256i ax[4];
+
+        for (int k = 0; k < 4; ++k) {
+            qx[k] = _mm256_loadu_si256((const __m256i *)(x[i].qs + 32*k));
+            ax[k] = _mm256_sign_epi8(qx[k], qx[k]);
+        }
+
+        const __m128 dx = _mm_set_ps(
+                LM_GGML_FP16_TO_FP32(x[i].d[3]), LM_GGML_FP16_TO_FP32(x[i].d[2]),
+                LM_GGML_FP16_TO_FP32(x[i].d[1]), LM_GGML_FP16_TO_FP32(x[i].d[0]));
+        const __m256 d = _mm256_insertf128_ps(_mm256_castps128_ps256(dx), dx, 1);
+
+        for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+            const __m256i qy = _mm256_loadu_si256((const __m256i *)y[c][i].qs);
+
+            __m256i sumi = _mm256_setzero_si256();
+            for (int k = 0; k < 4; ++k) {
+                const __m256i yq = _mm256_permutevar8x32_epi32(qy, perm[k]);
+                sumi = _mm256_add_epi32(sumi, mul_sum_us8_pairs_i32(ax[k], _mm256_sign_epi8(yq, qx[k])));
+            }
+
+            acc[c] = _mm256_fmadd_ps(_mm256_mul_ps(d, _mm256_set1_ps(LM_GGML_FP16_TO_FP32(y[c][i].d))), _mm256_cvtepi32_ps(sumi), acc[c]);
+        }
+    }
+
+    for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+        _mm_storeu_ps(s + c*bs, _mm_add_ps(_mm256_castps256_ps128(acc[c]), _mm256_extractf128_ps(acc[c], 1)));
+    }
+#endif
+}
+#endif
+
+//
+// AVX-512 (BW, VL, VNNI) and AVX-VNNI dot products, selected at runtime by lm_ggml_setup_cpu_kernels
+//
+
+#ifdef LM_GGML_X86_DISPATCH
+#include <immintrin.h>
+
+// products of the fp16 deltas of 4 consecutive x and y blocks, the deltas are the first member of the blocks
+static inline LM_GGML_TARGET_AVX512 __m512 lm_ggml_mul_deltas_x4_avx512(const void * vx, size_t bx, const void * vy, size_t by) {
+    const uint8_t * x = vx;
+    const uint8_t * y = vy;
+
+    const __m128i d16 = _mm_setr_epi16(
+            *(const lm_ggml_fp16_t *)(x + 0*bx), *(const lm_ggml_fp16_t *)(x + 1*bx), *(const lm_ggml_fp16_t *)(x + 2*bx), *(const lm_ggml_fp16_t *)(x + 3*bx),
+            *(const lm_ggml_fp16_t *)(y + 0*by), *(const lm_ggml_fp16_t *)(y + 1*by), *(const lm_ggml_fp16_t *)(y + 2*by), *(const lm_ggml_fp16_t *)(y + 3*by));
+    const __m256 d = _mm256_cvtph_ps(d16);
+
+    return _mm512_castps128_ps512(_mm_mul_ps(_mm256_castps256_ps128(d), _mm256_extractf128_ps(d, 1)));
+}
+
+static LM_GGML_TARGET_AVX512 void lm_ggml_vec_dot_q4_0_q8_0_avx512(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    const int qk = QK8_0;
+    const int nb = n / qk;
+
+    assert(n % qk == 0);
+
+    const block_q4_0 * restrict x = vx;
+    const block_q8_0 * restrict y = vy;
+
+    const __m512i m4   = _mm512_set1_epi8(0xF);
+    const __m512i off  = _mm512_set1_epi8(8);
+    const __m512i zero = _mm512_setzero_si512();
+    const __m512i perm[2] = {
+        _mm512_set_epi32(1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0),
+        _mm512_set_epi32(3, 3, 3, 3, 3, 3, 3, 3, 2, 2, 2, 2, 2, 2, 2, 2),
+    };
+
+    __m512 acc = _mm512_setzero_ps();
+
+    // four blocks per iteration, two per register; the nibbles are unsigned and the offset of 8 is subtracted through sum(y)
+    int i = 0;
+    for (; i + 3 < nb; i += 4) {
+        const __m512 d = lm_ggml_mul_deltas_x4_avx512(x + i, sizeof(block_q4_0), y + i, sizeof(block_q8_0));
+
+        for (int k = 0; k < 2; ++k) {
+            const block_q4_0 * restrict x0 = &x[i + 2*k];
+            const block_q8_0 * restrict y0 = &y[i + 2*k];
+
+            const __m256i bx = MM256_SET_M128I(_mm_loadu_si128((const __m128i *)x0[1].qs), _mm_loadu_si128((const __m128i *)x0[0].qs));
+            __m512i qx = _mm512_inserti64x4(_mm512_castsi256_si512(bx), _mm256_srli_epi16(bx, 4), 1);
+            qx = _mm512_and_si512(_mm512_shuffle_i64x2(qx, qx, _MM_SHUFFLE(3, 1, 2, 0)), m4);
+
+            const __m512i qy = _mm512_inserti64x4(_mm512_castsi256_si512(_mm256_loadu_si256((const __m256i *)y0[0].qs)),
+                                                  _mm256_loadu_si256((const __m256i *)y0[1].qs), 1);
+
+            const __m512i sumi = _mm512_sub_epi32(_mm512_dpbusd_epi32(zero, qx, qy), _mm512_dpbusd_epi32(zero, off, qy));
+
+            acc = _mm512_fmadd_ps(_mm512_permutexvar_ps(perm[k], d), _mm512_cvtepi32_ps(sumi), acc);
+        }
+    }
+
+    float sumf = _mm512_reduce_add_ps(acc);
+
+    for (; i < nb; ++i) {
+        int sumi = 0;
+
+        for (int j = 0; j < qk/2; ++j) {
+            const int v0 = (x[i].qs[j] & 0x0F) - 8;
+            const int v1 = (x[i].qs[j] >>   4) - 8;
+
+            sumi += (v0 * y[i].qs[j]) + (v1 * y[i].qs[j + qk/2]);
+        }
+
+        sumf += sumi*_cvtsh_ss(x[i].d)*_cvtsh_ss(y[i].d);
+    }
+
+    *s = sumf;
+}
+
+static LM_GGML_TARGET_AVX512 void lm_ggml_vec_dot_q8_0_q8_0_avx512(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    const int qk = QK8_0;
+    const int nb = n / qk;
+
+    assert(n % qk == 0);
+
+    const block_q8_0 * restrict x = vx;
+    const block_q8_0 * restrict y = vy;
+
+    const __m512i off  = _mm512_set1_epi8((char) 0x80);
+    const __m512i zero = _mm512_setzero_si512();
+    const __m512i perm[2] = {
+        _mm512_set_epi32(1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0),
+        _mm512_set_epi32(3, 3, 3, 3, 3, 3, 3, 3, 2, 2, 2, 2, 2, 2, 2, 2),
+    };
+
+    __m512 acc = _mm512_setzero_ps();
+
+    // four blocks per iteration, two per register; x is made unsigned by adding 128 which is subtracted through sum(y)
+    int i = 0;
+    for (; i + 3 < nb; i += 4) {
+        const __m512 d = lm_ggml_mul_deltas_x4_avx512(x + i, sizeof(block_q8_0), y + i, sizeof(block_q8_0));
+
+        for (int k = 0; k < 2; ++k) {
+            const block_q8_0 * restrict x0 = &x[i + 2*k];
+            const block_q8_0 * restrict y0 = &y[i + 2*k];
+
+            const __m512i qx = _mm512_xor_si512(_mm512_inserti64x4(_mm512_castsi256_si512(_mm256_loadu_si256((const __m256i *)x0[0].qs)),
+                                                                   _mm256_loadu_si256((const __m256i *)x0[1].qs), 1), off);
+            const __m512i qy = _mm512_inserti64x4(_mm512_castsi256_si512(_mm256_loadu_si256((const __m256i *)y0[0].qs)),
+                                                  _mm256_loadu_si256((const __m256i *)y0[1].qs), 1);
+
+            const __m512i sumi = _mm512_sub_epi32(_mm512_dpbusd_epi32(zero, qx, qy), _mm512_dpbusd_epi32(zero, off, qy));
+
+            acc = _mm512_fmadd_ps(_mm512_permutexvar_ps(perm[k], d), _mm512_cvtepi32_ps(sumi), acc);
+        }
+    }
+
+    float sumf = _mm512_reduce_add_ps(acc);
+
+    for (; i < nb; ++i) {
+        int sumi = 0;
+
+        for (int j = 0; j < qk; j++) {
+            sumi += x[i].qs[j]*y[i].qs[j];
+        }
+
+        sumf += sumi*(_cvtsh_ss(x[i].d)*_cvtsh_ss(y[i].d));
+    }
+
+    *s = sumf;
+}
+
+// horizontally add 8 floats
+static inline LM_GGML_TARGET_AVXVNNI float hsum_float_8_avxvnni(const __m256 x) {
+    __m128 res = _mm256_extractf128_ps(x, 1);
+    res = _mm_add_ps(res, _mm256_castps256_ps128(x));
+    res = _mm_add_ps(res, _mm_movehl_ps(res, res));
+    res = _mm_add_ss(res, _mm_movehdup_ps(res));
+    return _mm_cvtss_f32(res);
+}
+
+static LM_GGML_TARGET_AVXVNNI void lm_ggml_vec_dot_q4_0_q8_0_avxvnni(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    const int qk = QK8_0;
+    const int nb = n / qk;
+
+    assert(n % qk == 0);
+
+    const block_q4_0 * restrict x = vx;
+    const block_q8_0 * restrict y = vy;
+
+    const __m256i m4   = _mm256_set1_epi8(0xF);
+    const __m256i off  = _mm256_set1_epi8(8);
+    const __m256i zero = _mm256_setzero_si256();
+
+    __m256 acc = _mm256_setzero_ps();
+
+    for (int i = 0; i < nb; ++i) {
+        const __m128i tmp = _mm_loadu_si128((const __m128i *)x[i].qs);
+        const __m256i qx = _mm256_and_si256(MM256_SET_M128I(_mm_srli_epi16(tmp, 4), tmp), m4);
+        const __m256i qy = _mm256_loadu_si256((const __m256i *)y[i].qs);
+
+        const __m256i sumi = _mm256_sub_epi32(_mm256_dpbusd_avx_epi32(zero, qx, qy), _mm256_dpbusd_avx_epi32(zero, off, qy));
+
+        const __m256 d = _mm256_set1_ps(_cvtsh_ss(x[i].d) * _cvtsh_ss(y[i].d));
+
+        acc = _mm256_fmadd_ps(d, _mm256_cvtepi32_ps(sumi), acc);
+    }
+
+    *s = hsum_float_8_avxvnni(acc);
+}
+
+static LM_GGML_TARGET_AVXVNNI void lm_ggml_vec_dot_q8_0_q8_0_avxvnni(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    const int qk = QK8_0;
+    const int nb = n / qk;
+
+    assert(n % qk == 0);
+
+    const block_q8_0 * restrict x = vx;
+    const block_q8_0 * restrict y = vy;
+
+    const __m256i off  = _mm256_set1_epi8((char) 0x80);
+    const __m256i zero = _mm256_setzero_si256();
+
+    __m256 acc = _mm256_setzero_ps();
+
+    for (int i = 0; i < nb; ++i) {
+        const __m256i qx = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)x[i].qs), off);
+        const __m256i qy = _mm256_loadu_si256((const __m256i *)y[i].qs);
+
+        const __m256i sumi = _mm256_sub_epi32(_mm256_dpbusd_avx_epi32(zero, qx, qy), _mm256_dpbusd_avx_epi32(zero, off, qy));
+
+        const __m256 d = _mm256_set1_ps(_cvtsh_ss(x[i].d) * _cvtsh_ss(y[i].d));
+
+        acc = _mm256_fmadd_ps(d, _mm256_cvtepi32_ps(sumi), acc);
+    }
+
+    *s = hsum_float_8_avxvnni(acc);
+}
+#endif
+
+//
+// arm64 dotprod and fp16 variants of the NEON dot products, selected at runtime by lm_ggml_setup_cpu_kernels
+//
+
+#if defined(LM_GGML_ARM_DISPATCH)
+static void lm_ggml_vec_dot_q4_0_q8_0_dotprod(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    const int qk = QK8_0;
+    const int nb = n / qk;
+
+    assert(n % qk == 0);
+
+    const block_q4_0 * restrict x = vx;
+    const block_q8_0 * restrict y = vy;
+
+    float32x4_t sumv0 = vdupq_n_f32(0.0f);
+    float32x4_t sumv1 = vdupq_n_f32(0.0f);
+
+    int i = 0;
+    for (; i + 1 < nb; i += 2) {
+        const block_q4_0 * restrict x0 = &x[i + 0];
+        const block_q4_0 * restrict x1 = &x[i + 1];
+        const block_q8_0 * restrict y0 = &y[i + 0];
+        const block_q8_0 * restrict y1 = &y[i + 1];
+
+        const uint8x16_t m4b = vdupq_n_u8(0x0F);
+        const int8x16_t  s8b = vdupq_n_s8(0x8);
+
+        const uint8x16_t v0_0 = vld1q_u8(x0->qs);
+        const uint8x16_t v0_1 = vld1q_u8(x1->qs);
+
+        // 4-bit -> 8-bit
+        const int8x16_t v0_0l = vreinterpretq_s8_u8(vandq_u8  (v0_0, m4b));
+        const int8x16_t v0_0h = vreinterpretq_s8_u8(vshrq_n_u8(v0_0, 4));
+        const int8x16_t v0_1l = vreinterpretq_s8_u8(vandq_u8  (v0_1, m4b));
+        const int8x16_t v0_1h = vreinterpretq_s8_u8(vshrq_n_u8(v0_1, 4));
+
+        // sub 8
+        const int8x16_t v0_0ls = vsubq_s8(v0_0l, s8b);
+        const int8x16_t v0_0hs = vsubq_s8(v0_0h, s8b);
+        const int8x16_t v0_1ls = vsubq_s8(v0_1l, s8b);
+        const int8x16_t v0_1hs = vsubq_s8(v0_1h, s8b);
+
+        // load y
+        const int8x16_t v1_0l = vld1q_s8(y0->qs);
+        const int8x16_t v1_0h = vld1q_s8(y0->qs + 16);
+        const int8x16_t v1_1l = vld1q_s8(y1->qs);
+        const int8x16_t v1_1h = vld1q_s8(y1->qs + 16);
+
+        // dot product into int32x4_t
+        const int32x4_t p_0 = lm_ggml_sdotq_s32(lm_ggml_sdotq_s32(vdupq_n_s32(0), v0_0ls, v1_0l), v0_0hs, v1_0h);
+        const int32x4_t p_1 = lm_ggml_sdotq_s32(lm_ggml_sdotq_s32(vdupq_n_s32(0), v0_1ls, v1_1l), v0_1hs, v1_1h);
+
+        sumv0 = vmlaq_n_f32(sumv0, vcvtq_f32_s32(p_0), LM_GGML_FP16_TO_FP32(x0->d)*LM_GGML_FP16_TO_FP32(y0->d));
+        sumv1 = vmlaq_n_f32(sumv1, vcvtq_f32_s32(p_1), LM_GGML_FP16_TO_FP32(x1->d)*LM_GGML_FP16_TO_FP32(y1->d));
+    }
+
+    float sumf = vaddvq_f32(sumv0) + vaddvq_f32(sumv1);
+
+    // the last block of an odd number of blocks
+    for (; i < nb; ++i) {
+        int sumi = 0;
+
+        for (int j = 0; j < qk/2; ++j) {
+            const int v0 = (x[i].qs[j] & 0x0F) - 8;
+            const int v1 = (x[i].qs[j] >>   4) - 8;
+
+            sumi += (v0 * y[i].qs[j]) + (v1 * y[i].qs[j + qk/2]);
+        }
+
+        sumf += sumi*LM_GGML_FP16_TO_FP32(x[i].d)*LM_GGML_FP16_TO_FP32(y[i].d);
+    }
+
+    *s = sumf;
+}
+
+static void lm_ggml_vec_dot_q8_0_q8_0_dotprod(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    const int qk = QK8_0;
+    const int nb = n / qk;
+
+    assert(n % qk == 0);
+
+    const block_q8_0 * restrict x = vx;
+    const block_q8_0 * restrict y = vy;
+
+    float32x4_t sumv0 = vdupq_n_f32(0.0f);
+    float32x4_t sumv1 = vdupq_n_f32(0.0f);
+
+    int i = 0;
+    for (; i + 1 < nb; i += 2) {
+        const block_q8_0 * restrict x0 = &x[i + 0];
+        const block_q8_0 * restrict x1 = &x[i + 1];
+        const block_q8_0 * restrict y0 = &y[i + 0];
+        const block_q8_0 * restrict y1 = &y[i + 1];
+
+        const int8x16_t x0_0 = vld1q_s8(x0->qs);
+        const int8x16_t x0_1 = vld1q_s8(x0->qs + 16);
+        const int8x16_t x1_0 = vld1q_s8(x1->qs);
+        const int8x16_t x1_1 = vld1q_s8(x1->qs + 16);
+
+        // load y
+        const int8x16_t y0_0 = vld1q_s8(y0->qs);
+        const int8x16_t y0_1 = vld1q_s8(y0->qs + 16);
+        const int8x16_t y1_0 = vld1q_s8(y1->qs);
+        const int8x16_t y1_1 = vld1q_s8(y1->qs + 16);
+
+        sumv0 = vmlaq_n_f32(sumv0, vcvtq_f32_s32(vaddq_s32(
+                        lm_ggml_sdotq_s32(vdupq_n_s32(0), x0_0, y0_0),
+                        lm_ggml_sdotq_s32(vdupq_n_s32(0), x0_1, y0_1))), LM_GGML_FP16_TO_FP32(x0->d)*LM_GGML_FP16_TO_FP32(y0->d));
+
+        sumv1 = vmlaq_n_f32(sumv1, vcvtq_f32_s32(vaddq_s32(
+                        lm_ggml_sdotq_s32(vdupq_n_s32(0), x1_0, y1_0),
+                        lm_ggml_sdotq_s32(vdupq_n_s32(0), x1_1, y1_1))), LM_GGML_FP16_TO_FP32(x1->d)*LM_GGML_FP16_TO_FP32(y1->d));
+
+    }
+
+    float sumf = vaddvq_f32(sumv0) + vaddvq_f32(sumv1);
+
+    // the last block of an odd number of blocks
+    for (; i < nb; ++i) {
+        int sumi = 0;
+
+        for (int j = 0; j < qk; j++) {
+            sumi += x[i].qs[j]*y[i].qs[j];
+        }
+
+        sumf += sumi*(LM_GGML_FP16_TO_FP32(x[i].d)*LM_GGML_FP16_TO_FP32(y[i].d));
+    }
+
+    *s = sumf;
+}
+
+static void lm_ggml_vec_dot_q4_0_q8_0_mxn_dotprod(const int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by) {
+    const int qk = QK8_0;
+    const int nb = n / qk;
+
+    assert(n % qk == 0);
+
+    const block_q4_0 * restrict x[LM_GGML_VEC_DOT_MXN_NR0];
+    const block_q8_0 * restrict y[LM_GGML_VEC_DOT_MXN_NR1];
+
+    for (int r = 0; r < LM_GGML_VEC_DOT_MXN_NR0; ++r) {
+        x[r] = (const block_q4_0 *) ((const char *) vx + r*bx);
+    }
+    for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+        y[c] = (const block_q8_0 *) ((const char *) vy + c*by);
+    }
+
+    float32x4_t sumv0[LM_GGML_VEC_DOT_MXN_NR1][LM_GGML_VEC_DOT_MXN_NR0];
+    float32x4_t sumv1[LM_GGML_VEC_DOT_MXN_NR1][LM_GGML_VEC_DOT_MXN_NR0];
+
+    for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+        for (int r = 0; r < LM_GGML_VEC_DOT_MXN_NR0; ++r) {
+            sumv0[c][r] = vdupq_n_f32(0.0f);
+            sumv1[c][r] = vdupq_n_f32(0.0f);
+        }
+    }
+
+    const uint8x16_t m4b = vdupq_n_u8(0x0F);
+    const int8x16_t  s8b = vdupq_n_s8(0x8);
+
+    int i = 0;
+    for (; i + 1 < nb; i += 2) {
+        // unpack the x blocks once and reuse them for all columns of y
+        int8x16_t v0[LM_GGML_VEC_DOT_MXN_NR0][4];
+        float     d0[LM_GGML_VEC_DOT_MXN_NR0][2];
+
+        for (int r = 0; r < LM_GGML_VEC_DOT_MXN_NR0; ++r) {
+            const uint8x16_t v0_0 = vld1q_u8(x[r][i + 0].qs);
+            const uint8x16_t v0_1 = vld1q_u8(x[r][i + 1].qs);
+
+            v0[r][0] = vsubq_s8(vreinterpretq_s8_u8(vandq_u8  (v0_0, m4b)), s8b);
+            v0[r][1] = vsubq_s8(vreinterpretq_s8_u8(vshrq_n_u8(v0_0, 4)),   s8b);
+            v0[r][2] = vsubq_s8(vreinterpretq_s8_u8(vandq_u8  (v0_1, m4b)), s8b);
+            v0[r][3] = vsubq_s8(vreinterpretq_s8_u8(vshrq_n_u8(v0_1, 4)),   s8b);
+
+            d0[r][0] = LM_GGML_FP16_TO_FP32(x[r][i + 0].d);
+            d0[r][1] = LM_GGML_FP16_TO_FP32(x[r][i + 1].d);
+        }
+
+        for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+            const block_q8_0 * restrict y0 = &y[c][i + 0];
+            const block_q8_0 * restrict y1 = &y[c][i + 1];
+
+            const int8x16_t v1_0l = vld1q_s8(y0->qs);
+            const int8x16_t v1_0h = vld1q_s8(y0->qs + 16);
+            const int8x16_t v1_1l = vld1q_s8(y1->qs);
+            const int8x16_t v1_1h = vld1q_s8(y1->qs + 16);
+
+            const float d1_0 = LM_GGML_FP16_TO_FP32(y0->d);
+            const float d1_1 = LM_GGML_FP16_TO_FP32(y1->d);
+
+            for (int r = 0; r < LM_GGML_VEC_DOT_MXN_NR0; ++r) {
+                const int32x4_t p_0 = lm_ggml_sdotq_s32(lm_ggml_sdotq_s32(vdupq_n_s32(0), v0[r][0], v1_0l), v0[r][1], v1_0h);
+                const int32x4_t p_1 = lm_ggml_sdotq_s32(lm_ggml_sdotq_s32(vdupq_n_s32(0), v0[r][2], v1_1l), v0[r][3], v1_1h);
+                sumv0[c][r] = vmlaq_n_f32(sumv0[c][r], vcvtq_f32_s32(p_0), d0[r][0]*d1_0);
+                sumv1[c][r] = vmlaq_n_f32(sumv1[c][r], vcvtq_f32_s32(p_1), d0[r][1]*d1_1);
+            }
+        }
+    }
+
+    for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+        for (int r = 0; r < LM_GGML_VEC_DOT_MXN_NR0; ++r) {
+            float sumf = vaddvq_f32(sumv0[c][r]) + vaddvq_f32(sumv1[c][r]);
+
+            // the last block of an odd number of blocks
+            if (i < nb) {
+                float tail;
+                lm_ggml_vec_dot_q4_0_q8_0_dotprod(qk, &tail, x[r] + i, y[c] + i);
+                sumf += tail;
+            }
+
+            s[c*bs + r] = sumf;
+        }
+    }
+}
+
+static void lm_ggml_vec_dot_q8_0_q8_0_mxn_dotprod(const int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by) {
+    const int qk = QK8_0;
+    const int nb = n / qk;
+
+    assert(n % qk == 0);
+
+    const block_q8_0 * restrict x[LM_GGML_VEC_DOT_MXN_NR0];
+    const block_q8_0 * restrict y[LM_GGML_VEC_DOT_MXN_NR1];
+
+    for (int r = 0; r < LM_GGML_VEC_DOT_MXN_NR0; ++r) {
+        x[r] = (const block_q8_0 *) ((const char *) vx + r*bx);
+    }
+    for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+        y[c] = (const block_q8_0 *) ((const char *) vy + c*by);
+    }
+
+    float32x4_t sumv0[LM_GGML_VEC_DOT_MXN_NR1][LM_GGML_VEC_DOT_MXN_NR0];
+    float32x4_t sumv1[LM_GGML_VEC_DOT_MXN_NR1][LM_GGML_VEC_DOT_MXN_NR0];
+
+    for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+        for (int r = 0; r < LM_GGML_VEC_DOT_MXN_NR0; ++r) {
+            sumv0[c][r] = vdupq_n_f32(0.0f);
+            sumv1[c][r] = vdupq_n_f32(0.0f);
+        }
+    }
+
+    int i = 0;
+    for (; i + 1 < nb; i += 2) {
+        int8x16_t v0[LM_GGML_VEC_DOT_MXN_NR0][4];
+        float     d0[LM_GGML_VEC_DOT_MXN_NR0][2];
+
+        for (int r = 0; r < LM_GGML_VEC_DOT_MXN_NR0; ++r) {
+            v0[r][0] = vld1q_s8(x[r][i + 0].qs);
+            v0[r][1] = vld1q_s8(x[r][i + 0].qs + 16);
+            v0[r][2] = vld1q_s8(x[r][i + 1].qs);
+            v0[r][3] = vld1q_s8(x[r][i + 1].qs + 16);
+
+            d0[r][0] = LM_GGML_FP16_TO_FP32(x[r][i + 0].d);
+            d0[r][1] = LM_GGML_FP16_TO_FP32(x[r][i + 1].d);
+        }
+
+        for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+            const block_q8_0 * restrict y0 = &y[c][i + 0];
+            const block_q8_0 * restrict y1 = &y[c][i + 1];
+
+            const int8x16_t y0_0 = vld1q_s8(y0->qs);
+            const int8x16_t y0_1 = vld1q_s8(y0->qs + 16);
+            const int8x16_t y1_0 = vld1q_s8(y1->qs);
+            const int8x16_t y1_1 = vld1q_s8(y1->qs + 16);
+
+            const float d1_0 = LM_GGML_FP16_TO_FP32(y0->d);
+            const float d1_1 = LM_GGML_FP16_TO_FP32(y1->d);
+
+            for (int r = 0; r < LM_GGML_VEC_DOT_MXN_NR0; ++r) {
+                const int32x4_t p_0 = vaddq_s32(lm_ggml_sdotq_s32(vdupq_n_s32(0), v0[r][0], y0_0), lm_ggml_sdotq_s32(vdupq_n_s32(0), v0[r][1], y0_1));
+                const int32x4_t p_1 = vaddq_s32(lm_ggml_sdotq_s32(vdupq_n_s32(0), v0[r][2], y1_0), lm_ggml_sdotq_s32(vdupq_n_s32(0), v0[r][3], y1_1));
+                sumv0[c][r] = vmlaq_n_f32(sumv0[c][r], vcvtq_f32_s32(p_0), d0[r][0]*d1_0);
+                sumv1[c][r] = vmlaq_n_f32(sumv1[c][r], vcvtq_f32_s32(p_1), d0[r][1]*d1_1);
+            }
+        }
+    }
+
+    for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+        for (int r = 0; r < LM_GGML_VEC_DOT_MXN_NR0; ++r) {
+            float sumf = vaddvq_f32(sumv0[c][r]) + vaddvq_f32(sumv1[c][r]);
+
+            // the last block of an odd number of blocks
+            if (i < nb) {
+                float tail;
+                lm_ggml_vec_dot_q8_0_q8_0_dotprod(qk, &tail, x[r] + i, y[c] + i);
+                sumf += tail;
+            }
+
+            s[c*bs + r] = sumf;
+        }
+    }
+}
+
+static void lm_ggml_vec_dot_q4_0_x4_q8_0_dotprod(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    const int qk = QK8_0;
+    const int nb = n / qk;
+
+    assert(n % qk == 0);
+
+    const block_q4_0x4 * restrict x = vx;
+    const block_q8_0   * restrict y = vy;
+
+    const uint8x16_t m4b = vdupq_n_u8(0x0F);
+    const int8x16_t  s8b = vdupq_n_s8(0x8);
+
+    float32x4_t sumv = vdupq_n_f32(0.0f);
+
+    for (int i = 0; i < nb; ++i) {
+        const int32x4_t yl = vreinterpretq_s32_s8(vld1q_s8(y[i].qs));
+        const int32x4_t yh = vreinterpretq_s32_s8(vld1q_s8(y[i].qs + 16));
+
+        int32x4_t sumi = vdupq_n_s32(0);
+
+        // each 16 bytes of x hold the same group of 4 quants of the 4 rows, multiply them with the broadcast group of y
+#define LM_GGML_Q4_0_X4_GROUP(k) \
+        { \
+            const uint8x16_t q = vld1q_u8(x[i].qs + 16*(k)); \
+            const int8x16_t ql = vsubq_s8(vreinterpretq_s8_u8(vandq_u8  (q, m4b)), s8b); \
+            const int8x16_t qh = vsubq_s8(vreinterpretq_s8_u8(vshrq_n_u8(q, 4)),   s8b); \
+            sumi = lm_ggml_sdotq_s32(sumi, ql, vreinterpretq_s8_s32(vdupq_laneq_s32(yl, k))); \
+            sumi = lm_ggml_sdotq_s32(sumi, qh, vreinterpretq_s8_s32(vdupq_laneq_s32(yh, k))); \
+        }
+        LM_GGML_Q4_0_X4_GROUP(0)
+        LM_GGML_Q4_0_X4_GROUP(1)
+        LM_GGML_Q4_0_X4_GROUP(2)
+        LM_GGML_Q4_0_X4_GROUP(3)
+#undef LM_GGML_Q4_0_X4_GROUP
+
+        const float dx[4] = {
+            LM_GGML_FP16_TO_FP32(x[i].d[0]), LM_GGML_FP16_TO_FP32(x[i].d[1]),
+            LM_GGML_FP16_TO_FP32(x[i].d[2]), LM_GGML_FP16_TO_FP32(x[i].d[3]),
+        };
+
+        sumv = vmlaq_f32(sumv, vcvtq_f32_s32(sumi), vmulq_n_f32(vld1q_f32(dx), LM_GGML_FP16_TO_FP32(y[i].d)));
+    }
+
+    vst1q_f32(s, sumv);
+}
+
+static void lm_ggml_vec_dot_q8_0_x4_q8_0_dotprod(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    const int qk = QK8_0;
+    const int nb = n / qk;
+
+    assert(n % qk == 0);
+
+    const block_q8_0x4 * restrict x = vx;
+    const block_q8_0   * restrict y = vy;
+
+    float32x4_t sumv = vdupq_n_f32(0.0f);
+
+    for (int i = 0; i < nb; ++i) {
+        const int32x4_t y0 = vreinterpretq_s32_s8(vld1q_s8(y[i].qs));
+        const int32x4_t y1 = vreinterpretq_s32_s8(vld1q_s8(y[i].qs + 16));
+
+        int32x4_t sumi = vdupq_n_s32(0);
+
+        sumi = lm_ggml_sdotq_s32(sumi, vld1q_s8(x[i].qs +   0), vreinterpretq_s8_s32(vdupq_laneq_s32(y0, 0)));
+        sumi = lm_ggml_sdotq_s32(sumi, vld1q_s8(x[i].qs +  16), vreinterpretq_s8_s32(vdupq_laneq_s32(y0, 1)));
+        sumi = lm_ggml_sdotq_s32(sumi, vld1q_s8(x[i].qs +  32), vreinterpretq_s8_s32(vdupq_laneq_s32(y0, 2)));
+        sumi = lm_ggml_sdotq_s32(sumi, vld1q_s8(x[i].qs +  48), vreinterpretq_s8_s32(vdupq_laneq_s32(y0, 3)));
+        sumi = lm_ggml_sdotq_s32(sumi, vld1q_s8(x[i].qs +  64), vreinterpretq_s8_s32(vdupq_laneq_s32(y1, 0)));
+        sumi = lm_ggml_sdotq_s32(sumi, vld1q_s8(x[i].qs +  80), vreinterpretq_s8_s32(vdupq_laneq_s32(y1, 1)));
+        sumi = lm_ggml_sdotq_s32(sumi, vld1q_s8(x[i].qs +  96), vreinterpretq_s8_s32(vdupq_laneq_s32(y1, 2)));
+        sumi = lm_ggml_sdotq_s32(sumi, vld1q_s8(x[i].qs + 112), vreinterpretq_s8_s32(vdupq_laneq_s32(y1, 3)));
+
+        const float dx[4] = {
+            LM_GGML_FP16_TO_FP32(x[i].d[0]), LM_GGML_FP16_TO_FP32(x[i].d[1]),
+            LM_GGML_FP16_TO_FP32(x[i].d[2]), LM_GGML_FP16_TO_FP32(x[i].d[3]),
+        };
+
+        sumv = vmlaq_f32(sumv, vcvtq_f32_s32(sumi), vmulq_n_f32(vld1q_f32(dx), LM_GGML_FP16_TO_FP32(y[i].d)));
+    }
+
+    vst1q_f32(s, sumv);
+}
+
+static void lm_ggml_vec_dot_q4_0_x4_q8_0_mxn_dotprod(const int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by) {
+    const int qk = QK8_0;
+    const int nb = n / qk;
+
+    assert(n % qk == 0);
+    UNUSED(bx);
+
+    const block_q4_0x4 * restrict x = vx;
+    const block_q8_0   * restrict y[LM_GGML_VEC_DOT_MXN_NR1];
+
+    for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+        y[c] = (const block_q8_0 *) ((const char *) vy + c*by);
+    }
+
+    const uint8x16_t m4b = vdupq_n_u8(0x0F);
+    const int8x16_t  s8b = vdupq_n_s8(0x8);
+
+    float32x4_t sumv[LM_GGML_VEC_DOT_MXN_NR1];
+
+    for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+        sumv[c] = vdupq_n_f32(0.0f);
+    }
+
+    for (int i = 0; i < nb; ++i) {
+        // unpack the quants of x once for all columns of y
+        int8x16_t xl[4];
+        int8x16_t xh[4];
+
+        for (int k = 0; k < 4; ++k) {
+            const uint8x16_t q = vld1q_u8(x[i].qs + 16*k);
+            xl[k] = vsubq_s8(vreinterpretq_s8_u8(vandq_u8  (q, m4b)), s8b);
+            xh[k] = vsubq_s8(vreinterpretq_s8_u8(vshrq_n_u8(q, 4)),   s8b);
+        }
+
+        const float dx[4] = {
+            LM_GGML_FP16_TO_FP32(x[i].d[0]), LM_GGML_FP16_TO_FP32(x[i].d[1]),
+            LM_GGML_FP16_TO_FP32(x[i].d[2]), LM_GGML_FP16_TO_FP32(x[i].d[3]),
+        };
+        const float32x4_t d = vld1q_f32(dx);
+
+        for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+            const int32x4_t yl = vreinterpretq_s32_s8(vld1q_s8(y[c][i].qs));
+            const int32x4_t yh = vreinterpretq_s32_s8(vld1q_s8(y[c][i].qs + 16));
+
+            int32x4_t sumi = vdupq_n_s32(0);
+
+            sumi = lm_ggml_sdotq_s32(sumi, xl[0], vreinterpretq_s8_s32(vdupq_laneq_s32(yl, 0)));
+            sumi = lm_ggml_sdotq_s32(sumi, xh[0], vreinterpretq_s8_s32(vdupq_laneq_s32(yh, 0)));
+            sumi = lm_ggml_sdotq_s32(sumi, xl[1], vreinterpretq_s8_s32(vdupq_laneq_s32(yl, 1)));
+            sumi = lm_ggml_sdotq_s32(sumi, xh[1], vreinterpretq_s8_s32(vdupq_laneq_s32(yh, 1)));
+            sumi = lm_ggml_sdotq_s32(sumi, xl[2], vreinterpretq_s8_s32(vdupq_laneq_s32(yl, 2)));
+            sumi = lm_ggml_sdotq_s32(sumi, xh[2], vreinterpretq_s8_s32(vdupq_laneq_s32(yh, 2)));
+            sumi = lm_ggml_sdotq_s32(sumi, xl[3], vreinterpretq_s8_s32(vdupq_laneq_s32(yl, 3)));
+            sumi = lm_ggml_sdotq_s32(sumi, xh[3], vreinterpretq_s8_s32(vdupq_laneq_s32(yh, 3)));
+
+            sumv[c] = vmlaq_f32(sumv[c], vcvtq_f32_s32(sumi), vmulq_n_f32(d, LM_GGML_FP16_TO_FP32(y[c][i].d)));
+        }
+    }
+
+    for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+        vst1q_f32(s + c*bs, sumv[c]);
+    }
+}
+
+static void lm_ggml_vec_dot_q8_0_x4_q8_0_mxn_dotprod(const int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by) {
+    const int qk = QK8_0;
+    const int nb = n / qk;
+
+    assert(n % qk == 0);
+    UNUSED(bx);
+
+    const block_q8_0x4 * restrict x = vx;
+    const block_q8_0   * restrict y[LM_GGML_VEC_DOT_MXN_NR1];
+
+    for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+        y[c] = (const block_q8_0 *) ((const char *) vy + c*by);
+    }
+
+    float32x4_t sumv[LM_GGML_VEC_DOT_MXN_NR1];
+
+    for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+        sumv[c] = vdupq_n_f32(0.0f);
+    }
+
+    for (int i = 0; i < nb; ++i) {
+        int8x16_t xq[8];
+
+        for (int k = 0; k < 8; ++k) {
+            xq[k] = vld1q_s8(x[i].qs + 16*k);
+        }
+
+        const float dx[4] = {
+            LM_GGML_FP16_TO_FP32(x[i].d[0]), LM_GGML_FP16_TO_FP32(x[i].d[1]),
+            LM_GGML_FP16_TO_FP32(x[i].d[2]), LM_GGML_FP16_TO_FP32(x[i].d[3]),
+        };
+        const float32x4_t d = vld1q_f32(dx);
+
+        for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+            const int32x4_t y0 = vreinterpretq_s32_s8(vld1q_s8(y[c][i].qs));
+            const int32x4_t y1 = vreinterpretq_s32_s8(vld1q_s8(y[c][i].qs + 16));
+
+            int32x4_t sumi = vdupq_n_s32(0);
+
+            sumi = lm_ggml_sdotq_s32(sumi, xq[0], vreinterpretq_s8_s32(vdupq_laneq_s32(y0, 0)));
+            sumi = lm_ggml_sdotq_s32(sumi, xq[1], vreinterpretq_s8_s32(vdupq_laneq_s32(y0, 1)));
+            sumi = lm_ggml_sdotq_s32(sumi, xq[2], vreinterpretq_s8_s32(vdupq_laneq_s32(y0, 2)));
+            sumi = lm_ggml_sdotq_s32(sumi, xq[3], vreinterpretq_s8_s32(vdupq_laneq_s32(y0, 3)));
+            sumi = lm_ggml_sdotq_s32(sumi, xq[4], vreinterpretq_s8_s32(vdupq_laneq_s32(y1, 0)));
+            sumi = lm_ggml_sdotq_s32(sumi, xq[5], vreinterpretq_s8_s32(vdupq_laneq_s32(y1, 1)));
+            sumi = lm_ggml_sdotq_s32(sumi, xq[6], vreinterpretq_s8_s32(vdupq_laneq_s32(y1, 2)));
+            sumi = lm_ggml_sdotq_s32(sumi, xq[7], vreinterpretq_s8_s32(vdupq_laneq_s32(y1, 3)));
+
+            sumv[c] = vmlaq_f32(sumv[c], vcvtq_f32_s32(sumi), vmulq_n_f32(d, LM_GGML_FP16_TO_FP32(y[c][i].d)));
+        }
+    }
+
+    for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+        vst1q_f32(s + c*bs, sumv[c]);
+    }
+}
+#if !defined(__ARM_FEATURE_FP16_VECTOR_ARITHMETIC)
+// accumulates in fp16 like the LM_GGML_F16_VEC_FMA path of builds with fp16 arithmetic
+static void lm_ggml_vec_dot_f16_fp16(const int n, float * restrict s, lm_ggml_fp16_t * restrict x, lm_ggml_fp16_t * restrict y) {
+    const int np = (n & ~(32 - 1));
+
+    float16x8_t sum[4];
+    for (int j = 0; j < 4; j++) {
+        sum[j] = vreinterpretq_f16_u16(vdupq_n_u16(0));
+    }
+
+    for (int i = 0; i < np; i += 32) {
+        for (int j = 0; j < 4; j++) {
+            const float16x8_t ax = vreinterpretq_f16_u16(vld1q_u16((const uint16_t *) (x + i + 8*j)));
+            const float16x8_t ay = vreinterpretq_f16_u16(vld1q_u16((const uint16_t *) (y + i + 8*j)));
+
+            sum[j] = lm_ggml_hfmaq_f16(sum[j], ax, ay);
+        }
+    }
+
+    // reduce in fp32, the fp16 adds of the reduction need the extension too
+    float32x4_t sumv = vdupq_n_f32(0.0f);
+    for (int j = 0; j < 4; j++) {
+        sumv = vaddq_f32(sumv, vcvt_f32_f16(vget_low_f16(sum[j])));
+        sumv = vaddq_f32(sumv, vcvt_high_f32_f16(sum[j]));
+    }
+
+    lm_ggml_float sumf = vaddvq_f32(sumv);
+
+    // leftovers
+    for (int i = np; i < n; ++i) {
+        sumf += (lm_ggml_float)(LM_GGML_FP16_TO_FP32(x[i])*LM_GGML_FP16_TO_FP32(y[i]));
+    }
+
+    *s = sumf;
+}
+#endif
+#endif
+
+// compute LM_GGML_VEC_DOT_UNROLL dot products at once
+// xs - x row stride in bytes
+inline static void lm_ggml_vec_dot_f16_unroll(const int n, const int xs, float * restrict s, void * restrict xv, lm_ggml_fp16_t * restrict y) {
+    lm_ggml_float sumf[LM_GGML_VEC_DOT_UNROLL] = { 0.0 };
+
+    lm_ggml_fp16_t * restrict x[LM_GGML_VEC_DOT_UNROLL];
+
+    for (int i = 0; i < LM_GGML_VEC_DOT_UNROLL; ++i) {
+        x[i] = (lm_ggml_fp16_t *) ((char *) xv + i*xs);
+    }
+
+#if defined(LM_GGML_SIMD)
+    const int np = (n & ~(LM_GGML_F16_STEP - 1));
 
     LM_GGML_F16_VEC sum[LM_GGML_VEC_DOT_UNROLL][LM_GGML_F16_ARR] = { { LM_GGML_F16_VEC_ZERO } };
 
@@ -4030,6 +5665,9 @@ static const char * LM_GGML_OP_NAME[LM_GGML_OP_COUNT] = {
     "NORM",
     "RMS_NORM",
     "RMS_NORM_BACK",
+    "RMS_NORM_MUL",
+    "ADD_RMS_NORM_MUL",
+    "SWIGLU",
     "GROUP_NORM",
 
     "MUL_MAT",
@@ -4067,6 +5705,7 @@ static const char * LM_GGML_OP_NAME[LM_GGML_OP_COUNT] = {
     "UPSCALE",
 
     "FLASH_ATTN",
+    "FLASH_ATTN_EXT",
     "FLASH_FF",
     "FLASH_ATTN_BACK",
     "WIN_PART",
@@ -4091,7 +5730,7 @@ static const char * LM_GGML_OP_NAME[LM_GGML_OP_COUNT] = {
     "CROSS_ENTROPY_LOSS_BACK",
 };
 
-static_assert(LM_GGML_OP_COUNT == 73, "LM_GGML_OP_COUNT != 73");
+static_assert(LM_GGML_OP_COUNT == 77, "LM_GGML_OP_COUNT != 77");
 
 static const char * LM_GGML_OP_SYMBOL[LM_GGML_OP_COUNT] = {
     "none",
@@ -4117,6 +5756,9 @@ static const char * LM_GGML_OP_SYMBOL[LM_GGML_OP_COUNT] = {
     "norm(x)",
     "rms_norm(x)",
     "rms_norm_back(x)",
+    "rms_norm(x)*y",
+    "rms_norm(x+y)*z",
+    "silu(x)*y",
     "group_norm(x)",
 
     "X*Y",
@@ -4154,6 +5796,7 @@ static const char * LM_GGML_OP_SYMBOL[LM_GGML_OP_COUNT] = {
     "upscale(x)",
 
     "flash_attn(x)",
+    "flash_attn_ext(x)",
     "flash_ff(x)",
     "flash_attn_back(x)",
     "win_part(x)",
@@ -4178,7 +5821,7 @@ static const char * LM_GGML_OP_SYMBOL[LM_GGML_OP_COUNT] = {
     "cross_entropy_loss_back(x,y)",
 };
 
-static_assert(LM_GGML_OP_COUNT == 73, "LM_GGML_OP_COUNT != 73");
+static_assert(LM_GGML_OP_COUNT == 77, "LM_GGML_OP_COUNT != 77");
 
 static_assert(LM_GGML_OP_POOL_COUNT == 2, "LM_GGML_OP_POOL_COUNT != 2");
 
@@ -4195,35 +5838,194 @@ static_assert(sizeof(struct lm_ggml_tensor)%LM_GGML_MEM_ALIGN == 0, "lm_ggml_ten
 static bool LM_GGML_OP_HAS_INIT    [LM_GGML_OP_COUNT] = { 0 };
 static bool LM_GGML_OP_HAS_FINALIZE[LM_GGML_OP_COUNT] = { 0 };
 
-static void lm_ggml_setup_op_has_task_pass(void) {
-    {   // INIT
-        bool * p = LM_GGML_OP_HAS_INIT;
+static void lm_ggml_setup_op_has_task_pass(void) {
+    {   // INIT
+        bool * p = LM_GGML_OP_HAS_INIT;
+
+        p[LM_GGML_OP_ACC                    ] = true;
+        p[LM_GGML_OP_MUL_MAT                ] = true;
+        p[LM_GGML_OP_OUT_PROD               ] = true;
+        p[LM_GGML_OP_SET                    ] = true;
+        p[LM_GGML_OP_GET_ROWS_BACK          ] = true;
+        p[LM_GGML_OP_DIAG_MASK_INF          ] = true;
+        p[LM_GGML_OP_DIAG_MASK_ZERO         ] = true;
+        p[LM_GGML_OP_CONV_1D                ] = true;
+        p[LM_GGML_OP_CONV_1D_STAGE_0        ] = true;
+        p[LM_GGML_OP_CONV_1D_STAGE_1        ] = true;
+        p[LM_GGML_OP_CONV_TRANSPOSE_1D      ] = true;
+        p[LM_GGML_OP_CONV_2D                ] = true;
+        p[LM_GGML_OP_CONV_2D_STAGE_0        ] = true;
+        p[LM_GGML_OP_CONV_2D_STAGE_1        ] = true;
+        p[LM_GGML_OP_CONV_TRANSPOSE_2D      ] = true;
+        p[LM_GGML_OP_FLASH_ATTN_BACK        ] = true;
+        p[LM_GGML_OP_CROSS_ENTROPY_LOSS     ] = true;
+        p[LM_GGML_OP_ADD_REL_POS            ] = true;
+    }
+
+    {   // FINALIZE
+        bool * p = LM_GGML_OP_HAS_FINALIZE;
+
+        p[LM_GGML_OP_CROSS_ENTROPY_LOSS     ] = true;
+    }
+}
+
+//
+// runtime kernel selection
+//
+
+#ifdef LM_GGML_X86_DISPATCH
+#include <cpuid.h>
+
+// ISA levels above the build baseline whose kernels are installed in type_traits
+static bool lm_ggml_x86_avx512_vnni = false;
+static bool lm_ggml_x86_avx_vnni    = false;
+
+static void lm_ggml_x86_detect(void) {
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return;
+    }
+
+    const bool osxsave = ecx & (1u << 27);
+    const bool fma     = ecx & (1u << 12);
+    const bool f16c    = ecx & (1u << 29);
+    if (!osxsave || !fma || !f16c) {
+        return;
+    }
+
+    // the OS has to save the AVX (and for AVX-512 also the opmask and ZMM) state
+    unsigned int xcr0_lo, xcr0_hi;
+    __asm__ __volatile__ ("xgetbv" : "=a" (xcr0_lo), "=d" (xcr0_hi) : "c" (0));
+    const bool os_avx    = (xcr0_lo & 0x06) == 0x06;
+    const bool os_avx512 = (xcr0_lo & 0xe6) == 0xe6;
+
+    if (!os_avx || !__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+        return;
+    }
+
+    const unsigned int max_subleaf = eax;
+
+    const bool avx2        = ebx & (1u <<  5);
+    const bool avx512f     = ebx & (1u << 16);
+    const bool avx512bw    = ebx & (1u << 30);
+    const bool avx512vl    = ebx & (1u << 31);
+    const bool avx512_vnni = ecx & (1u << 11);
+
+    bool avx_vnni = false;
+    if (max_subleaf >= 1 && __get_cpuid_count(7, 1, &eax, &ebx, &ecx, &edx)) {
+        avx_vnni = eax & (1u << 4);
+    }
+
+    lm_ggml_x86_avx512_vnni = avx2 && os_avx512 && avx512f && avx512bw && avx512vl && avx512_vnni;
+    lm_ggml_x86_avx_vnni    = avx2 && avx_vnni;
+}
+#endif
+
+#if defined(LM_GGML_ARM_DISPATCH)
+#if defined(__APPLE__)
+#include <sys/sysctl.h>
+#else
+#include <sys/auxv.h>
+#ifndef HWCAP_ASIMDHP
+#define HWCAP_ASIMDHP (1 << 10)
+#endif
+#ifndef HWCAP_ASIMDDP
+#define HWCAP_ASIMDDP (1 << 20)
+#endif
+#endif
+
+static bool lm_ggml_arm_dotprod = false;
+static bool lm_ggml_arm_fp16    = false;
 
-        p[LM_GGML_OP_ACC                    ] = true;
-        p[LM_GGML_OP_MUL_MAT                ] = true;
-        p[LM_GGML_OP_OUT_PROD               ] = true;
-        p[LM_GGML_OP_SET                    ] = true;
-        p[LM_GGML_OP_GET_ROWS_BACK          ] = true;
-        p[LM_GGML_OP_DIAG_MASK_INF          ] = true;
-        p[LM_GGML_OP_DIAG_MASK_ZERO         ] = true;
-        p[LM_GGML_OP_CONV_1D                ] = true;
-        p[LM_GGML_OP_CONV_1D_STAGE_0        ] = true;
-        p[LM_GGML_OP_CONV_1D_STAGE_1        ] = true;
-        p[LM_GGML_OP_CONV_TRANSPOSE_1D      ] = true;
-        p[LM_GGML_OP_CONV_2D                ] = true;
-        p[LM_GGML_OP_CONV_2D_STAGE_0        ] = true;
-        p[LM_GGML_OP_CONV_2D_STAGE_1        ] = true;
-        p[LM_GGML_OP_CONV_TRANSPOSE_2D      ] = true;
-        p[LM_GGML_OP_FLASH_ATTN_BACK        ] = true;
-        p[LM_GGML_OP_CROSS_ENTROPY_LOSS     ] = true;
-        p[LM_GGML_OP_ADD_REL_POS            ] = true;
+static void lm_ggml_arm_detect(void) {
+#if defined(__APPLE__)
+    int    value = 0;
+    size_t size  = sizeof(value);
+    if (sysctlbyname("hw.optional.arm.FEAT_DotProd", &value, &size, NULL, 0) == 0) {
+        lm_ggml_arm_dotprod = value != 0;
     }
+    value = 0;
+    size  = sizeof(value);
+    if (sysctlbyname("hw.optional.arm.FEAT_FP16", &value, &size, NULL, 0) == 0) {
+        lm_ggml_arm_fp16 = value != 0;
+    }
+#else
+    const unsigned long hwcap = getauxval(AT_HWCAP);
 
-    {   // FINALIZE
-        bool * p = LM_GGML_OP_HAS_FINALIZE;
+    lm_ggml_arm_dotprod = (hwcap & HWCAP_ASIMDDP) != 0;
+    lm_ggml_arm_fp16    = (hwcap & HWCAP_ASIMDHP) != 0;
+#endif
+}
+#endif
 
-        p[LM_GGML_OP_CROSS_ENTROPY_LOSS     ] = true;
+// replaces the vec_dot kernels selected at compile time with the faster variants allowed by the detected features
+static void lm_ggml_install_cpu_kernels(void) {
+#ifdef LM_GGML_X86_DISPATCH
+    // the tiled mxn kernels are built for the baseline ISA, with AVX-512 the wider per-row kernels
+    // are used for batches too
+    if (lm_ggml_x86_avx512_vnni) {
+        type_traits[LM_GGML_TYPE_Q4_0].vec_dot     = lm_ggml_vec_dot_q4_0_q8_0_avx512;
+        type_traits[LM_GGML_TYPE_Q4_0].vec_dot_mxn = NULL;
+        type_traits[LM_GGML_TYPE_Q8_0].vec_dot     = lm_ggml_vec_dot_q8_0_q8_0_avx512;
+        type_traits[LM_GGML_TYPE_Q8_0].vec_dot_mxn = NULL;
+#if defined(LM_GGML_USE_K_QUANTS) && QK_K == 256
+        type_traits[LM_GGML_TYPE_Q2_K].vec_dot     = lm_ggml_vec_dot_q2_K_q8_K_avx512;
+        type_traits[LM_GGML_TYPE_Q3_K].vec_dot     = lm_ggml_vec_dot_q3_K_q8_K_avx512;
+        type_traits[LM_GGML_TYPE_Q4_K].vec_dot     = lm_ggml_vec_dot_q4_K_q8_K_avx512;
+        type_traits[LM_GGML_TYPE_Q4_K].vec_dot_mxn = NULL;
+        type_traits[LM_GGML_TYPE_Q5_K].vec_dot     = lm_ggml_vec_dot_q5_K_q8_K_avx512;
+        type_traits[LM_GGML_TYPE_Q6_K].vec_dot     = lm_ggml_vec_dot_q6_K_q8_K_avx512;
+#endif
+    } else if (lm_ggml_x86_avx_vnni) {
+        type_traits[LM_GGML_TYPE_Q4_0].vec_dot = lm_ggml_vec_dot_q4_0_q8_0_avxvnni;
+        type_traits[LM_GGML_TYPE_Q8_0].vec_dot = lm_ggml_vec_dot_q8_0_q8_0_avxvnni;
+#if defined(LM_GGML_USE_K_QUANTS) && QK_K == 256
+        type_traits[LM_GGML_TYPE_Q2_K].vec_dot = lm_ggml_vec_dot_q2_K_q8_K_avxvnni;
+        type_traits[LM_GGML_TYPE_Q3_K].vec_dot = lm_ggml_vec_dot_q3_K_q8_K_avxvnni;
+        type_traits[LM_GGML_TYPE_Q4_K].vec_dot = lm_ggml_vec_dot_q4_K_q8_K_avxvnni;
+        type_traits[LM_GGML_TYPE_Q5_K].vec_dot = lm_ggml_vec_dot_q5_K_q8_K_avxvnni;
+        type_traits[LM_GGML_TYPE_Q6_K].vec_dot = lm_ggml_vec_dot_q6_K_q8_K_avxvnni;
+#endif
+    }
+#endif
+
+#if defined(LM_GGML_ARM_DISPATCH)
+    if (lm_ggml_arm_dotprod) {
+        type_traits[LM_GGML_TYPE_Q4_0].vec_dot        = lm_ggml_vec_dot_q4_0_q8_0_dotprod;
+        type_traits[LM_GGML_TYPE_Q4_0].vec_dot_mxn    = lm_ggml_vec_dot_q4_0_q8_0_mxn_dotprod;
+        type_traits[LM_GGML_TYPE_Q8_0].vec_dot        = lm_ggml_vec_dot_q8_0_q8_0_dotprod;
+        type_traits[LM_GGML_TYPE_Q8_0].vec_dot_mxn    = lm_ggml_vec_dot_q8_0_q8_0_mxn_dotprod;
+        type_traits[LM_GGML_TYPE_Q4_0_X4].vec_dot     = lm_ggml_vec_dot_q4_0_x4_q8_0_dotprod;
+        type_traits[LM_GGML_TYPE_Q4_0_X4].vec_dot_mxn = lm_ggml_vec_dot_q4_0_x4_q8_0_mxn_dotprod;
+        type_traits[LM_GGML_TYPE_Q8_0_X4].vec_dot     = lm_ggml_vec_dot_q8_0_x4_q8_0_dotprod;
+        type_traits[LM_GGML_TYPE_Q8_0_X4].vec_dot_mxn = lm_ggml_vec_dot_q8_0_x4_q8_0_mxn_dotprod;
+#if defined(LM_GGML_USE_K_QUANTS) && QK_K == 256
+        type_traits[LM_GGML_TYPE_Q2_K].vec_dot        = lm_ggml_vec_dot_q2_K_q8_K_dotprod;
+        type_traits[LM_GGML_TYPE_Q3_K].vec_dot        = lm_ggml_vec_dot_q3_K_q8_K_dotprod;
+        type_traits[LM_GGML_TYPE_Q4_K].vec_dot        = lm_ggml_vec_dot_q4_K_q8_K_dotprod;
+        type_traits[LM_GGML_TYPE_Q4_K].vec_dot_mxn    = lm_ggml_vec_dot_q4_K_q8_K_mxn_dotprod;
+        type_traits[LM_GGML_TYPE_Q5_K].vec_dot        = lm_ggml_vec_dot_q5_K_q8_K_dotprod;
+        type_traits[LM_GGML_TYPE_Q6_K].vec_dot        = lm_ggml_vec_dot_q6_K_q8_K_dotprod;
+        type_traits[LM_GGML_TYPE_Q4_K_X4].vec_dot     = lm_ggml_vec_dot_q4_K_x4_q8_K_dotprod;
+#endif
     }
+#if !defined(__ARM_FEATURE_FP16_VECTOR_ARITHMETIC)
+    if (lm_ggml_arm_fp16) {
+        type_traits[LM_GGML_TYPE_F16].vec_dot = (lm_ggml_vec_dot_t) lm_ggml_vec_dot_f16_fp16;
+    }
+#endif
+#endif
+}
+
+static void lm_ggml_setup_cpu_kernels(void) {
+#ifdef LM_GGML_X86_DISPATCH
+    lm_ggml_x86_detect();
+#endif
+#if defined(LM_GGML_ARM_DISPATCH)
+    lm_ggml_arm_detect();
+#endif
+    lm_ggml_install_cpu_kernels();
 }
 
 //
@@ -4670,6 +6472,8 @@ struct lm_ggml_context * lm_ggml_init(struct lm_ggml_init_params params) {
 
         lm_ggml_setup_op_has_task_pass();
 
+        lm_ggml_setup_cpu_kernels();
+
         is_first_call = false;
     }
 
@@ -6419,6 +8223,91 @@ struct lm_ggml_tensor * lm_ggml_rms_norm_back(
     return result;
 }
 
+// lm_ggml_rms_norm_mul
+
+struct lm_ggml_tensor * lm_ggml_rms_norm_mul(
+        struct lm_ggml_context * ctx,
+        struct lm_ggml_tensor  * a,
+        struct lm_ggml_tensor  * b,
+        float  eps) {
+    LM_GGML_ASSERT(lm_ggml_can_repeat_rows(b, a));
+
+    bool is_node = false;
+
+    if (a->grad || b->grad) {
+        // TODO: implement backward
+        is_node = true;
+    }
+
+    struct lm_ggml_tensor * result = lm_ggml_dup_tensor(ctx, a);
+
+    lm_ggml_set_op_params(result, &eps, sizeof(eps));
+
+    result->op   = LM_GGML_OP_RMS_NORM_MUL;
+    result->grad = is_node ? lm_ggml_dup_tensor(ctx, result) : NULL;
+    result->src[0] = a;
+    result->src[1] = b;
+
+    return result;
+}
+
+// lm_ggml_add_rms_norm_mul
+
+struct lm_ggml_tensor * lm_ggml_add_rms_norm_mul(
+        struct lm_ggml_context * ctx,
+        struct lm_ggml_tensor  * a,
+        struct lm_ggml_tensor  * b,
+        struct lm_ggml_tensor  * c,
+        float  eps) {
+    LM_GGML_ASSERT(lm_ggml_are_same_shape(a, b));
+    LM_GGML_ASSERT(a->ne[2] == 1 && a->ne[3] == 1);
+    LM_GGML_ASSERT(lm_ggml_can_repeat_rows(c, a));
+
+    bool is_node = false;
+
+    if (a->grad || b->grad || c->grad) {
+        // TODO: implement backward
+        is_node = true;
+    }
+
+    struct lm_ggml_tensor * result = lm_ggml_new_tensor_3d(ctx, LM_GGML_TYPE_F32, a->ne[0], a->ne[1], 2);
+
+    lm_ggml_set_op_params(result, &eps, sizeof(eps));
+
+    result->op   = LM_GGML_OP_ADD_RMS_NORM_MUL;
+    result->grad = is_node ? lm_ggml_dup_tensor(ctx, result) : NULL;
+    result->src[0] = a;
+    result->src[1] = b;
+    result->src[2] = c;
+
+    return result;
+}
+
+// lm_ggml_swiglu
+
+struct lm_ggml_tensor * lm_ggml_swiglu(
+        struct lm_ggml_context * ctx,
+        struct lm_ggml_tensor  * a,
+        struct lm_ggml_tensor  * b) {
+    LM_GGML_ASSERT(lm_ggml_are_same_shape(a, b));
+
+    bool is_node = false;
+
+    if (a->grad || b->grad) {
+        // TODO: implement backward
+        is_node = true;
+    }
+
+    struct lm_ggml_tensor * result = lm_ggml_dup_tensor(ctx, a);
+
+    result->op   = LM_GGML_OP_SWIGLU;
+    result->grad = is_node ? lm_ggml_dup_tensor(ctx, result) : NULL;
+    result->src[0] = a;
+    result->src[1] = b;
+
+    return result;
+}
+
 // lm_ggml_group_norm
 
 static struct lm_ggml_tensor * lm_ggml_group_norm_impl(
@@ -7995,6 +9884,52 @@ struct lm_ggml_tensor * lm_ggml_flash_attn(
     return result;
 }
 
+// lm_ggml_flash_attn_ext
+
+struct lm_ggml_tensor * lm_ggml_flash_attn_ext(
+        struct lm_ggml_context * ctx,
+        struct lm_ggml_tensor  * q,
+        struct lm_ggml_tensor  * k,
+        struct lm_ggml_tensor  * v,
+        struct lm_ggml_tensor  * mask,
+        float                 scale) {
+    LM_GGML_ASSERT(lm_ggml_can_mul_mat(k, q));
+    LM_GGML_ASSERT(q->type == LM_GGML_TYPE_F32);
+    LM_GGML_ASSERT(k->type == v->type);
+    LM_GGML_ASSERT(v->ne[0] == k->ne[1]); // v is transposed
+    LM_GGML_ASSERT(v->ne[1] == k->ne[0]);
+    LM_GGML_ASSERT(v->ne[2] == k->ne[2]);
+    LM_GGML_ASSERT(q->ne[3] == 1 && k->ne[3] == 1 && v->ne[3] == 1);
+    if (mask) {
+        LM_GGML_ASSERT(mask->type == LM_GGML_TYPE_F32);
+        LM_GGML_ASSERT(lm_ggml_is_contiguous(mask));
+        LM_GGML_ASSERT(mask->ne[0] == k->ne[1]);
+        LM_GGML_ASSERT(mask->ne[1] >= q->ne[1]);
+    }
+
+    bool is_node = false;
+
+    if (q->grad || k->grad || v->grad) {
+        is_node = true;
+    }
+
+    // permute(0, 2, 1, 3)
+    int64_t ne[4] = { q->ne[0], q->ne[2], q->ne[1], q->ne[3] };
+    struct lm_ggml_tensor * result = lm_ggml_new_tensor(ctx, LM_GGML_TYPE_F32, 4, ne);
+
+    float params[] = { scale };
+    lm_ggml_set_op_params(result, params, sizeof(params));
+
+    result->op   = LM_GGML_OP_FLASH_ATTN_EXT;
+    result->grad = is_node ? lm_ggml_dup_tensor(ctx, result) : NULL;
+    result->src[0] = q;
+    result->src[1] = k;
+    result->src[2] = v;
+    result->src[3] = mask;
+
+    return result;
+}
+
 // lm_ggml_flash_ff
 
 struct lm_ggml_tensor * lm_ggml_flash_ff(
@@ -11688,17 +13623,201 @@ static void lm_ggml_compute_forward_rms_norm_back_f32(
                 // dx := scale(dx, rrms)
                 float * dx = (float *) ((char *) dst->data + i01*nb1 + i02*nb2 + i03*nb3);
 
-                lm_ggml_vec_cpy_f32  (ne00, dx, x);
-                // lm_ggml_vec_scale_f32(ne00, dx, -mean_xdz/mean_eps);
-                lm_ggml_vec_scale_f32(ne00, dx, (float)(-sum_xdz)/sum_eps);
-                lm_ggml_vec_acc_f32  (ne00, dx, dz);
-                lm_ggml_vec_scale_f32(ne00, dx, rrms);
-            }
-        }
+                lm_ggml_vec_cpy_f32  (ne00, dx, x);
+                // lm_ggml_vec_scale_f32(ne00, dx, -mean_xdz/mean_eps);
+                lm_ggml_vec_scale_f32(ne00, dx, (float)(-sum_xdz)/sum_eps);
+                lm_ggml_vec_acc_f32  (ne00, dx, dz);
+                lm_ggml_vec_scale_f32(ne00, dx, rrms);
+            }
+        }
+    }
+}
+
+static void lm_ggml_compute_forward_rms_norm_back(
+        const struct lm_ggml_compute_params * params,
+        const struct lm_ggml_tensor * src0,
+        const struct lm_ggml_tensor * src1,
+        struct lm_ggml_tensor * dst) {
+    switch (src0->type) {
+        case LM_GGML_TYPE_F32:
+            {
+                lm_ggml_compute_forward_rms_norm_back_f32(params, src0, src1, dst);
+            } break;
+        default:
+            {
+                LM_GGML_ASSERT(false);
+            } break;
+    }
+}
+
+// lm_ggml_compute_forward_rms_norm_mul
+
+// y = rms_norm(x)*w for a single row, with the same order of operations as rms_norm followed by mul
+inline static void lm_ggml_vec_rms_norm_mul_f32(const int64_t n, float * y, const float * x, const float * w, const float eps) {
+    lm_ggml_float sum = 0.0;
+    for (int64_t i = 0; i < n; i++) {
+        sum += (lm_ggml_float)(x[i] * x[i]);
+    }
+
+    const float mean  = sum/n;
+    const float scale = 1.0f/sqrtf(mean + eps);
+
+    for (int64_t i = 0; i < n; i++) {
+        y[i] = (x[i]*scale)*w[i];
+    }
+}
+
+static void lm_ggml_compute_forward_rms_norm_mul_f32(
+        const struct lm_ggml_compute_params * params,
+        const struct lm_ggml_tensor * src0,
+        const struct lm_ggml_tensor * src1,
+        struct lm_ggml_tensor * dst) {
+    LM_GGML_ASSERT(lm_ggml_can_repeat_rows(src1, src0) && lm_ggml_are_same_shape(src0, dst));
+
+    if (params->type == LM_GGML_TASK_INIT || params->type == LM_GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    LM_GGML_TENSOR_BINARY_OP_LOCALS
+
+    LM_GGML_ASSERT( nb0 == sizeof(float));
+    LM_GGML_ASSERT(nb00 == sizeof(float));
+    LM_GGML_ASSERT(nb10 == sizeof(float));
+
+    float eps;
+    memcpy(&eps, dst->op_params, sizeof(float));
+
+    for (int64_t i03 = 0; i03 < ne03; i03++) {
+        for (int64_t i02 = 0; i02 < ne02; i02++) {
+            for (int64_t i01 = ith; i01 < ne01; i01 += nth) {
+                const float * x = (float *) ((char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03);
+                const float * w = (float *) ((char *) src1->data + (i01 % ne11)*nb11 + (i02 % ne12)*nb12 + (i03 % ne13)*nb13);
+
+                float * y = (float *) ((char *) dst->data + i01*nb1 + i02*nb2 + i03*nb3);
+
+                lm_ggml_vec_rms_norm_mul_f32(ne00, y, x, w, eps);
+            }
+        }
+    }
+}
+
+static void lm_ggml_compute_forward_rms_norm_mul(
+        const struct lm_ggml_compute_params * params,
+        const struct lm_ggml_tensor * src0,
+        const struct lm_ggml_tensor * src1,
+        struct lm_ggml_tensor * dst) {
+    switch (src0->type) {
+        case LM_GGML_TYPE_F32:
+            {
+                lm_ggml_compute_forward_rms_norm_mul_f32(params, src0, src1, dst);
+            } break;
+        default:
+            {
+                LM_GGML_ASSERT(false);
+            } break;
+    }
+}
+
+// lm_ggml_compute_forward_add_rms_norm_mul
+
+static void lm_ggml_compute_forward_add_rms_norm_mul_f32(
+        const struct lm_ggml_compute_params * params,
+        const struct lm_ggml_tensor * src0,
+        const struct lm_ggml_tensor * src1,
+        const struct lm_ggml_tensor * src2,
+        struct lm_ggml_tensor * dst) {
+    LM_GGML_ASSERT(lm_ggml_are_same_shape(src0, src1) && lm_ggml_can_repeat_rows(src2, src0));
+
+    if (params->type == LM_GGML_TASK_INIT || params->type == LM_GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    LM_GGML_TENSOR_BINARY_OP_LOCALS
+
+    LM_GGML_ASSERT(ne0 == ne00 && ne1 == ne01 && ne2 == 2);
+    LM_GGML_ASSERT( nb0 == sizeof(float));
+    LM_GGML_ASSERT(nb00 == sizeof(float));
+    LM_GGML_ASSERT(nb10 == sizeof(float));
+    LM_GGML_ASSERT(src2->nb[0] == sizeof(float));
+
+    float eps;
+    memcpy(&eps, dst->op_params, sizeof(float));
+
+    for (int64_t i01 = ith; i01 < ne01; i01 += nth) {
+        const float * a = (float *) ((char *) src0->data + i01*nb01);
+        const float * b = (float *) ((char *) src1->data + i01*nb11);
+        const float * w = (float *) ((char *) src2->data + (i01 % src2->ne[1])*src2->nb[1]);
+
+        float * s = (float *) ((char *) dst->data + i01*nb1);
+        float * y = (float *) ((char *) dst->data + i01*nb1 + nb2);
+
+        lm_ggml_vec_add_f32(ne00, s, a, b);
+        lm_ggml_vec_rms_norm_mul_f32(ne00, y, s, w, eps);
+    }
+}
+
+static void lm_ggml_compute_forward_add_rms_norm_mul(
+        const struct lm_ggml_compute_params * params,
+        const struct lm_ggml_tensor * src0,
+        const struct lm_ggml_tensor * src1,
+        const struct lm_ggml_tensor * src2,
+        struct lm_ggml_tensor * dst) {
+    switch (src0->type) {
+        case LM_GGML_TYPE_F32:
+            {
+                lm_ggml_compute_forward_add_rms_norm_mul_f32(params, src0, src1, src2, dst);
+            } break;
+        default:
+            {
+                LM_GGML_ASSERT(false);
+            } break;
+    }
+}
+
+// lm_ggml_compute_forward_swiglu
+
+static void lm_ggml_compute_forward_swiglu_f32(
+        const struct lm_ggml_compute_params * params,
+        const struct lm_ggml_tensor * src0,
+        const struct lm_ggml_tensor * src1,
+        struct lm_ggml_tensor * dst) {
+    LM_GGML_ASSERT(lm_ggml_is_contiguous_except_dim_1(src0));
+    LM_GGML_ASSERT(lm_ggml_is_contiguous_except_dim_1(src1));
+    LM_GGML_ASSERT(lm_ggml_is_contiguous_except_dim_1(dst));
+    LM_GGML_ASSERT(lm_ggml_are_same_shape(src0, dst) && lm_ggml_are_same_shape(src1, dst));
+
+    if (params->type == LM_GGML_TASK_INIT || params->type == LM_GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int nc = src0->ne[0];
+    const int nr = lm_ggml_nrows(src0);
+
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
+
+    for (int i1 = ir0; i1 < ir1; i1++) {
+        float * y = (float *) ((char *) dst->data + i1*(dst->nb[1]));
+
+        lm_ggml_vec_silu_f32(nc, y, (float *) ((char *) src0->data + i1*(src0->nb[1])));
+        lm_ggml_vec_mul_f32 (nc, y, y, (float *) ((char *) src1->data + i1*(src1->nb[1])));
     }
 }
 
-static void lm_ggml_compute_forward_rms_norm_back(
+static void lm_ggml_compute_forward_swiglu(
         const struct lm_ggml_compute_params * params,
         const struct lm_ggml_tensor * src0,
         const struct lm_ggml_tensor * src1,
@@ -11706,7 +13825,7 @@ static void lm_ggml_compute_forward_rms_norm_back(
     switch (src0->type) {
         case LM_GGML_TYPE_F32:
             {
-                lm_ggml_compute_forward_rms_norm_back_f32(params, src0, src1, dst);
+                lm_ggml_compute_forward_swiglu_f32(params, src0, src1, dst);
             } break;
         default:
             {
@@ -11823,7 +13942,8 @@ static bool lm_ggml_compute_forward_mul_mat_use_blas(
     const int64_t ne1 = dst->ne[1];
 
     // TODO: find the optimal values for these
-    if (lm_ggml_is_contiguous(src0) &&
+    if (type_traits[src0->type].blck_rows == 0 &&
+        lm_ggml_is_contiguous(src0) &&
         lm_ggml_is_contiguous(src1) &&
         (ne0 >= 32 && ne1 >= 32 && ne10 >= 32)) {
 
@@ -11856,10 +13976,17 @@ static void lm_ggml_compute_forward_mul_mat(
     enum lm_ggml_type    const vec_dot_type          = type_traits[type].vec_dot_type;
     lm_ggml_from_float_t const from_float_to_vec_dot = type_traits[vec_dot_type].from_float;
 
+    // the tiled kernel only pays off when there are enough src1 rows to share the src0 blocks with
+    lm_ggml_vec_dot_mxn_t const vec_dot_mxn = ne11 >= LM_GGML_MUL_MAT_MXN_MIN_NE11 ? type_traits[type].vec_dot_mxn : NULL;
+
+    // repacked src0 types interleave blck_rows rows, for which vec_dot computes blck_rows outputs at once
+    const int64_t blck_rows = type_traits[type].blck_rows > 0 ? type_traits[type].blck_rows : 1;
+
     LM_GGML_ASSERT(ne0 == ne01);
     LM_GGML_ASSERT(ne1 == ne11);
     LM_GGML_ASSERT(ne2 == ne12);
     LM_GGML_ASSERT(ne3 == ne13);
+    LM_GGML_ASSERT(ne01 % blck_rows == 0);
 
     // we don't support permuted src0 or src1
     LM_GGML_ASSERT(nb00 == lm_ggml_type_size(type));
@@ -11978,7 +14105,8 @@ static void lm_ggml_compute_forward_mul_mat(
     const int64_t ith0 = ith % nth0;
     const int64_t ith1 = ith / nth0;
 
-    const int64_t dr0 = (nr0 + nth0 - 1)/nth0;
+    // split src0 at block boundaries when its rows are interleaved
+    const int64_t dr0 = ((nr0 + nth0 - 1)/nth0 + blck_rows - 1)/blck_rows*blck_rows;
     const int64_t dr1 = (nr1 + nth1 - 1)/nth1;
 
     const int64_t ir010 = dr0*ith0;
@@ -12007,7 +14135,10 @@ static void lm_ggml_compute_forward_mul_mat(
 
     for (int64_t iir1 = ir110; iir1 < ir111; iir1 += blck_1) {
         for (int64_t iir0 = ir010; iir0 < ir011; iir0 += blck_0) {
-            for (int64_t ir1 = iir1; ir1 < iir1 + blck_1 && ir1 < ir111; ++ir1) {
+            const int64_t ir0_end = MIN(iir0 + blck_0, ir011);
+            const int64_t ir1_end = MIN(iir1 + blck_1, ir111);
+
+            for (int64_t ir1 = iir1; ir1 < ir1_end; ++ir1) {
                 const int64_t i13 = (ir1/(ne12*ne11));
                 const int64_t i12 = (ir1 - i13*ne12*ne11)/ne11;
                 const int64_t i11 = (ir1 - i13*ne12*ne11 - i12*ne11);
@@ -12033,14 +14164,33 @@ static void lm_ggml_compute_forward_mul_mat(
 
                 float * dst_col = (float *) ((char *) dst->data + (i1*nb1 + i2*nb2 + i3*nb3));
 
+                // process LM_GGML_VEC_DOT_MXN_NR1 src1 rows at once if they belong to the same src0 matrix
+                if (vec_dot_mxn && ir1 + LM_GGML_VEC_DOT_MXN_NR1 <= ir1_end && i11 + LM_GGML_VEC_DOT_MXN_NR1 <= ne11) {
+                    const size_t src1_stride = src1_cont || src1->type != vec_dot_type ? row_size : nb11;
+                    const size_t dst_stride  = nb1/sizeof(float);
+
+                    int64_t ir0 = iir0;
+                    for (; ir0 + LM_GGML_VEC_DOT_MXN_NR0 <= ir0_end; ir0 += LM_GGML_VEC_DOT_MXN_NR0) {
+                        vec_dot_mxn(ne00, &dst_col[ir0], dst_stride, src0_row + ir0*nb01, nb01, src1_col, src1_stride);
+                    }
+                    for (; ir0 < ir0_end; ++ir0) {
+                        for (int64_t j = 0; j < LM_GGML_VEC_DOT_MXN_NR1; ++j) {
+                            vec_dot(ne00, &dst_col[ir0 + j*dst_stride], src0_row + ir0*nb01, src1_col + j*src1_stride);
+                        }
+                    }
+
+                    ir1 += LM_GGML_VEC_DOT_MXN_NR1 - 1;
+                    continue;
+                }
+
                 //for (int64_t ir0 = iir0; ir0 < iir0 + blck_0 && ir0 < ir011; ++ir0) {
                 //    vec_dot(ne00, &dst_col[ir0], src0_row + ir0*nb01, src1_col);
                 //}
 
-                for (int64_t ir0 = iir0; ir0 < iir0 + blck_0 && ir0 < ir011; ++ir0) {
+                for (int64_t ir0 = iir0; ir0 < ir0_end; ir0 += blck_rows) {
                     vec_dot(ne00, &tmp[ir0 - iir0], src0_row + ir0*nb01, src1_col);
                 }
-                memcpy(&dst_col[iir0], tmp, (MIN(iir0 + blck_0, ir011) - iir0)*sizeof(float));
+                memcpy(&dst_col[iir0], tmp, (ir0_end - iir0)*sizeof(float));
             }
         }
     }
@@ -13278,6 +15428,9 @@ static void lm_ggml_compute_forward_alibi(
         case LM_GGML_TYPE_I8:
         case LM_GGML_TYPE_I16:
         case LM_GGML_TYPE_I32:
+        case LM_GGML_TYPE_Q4_0_X4:
+        case LM_GGML_TYPE_Q8_0_X4:
+        case LM_GGML_TYPE_Q4_K_X4:
         case LM_GGML_TYPE_COUNT:
             {
                 LM_GGML_ASSERT(false);
@@ -13352,6 +15505,9 @@ static void lm_ggml_compute_forward_clamp(
         case LM_GGML_TYPE_I8:
         case LM_GGML_TYPE_I16:
         case LM_GGML_TYPE_I32:
+        case LM_GGML_TYPE_Q4_0_X4:
+        case LM_GGML_TYPE_Q8_0_X4:
+        case LM_GGML_TYPE_Q4_K_X4:
         case LM_GGML_TYPE_COUNT:
             {
                 LM_GGML_ASSERT(false);
@@ -15449,128 +17605,347 @@ static void lm_ggml_compute_forward_flash_attn_f16(
             }
         }
 
-        // scale
-        lm_ggml_vec_scale_f32(nek1, S, scale);
+        // scale
+        lm_ggml_vec_scale_f32(nek1, S, scale);
+
+        if (masked) {
+            for (int64_t i = P; i < M; i++) {
+                if (i > P + iq1) {
+                    S[i] = -INFINITY;
+                }
+            }
+        }
+
+        // softmax
+        // todo: exclude known -INF S[..] values from max and loop, assuming their results to be zero.
+        // dont forget to set their S values to zero
+        {
+            float max = -INFINITY;
+            lm_ggml_vec_max_f32(M, &max, S);
+
+            lm_ggml_float sum = 0.0;
+            {
+#ifdef LM_GGML_SOFT_MAX_ACCELERATE
+                max = -max;
+                vDSP_vsadd(S, 1, &max, S, 1, Mup);
+                vvexpf(S, S, &Mup);
+                lm_ggml_vec_sum_f32(Mup, &sum, S);
+#else
+                uint16_t   scvt[LM_GGML_SOFT_MAX_UNROLL];
+                lm_ggml_float sump[LM_GGML_SOFT_MAX_UNROLL] = { 0.0 };
+
+                for (int i = 0; i < Mup; i += LM_GGML_SOFT_MAX_UNROLL) {
+                    float * SS = S + i;
+
+                    for (int j = 0; j < LM_GGML_SOFT_MAX_UNROLL; ++j) {
+                        if (SS[j] == -INFINITY) {
+                            SS[j] = 0.0f;
+                        } else {
+                            lm_ggml_fp16_t s = LM_GGML_FP32_TO_FP16(SS[j] - max);
+                            memcpy(&scvt[j], &s, sizeof(uint16_t));
+                            const float val = LM_GGML_FP16_TO_FP32(table_exp_f16[scvt[j]]);
+                            sump[j] += (lm_ggml_float)val;
+                            SS[j] = val;
+                        }
+                    }
+                }
+
+                for (int i = 0; i < LM_GGML_SOFT_MAX_UNROLL; i++) {
+                    sum += sump[i];
+                }
+#endif
+            }
+
+            assert(sum > 0.0);
+
+            sum = 1.0/sum;
+            lm_ggml_vec_scale_f32(M, S, sum);
+
+#ifndef NDEBUG
+            for (int i = 0; i < M; ++i) {
+                assert(!isnan(S[i]));
+                assert(!isinf(S[i]));
+            }
+#endif
+        }
+
+        lm_ggml_fp16_t * S16 = (lm_ggml_fp16_t *) ((float *) params->wdata + ith*(2*Mup + CACHE_LINE_SIZE_F32) + Mup);
+
+        for (int64_t i = 0; i < M; i++) {
+            S16[i] = LM_GGML_FP32_TO_FP16(S[i]);
+        }
+
+        // todo: exclude known zero S[..] values from dot (reducing nev0 and increasing begin of v and S16).
+        if (LM_GGML_VEC_DOT_UNROLL == 1 || (nev1 % LM_GGML_VEC_DOT_UNROLL != 0)) {
+            for (int64_t ic = 0; ic < nev1; ++ic) {
+                // dst indices
+                const int i1 = iq1;
+                const int i2 = iq2;
+                const int i3 = iq3;
+
+                // v indices
+                const int iv2 = iq2 % nev2;
+                const int iv3 = iq3;
+
+                lm_ggml_vec_dot_f16(nev0,
+                        (float *)       ((char *) dst->data + (ic*nb0 + i1*nb1  + i2*nb2   + i3*nb3)),
+                        (lm_ggml_fp16_t *) ((char *) v->data   + (         ic*nbv1 + iv2*nbv2 + iv3*nbv3)),
+                        S16);
+            }
+        } else {
+            for (int64_t ic = 0; ic < nev1; ic += LM_GGML_VEC_DOT_UNROLL) {
+                // dst indices
+                const int i1 = iq1;
+                const int i2 = iq2;
+                const int i3 = iq3;
+
+                // v indices
+                const int iv2 = iq2 % nev2;
+                const int iv3 = iq3;
+
+                lm_ggml_vec_dot_f16_unroll(nev0, nbv1,
+                        (float *) ((char *) dst->data + (ic*nb0 + i1*nb1  + i2*nb2   + i3*nb3)),
+                        ((char *)             v->data + (         ic*nbv1 + iv2*nbv2 + iv3*nbv3)),
+                        S16);
+            }
+        }
+    }
+}
+
+static void lm_ggml_compute_forward_flash_attn(
+        const struct lm_ggml_compute_params * params,
+        const struct lm_ggml_tensor * q,
+        const struct lm_ggml_tensor * k,
+        const struct lm_ggml_tensor * v,
+        const bool masked,
+        struct lm_ggml_tensor * dst) {
+    switch (q->type) {
+        case LM_GGML_TYPE_F16:
+            {
+                lm_ggml_compute_forward_flash_attn_f16(params, q, k, v, masked, dst);
+            } break;
+        case LM_GGML_TYPE_F32:
+            {
+                lm_ggml_compute_forward_flash_attn_f32(params, q, k, v, masked, dst);
+            } break;
+        default:
+            {
+                LM_GGML_ASSERT(false);
+            } break;
+    }
+}
+
+// lm_ggml_compute_forward_flash_attn_ext
+
+// number of KV cells processed per step of the online softmax
+#define LM_GGML_FLASH_ATTN_EXT_TILE 128
+
+static void lm_ggml_compute_forward_flash_attn_ext_f16(
+        const struct lm_ggml_compute_params * params,
+        const struct lm_ggml_tensor * q,
+        const struct lm_ggml_tensor * k,
+        const struct lm_ggml_tensor * v,
+        const struct lm_ggml_tensor * mask,
+        struct lm_ggml_tensor * dst) {
+    int64_t t0 = lm_ggml_perf_time_us();
+    UNUSED(t0);
+
+    LM_GGML_TENSOR_LOCALS(int64_t, neq, q,   ne)
+    LM_GGML_TENSOR_LOCALS(size_t,  nbq, q,   nb)
+    LM_GGML_TENSOR_LOCALS(int64_t, nek, k,   ne)
+    LM_GGML_TENSOR_LOCALS(size_t,  nbk, k,   nb)
+    LM_GGML_TENSOR_LOCALS(int64_t, nev, v,   ne)
+    LM_GGML_TENSOR_LOCALS(size_t,  nbv, v,   nb)
+    LM_GGML_TENSOR_LOCALS(int64_t, ne,  dst, ne)
+    LM_GGML_TENSOR_LOCALS(size_t,  nb,  dst, nb)
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int64_t D    = neq0;
+    const int64_t N    = neq1;
+    const int64_t n_kv = nek1;
+
+    LM_GGML_ASSERT(ne0 == D);
+    LM_GGML_ASSERT(ne1 == neq2);
+    LM_GGML_ASSERT(ne2 == N);
+
+    LM_GGML_ASSERT(nbq0 == sizeof(float));
+    LM_GGML_ASSERT(nbk0 == lm_ggml_type_size(k->type));
+    LM_GGML_ASSERT(nbv0 == lm_ggml_type_size(v->type));
+
+    LM_GGML_ASSERT(nek0 == D);
+    LM_GGML_ASSERT(nev0 == n_kv);
+    LM_GGML_ASSERT(nev1 == D);
+
+    // dst cannot be transposed or permuted
+    LM_GGML_ASSERT(nb0 == sizeof(float));
+    LM_GGML_ASSERT(nb0 <= nb1);
+    LM_GGML_ASSERT(nb1 <= nb2);
+    LM_GGML_ASSERT(nb2 <= nb3);
+
+    if (params->type == LM_GGML_TASK_INIT) {
+        return;
+    }
+
+    if (params->type == LM_GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    // broadcast factors for grouped-query attention
+    const int64_t rk2 = neq2/nek2;
+    const int64_t rv2 = neq2/nev2;
+
+    float scale = 1.0f;
+    memcpy(&scale, (float *) dst->op_params + 0, sizeof(float));
+
+    const bool is_f16 = k->type == LM_GGML_TYPE_F16;
+
+    // parallelize by q rows, rows of the same head are kept together so that K and V stay in cache
+
+    // total rows in q
+    const int nr = neq1*neq2*neq3;
+
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
+
+    // per-thread scratch: query row converted to the KV type, tile scores, tile probabilities and the output accumulator
+    float * wdata = (float *) params->wdata + ith*(2*D + 2*LM_GGML_FLASH_ATTN_EXT_TILE + CACHE_LINE_SIZE_F32);
+
+    float * Q   = wdata;
+    float * S   = wdata + D;
+    float * P   = wdata + D + LM_GGML_FLASH_ATTN_EXT_TILE;
+    float * VKQ = wdata + D + 2*LM_GGML_FLASH_ATTN_EXT_TILE;
+
+    lm_ggml_fp16_t * Q16 = (lm_ggml_fp16_t *) Q;
+    lm_ggml_fp16_t * P16 = (lm_ggml_fp16_t *) P;
+
+    for (int ir = ir0; ir < ir1; ++ir) {
+        // q indices
+        const int iq3 = ir/(neq2*neq1);
+        const int iq2 = (ir - iq3*neq2*neq1)/neq1;
+        const int iq1 = (ir - iq3*neq2*neq1 - iq2*neq1);
+
+        // k and v indices
+        const int ik2 = iq2/rk2;
+        const int iv2 = iq2/rv2;
 
-        if (masked) {
-            for (int64_t i = P; i < M; i++) {
-                if (i > P + iq1) {
-                    S[i] = -INFINITY;
-                }
+        const float * pq = (const float *) ((char *) q->data + (iq1*nbq1 + iq2*nbq2 + iq3*nbq3));
+        const float * mp = mask ? (const float *) ((char *) mask->data + iq1*mask->nb[1]) : NULL;
+
+        if (is_f16) {
+            for (int64_t d = 0; d < D; ++d) {
+                Q16[d] = LM_GGML_FP32_TO_FP16(pq[d]);
             }
+        } else {
+            memcpy(Q, pq, D*sizeof(float));
         }
 
-        // softmax
-        // todo: exclude known -INF S[..] values from max and loop, assuming their results to be zero.
-        // dont forget to set their S values to zero
-        {
-            float max = -INFINITY;
-            lm_ggml_vec_max_f32(M, &max, S);
+        memset(VKQ, 0, D*sizeof(float));
 
-            lm_ggml_float sum = 0.0;
-            {
-#ifdef LM_GGML_SOFT_MAX_ACCELERATE
-                max = -max;
-                vDSP_vsadd(S, 1, &max, S, 1, Mup);
-                vvexpf(S, S, &Mup);
-                lm_ggml_vec_sum_f32(Mup, &sum, S);
-#else
-                uint16_t   scvt[LM_GGML_SOFT_MAX_UNROLL];
-                lm_ggml_float sump[LM_GGML_SOFT_MAX_UNROLL] = { 0.0 };
+        float M = -INFINITY; // running maximum of the scores
+        float L = 0.0f;      // running sum of exp(score - M)
 
-                for (int i = 0; i < Mup; i += LM_GGML_SOFT_MAX_UNROLL) {
-                    float * SS = S + i;
+        for (int64_t ic0 = 0; ic0 < n_kv; ic0 += LM_GGML_FLASH_ATTN_EXT_TILE) {
+            const int nc = MIN(LM_GGML_FLASH_ATTN_EXT_TILE, n_kv - ic0);
 
-                    for (int j = 0; j < LM_GGML_SOFT_MAX_UNROLL; ++j) {
-                        if (SS[j] == -INFINITY) {
-                            SS[j] = 0.0f;
-                        } else {
-                            lm_ggml_fp16_t s = LM_GGML_FP32_TO_FP16(SS[j] - max);
-                            memcpy(&scvt[j], &s, sizeof(uint16_t));
-                            const float val = LM_GGML_FP16_TO_FP32(table_exp_f16[scvt[j]]);
-                            sump[j] += (lm_ggml_float)val;
-                            SS[j] = val;
-                        }
-                    }
-                }
+            // KQ for the tile, masked cells are skipped
+            float Mt = -INFINITY;
 
-                for (int i = 0; i < LM_GGML_SOFT_MAX_UNROLL; i++) {
-                    sum += sump[i];
+            for (int ic = 0; ic < nc; ++ic) {
+                const float mv = mp ? mp[ic0 + ic] : 0.0f;
+                if (mv == -INFINITY) {
+                    S[ic] = -INFINITY;
+                    continue;
                 }
-#endif
-            }
 
-            assert(sum > 0.0);
+                const char * pk = (const char *) k->data + ((ic0 + ic)*nbk1 + ik2*nbk2 + iq3*nbk3);
 
-            sum = 1.0/sum;
-            lm_ggml_vec_scale_f32(M, S, sum);
+                float s;
+                if (is_f16) {
+                    lm_ggml_vec_dot_f16(D, &s, (lm_ggml_fp16_t *) pk, Q16);
+                } else {
+                    lm_ggml_vec_dot_f32(D, &s, (const float *) pk, Q);
+                }
 
-#ifndef NDEBUG
-            for (int i = 0; i < M; ++i) {
-                assert(!isnan(S[i]));
-                assert(!isinf(S[i]));
+                S[ic] = s*scale + mv;
+                Mt = MAX(Mt, S[ic]);
             }
-#endif
-        }
 
-        lm_ggml_fp16_t * S16 = (lm_ggml_fp16_t *) ((float *) params->wdata + ith*(2*Mup + CACHE_LINE_SIZE_F32) + Mup);
+            if (Mt == -INFINITY) {
+                // the whole tile is masked
+                continue;
+            }
 
-        for (int64_t i = 0; i < M; i++) {
-            S16[i] = LM_GGML_FP32_TO_FP16(S[i]);
-        }
+            // rescale the previous partial results to the new maximum
+            const float Mnew = MAX(M, Mt);
+            if (M != -INFINITY && M != Mnew) {
+                const float ms = expf(M - Mnew);
+                L *= ms;
+                lm_ggml_vec_scale_f32(D, VKQ, ms);
+            }
+            M = Mnew;
 
-        // todo: exclude known zero S[..] values from dot (reducing nev0 and increasing begin of v and S16).
-        if (LM_GGML_VEC_DOT_UNROLL == 1 || (nev1 % LM_GGML_VEC_DOT_UNROLL != 0)) {
-            for (int64_t ic = 0; ic < nev1; ++ic) {
-                // dst indices
-                const int i1 = iq1;
-                const int i2 = iq2;
-                const int i3 = iq3;
+            // softmax numerators, same exp approximation as lm_ggml_compute_forward_soft_max
+            lm_ggml_float sum = 0.0;
+            for (int ic = 0; ic < nc; ++ic) {
+                float val = 0.0f;
+                if (S[ic] != -INFINITY) {
+                    lm_ggml_fp16_t s = LM_GGML_FP32_TO_FP16(S[ic] - M);
+                    uint16_t scvt;
+                    memcpy(&scvt, &s, sizeof(scvt));
+                    val = LM_GGML_FP16_TO_FP32(table_exp_f16[scvt]);
+                }
+                sum += (lm_ggml_float) val;
+                if (is_f16) {
+                    P16[ic] = LM_GGML_FP32_TO_FP16(val);
+                } else {
+                    P[ic] = val;
+                }
+            }
+            L += (float) sum;
 
-                // v indices
-                const int iv2 = iq2 % nev2;
-                const int iv3 = iq3;
+            // VKQ += V*P - each row of the transposed V is contiguous over the KV cells of the tile
+            for (int64_t d = 0; d < D; ++d) {
+                const char * pv = (const char *) v->data + (ic0*nbv0 + d*nbv1 + iv2*nbv2 + iq3*nbv3);
 
-                lm_ggml_vec_dot_f16(nev0,
-                        (float *)       ((char *) dst->data + (ic*nb0 + i1*nb1  + i2*nb2   + i3*nb3)),
-                        (lm_ggml_fp16_t *) ((char *) v->data   + (         ic*nbv1 + iv2*nbv2 + iv3*nbv3)),
-                        S16);
+                float s;
+                if (is_f16) {
+                    lm_ggml_vec_dot_f16(nc, &s, (lm_ggml_fp16_t *) pv, P16);
+                } else {
+                    lm_ggml_vec_dot_f32(nc, &s, (const float *) pv, P);
+                }
+
+                VKQ[d] += s;
             }
-        } else {
-            for (int64_t ic = 0; ic < nev1; ic += LM_GGML_VEC_DOT_UNROLL) {
-                // dst indices
-                const int i1 = iq1;
-                const int i2 = iq2;
-                const int i3 = iq3;
+        }
 
-                // v indices
-                const int iv2 = iq2 % nev2;
-                const int iv3 = iq3;
+        // dst is [D, n_head, n_batch]
+        float * pdst = (float *) ((char *) dst->data + (iq2*nb1 + iq1*nb2 + iq3*nb3));
 
-                lm_ggml_vec_dot_f16_unroll(nev0, nbv1,
-                        (float *) ((char *) dst->data + (ic*nb0 + i1*nb1  + i2*nb2   + i3*nb3)),
-                        ((char *)             v->data + (         ic*nbv1 + iv2*nbv2 + iv3*nbv3)),
-                        S16);
-            }
+        if (L > 0.0f) {
+            lm_ggml_vec_scale_f32(D, VKQ, 1.0f/L);
         }
+        memcpy(pdst, VKQ, D*sizeof(float));
     }
 }
 
-static void lm_ggml_compute_forward_flash_attn(
+static void lm_ggml_compute_forward_flash_attn_ext(
         const struct lm_ggml_compute_params * params,
         const struct lm_ggml_tensor * q,
         const struct lm_ggml_tensor * k,
         const struct lm_ggml_tensor * v,
-        const bool masked,
+        const struct lm_ggml_tensor * mask,
         struct lm_ggml_tensor * dst) {
-    switch (q->type) {
+    switch (k->type) {
         case LM_GGML_TYPE_F16:
-            {
-                lm_ggml_compute_forward_flash_attn_f16(params, q, k, v, masked, dst);
-            } break;
         case LM_GGML_TYPE_F32:
             {
-                lm_ggml_compute_forward_flash_attn_f32(params, q, k, v, masked, dst);
+                lm_ggml_compute_forward_flash_attn_ext_f16(params, q, k, v, mask, dst);
             } break;
         default:
             {
@@ -15581,6 +17956,7 @@ static void lm_ggml_compute_forward_flash_attn(
 
 // lm_ggml_compute_forward_flash_ff
 
+
 static void lm_ggml_compute_forward_flash_ff_f16(
         const struct lm_ggml_compute_params * params,
         const struct lm_ggml_tensor * a,  // F16
@@ -16949,6 +19325,18 @@ static void lm_ggml_compute_forward(struct lm_ggml_compute_params * params, stru
             {
                 lm_ggml_compute_forward_rms_norm_back(params, tensor->src[0], tensor->src[1], tensor);
             } break;
+        case LM_GGML_OP_RMS_NORM_MUL:
+            {
+                lm_ggml_compute_forward_rms_norm_mul(params, tensor->src[0], tensor->src[1], tensor);
+            } break;
+        case LM_GGML_OP_ADD_RMS_NORM_MUL:
+            {
+                lm_ggml_compute_forward_add_rms_norm_mul(params, tensor->src[0], tensor->src[1], tensor->src[2], tensor);
+            } break;
+        case LM_GGML_OP_SWIGLU:
+            {
+                lm_ggml_compute_forward_swiglu(params, tensor->src[0], tensor->src[1], tensor);
+            } break;
         case LM_GGML_OP_GROUP_NORM:
             {
                 lm_ggml_compute_forward_group_norm(params, tensor->src[0], tensor);
@@ -17088,6 +19476,10 @@ static void lm_ggml_compute_forward(struct lm_ggml_compute_params * params, stru
                 const bool masked = t != 0;
                 lm_ggml_compute_forward_flash_attn(params, tensor->src[0], tensor->src[1], tensor->src[2], masked, tensor);
             } break;
+        case LM_GGML_OP_FLASH_ATTN_EXT:
+            {
+                lm_ggml_compute_forward_flash_attn_ext(params, tensor->src[0], tensor->src[1], tensor->src[2], tensor->src[3], tensor);
+            } break;
         case LM_GGML_OP_FLASH_FF:
             {
                 lm_ggml_compute_forward_flash_ff(params, tensor->src[0], tensor->src[1], tensor->src[2], tensor->src[3], tensor->src[4], tensor);
@@ -17619,6 +20011,9 @@ static void lm_ggml_compute_backward(struct lm_ggml_context * ctx, struct lm_ggm
                 }
             } break;
         case LM_GGML_OP_RMS_NORM_BACK:
+        case LM_GGML_OP_RMS_NORM_MUL:
+        case LM_GGML_OP_ADD_RMS_NORM_MUL:
+        case LM_GGML_OP_SWIGLU:
             {
                 LM_GGML_ASSERT(false); // TODO: not implemented
             } break;
@@ -18080,6 +20475,10 @@ static void lm_ggml_compute_backward(struct lm_ggml_context * ctx, struct lm_ggm
                             zero_table);
                 }
             } break;
+        case LM_GGML_OP_FLASH_ATTN_EXT:
+            {
+                LM_GGML_ASSERT(false); // not supported
+            } break;
         case LM_GGML_OP_FLASH_FF:
             {
                 LM_GGML_ASSERT(false); // not supported
@@ -18575,6 +20974,10 @@ static thread_ret_t lm_ggml_graph_compute_thread(void * data) {
             while (++node_n < cgraph->n_nodes) {
                 LM_GGML_PRINT_DEBUG_5("%s: %d/%d\n", __func__, node_n, cgraph->n_nodes);
 
+                if (cplan->node_callback) {
+                    cplan->node_callback(node_n, cplan->node_callback_data);
+                }
+
                 struct lm_ggml_tensor * node = cgraph->nodes[node_n];
                 const int n_tasks = n_tasks_arr[node_n];
 
@@ -18748,6 +21151,9 @@ struct lm_ggml_cplan lm_ggml_graph_plan(struct lm_ggml_cgraph * cgraph, int n_th
             case LM_GGML_OP_NORM:
             case LM_GGML_OP_RMS_NORM:
             case LM_GGML_OP_RMS_NORM_BACK:
+            case LM_GGML_OP_RMS_NORM_MUL:
+            case LM_GGML_OP_ADD_RMS_NORM_MUL:
+            case LM_GGML_OP_SWIGLU:
             case LM_GGML_OP_GROUP_NORM:
                 {
                     n_tasks = n_threads;
@@ -19011,6 +21417,16 @@ struct lm_ggml_cplan lm_ggml_graph_plan(struct lm_ggml_cgraph * cgraph, int n_th
                         cur += sizeof(float)*ne11*n_tasks; // this is overestimated by x2
                     }
 
+                    work_size = MAX(work_size, cur);
+                } break;
+            case LM_GGML_OP_FLASH_ATTN_EXT:
+                {
+                    n_tasks = n_threads;
+
+                    const int64_t D = node->src[0]->ne[0];
+
+                    const size_t cur = sizeof(float)*(2*D + 2*LM_GGML_FLASH_ATTN_EXT_TILE + CACHE_LINE_SIZE_F32)*n_tasks;
+
                     work_size = MAX(work_size, cur);
                 } break;
             case LM_GGML_OP_FLASH_FF:
@@ -21051,6 +23467,95 @@ size_t lm_ggml_quantize_chunk(enum lm_ggml_type type, const float * src, void *
     return result;
 }
 
+// interleave the quants of 4 rows in groups of 4 bytes
+static void lm_ggml_interleave_x4(uint8_t * restrict dst, const uint8_t * restrict src[4], int n) {
+    for (int k = 0; k < n/4; ++k) {
+        for (int r = 0; r < 4; ++r) {
+            memcpy(dst + 16*k + 4*r, src[r] + 4*k, 4);
+        }
+    }
+}
+
+static void repack_q4_0_x4(const block_q4_0 * restrict x, block_q4_0x4 * restrict y, int nrows, int k) {
+    const int nb = k / QK4_0;
+
+    for (int ir = 0; ir < nrows; ir += 4) {
+        for (int i = 0; i < nb; ++i) {
+            const uint8_t * qs[4];
+
+            for (int r = 0; r < 4; ++r) {
+                y[i].d[r] = x[r*nb + i].d;
+                qs[r]     = x[r*nb + i].qs;
+            }
+
+            lm_ggml_interleave_x4(y[i].qs, qs, QK4_0/2);
+        }
+
+        x += 4*nb;
+        y += nb;
+    }
+}
+
+static void repack_q8_0_x4(const block_q8_0 * restrict x, block_q8_0x4 * restrict y, int nrows, int k) {
+    const int nb = k / QK8_0;
+
+    for (int ir = 0; ir < nrows; ir += 4) {
+        for (int i = 0; i < nb; ++i) {
+            const uint8_t * qs[4];
+
+            for (int r = 0; r < 4; ++r) {
+                y[i].d[r] = x[r*nb + i].d;
+                qs[r]     = (const uint8_t *) x[r*nb + i].qs;
+            }
+
+            lm_ggml_interleave_x4((uint8_t *) y[i].qs, qs, QK8_0);
+        }
+
+        x += 4*nb;
+        y += nb;
+    }
+}
+
+enum lm_ggml_type lm_ggml_repack_type(enum lm_ggml_type type) {
+    switch (type) {
+        case LM_GGML_TYPE_Q4_0: return LM_GGML_TYPE_Q4_0_X4;
+        case LM_GGML_TYPE_Q8_0: return LM_GGML_TYPE_Q8_0_X4;
+#if defined(LM_GGML_USE_K_QUANTS) && QK_K == 256
+        case LM_GGML_TYPE_Q4_K: return LM_GGML_TYPE_Q4_K_X4;
+#endif
+        default:                return LM_GGML_TYPE_COUNT;
+    }
+}
+
+size_t lm_ggml_repack(enum lm_ggml_type type, const void * src, void * dst, int nrows, int n_per_row) {
+    const enum lm_ggml_type type_x4 = lm_ggml_repack_type(type);
+
+    LM_GGML_ASSERT(type_x4 != LM_GGML_TYPE_COUNT);
+    LM_GGML_ASSERT(nrows % type_traits[type_x4].blck_rows == 0);
+    LM_GGML_ASSERT(n_per_row % lm_ggml_blck_size(type) == 0);
+
+    switch (type) {
+        case LM_GGML_TYPE_Q4_0:
+            {
+                repack_q4_0_x4(src, dst, nrows, n_per_row);
+            } break;
+        case LM_GGML_TYPE_Q8_0:
+            {
+                repack_q8_0_x4(src, dst, nrows, n_per_row);
+            } break;
+#if defined(LM_GGML_USE_K_QUANTS) && QK_K == 256
+        case LM_GGML_TYPE_Q4_K:
+            {
+                repack_q4_K_x4(src, dst, nrows, n_per_row);
+            } break;
+#endif
+        default:
+            LM_GGML_ASSERT(false);
+    }
+
+    return (size_t) nrows*n_per_row/lm_ggml_blck_size(type)*lm_ggml_type_size(type);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 struct lm_gguf_str {
@@ -21156,36 +23661,150 @@ struct lm_gguf_context {
 
     //uint8_t * padding;
     void * data;
+
+    struct lm_gguf_str_block * str_blocks; // strings read from the file
+};
+
+// the strings read from a file (keys, values, tensor names, the vocab of a model) are carved out of a few large
+// blocks instead of being allocated one by one, the strings set through the API are allocated with strdup
+struct lm_gguf_str_block {
+    struct lm_gguf_str_block * next;
+
+    size_t size;
+    size_t used;
+
+    char data[];
+};
+
+#define LM_GGUF_STR_BLOCK_SIZE (1024*1024)
+
+static char * lm_gguf_str_alloc(struct lm_gguf_context * ctx, size_t n) {
+    struct lm_gguf_str_block * block = ctx->str_blocks;
+
+    if (block == NULL || block->size - block->used < n) {
+        const size_t size = MAX(n, LM_GGUF_STR_BLOCK_SIZE);
+
+        block = malloc(sizeof(struct lm_gguf_str_block) + size);
+        if (block == NULL) {
+            return NULL;
+        }
+
+        block->next = ctx->str_blocks;
+        block->size = size;
+        block->used = 0;
+
+        ctx->str_blocks = block;
+    }
+
+    char * data = block->data + block->used;
+    block->used += n;
+
+    return data;
+}
+
+static void lm_gguf_str_free(struct lm_gguf_context * ctx, char * data) {
+    if (data == NULL) {
+        return;
+    }
+
+    for (struct lm_gguf_str_block * block = ctx->str_blocks; block != NULL; block = block->next) {
+        if ((uintptr_t) data >= (uintptr_t) block->data && (uintptr_t) data < (uintptr_t) (block->data + block->size)) {
+            return;
+        }
+    }
+
+    free(data);
+}
+
+// the file is read through a read-only mapping when possible: the metadata is made of many small fields and
+// strings, and copying them out of the mapping is much cheaper than a fread call for each
+struct lm_gguf_reader {
+    FILE * file;
+
+    const uint8_t * map; // NULL if the file is read with fread
+    size_t          map_size;
 };
 
-static bool lm_gguf_fread_el(FILE * file, void * dst, size_t size, size_t * offset) {
-    const size_t n = fread(dst, 1, size, file);
+static void lm_gguf_reader_open(struct lm_gguf_reader * reader, FILE * file) {
+    reader->file     = file;
+    reader->map      = NULL;
+    reader->map_size = 0;
+
+#if defined(_POSIX_MAPPED_FILES)
+    struct stat st;
+    if (fstat(fileno(file), &st) == 0 && st.st_size > 0 && (uint64_t) st.st_size <= SIZE_MAX) {
+        void * map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+        if (map != MAP_FAILED) {
+            reader->map      = map;
+            reader->map_size = (size_t) st.st_size;
+        }
+    }
+#endif
+}
+
+static void lm_gguf_reader_close(struct lm_gguf_reader * reader) {
+#if defined(_POSIX_MAPPED_FILES)
+    if (reader->map) {
+        munmap((void *) reader->map, reader->map_size);
+    }
+#endif
+    fclose(reader->file);
+}
+
+// offset is the position in the file and is only advanced by the bytes actually read
+static bool lm_gguf_fread_el(const struct lm_gguf_reader * reader, void * dst, size_t size, size_t * offset) {
+    if (reader->map) {
+        if (*offset > reader->map_size || size > reader->map_size - *offset) {
+            return false;
+        }
+        memcpy(dst, reader->map + *offset, size);
+        *offset += size;
+        return true;
+    }
+
+    const size_t n = fread(dst, 1, size, reader->file);
     *offset += n;
     return n == size;
 }
 
+static bool lm_gguf_fread_str_data(const struct lm_gguf_reader * reader, struct lm_gguf_context * ctx, struct lm_gguf_str * p, size_t * offset) {
+    // also rejects lengths past the end of the file before allocating for them
+    if (p->n >= SIZE_MAX/2 || (reader->map && (*offset > reader->map_size || p->n > reader->map_size - *offset))) {
+        return false;
+    }
+
+    p->data = lm_gguf_str_alloc(ctx, p->n + 1);
+    if (p->data == NULL) {
+        return false;
+    }
+
+    p->data[p->n] = 0;
+
+    return lm_gguf_fread_el(reader, p->data, p->n, offset);
+}
+
 // NOTE: temporary handling of GGUFv1 >> remove after Oct 2023
-static bool lm_gguf_fread_str_cur(FILE * file, struct lm_gguf_str * p, size_t * offset) {
+static bool lm_gguf_fread_str_cur(const struct lm_gguf_reader * reader, struct lm_gguf_context * ctx, struct lm_gguf_str * p, size_t * offset) {
     p->n    = 0;
     p->data = NULL;
 
     bool ok = true;
 
-    ok = ok && lm_gguf_fread_el(file, &p->n,    sizeof(p->n), offset); p->data = calloc(p->n + 1, 1);
-    ok = ok && lm_gguf_fread_el(file,  p->data, p->n,         offset);
+    ok = ok && lm_gguf_fread_el(reader, &p->n, sizeof(p->n), offset);
+    ok = ok && lm_gguf_fread_str_data(reader, ctx, p, offset);
 
     return ok;
 }
 
-static bool lm_gguf_fread_str_v1(FILE * file, struct lm_gguf_str * p, size_t * offset) {
+static bool lm_gguf_fread_str_v1(const struct lm_gguf_reader * reader, struct lm_gguf_context * ctx, struct lm_gguf_str * p, size_t * offset) {
     p->n    = 0;
     p->data = NULL;
 
     bool ok = true;
 
     uint32_t n = 0;
-    ok = ok && lm_gguf_fread_el(file, &n,       sizeof(n), offset); p->data = calloc(n + 1, 1); p->n = n;
-    ok = ok && lm_gguf_fread_el(file,  p->data, p->n,      offset);
+    ok = ok && lm_gguf_fread_el(reader, &n, sizeof(n), offset); p->n = n;
+    ok = ok && lm_gguf_fread_str_data(reader, ctx, p, offset);
 
     return ok;
 }
@@ -21207,6 +23826,8 @@ struct lm_gguf_context * lm_gguf_init_empty(void) {
 
     ctx->data = NULL;
 
+    ctx->str_blocks = NULL;
+
     return ctx;
 }
 
@@ -21216,6 +23837,9 @@ struct lm_gguf_context * lm_gguf_init_from_file(const char * fname, struct lm_gg
         return NULL;
     }
 
+    struct lm_gguf_reader reader;
+    lm_gguf_reader_open(&reader, file);
+
     // offset from start of file
     size_t offset = 0;
 
@@ -21223,12 +23847,12 @@ struct lm_gguf_context * lm_gguf_init_from_file(const char * fname, struct lm_gg
 
     // check the magic before making allocations
     {
-        lm_gguf_fread_el(file, &magic, sizeof(magic), &offset);
+        lm_gguf_fread_el(&reader, &magic, sizeof(magic), &offset);
 
         for (uint32_t i = 0; i < sizeof(magic); i++) {
             if (magic[i] != LM_GGUF_MAGIC[i]) {
                 fprintf(stderr, "%s: invalid magic characters %s.\n", __func__, magic);
-                fclose(file);
+                lm_gguf_reader_close(&reader);
                 return NULL;
             }
         }
@@ -21247,75 +23871,77 @@ struct lm_gguf_context * lm_gguf_init_from_file(const char * fname, struct lm_gg
         ctx->infos = NULL;
         ctx->data  = NULL;
 
-        ok = ok && lm_gguf_fread_el(file, &ctx->header.version,   sizeof(ctx->header.version),   &offset);
+        ctx->str_blocks = NULL;
+
+        ok = ok && lm_gguf_fread_el(&reader, &ctx->header.version,   sizeof(ctx->header.version),   &offset);
 
         if (ctx->header.version == 1) {
             // NOTE: temporary handling of GGUFv1 >> remove after Oct 2023
             uint32_t n_tensors = 0;
             uint32_t n_kv      = 0;
 
-            ok = ok && lm_gguf_fread_el(file, &n_tensors, sizeof(n_tensors), &offset);
-            ok = ok && lm_gguf_fread_el(file, &n_kv,      sizeof(n_kv),      &offset);
+            ok = ok && lm_gguf_fread_el(&reader, &n_tensors, sizeof(n_tensors), &offset);
+            ok = ok && lm_gguf_fread_el(&reader, &n_kv,      sizeof(n_kv),      &offset);
 
             ctx->header.n_tensors = n_tensors;
             ctx->header.n_kv      = n_kv;
         } else {
-            ok = ok && lm_gguf_fread_el(file, &ctx->header.n_tensors, sizeof(ctx->header.n_tensors), &offset);
-            ok = ok && lm_gguf_fread_el(file, &ctx->header.n_kv,      sizeof(ctx->header.n_kv),      &offset);
+            ok = ok && lm_gguf_fread_el(&reader, &ctx->header.n_tensors, sizeof(ctx->header.n_tensors), &offset);
+            ok = ok && lm_gguf_fread_el(&reader, &ctx->header.n_kv,      sizeof(ctx->header.n_kv),      &offset);
         }
 
         if (!ok) {
             fprintf(stderr, "%s: failed to read header\n", __func__);
-            fclose(file);
+            lm_gguf_reader_close(&reader);
             lm_gguf_free(ctx);
             return NULL;
         }
     }
 
     // NOTE: temporary handling of GGUFv1 >> remove after Oct 2023
-    bool (* lm_gguf_fread_str)(FILE *, struct lm_gguf_str *, size_t *) = lm_gguf_fread_str_cur;
+    bool (* lm_gguf_fread_str)(const struct lm_gguf_reader *, struct lm_gguf_context *, struct lm_gguf_str *, size_t *) = lm_gguf_fread_str_cur;
     if (ctx->header.version == 1) {
         lm_gguf_fread_str = lm_gguf_fread_str_v1;
     }
 
     // read the kv pairs
     {
-        ctx->kv = malloc(ctx->header.n_kv * sizeof(struct lm_gguf_kv));
+        ctx->kv = calloc(ctx->header.n_kv, sizeof(struct lm_gguf_kv));
 
         for (uint32_t i = 0; i < ctx->header.n_kv; ++i) {
             struct lm_gguf_kv * kv = &ctx->kv[i];
 
             //fprintf(stderr, "%s: reading kv %d\n", __func__, i);
 
-            ok = ok && lm_gguf_fread_str(file, &kv->key,                    &offset);
-            ok = ok && lm_gguf_fread_el (file, &kv->type, sizeof(kv->type), &offset);
+            ok = ok && lm_gguf_fread_str(&reader, ctx, &kv->key,                    &offset);
+            ok = ok && lm_gguf_fread_el (&reader, &kv->type, sizeof(kv->type), &offset);
 
             //fprintf(stderr, "%s: reading kv with key %s\n", __func__, kv->key.data);
 
             switch (kv->type) {
-                case LM_GGUF_TYPE_UINT8:   ok = ok && lm_gguf_fread_el (file, &kv->value.uint8,   sizeof(kv->value.uint8),   &offset); break;
-                case LM_GGUF_TYPE_INT8:    ok = ok && lm_gguf_fread_el (file, &kv->value.int8,    sizeof(kv->value.int8),    &offset); break;
-                case LM_GGUF_TYPE_UINT16:  ok = ok && lm_gguf_fread_el (file, &kv->value.uint16,  sizeof(kv->value.uint16),  &offset); break;
-                case LM_GGUF_TYPE_INT16:   ok = ok && lm_gguf_fread_el (file, &kv->value.int16,   sizeof(kv->value.int16),   &offset); break;
-                case LM_GGUF_TYPE_UINT32:  ok = ok && lm_gguf_fread_el (file, &kv->value.uint32,  sizeof(kv->value.uint32),  &offset); break;
-                case LM_GGUF_TYPE_INT32:   ok = ok && lm_gguf_fread_el (file, &kv->value.int32,   sizeof(kv->value.int32),   &offset); break;
-                case LM_GGUF_TYPE_FLOAT32: ok = ok && lm_gguf_fread_el (file, &kv->value.float32, sizeof(kv->value.float32), &offset); break;
-                case LM_GGUF_TYPE_UINT64:  ok = ok && lm_gguf_fread_el (file, &kv->value.uint64,  sizeof(kv->value.uint64),  &offset); break;
-                case LM_GGUF_TYPE_INT64:   ok = ok && lm_gguf_fread_el (file, &kv->value.int64,   sizeof(kv->value.int64),   &offset); break;
-                case LM_GGUF_TYPE_FLOAT64: ok = ok && lm_gguf_fread_el (file, &kv->value.float64, sizeof(kv->value.float64), &offset); break;
-                case LM_GGUF_TYPE_BOOL:    ok = ok && lm_gguf_fread_el (file, &kv->value.bool_,   sizeof(kv->value.bool_),   &offset); break;
-                case LM_GGUF_TYPE_STRING:  ok = ok && lm_gguf_fread_str(file, &kv->value.str,                                &offset); break;
+                case LM_GGUF_TYPE_UINT8:   ok = ok && lm_gguf_fread_el (&reader, &kv->value.uint8,   sizeof(kv->value.uint8),   &offset); break;
+                case LM_GGUF_TYPE_INT8:    ok = ok && lm_gguf_fread_el (&reader, &kv->value.int8,    sizeof(kv->value.int8),    &offset); break;
+                case LM_GGUF_TYPE_UINT16:  ok = ok && lm_gguf_fread_el (&reader, &kv->value.uint16,  sizeof(kv->value.uint16),  &offset); break;
+                case LM_GGUF_TYPE_INT16:   ok = ok && lm_gguf_fread_el (&reader, &kv->value.int16,   sizeof(kv->value.int16),   &offset); break;
+                case LM_GGUF_TYPE_UINT32:  ok = ok && lm_gguf_fread_el (&reader, &kv->value.uint32,  sizeof(kv->value.uint32),  &offset); break;
+                case LM_GGUF_TYPE_INT32:   ok = ok && lm_gguf_fread_el (&reader, &kv->value.int32,   sizeof(kv->value.int32),   &offset); break;
+                case LM_GGUF_TYPE_FLOAT32: ok = ok && lm_gguf_fread_el (&reader, &kv->value.float32, sizeof(kv->value.float32), &offset); break;
+                case LM_GGUF_TYPE_UINT64:  ok = ok && lm_gguf_fread_el (&reader, &kv->value.uint64,  sizeof(kv->value.uint64),  &offset); break;
+                case LM_GGUF_TYPE_INT64:   ok = ok && lm_gguf_fread_el (&reader, &kv->value.int64,   sizeof(kv->value.int64),   &offset); break;
+                case LM_GGUF_TYPE_FLOAT64: ok = ok && lm_gguf_fread_el (&reader, &kv->value.float64, sizeof(kv->value.float64), &offset); break;
+                case LM_GGUF_TYPE_BOOL:    ok = ok && lm_gguf_fread_el (&reader, &kv->value.bool_,   sizeof(kv->value.bool_),   &offset); break;
+                case LM_GGUF_TYPE_STRING:  ok = ok && lm_gguf_fread_str(&reader, ctx, &kv->value.str,                                &offset); break;
                 case LM_GGUF_TYPE_ARRAY:
                     {
-                        ok = ok && lm_gguf_fread_el(file, &kv->value.arr.type, sizeof(kv->value.arr.type), &offset);
+                        ok = ok && lm_gguf_fread_el(&reader, &kv->value.arr.type, sizeof(kv->value.arr.type), &offset);
 
                         if (ctx->header.version == 1) {
                             // NOTE: temporary handling of GGUFv1 >> remove after Oct 2023
                             uint32_t n = 0;
-                            ok = ok && lm_gguf_fread_el(file, &n, sizeof(n), &offset);
+                            ok = ok && lm_gguf_fread_el(&reader, &n, sizeof(n), &offset);
                             kv->value.arr.n = n;
                         } else {
-                            ok = ok && lm_gguf_fread_el(file, &kv->value.arr.n, sizeof(kv->value.arr.n), &offset);
+                            ok = ok && lm_gguf_fread_el(&reader, &kv->value.arr.n, sizeof(kv->value.arr.n), &offset);
                         }
 
                         switch (kv->value.arr.type) {
@@ -21332,13 +23958,13 @@ struct lm_gguf_context * lm_gguf_init_from_file(const char * fname, struct lm_gg
                             case LM_GGUF_TYPE_BOOL:
                                 {
                                     kv->value.arr.data = malloc(kv->value.arr.n * LM_GGUF_TYPE_SIZE[kv->value.arr.type]);
-                                    ok = ok && lm_gguf_fread_el(file, kv->value.arr.data, kv->value.arr.n * LM_GGUF_TYPE_SIZE[kv->value.arr.type], &offset);
+                                    ok = ok && lm_gguf_fread_el(&reader, kv->value.arr.data, kv->value.arr.n * LM_GGUF_TYPE_SIZE[kv->value.arr.type], &offset);
                                 } break;
                             case LM_GGUF_TYPE_STRING:
                                 {
-                                    kv->value.arr.data = malloc(kv->value.arr.n * sizeof(struct lm_gguf_str));
+                                    kv->value.arr.data = calloc(kv->value.arr.n, sizeof(struct lm_gguf_str));
                                     for (uint32_t j = 0; j < kv->value.arr.n; ++j) {
-                                        ok = ok && lm_gguf_fread_str(file, &((struct lm_gguf_str *) kv->value.arr.data)[j], &offset);
+                                        ok = ok && lm_gguf_fread_str(&reader, ctx, &((struct lm_gguf_str *) kv->value.arr.data)[j], &offset);
                                     }
                                 } break;
                             case LM_GGUF_TYPE_ARRAY:
@@ -21355,7 +23981,7 @@ struct lm_gguf_context * lm_gguf_init_from_file(const char * fname, struct lm_gg
 
         if (!ok) {
             fprintf(stderr, "%s: failed to read key-value pairs\n", __func__);
-            fclose(file);
+            lm_gguf_reader_close(&reader);
             lm_gguf_free(ctx);
             return NULL;
         }
@@ -21363,7 +23989,7 @@ struct lm_gguf_context * lm_gguf_init_from_file(const char * fname, struct lm_gg
 
     // read the tensor infos
     {
-        ctx->infos = malloc(ctx->header.n_tensors * sizeof(struct lm_gguf_tensor_info));
+        ctx->infos = calloc(ctx->header.n_tensors, sizeof(struct lm_gguf_tensor_info));
 
         for (uint32_t i = 0; i < ctx->header.n_tensors; ++i) {
             struct lm_gguf_tensor_info * info = &ctx->infos[i];
@@ -21372,24 +23998,32 @@ struct lm_gguf_context * lm_gguf_init_from_file(const char * fname, struct lm_gg
                 info->ne[j] = 1;
             }
 
-            ok = ok && lm_gguf_fread_str(file, &info->name,                          &offset);
-            ok = ok && lm_gguf_fread_el (file, &info->n_dims, sizeof(info->n_dims),  &offset);
+            ok = ok && lm_gguf_fread_str(&reader, ctx, &info->name,                          &offset);
+            ok = ok && lm_gguf_fread_el (&reader, &info->n_dims, sizeof(info->n_dims),  &offset);
             for (uint32_t j = 0; j < info->n_dims; ++j) {
                 if (ctx->header.version == 1) {
                     // NOTE: temporary handling of GGUFv1 >> remove after Oct 2023
                     uint32_t t = 0;
-                    ok = ok && lm_gguf_fread_el(file, &t, sizeof(t), &offset);
+                    ok = ok && lm_gguf_fread_el(&reader, &t, sizeof(t), &offset);
                     info->ne[j] = t;
                 } else {
-                    ok = ok && lm_gguf_fread_el(file, &info->ne[j], sizeof(info->ne[j]), &offset);
+                    ok = ok && lm_gguf_fread_el(&reader, &info->ne[j], sizeof(info->ne[j]), &offset);
                 }
             }
-            ok = ok && lm_gguf_fread_el (file, &info->type,   sizeof(info->type),    &offset);
-            ok = ok && lm_gguf_fread_el (file, &info->offset, sizeof(info->offset),  &offset);
+            ok = ok && lm_gguf_fread_el (&reader, &info->type,   sizeof(info->type),    &offset);
+            ok = ok && lm_gguf_fread_el (&reader, &info->offset, sizeof(info->offset),  &offset);
 
             if (!ok) {
                 fprintf(stderr, "%s: failed to read tensor info\n", __func__);
-                fclose(file);
+                lm_gguf_reader_close(&reader);
+                lm_gguf_free(ctx);
+                return NULL;
+            }
+
+            // the interleaved layouts only exist in memory
+            if ((int) info->type < 0 || info->type >= LM_GGML_TYPE_COUNT || type_traits[info->type].blck_rows > 0) {
+                fprintf(stderr, "%s: tensor '%s' has invalid type %d\n", __func__, info->name.data, info->type);
+                lm_gguf_reader_close(&reader);
                 lm_gguf_free(ctx);
                 return NULL;
             }
@@ -21409,7 +24043,9 @@ struct lm_gguf_context * lm_gguf_init_from_file(const char * fname, struct lm_gg
 
         if (offset_pad != 0) {
             offset += ctx->alignment - offset_pad;
-            fseek(file, offset, SEEK_SET);
+            if (!reader.map) {
+                fseek(file, offset, SEEK_SET);
+            }
         }
     }
 
@@ -21431,7 +24067,7 @@ struct lm_gguf_context * lm_gguf_init_from_file(const char * fname, struct lm_gg
             if (ne % lm_ggml_blck_size(info->type) != 0) {
                 fprintf(stderr, "%s: tensor '%s' number of elements (%" PRId64 ") is not a multiple of block size (%d)\n",
                         __func__, info->name.data, ne, lm_ggml_blck_size(info->type));
-                fclose(file);
+                lm_gguf_reader_close(&reader);
                 lm_gguf_free(ctx);
                 return NULL;
             }
@@ -21472,11 +24108,11 @@ struct lm_gguf_context * lm_gguf_init_from_file(const char * fname, struct lm_gg
             ok = ok && data != NULL;
 
             // read the binary blob with the tensor data
-            ok = ok && lm_gguf_fread_el(file, data->data, ctx->size, &offset);
+            ok = ok && lm_gguf_fread_el(&reader, data->data, ctx->size, &offset);
 
             if (!ok) {
                 fprintf(stderr, "%s: failed to read tensor data\n", __func__);
-                fclose(file);
+                lm_gguf_reader_close(&reader);
                 lm_ggml_free(ctx_data);
                 lm_gguf_free(ctx);
                 return NULL;
@@ -21515,7 +24151,7 @@ struct lm_gguf_context * lm_gguf_init_from_file(const char * fname, struct lm_gg
 
         if (!ok) {
             fprintf(stderr, "%s: failed to read the tensor data\n", __func__);
-            fclose(file);
+            lm_gguf_reader_close(&reader);
             lm_ggml_free(ctx_data);
             lm_gguf_free(ctx);
             return NULL;
@@ -21524,7 +24160,7 @@ struct lm_gguf_context * lm_gguf_init_from_file(const char * fname, struct lm_gg
         lm_ggml_set_no_alloc(ctx_data, params.no_alloc);
     }
 
-    fclose(file);
+    lm_gguf_reader_close(&reader);
 
     return ctx;
 }
@@ -21539,14 +24175,10 @@ void lm_gguf_free(struct lm_gguf_context * ctx) {
         for (uint32_t i = 0; i < ctx->header.n_kv; ++i) {
             struct lm_gguf_kv * kv = &ctx->kv[i];
 
-            if (kv->key.data) {
-                free(kv->key.data);
-            }
+            lm_gguf_str_free(ctx, kv->key.data);
 
             if (kv->type == LM_GGUF_TYPE_STRING) {
-                if (kv->value.str.data) {
-                    free(kv->value.str.data);
-                }
+                lm_gguf_str_free(ctx, kv->value.str.data);
             }
 
             if (kv->type == LM_GGUF_TYPE_ARRAY) {
@@ -21554,9 +24186,7 @@ void lm_gguf_free(struct lm_gguf_context * ctx) {
                     if (kv->value.arr.type == LM_GGUF_TYPE_STRING) {
                         for (uint32_t j = 0; j < kv->value.arr.n; ++j) {
                             struct lm_gguf_str * str = &((struct lm_gguf_str *) kv->value.arr.data)[j];
-                            if (str->data) {
-                                free(str->data);
-                            }
+                            lm_gguf_str_free(ctx, str->data);
                         }
                     }
                     free(kv->value.arr.data);
@@ -21571,14 +24201,18 @@ void lm_gguf_free(struct lm_gguf_context * ctx) {
         for (uint32_t i = 0; i < ctx->header.n_tensors; ++i) {
             struct lm_gguf_tensor_info * info = &ctx->infos[i];
 
-            if (info->name.data) {
-                free(info->name.data);
-            }
+            lm_gguf_str_free(ctx, info->name.data);
         }
 
         free(ctx->infos);
     }
 
+    while (ctx->str_blocks) {
+        struct lm_gguf_str_block * next = ctx->str_blocks->next;
+        free(ctx->str_blocks);
+        ctx->str_blocks = next;
+    }
+
     LM_GGML_ALIGNED_FREE(ctx);
 }
 
@@ -22191,6 +24825,8 @@ int lm_ggml_cpu_has_avx2(void) {
 int lm_ggml_cpu_has_avx512(void) {
 #if defined(__AVX512F__)
     return 1;
+#elif defined(LM_GGML_X86_DISPATCH)
+    return lm_ggml_x86_avx512_vnni;
 #else
     return 0;
 #endif
@@ -22207,6 +24843,18 @@ int lm_ggml_cpu_has_avx512_vbmi(void) {
 int lm_ggml_cpu_has_avx512_vnni(void) {
 #if defined(__AVX512VNNI__)
     return 1;
+#elif defined(LM_GGML_X86_DISPATCH)
+    return lm_ggml_x86_avx512_vnni;
+#else
+    return 0;
+#endif
+}
+
+int lm_ggml_cpu_has_avx_vnni(void) {
+#if defined(__AVXVNNI__)
+    return 1;
+#elif defined(LM_GGML_X86_DISPATCH)
+    return lm_ggml_x86_avx_vnni;
 #else
     return 0;
 #endif
@@ -22255,6 +24903,18 @@ int lm_ggml_cpu_has_f16c(void) {
 int lm_ggml_cpu_has_fp16_va(void) {
 #if defined(__ARM_FEATURE_FP16_VECTOR_ARITHMETIC)
     return 1;
+#elif defined(LM_GGML_ARM_DISPATCH)
+    return lm_ggml_arm_fp16;
+#else
+    return 0;
+#endif
+}
+
+int lm_ggml_cpu_has_dotprod(void) {
+#if defined(__ARM_FEATURE_DOTPROD)
+    return 1;
+#elif defined(LM_GGML_ARM_DISPATCH)
+    return lm_ggml_arm_dotprod;
 #else
     return 0;
 #endif
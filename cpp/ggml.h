@@ -324,6 +324,10 @@ extern "C" {
         LM_GGML_TYPE_I8,
         LM_GGML_TYPE_I16,
         LM_GGML_TYPE_I32,
+        // CPU-only layouts with 4 rows interleaved per block, never stored in files (see lm_ggml_repack)
+        LM_GGML_TYPE_Q4_0_X4,
+        LM_GGML_TYPE_Q8_0_X4,
+        LM_GGML_TYPE_Q4_K_X4,
         LM_GGML_TYPE_COUNT,
     };
 
@@ -376,6 +380,9 @@ extern "C" {
         LM_GGML_OP_NORM, // normalize
         LM_GGML_OP_RMS_NORM,
         LM_GGML_OP_RMS_NORM_BACK,
+        LM_GGML_OP_RMS_NORM_MUL,
+        LM_GGML_OP_ADD_RMS_NORM_MUL,
+        LM_GGML_OP_SWIGLU,
         LM_GGML_OP_GROUP_NORM,
 
         LM_GGML_OP_MUL_MAT,
@@ -414,6 +421,7 @@ extern "C" {
         LM_GGML_OP_UPSCALE, // nearest interpolate
 
         LM_GGML_OP_FLASH_ATTN,
+        LM_GGML_OP_FLASH_ATTN_EXT,
         LM_GGML_OP_FLASH_FF,
         LM_GGML_OP_FLASH_ATTN_BACK,
         LM_GGML_OP_WIN_PART,
@@ -537,6 +545,10 @@ extern "C" {
         // abort lm_ggml_graph_compute when true
         bool (*abort_callback)(void * data);
         void * abort_callback_data;
+
+        // called before the computation of each node, by a single thread while the other threads wait
+        void (*node_callback)(int node_n, void * data);
+        void * node_callback_data;
     };
 
     // next prime after LM_GGML_MAX_NODES
@@ -1021,6 +1033,31 @@ extern "C" {
             struct lm_ggml_tensor  * b,
             float                 eps);
 
+    // fused lm_ggml_mul(ctx, lm_ggml_rms_norm(ctx, a, eps), b)
+    // b is broadcast over the rows of a
+    LM_GGML_API struct lm_ggml_tensor * lm_ggml_rms_norm_mul(
+            struct lm_ggml_context * ctx,
+            struct lm_ggml_tensor  * a,
+            struct lm_ggml_tensor  * b,
+            float                 eps);
+
+    // fused residual add + rms_norm + mul, a and b are [ne0, ne1]
+    // res: [ne0, ne1, 2] with
+    //   res[:, :, 0] = a + b
+    //   res[:, :, 1] = rms_norm(a + b)*c
+    LM_GGML_API struct lm_ggml_tensor * lm_ggml_add_rms_norm_mul(
+            struct lm_ggml_context * ctx,
+            struct lm_ggml_tensor  * a,
+            struct lm_ggml_tensor  * b,
+            struct lm_ggml_tensor  * c,
+            float                 eps);
+
+    // fused lm_ggml_mul(ctx, lm_ggml_silu(ctx, a), b)
+    LM_GGML_API struct lm_ggml_tensor * lm_ggml_swiglu(
+            struct lm_ggml_context * ctx,
+            struct lm_ggml_tensor  * a,
+            struct lm_ggml_tensor  * b);
+
     // A: k columns, n rows => [ne03, ne02, n, k]
     // B: k columns, m rows  (i.e. we transpose it internally) => [ne03 * x, ne02 * y, m, k]
     // result is n columns, m rows => [ne03 * x, ne02 * y, m, n]
@@ -1488,6 +1525,21 @@ extern "C" {
             struct lm_ggml_tensor  * v,
             bool                  masked);
 
+    // fused scale + mask + soft_max attention with an online softmax over tiles of the KV cache
+    // q:    [n_embd_head, n_batch,     n_head,    1]
+    // k:    [n_embd_head, n_kv,        n_head_kv, 1]
+    // v:    [n_kv,        n_embd_head, n_head_kv, 1] (transposed, as stored in the KV cache)
+    // mask: [n_kv,        n_batch,     1,         1] (optional)
+    // res:  [n_embd_head, n_head,      n_batch,   1] !! permuted !!
+    // n_head must be a multiple of n_head_kv (grouped-query attention)
+    LM_GGML_API struct lm_ggml_tensor * lm_ggml_flash_attn_ext(
+            struct lm_ggml_context * ctx,
+            struct lm_ggml_tensor  * q,
+            struct lm_ggml_tensor  * k,
+            struct lm_ggml_tensor  * v,
+            struct lm_ggml_tensor  * mask,
+            float                 scale);
+
     LM_GGML_API struct lm_ggml_tensor * lm_ggml_flash_attn_back(
            struct lm_ggml_context * ctx,
            struct lm_ggml_tensor  * q,
@@ -1938,6 +1990,13 @@ extern "C" {
 
     LM_GGML_API size_t lm_ggml_quantize_chunk(enum lm_ggml_type type, const float * src, void * dst, int start, int n, int64_t * hist);
 
+    // interleaved layout of a quantized type for faster mul_mat on the CPU, LM_GGML_TYPE_COUNT if there is none
+    LM_GGML_API enum lm_ggml_type lm_ggml_repack_type(enum lm_ggml_type type);
+
+    // repack nrows rows of n_per_row elements of the given type into the layout lm_ggml_repack_type(type)
+    // nrows must be a multiple of the number of interleaved rows, src and dst must not overlap
+    LM_GGML_API size_t lm_ggml_repack(enum lm_ggml_type type, const void * src, void * dst, int nrows, int n_per_row);
+
     //
     // gguf
     //
@@ -2068,12 +2127,14 @@ extern "C" {
     LM_GGML_API int lm_ggml_cpu_has_avx512     (void);
     LM_GGML_API int lm_ggml_cpu_has_avx512_vbmi(void);
     LM_GGML_API int lm_ggml_cpu_has_avx512_vnni(void);
+    LM_GGML_API int lm_ggml_cpu_has_avx_vnni   (void);
     LM_GGML_API int lm_ggml_cpu_has_fma        (void);
     LM_GGML_API int lm_ggml_cpu_has_neon       (void);
     LM_GGML_API int lm_ggml_cpu_has_arm_fma    (void);
     LM_GGML_API int lm_ggml_cpu_has_metal      (void);
     LM_GGML_API int lm_ggml_cpu_has_f16c       (void);
     LM_GGML_API int lm_ggml_cpu_has_fp16_va    (void);
+    LM_GGML_API int lm_ggml_cpu_has_dotprod    (void);
     LM_GGML_API int lm_ggml_cpu_has_wasm_simd  (void);
     LM_GGML_API int lm_ggml_cpu_has_blas       (void);
     LM_GGML_API int lm_ggml_cpu_has_cublas     (void);
@@ -2097,6 +2158,32 @@ extern "C" {
     typedef void (*lm_ggml_from_float_t)(const float * LM_GGML_RESTRICT x, void  * LM_GGML_RESTRICT y, int k);
     typedef void (*lm_ggml_vec_dot_t)   (const int n, float * LM_GGML_RESTRICT s, const void * LM_GGML_RESTRICT x, const void * LM_GGML_RESTRICT y);
 
+    // tiled dot product: computes the LM_GGML_VEC_DOT_MXN_NR0 x LM_GGML_VEC_DOT_MXN_NR1 outputs
+    //   s[j*bs + i] = dot(x + i*bx, y + j*by)
+    // reusing each loaded block of x across the columns of y and vice versa
+    // for interleaved types (blck_rows > 0) the rows of the tile are the interleaved rows of x and bx is unused
+    #define LM_GGML_VEC_DOT_MXN_NR0 4
+    #define LM_GGML_VEC_DOT_MXN_NR1 2
+
+    // x86 dot kernels for ISA levels above the build baseline are compiled with per-function target
+    // attributes and installed in the type traits by lm_ggml_init when the CPU supports them
+#if defined(__x86_64__) && !defined(_MSC_VER) && \
+    ((defined(__apple_build_version__) && __clang_major__ >= 13) || \
+     (defined(__clang__) && !defined(__apple_build_version__) && __clang_major__ >= 12) || \
+     (defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11))
+    #define LM_GGML_X86_DISPATCH
+    #define LM_GGML_TARGET_AVX512  __attribute__((target("avx2,fma,f16c,avx512f,avx512bw,avx512vl,avx512vnni")))
+    #define LM_GGML_TARGET_AVXVNNI __attribute__((target("avx2,fma,f16c,avxvnni")))
+#endif
+
+    // arm64 builds without dotprod carry variants of the integer dot kernels that issue sdot through
+    // inline assembly, they are installed the same way when the CPU reports the extension
+#if defined(__aarch64__) && !defined(__ARM_FEATURE_DOTPROD) && defined(__GNUC__) && \
+    (defined(__linux__) || defined(__APPLE__))
+    #define LM_GGML_ARM_DISPATCH
+#endif
+    typedef void (*lm_ggml_vec_dot_mxn_t)(const int n, float * LM_GGML_RESTRICT s, size_t bs, const void * LM_GGML_RESTRICT x, size_t bx, const void * LM_GGML_RESTRICT y, size_t by);
+
     typedef struct {
         const char      * type_name;
         int               blck_size;
@@ -2107,6 +2194,8 @@ extern "C" {
         lm_ggml_from_float_t from_float_reference;
         lm_ggml_vec_dot_t    vec_dot;
         enum lm_ggml_type    vec_dot_type;
+        lm_ggml_vec_dot_mxn_t vec_dot_mxn; // optional, used by mul_mat for batched src1
+        int               blck_rows; // rows interleaved in each block (vec_dot then computes blck_rows outputs), 0 if not interleaved
     } lm_ggml_type_traits_t;
 
     LM_GGML_API lm_ggml_type_traits_t lm_ggml_internal_get_type_traits(enum lm_ggml_type type);
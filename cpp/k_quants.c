@@ -33,6 +33,28 @@ inline static int32_t vaddvq_s32(int32x4_t v) {
 }
 #endif
 
+#if defined(__aarch64__)
+#if defined(__ARM_FEATURE_DOTPROD)
+#define lm_ggml_vdotq_s32(a, b, c) vdotq_s32(a, b, c)
+#else
+// adds the dot products of each group of 4 int8 of b and c to the lanes of a
+inline static int32x4_t lm_ggml_vdotq_s32(int32x4_t a, int8x16_t b, int8x16_t c) {
+    const int16x8_t p0 = vmull_s8(vget_low_s8 (b), vget_low_s8 (c));
+    const int16x8_t p1 = vmull_s8(vget_high_s8(b), vget_high_s8(c));
+
+    return vaddq_s32(a, vpaddq_s32(vpaddlq_s16(p0), vpaddlq_s16(p1)));
+}
+#endif
+#endif
+
+#if defined(LM_GGML_ARM_DISPATCH)
+// sdot without dotprod enabled for the build, see ggml.c
+inline static int32x4_t lm_ggml_sdotq_s32(int32x4_t a, int8x16_t b, int8x16_t c) {
+    __asm__(".arch armv8.4-a\n\tsdot %0.4s, %1.16b, %2.16b" : "+w" (a) : "w" (b), "w" (c));
+    return a;
+}
+#endif
+
 #else
 
 #ifdef __wasm_simd128__
@@ -849,6 +871,35 @@ size_t lm_ggml_quantize_q4_K(const float * restrict src, void * restrict dst, in
     return (n/QK_K*sizeof(block_q4_K));
 }
 
+#if QK_K == 256
+void repack_q4_K_x4(const block_q4_K * restrict x, block_q4_Kx4 * restrict y, int nrows, int k) {
+    assert(k % QK_K == 0);
+    assert(nrows % 4 == 0);
+    const int nb = k / QK_K;
+
+    for (int ir = 0; ir < nrows; ir += 4) {
+        for (int i = 0; i < nb; ++i) {
+            for (int r = 0; r < 4; ++r) {
+                const block_q4_K * restrict xr = x + r*nb + i;
+
+                y[i].d[r]    = xr->d;
+                y[i].dmin[r] = xr->dmin;
+                for (int l = 0; l < K_SCALE_SIZE; ++l) {
+                    y[i].scales[l][r] = xr->scales[l];
+                }
+
+                for (int l = 0; l < QK_K/8; ++l) {
+                    memcpy(y[i].qs + 16*l + 4*r, xr->qs + 4*l, 4);
+                }
+            }
+        }
+
+        x += 4*nb;
+        y += nb;
+    }
+}
+#endif
+
 // ====================== 5-bit (de)-quantization
 
 void quantize_row_q5_K_reference(const float * restrict x, block_q5_K * restrict y, int k) {
@@ -3263,6 +3314,492 @@ void lm_ggml_vec_dot_q4_K_q8_K(const int n, float * restrict s, const void * res
     *s = sumf;
 #endif
 }
+
+#ifdef LM_GGML_VEC_DOT_Q4_K_Q8_K_MXN
+void lm_ggml_vec_dot_q4_K_q8_K_mxn(const int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by) {
+    assert(n % QK_K == 0);
+
+    const block_q4_K * restrict x[LM_GGML_VEC_DOT_MXN_NR0];
+    const block_q8_K * restrict y[LM_GGML_VEC_DOT_MXN_NR1];
+
+    for (int r = 0; r < LM_GGML_VEC_DOT_MXN_NR0; ++r) {
+        x[r] = (const block_q4_K *) ((const char *) vx + r*bx);
+    }
+    for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+        y[c] = (const block_q8_K *) ((const char *) vy + c*by);
+    }
+
+    const int nb = n / QK_K;
+
+    static const uint32_t kmask1 = 0x3f3f3f3f;
+    static const uint32_t kmask2 = 0x0f0f0f0f;
+    static const uint32_t kmask3 = 0x03030303;
+
+    uint32_t utmp[4];
+
+#ifdef __ARM_NEON
+
+    const uint8x16_t m4b = vdupq_n_u8(0xf);
+#ifdef __ARM_FEATURE_DOTPROD
+    const int32x4_t mzero = vdupq_n_s32(0);
+#endif
+
+    float sumf[LM_GGML_VEC_DOT_MXN_NR1][LM_GGML_VEC_DOT_MXN_NR0] = { { 0 } };
+
+    for (int i = 0; i < nb; ++i) {
+
+        // unpack the scales and mins of the x super-blocks once for all columns of y
+        uint32_t   scales[LM_GGML_VEC_DOT_MXN_NR0][2];
+        int16x8_t  mins  [LM_GGML_VEC_DOT_MXN_NR0];
+
+        for (int r = 0; r < LM_GGML_VEC_DOT_MXN_NR0; ++r) {
+            memcpy(utmp, x[r][i].scales, 12);
+
+            uint32x2_t mins8 = { 0 };
+            mins8 = vset_lane_u32(utmp[1] & kmask1, mins8, 0);
+            mins8 = vset_lane_u32(((utmp[2] >> 4) & kmask2) | (((utmp[1] >> 6) & kmask3) << 4), mins8, 1);
+
+            scales[r][1] = (utmp[2] & kmask2) | (((utmp[0] >> 6) & kmask3) << 4);
+            scales[r][0] = utmp[0] & kmask1;
+
+            mins[r] = vreinterpretq_s16_u16(vmovl_u8(vreinterpret_u8_u32(mins8)));
+        }
+
+        for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+            const int16x8_t q8sums = vpaddq_s16(vld1q_s16(y[c][i].bsums), vld1q_s16(y[c][i].bsums + 8));
+
+            for (int r = 0; r < LM_GGML_VEC_DOT_MXN_NR0; ++r) {
+                const float dmin = y[c][i].d * lm_ggml_fp16_to_fp32(x[r][i].dmin);
+
+                const int32x4_t prod = vaddq_s32(vmull_s16(vget_low_s16 (q8sums), vget_low_s16 (mins[r])),
+                                                 vmull_s16(vget_high_s16(q8sums), vget_high_s16(mins[r])));
+                sumf[c][r] -= dmin * vaddvq_s32(prod);
+            }
+        }
+
+#ifdef __ARM_FEATURE_DOTPROD
+        // accumulate the scaled products in vectors and reduce them once per super-block
+        int32x4_t sumv[LM_GGML_VEC_DOT_MXN_NR1][LM_GGML_VEC_DOT_MXN_NR0];
+
+        for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+            for (int r = 0; r < LM_GGML_VEC_DOT_MXN_NR0; ++r) {
+                sumv[c][r] = mzero;
+            }
+        }
+#else
+        int32_t sumi1[LM_GGML_VEC_DOT_MXN_NR1][LM_GGML_VEC_DOT_MXN_NR0] = { { 0 } };
+        int32_t sumi2[LM_GGML_VEC_DOT_MXN_NR1][LM_GGML_VEC_DOT_MXN_NR0] = { { 0 } };
+#endif
+
+        for (int j = 0; j < QK_K/64; ++j) {
+
+            uint8x16x2_t q4bits[LM_GGML_VEC_DOT_MXN_NR0];
+
+            for (int r = 0; r < LM_GGML_VEC_DOT_MXN_NR0; ++r) {
+                q4bits[r] = vld1q_u8_x2(x[r][i].qs + 32*j);
+            }
+
+            for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+                const int8x16x2_t q8l = vld1q_s8_x2(y[c][i].qs + 64*j);
+                const int8x16x2_t q8h = vld1q_s8_x2(y[c][i].qs + 64*j + 32);
+
+                for (int r = 0; r < LM_GGML_VEC_DOT_MXN_NR0; ++r) {
+                    const uint8_t * sc = (const uint8_t *) scales[r];
+
+                    int8x16x2_t q4bytes;
+
+#ifdef __ARM_FEATURE_DOTPROD
+                    q4bytes.val[0] = vreinterpretq_s8_u8(vandq_u8  (q4bits[r].val[0], m4b));
+                    q4bytes.val[1] = vreinterpretq_s8_u8(vandq_u8  (q4bits[r].val[1], m4b));
+
+                    const int32x4_t p1 = vdotq_s32(vdotq_s32(mzero, q4bytes.val[0], q8l.val[0]), q4bytes.val[1], q8l.val[1]);
+                    sumv[c][r] = vmlaq_n_s32(sumv[c][r], p1, sc[2*j+0]);
+
+                    q4bytes.val[0] = vreinterpretq_s8_u8(vshrq_n_u8(q4bits[r].val[0], 4));
+                    q4bytes.val[1] = vreinterpretq_s8_u8(vshrq_n_u8(q4bits[r].val[1], 4));
+
+                    const int32x4_t p2 = vdotq_s32(vdotq_s32(mzero, q4bytes.val[0], q8h.val[0]), q4bytes.val[1], q8h.val[1]);
+                    sumv[c][r] = vmlaq_n_s32(sumv[c][r], p2, sc[2*j+1]);
+#else
+                    q4bytes.val[0] = vreinterpretq_s8_u8(vandq_u8  (q4bits[r].val[0], m4b));
+                    q4bytes.val[1] = vreinterpretq_s8_u8(vandq_u8  (q4bits[r].val[1], m4b));
+                    const int16x8_t p0 = vaddq_s16(vmull_s8(vget_low_s8 (q4bytes.val[0]), vget_low_s8 (q8l.val[0])),
+                                                   vmull_s8(vget_high_s8(q4bytes.val[0]), vget_high_s8(q8l.val[0])));
+                    const int16x8_t p1 = vaddq_s16(vmull_s8(vget_low_s8 (q4bytes.val[1]), vget_low_s8 (q8l.val[1])),
+                                                   vmull_s8(vget_high_s8(q4bytes.val[1]), vget_high_s8(q8l.val[1])));
+                    sumi1[c][r] += vaddvq_s16(vaddq_s16(p0, p1)) * sc[2*j+0];
+
+                    q4bytes.val[0] = vreinterpretq_s8_u8(vshrq_n_u8(q4bits[r].val[0], 4));
+                    q4bytes.val[1] = vreinterpretq_s8_u8(vshrq_n_u8(q4bits[r].val[1], 4));
+                    const int16x8_t p2 = vaddq_s16(vmull_s8(vget_low_s8 (q4bytes.val[0]), vget_low_s8 (q8h.val[0])),
+                                                   vmull_s8(vget_high_s8(q4bytes.val[0]), vget_high_s8(q8h.val[0])));
+                    const int16x8_t p3 = vaddq_s16(vmull_s8(vget_low_s8 (q4bytes.val[1]), vget_low_s8 (q8h.val[1])),
+                                                   vmull_s8(vget_high_s8(q4bytes.val[1]), vget_high_s8(q8h.val[1])));
+                    sumi2[c][r] += vaddvq_s16(vaddq_s16(p2, p3)) * sc[2*j+1];
+#endif
+                }
+            }
+        }
+
+        for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+            for (int r = 0; r < LM_GGML_VEC_DOT_MXN_NR0; ++r) {
+                const float d = y[c][i].d * lm_ggml_fp16_to_fp32(x[r][i].d);
+#ifdef __ARM_FEATURE_DOTPROD
+                sumf[c][r] += d * vaddvq_s32(sumv[c][r]);
+#else
+                sumf[c][r] += d * (sumi1[c][r] + sumi2[c][r]);
+#endif
+            }
+        }
+    }
+
+    for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+        for (int r = 0; r < LM_GGML_VEC_DOT_MXN_NR0; ++r) {
+            s[c*bs + r] = sumf[c][r];
+        }
+    }
+
+#elif defined __AVX2__
+
+    const __m256i m4 = _mm256_set1_epi8(0xF);
+
+    __m256 acc  [LM_GGML_VEC_DOT_MXN_NR1][LM_GGML_VEC_DOT_MXN_NR0];
+    __m128 acc_m[LM_GGML_VEC_DOT_MXN_NR1][LM_GGML_VEC_DOT_MXN_NR0];
+
+    for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+        for (int r = 0; r < LM_GGML_VEC_DOT_MXN_NR0; ++r) {
+            acc  [c][r] = _mm256_setzero_ps();
+            acc_m[c][r] = _mm_setzero_ps();
+        }
+    }
+
+    for (int i = 0; i < nb; ++i) {
+
+        // unpack the scales and mins of the x super-blocks once for all columns of y
+        __m256i scales[LM_GGML_VEC_DOT_MXN_NR0];
+        __m128i mins  [LM_GGML_VEC_DOT_MXN_NR0];
+
+        for (int r = 0; r < LM_GGML_VEC_DOT_MXN_NR0; ++r) {
+            memcpy(utmp, x[r][i].scales, 12);
+            utmp[3] = ((utmp[2] >> 4) & kmask2) | (((utmp[1] >> 6) & kmask3) << 4);
+            const uint32_t uaux = utmp[1] & kmask1;
+            utmp[1] = (utmp[2] & kmask2) | (((utmp[0] >> 6) & kmask3) << 4);
+            utmp[2] = uaux;
+            utmp[0] &= kmask1;
+
+            const __m256i mins_and_scales = _mm256_cvtepu8_epi16(_mm_set_epi32(utmp[3], utmp[2], utmp[1], utmp[0]));
+
+            const __m128i sc128 = _mm256_extracti128_si256(mins_and_scales, 0);
+            scales[r] = MM256_SET_M128I(sc128, sc128);
+            mins[r]   = _mm256_extracti128_si256(mins_and_scales, 1);
+        }
+
+        for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+            const __m256i q8sums = _mm256_loadu_si256((const __m256i*)y[c][i].bsums);
+            const __m128i q8s = _mm_hadd_epi16(_mm256_extracti128_si256(q8sums, 0), _mm256_extracti128_si256(q8sums, 1));
+
+            for (int r = 0; r < LM_GGML_VEC_DOT_MXN_NR0; ++r) {
+                const float dmin = -y[c][i].d * lm_ggml_fp16_to_fp32(x[r][i].dmin);
+
+                const __m128i prod = _mm_madd_epi16(mins[r], q8s);
+                acc_m[c][r] = _mm_fmadd_ps(_mm_set1_ps(dmin), _mm_cvtepi32_ps(prod), acc_m[c][r]);
+            }
+        }
+
+        __m256i sumi[LM_GGML_VEC_DOT_MXN_NR1][LM_GGML_VEC_DOT_MXN_NR0];
+
+        for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+            for (int r = 0; r < LM_GGML_VEC_DOT_MXN_NR0; ++r) {
+                sumi[c][r] = _mm256_setzero_si256();
+            }
+        }
+
+        for (int j = 0; j < QK_K/64; ++j) {
+
+            __m256i q8l[LM_GGML_VEC_DOT_MXN_NR1];
+            __m256i q8h[LM_GGML_VEC_DOT_MXN_NR1];
+
+            for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+                q8l[c] = _mm256_loadu_si256((const __m256i*)(y[c][i].qs + 64*j));
+                q8h[c] = _mm256_loadu_si256((const __m256i*)(y[c][i].qs + 64*j + 32));
+            }
+
+            for (int r = 0; r < LM_GGML_VEC_DOT_MXN_NR0; ++r) {
+                const __m256i scale_l = _mm256_shuffle_epi8(scales[r], get_scale_shuffle_k4(2*j+0));
+                const __m256i scale_h = _mm256_shuffle_epi8(scales[r], get_scale_shuffle_k4(2*j+1));
+
+                const __m256i q4bits = _mm256_loadu_si256((const __m256i*)(x[r][i].qs + 32*j));
+                const __m256i q4l = _mm256_and_si256(q4bits, m4);
+                const __m256i q4h = _mm256_and_si256(_mm256_srli_epi16(q4bits, 4), m4);
+
+                for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+                    const __m256i p16l = _mm256_madd_epi16(scale_l, _mm256_maddubs_epi16(q4l, q8l[c]));
+                    const __m256i p16h = _mm256_madd_epi16(scale_h, _mm256_maddubs_epi16(q4h, q8h[c]));
+
+                    sumi[c][r] = _mm256_add_epi32(sumi[c][r], _mm256_add_epi32(p16l, p16h));
+                }
+            }
+        }
+
+        for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+            for (int r = 0; r < LM_GGML_VEC_DOT_MXN_NR0; ++r) {
+                const float d = y[c][i].d * lm_ggml_fp16_to_fp32(x[r][i].d);
+                acc[c][r] = _mm256_fmadd_ps(_mm256_set1_ps(d), _mm256_cvtepi32_ps(sumi[c][r]), acc[c][r]);
+            }
+        }
+    }
+
+    for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+        for (int r = 0; r < LM_GGML_VEC_DOT_MXN_NR0; ++r) {
+            __m128 m = acc_m[c][r];
+            m = _mm_add_ps(m, _mm_movehl_ps(m, m));
+            m = _mm_add_ss(m, _mm_movehdup_ps(m));
+
+            s[c*bs + r] = hsum_float_8(acc[c][r]) + _mm_cvtss_f32(m);
+        }
+    }
+
+#endif
+}
+#endif
+
+// dot products of the 4 interleaved rows of x with y: s[r] = dot(x_r, y)
+void lm_ggml_vec_dot_q4_K_x4_q8_K(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    assert(n % QK_K == 0);
+
+    const block_q4_Kx4 * restrict x = vx;
+    const block_q8_K   * restrict y = vy;
+
+    const int nb = n / QK_K;
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+
+    const uint8x16_t m4b = vdupq_n_u8(0xf);
+    const uint8x16_t m6b = vdupq_n_u8(0x3f);
+
+    float32x4_t sumv = vdupq_n_f32(0.0f);
+
+    for (int i = 0; i < nb; ++i) {
+
+        // unpack the 6-bit scales and mins of the 4 rows at once, byte 4*j + r belongs to sub-block j of row r
+        const uint8x16_t s0 = vld1q_u8(x[i].scales[0]);
+        const uint8x16_t s1 = vld1q_u8(x[i].scales[4]);
+        const uint8x16_t s2 = vld1q_u8(x[i].scales[8]);
+
+        const uint8x16_t sc_lo = vandq_u8(s0, m6b);
+        const uint8x16_t sc_hi = vorrq_u8(vandq_u8(s2, m4b), vshlq_n_u8(vshrq_n_u8(s0, 6), 4));
+        const uint8x16_t mn_lo = vandq_u8(s1, m6b);
+        const uint8x16_t mn_hi = vorrq_u8(vshrq_n_u8(s2, 4), vshlq_n_u8(vshrq_n_u8(s1, 6), 4));
+
+        const uint16x8_t sc16[QK_K/64] = {
+            vmovl_u8(vget_low_u8(sc_lo)), vmovl_u8(vget_high_u8(sc_lo)),
+            vmovl_u8(vget_low_u8(sc_hi)), vmovl_u8(vget_high_u8(sc_hi)),
+        };
+
+        const int16x8_t q8sums = vpaddq_s16(vld1q_s16(y[i].bsums), vld1q_s16(y[i].bsums + 8));
+
+        const int16x8_t mn16_0 = vreinterpretq_s16_u16(vmovl_u8(vget_low_u8 (mn_lo)));
+        const int16x8_t mn16_1 = vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(mn_lo)));
+        const int16x8_t mn16_2 = vreinterpretq_s16_u16(vmovl_u8(vget_low_u8 (mn_hi)));
+        const int16x8_t mn16_3 = vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(mn_hi)));
+
+        int32x4_t summ = vdupq_n_s32(0);
+        summ = vmlal_laneq_s16(summ, vget_low_s16 (mn16_0), q8sums, 0);
+        summ = vmlal_laneq_s16(summ, vget_high_s16(mn16_0), q8sums, 1);
+        summ = vmlal_laneq_s16(summ, vget_low_s16 (mn16_1), q8sums, 2);
+        summ = vmlal_laneq_s16(summ, vget_high_s16(mn16_1), q8sums, 3);
+        summ = vmlal_laneq_s16(summ, vget_low_s16 (mn16_2), q8sums, 4);
+        summ = vmlal_laneq_s16(summ, vget_high_s16(mn16_2), q8sums, 5);
+        summ = vmlal_laneq_s16(summ, vget_low_s16 (mn16_3), q8sums, 6);
+        summ = vmlal_laneq_s16(summ, vget_high_s16(mn16_3), q8sums, 7);
+
+        const uint8_t * restrict q4 = x[i].qs;
+        const int8_t  * restrict q8 = y[i].qs;
+
+        int32x4_t sumi = vdupq_n_s32(0);
+
+        for (int j = 0; j < QK_K/64; ++j) {
+            const int32x4_t yl0 = vreinterpretq_s32_s8(vld1q_s8(q8 +  0));
+            const int32x4_t yl1 = vreinterpretq_s32_s8(vld1q_s8(q8 + 16));
+            const int32x4_t yh0 = vreinterpretq_s32_s8(vld1q_s8(q8 + 32));
+            const int32x4_t yh1 = vreinterpretq_s32_s8(vld1q_s8(q8 + 48));
+
+            int32x4_t suml = vdupq_n_s32(0);
+            int32x4_t sumh = vdupq_n_s32(0);
+
+            // each 16 bytes of x hold the same group of 4 quants of the 4 rows, multiply them with the broadcast group of y
+#define LM_GGML_Q4_K_X4_GROUP(k, yl, yh, l) \
+            { \
+                const uint8x16_t q = vld1q_u8(q4 + 16*(k)); \
+                suml = lm_ggml_vdotq_s32(suml, vreinterpretq_s8_u8(vandq_u8  (q, m4b)), vreinterpretq_s8_s32(vdupq_laneq_s32(yl, l))); \
+                sumh = lm_ggml_vdotq_s32(sumh, vreinterpretq_s8_u8(vshrq_n_u8(q, 4)),   vreinterpretq_s8_s32(vdupq_laneq_s32(yh, l))); \
+            }
+            LM_GGML_Q4_K_X4_GROUP(0, yl0, yh0, 0)
+            LM_GGML_Q4_K_X4_GROUP(1, yl0, yh0, 1)
+            LM_GGML_Q4_K_X4_GROUP(2, yl0, yh0, 2)
+            LM_GGML_Q4_K_X4_GROUP(3, yl0, yh0, 3)
+            LM_GGML_Q4_K_X4_GROUP(4, yl1, yh1, 0)
+            LM_GGML_Q4_K_X4_GROUP(5, yl1, yh1, 1)
+            LM_GGML_Q4_K_X4_GROUP(6, yl1, yh1, 2)
+            LM_GGML_Q4_K_X4_GROUP(7, yl1, yh1, 3)
+#undef LM_GGML_Q4_K_X4_GROUP
+
+            sumi = vmlaq_s32(sumi, suml, vreinterpretq_s32_u32(vmovl_u16(vget_low_u16 (sc16[j]))));
+            sumi = vmlaq_s32(sumi, sumh, vreinterpretq_s32_u32(vmovl_u16(vget_high_u16(sc16[j]))));
+
+            q4 += 128; q8 += 64;
+        }
+
+        const float d[4] = {
+            lm_ggml_fp16_to_fp32(x[i].d[0]), lm_ggml_fp16_to_fp32(x[i].d[1]),
+            lm_ggml_fp16_to_fp32(x[i].d[2]), lm_ggml_fp16_to_fp32(x[i].d[3]),
+        };
+        const float dmin[4] = {
+            lm_ggml_fp16_to_fp32(x[i].dmin[0]), lm_ggml_fp16_to_fp32(x[i].dmin[1]),
+            lm_ggml_fp16_to_fp32(x[i].dmin[2]), lm_ggml_fp16_to_fp32(x[i].dmin[3]),
+        };
+
+        sumv = vmlaq_f32(sumv, vcvtq_f32_s32(sumi), vmulq_n_f32(vld1q_f32(d),    y[i].d));
+        sumv = vmlsq_f32(sumv, vcvtq_f32_s32(summ), vmulq_n_f32(vld1q_f32(dmin), y[i].d));
+    }
+
+    vst1q_f32(s, sumv);
+
+#elif defined __AVX2__
+
+    const __m128i m2 = _mm_set1_epi8(0x03);
+    const __m128i m6 = _mm_set1_epi8(0x3F);
+    const __m256i m4 = _mm256_set1_epi8(0xF);
+
+    // broadcast 2 groups of 4 quants of y (or 2 sub-block sums) to the lanes of the 4 rows
+    const __m256i perm0 = _mm256_set_epi32(1, 1, 1, 1, 0, 0, 0, 0);
+    const __m256i perm1 = _mm256_set_epi32(3, 3, 3, 3, 2, 2, 2, 2);
+    const __m256i perm2 = _mm256_set_epi32(5, 5, 5, 5, 4, 4, 4, 4);
+    const __m256i perm3 = _mm256_set_epi32(7, 7, 7, 7, 6, 6, 6, 6);
+
+    // picks the scales of sub-block j of the 4 rows into both 16-bit halves of lanes r and r + 4
+    static const uint8_t k_shuffle[4][32] = {
+        { 0,128, 0,128, 1,128, 1,128, 2,128, 2,128, 3,128, 3,128,  0,128, 0,128, 1,128, 1,128, 2,128, 2,128, 3,128, 3,128},
+        { 4,128, 4,128, 5,128, 5,128, 6,128, 6,128, 7,128, 7,128,  4,128, 4,128, 5,128, 5,128, 6,128, 6,128, 7,128, 7,128},
+        { 8,128, 8,128, 9,128, 9,128,10,128,10,128,11,128,11,128,  8,128, 8,128, 9,128, 9,128,10,128,10,128,11,128,11,128},
+        {12,128,12,128,13,128,13,128,14,128,14,128,15,128,15,128, 12,128,12,128,13,128,13,128,14,128,14,128,15,128,15,128},
+    };
+
+    __m256 acc = _mm256_setzero_ps();
+
+    for (int i = 0; i < nb; ++i) {
+
+        // unpack the 6-bit scales and mins of the 4 rows at once, byte 4*j + r belongs to sub-block j of row r
+        const __m128i s0 = _mm_loadu_si128((const __m128i*)x[i].scales[0]);
+        const __m128i s1 = _mm_loadu_si128((const __m128i*)x[i].scales[4]);
+        const __m128i s2 = _mm_loadu_si128((const __m128i*)x[i].scales[8]);
+
+        const __m128i sc_lo = _mm_and_si128(s0, m6);
+        const __m128i sc_hi = _mm_or_si128(_mm_and_si128(s2, _mm256_castsi256_si128(m4)),
+                                           _mm_slli_epi16(_mm_and_si128(_mm_srli_epi16(s0, 6), m2), 4));
+        const __m128i mn_lo = _mm_and_si128(s1, m6);
+        const __m128i mn_hi = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(s2, 4), _mm256_castsi256_si128(m4)),
+                                           _mm_slli_epi16(_mm_and_si128(_mm_srli_epi16(s1, 6), m2), 4));
+
+        const __m256i scales[2] = { _mm256_broadcastsi128_si256(sc_lo), _mm256_broadcastsi128_si256(sc_hi) };
+
+        // sums of the mins with the sums of y, the upper 16 bits of the zero-extended mins cancel the sign extension of the sums
+        const __m128i q8s = _mm_hadd_epi16(_mm_loadu_si128((const __m128i*)y[i].bsums), _mm_loadu_si128((const __m128i*)y[i].bsums + 1));
+        const __m256i q8s32 = _mm256_cvtepi16_epi32(q8s);
+
+        __m256i summ = _mm256_madd_epi16(_mm256_cvtepu8_epi32(mn_lo), _mm256_permutevar8x32_epi32(q8s32, perm0));
+        summ = _mm256_add_epi32(summ, _mm256_madd_epi16(_mm256_cvtepu8_epi32(_mm_srli_si128(mn_lo, 8)), _mm256_permutevar8x32_epi32(q8s32, perm1)));
+        summ = _mm256_add_epi32(summ, _mm256_madd_epi16(_mm256_cvtepu8_epi32(mn_hi),                    _mm256_permutevar8x32_epi32(q8s32, perm2)));
+        summ = _mm256_add_epi32(summ, _mm256_madd_epi16(_mm256_cvtepu8_epi32(_mm_srli_si128(mn_hi, 8)), _mm256_permutevar8x32_epi32(q8s32, perm3)));
+
+        const uint8_t * restrict q4 = x[i].qs;
+        const int8_t  * restrict q8 = y[i].qs;
+
+        __m256i sumi = _mm256_setzero_si256();
+
+        for (int j = 0; j < QK_K/64; ++j) {
+            const __m256i yl = _mm256_loadu_si256((const __m256i*)(q8 +  0));
+            const __m256i yh = _mm256_loadu_si256((const __m256i*)(q8 + 32));
+
+            const __m256i q0 = _mm256_loadu_si256((const __m256i*)(q4 +  0));
+            const __m256i q1 = _mm256_loadu_si256((const __m256i*)(q4 + 32));
+            const __m256i q2 = _mm256_loadu_si256((const __m256i*)(q4 + 64));
+            const __m256i q3 = _mm256_loadu_si256((const __m256i*)(q4 + 96));
+
+            // at most 4*2*15*128 in each 16-bit lane, no saturation
+            __m256i p16l = _mm256_maddubs_epi16(_mm256_and_si256(q0, m4), _mm256_permutevar8x32_epi32(yl, perm0));
+            p16l = _mm256_add_epi16(p16l, _mm256_maddubs_epi16(_mm256_and_si256(q1, m4), _mm256_permutevar8x32_epi32(yl, perm1)));
+            p16l = _mm256_add_epi16(p16l, _mm256_maddubs_epi16(_mm256_and_si256(q2, m4), _mm256_permutevar8x32_epi32(yl, perm2)));
+            p16l = _mm256_add_epi16(p16l, _mm256_maddubs_epi16(_mm256_and_si256(q3, m4), _mm256_permutevar8x32_epi32(yl, perm3)));
+
+            __m256i p16h = _mm256_maddubs_epi16(_mm256_and_si256(_mm256_srli_epi16(q0, 4), m4), _mm256_permutevar8x32_epi32(yh, perm0));
+            p16h = _mm256_add_epi16(p16h, _mm256_maddubs_epi16(_mm256_and_si256(_mm256_srli_epi16(q1, 4), m4), _mm256_permutevar8x32_epi32(yh, perm1)));
+            p16h = _mm256_add_epi16(p16h, _mm256_maddubs_epi16(_mm256_and_si256(_mm256_srli_epi16(q2, 4), m4), _mm256_permutevar8x32_epi32(yh, perm2)));
+            p16h = _mm256_add_epi16(p16h, _mm256_maddubs_epi16(_mm256_and_si256(_mm256_srli_epi16(q3, 4), m4), _mm256_permutevar8x32_epi32(yh, perm3)));
+
+            const __m256i scale_l = _mm256_shuffle_epi8(scales[j/2], _mm256_loadu_si256((const __m256i*)k_shuffle[(2*j+0)%4]));
+            const __m256i scale_h = _mm256_shuffle_epi8(scales[j/2], _mm256_loadu_si256((const __m256i*)k_shuffle[(2*j+1)%4]));
+
+            sumi = _mm256_add_epi32(sumi, _mm256_madd_epi16(p16l, scale_l));
+            sumi = _mm256_add_epi32(sumi, _mm256_madd_epi16(p16h, scale_h));
+
+            q4 += 128; q8 += 64;
+        }
+
+        const __m128 d = _mm_mul_ps(_mm_set_ps(
+                    lm_ggml_fp16_to_fp32(x[i].d[3]), lm_ggml_fp16_to_fp32(x[i].d[2]),
+                    lm_ggml_fp16_to_fp32(x[i].d[1]), lm_ggml_fp16_to_fp32(x[i].d[0])), _mm_set1_ps(y[i].d));
+        const __m128 dmin = _mm_mul_ps(_mm_set_ps(
+                    lm_ggml_fp16_to_fp32(x[i].dmin[3]), lm_ggml_fp16_to_fp32(x[i].dmin[2]),
+                    lm_ggml_fp16_to_fp32(x[i].dmin[1]), lm_ggml_fp16_to_fp32(x[i].dmin[0])), _mm_set1_ps(y[i].d));
+
+        acc = _mm256_fmadd_ps (_mm256_insertf128_ps(_mm256_castps128_ps256(d),    d,    1), _mm256_cvtepi32_ps(sumi), acc);
+        acc = _mm256_fnmadd_ps(_mm256_insertf128_ps(_mm256_castps128_ps256(dmin), dmin, 1), _mm256_cvtepi32_ps(summ), acc);
+    }
+
+    _mm_storeu_ps(s, _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1)));
+
+#else
+
+    float sumf[4] = { 0 };
+
+    for (int i = 0; i < nb; ++i) {
+        for (int r = 0; r < 4; ++r) {
+            uint8_t scales[K_SCALE_SIZE];
+            for (int l = 0; l < K_SCALE_SIZE; ++l) {
+                scales[l] = x[i].scales[l][r];
+            }
+
+            const uint8_t * restrict q4 = x[i].qs + 4*r;
+            const int8_t  * restrict q8 = y[i].qs;
+
+            int32_t sumi = 0;
+            int32_t summ = 0;
+            for (int j = 0; j < QK_K/64; ++j) {
+                uint8_t sc1, m1, sc2, m2;
+                get_scale_min_k4(2*j+0, scales, &sc1, &m1);
+                get_scale_min_k4(2*j+1, scales, &sc2, &m2);
+
+                int32_t suml = 0, sumh = 0;
+                for (int l = 0; l < 32; ++l) {
+                    const uint8_t q = q4[16*(l/4) + l%4];
+                    suml += (q & 0xF) * q8[l];
+                    sumh += (q >>  4) * q8[l + 32];
+                }
+                sumi += suml * sc1 + sumh * sc2;
+                summ += m1 * (y[i].bsums[4*j+0] + y[i].bsums[4*j+1]) + m2 * (y[i].bsums[4*j+2] + y[i].bsums[4*j+3]);
+                q4 += 128; q8 += 64;
+            }
+
+            sumf[r] += y[i].d * (lm_ggml_fp16_to_fp32(x[i].d[r]) * sumi - lm_ggml_fp16_to_fp32(x[i].dmin[r]) * summ);
+        }
+    }
+
+    for (int r = 0; r < 4; ++r) {
+        s[r] = sumf[r];
+    }
+#endif
+}
 #else
 void lm_ggml_vec_dot_q4_K_q8_K(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
     assert(n % QK_K == 0);
@@ -5050,3 +5587,1327 @@ void lm_ggml_vec_dot_q6_K_q8_K(const int n, float * restrict s, const void * res
 }
 
 #endif
+
+//
+// AVX-512 and AVX-VNNI dot products, compiled regardless of the baseline ISA and selected at runtime
+//
+// Each super-block is processed in contiguous chunks of q8 quants (64 for AVX-512, 32 for AVX-VNNI), so the
+// quants of x are brought into the order of y and the per-block scales are broadcast to the i16 products.
+// Constant offsets (q3_K: -4, q6_K: -32) are applied once per super-block through the q8 block sums.
+//
+
+#if QK_K == 256 && defined(LM_GGML_X86_DISPATCH)
+
+// i16 lane -> scale index for each 64-quant chunk, 16 quants per scale
+static const uint16_t k_perm_scales_16[4][32] = {
+    { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,  2, 2, 2, 2, 2, 2, 2, 2,  3, 3, 3, 3, 3, 3, 3, 3},
+    { 4, 4, 4, 4, 4, 4, 4, 4, 5, 5, 5, 5, 5, 5, 5, 5,  6, 6, 6, 6, 6, 6, 6, 6,  7, 7, 7, 7, 7, 7, 7, 7},
+    { 8, 8, 8, 8, 8, 8, 8, 8, 9, 9, 9, 9, 9, 9, 9, 9, 10,10,10,10,10,10,10,10, 11,11,11,11,11,11,11,11},
+    {12,12,12,12,12,12,12,12,13,13,13,13,13,13,13,13, 14,14,14,14,14,14,14,14, 15,15,15,15,15,15,15,15},
+};
+
+// i16 lane -> scale index for each 64-quant chunk, 32 quants per scale
+static const uint16_t k_perm_scales_32[4][32] = {
+    { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  1, 1, 1, 1, 1, 1, 1, 1,  1, 1, 1, 1, 1, 1, 1, 1},
+    { 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,  3, 3, 3, 3, 3, 3, 3, 3,  3, 3, 3, 3, 3, 3, 3, 3},
+    { 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,  5, 5, 5, 5, 5, 5, 5, 5,  5, 5, 5, 5, 5, 5, 5, 5},
+    { 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,  7, 7, 7, 7, 7, 7, 7, 7,  7, 7, 7, 7, 7, 7, 7, 7},
+};
+
+// byte shuffles picking the i16 scale of each 32-quant chunk out of 8 scales duplicated in both 128-bit lanes
+static const uint8_t k_shuffle_scales_16[4][32] = {
+    { 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1,  2, 3, 2, 3, 2, 3, 2, 3, 2, 3, 2, 3, 2, 3, 2, 3},
+    { 4, 5, 4, 5, 4, 5, 4, 5, 4, 5, 4, 5, 4, 5, 4, 5,  6, 7, 6, 7, 6, 7, 6, 7, 6, 7, 6, 7, 6, 7, 6, 7},
+    { 8, 9, 8, 9, 8, 9, 8, 9, 8, 9, 8, 9, 8, 9, 8, 9, 10,11,10,11,10,11,10,11,10,11,10,11,10,11,10,11},
+    {12,13,12,13,12,13,12,13,12,13,12,13,12,13,12,13, 14,15,14,15,14,15,14,15,14,15,14,15,14,15,14,15},
+};
+
+static const uint8_t k_shuffle_scales_32[8][32] = {
+    { 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1,  0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1},
+    { 2, 3, 2, 3, 2, 3, 2, 3, 2, 3, 2, 3, 2, 3, 2, 3,  2, 3, 2, 3, 2, 3, 2, 3, 2, 3, 2, 3, 2, 3, 2, 3},
+    { 4, 5, 4, 5, 4, 5, 4, 5, 4, 5, 4, 5, 4, 5, 4, 5,  4, 5, 4, 5, 4, 5, 4, 5, 4, 5, 4, 5, 4, 5, 4, 5},
+    { 6, 7, 6, 7, 6, 7, 6, 7, 6, 7, 6, 7, 6, 7, 6, 7,  6, 7, 6, 7, 6, 7, 6, 7, 6, 7, 6, 7, 6, 7, 6, 7},
+    { 8, 9, 8, 9, 8, 9, 8, 9, 8, 9, 8, 9, 8, 9, 8, 9,  8, 9, 8, 9, 8, 9, 8, 9, 8, 9, 8, 9, 8, 9, 8, 9},
+    {10,11,10,11,10,11,10,11,10,11,10,11,10,11,10,11, 10,11,10,11,10,11,10,11,10,11,10,11,10,11,10,11},
+    {12,13,12,13,12,13,12,13,12,13,12,13,12,13,12,13, 12,13,12,13,12,13,12,13,12,13,12,13,12,13,12,13},
+    {14,15,14,15,14,15,14,15,14,15,14,15,14,15,14,15, 14,15,14,15,14,15,14,15,14,15,14,15,14,15,14,15},
+};
+
+// unpacks the 6-bit scales and mins of q4_K and q5_K: utmp[0..1] = scales, utmp[2..3] = mins
+static inline void unpack_scales_mins_k4(const uint8_t * restrict scales, uint32_t * restrict utmp) {
+    const uint32_t kmask1 = 0x3f3f3f3f;
+    const uint32_t kmask2 = 0x0f0f0f0f;
+    const uint32_t kmask3 = 0x03030303;
+
+    memcpy(utmp, scales, 12);
+    utmp[3] = ((utmp[2] >> 4) & kmask2) | (((utmp[1] >> 6) & kmask3) << 4);
+    const uint32_t uaux = utmp[1] & kmask1;
+    utmp[1] = (utmp[2] & kmask2) | (((utmp[0] >> 6) & kmask3) << 4);
+    utmp[2] = uaux;
+    utmp[0] &= kmask1;
+}
+
+// unpacks the 6-bit scales of q3_K, without the -32 offset
+static inline void unpack_scales_q3_K(const uint8_t * restrict scales, uint32_t * restrict utmp) {
+    const uint32_t kmask1 = 0x03030303;
+    const uint32_t kmask2 = 0x0f0f0f0f;
+
+    uint32_t aux[3];
+    memcpy(aux, scales, 12);
+    utmp[0] = (aux[0] & kmask2) | (((aux[2] >> 0) & kmask1) << 4);
+    utmp[1] = (aux[1] & kmask2) | (((aux[2] >> 2) & kmask1) << 4);
+    utmp[2] = ((aux[0] >> 4) & kmask2) | (((aux[2] >> 4) & kmask1) << 4);
+    utmp[3] = ((aux[1] >> 4) & kmask2) | (((aux[2] >> 6) & kmask1) << 4);
+}
+
+//
+// AVX-512
+//
+
+LM_GGML_TARGET_AVX512 void lm_ggml_vec_dot_q2_K_q8_K_avx512(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    assert(n % QK_K == 0);
+
+    const block_q2_K * restrict x = vx;
+    const block_q8_K * restrict y = vy;
+
+    const int nb = n / QK_K;
+
+    const __m512i m3 = _mm512_set1_epi8(3);
+    const __m128i m4 = _mm_set1_epi8(0xF);
+
+    __m512 acc = _mm512_setzero_ps();
+
+    for (int i = 0; i < nb; ++i) {
+
+        const float d = y[i].d * _cvtsh_ss(x[i].d);
+        const float dmin = -y[i].d * _cvtsh_ss(x[i].dmin);
+
+        const uint8_t * restrict q2 = x[i].qs;
+        const int8_t  * restrict q8 = y[i].qs;
+
+        const __m128i mins_and_scales = _mm_loadu_si128((const __m128i*)x[i].scales);
+        const __m256i scales = _mm256_cvtepu8_epi16(_mm_and_si128(mins_and_scales, m4));
+        const __m256i mins = _mm256_cvtepu8_epi16(_mm_and_si128(_mm_srli_epi16(mins_and_scales, 4), m4));
+        const __m256i prod = _mm256_madd_epi16(mins, _mm256_loadu_si256((const __m256i*)y[i].bsums));
+
+        acc = _mm512_fmadd_ps(_mm512_set1_ps(dmin), _mm512_cvtepi32_ps(_mm512_zextsi256_si512(prod)), acc);
+
+        const __m512i sc = _mm512_castsi256_si512(scales);
+
+        __m512i sumi = _mm512_setzero_si512();
+
+        for (int j = 0; j < QK_K/128; ++j) {
+            // 2-bit fields 0,1 and 2,3 of each byte next to each other
+            const __m256i q2bits = _mm256_loadu_si256((const __m256i*)(q2 + 32*j));
+            const __m512i q2x = _mm512_inserti64x4(_mm512_castsi256_si512(q2bits), _mm256_srli_epi16(q2bits, 2), 1);
+
+            for (int k = 0; k < 2; ++k) {
+                const int c = 2*j + k;
+                const __m512i q2c = _mm512_and_si512(_mm512_srli_epi16(q2x, 4*k), m3);
+                const __m512i q8c = _mm512_loadu_si512((const __m512i*)(q8 + 64*c));
+                const __m512i p16 = _mm512_maddubs_epi16(q2c, q8c);
+                const __m512i scale = _mm512_permutexvar_epi16(_mm512_loadu_si512((const __m512i*)k_perm_scales_16[c]), sc);
+                sumi = _mm512_dpwssd_epi32(sumi, scale, p16);
+            }
+        }
+
+        acc = _mm512_fmadd_ps(_mm512_set1_ps(d), _mm512_cvtepi32_ps(sumi), acc);
+    }
+
+    *s = _mm512_reduce_add_ps(acc);
+}
+
+LM_GGML_TARGET_AVX512 void lm_ggml_vec_dot_q3_K_q8_K_avx512(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    assert(n % QK_K == 0);
+
+    const block_q3_K * restrict x = vx;
+    const block_q8_K * restrict y = vy;
+
+    const int nb = n / QK_K;
+
+    const __m512i m3 = _mm512_set1_epi8(3);
+    const __m512i m4 = _mm512_set1_epi8(4);
+    const __m128i m32 = _mm_set1_epi8(32);
+
+    __m512 acc = _mm512_setzero_ps();
+
+    uint32_t utmp[4];
+
+    for (int i = 0; i < nb; ++i) {
+
+        const float d = y[i].d * _cvtsh_ss(x[i].d);
+
+        const uint8_t * restrict q3 = x[i].qs;
+        const int8_t  * restrict q8 = y[i].qs;
+
+        unpack_scales_q3_K(x[i].scales, utmp);
+        const __m256i scales = _mm256_cvtepi8_epi16(_mm_sub_epi8(_mm_set_epi32(utmp[3], utmp[2], utmp[1], utmp[0]), m32));
+        const __m512i sc = _mm512_castsi256_si512(scales);
+
+        // the quants are stored with an offset of 4 when the high bit is set, subtract 4*scale*sum(q8) instead
+        const __m256i prod = _mm256_madd_epi16(scales, _mm256_loadu_si256((const __m256i*)y[i].bsums));
+        __m512i sumi = _mm512_zextsi256_si512(_mm256_sub_epi32(_mm256_setzero_si256(), _mm256_slli_epi32(prod, 2)));
+
+        // high bits 2*c and 2*c+1 of each byte next to each other
+        const __m256i hbits = _mm256_loadu_si256((const __m256i*)x[i].hmask);
+        const __m512i hx = _mm512_inserti64x4(_mm512_castsi256_si512(hbits), _mm256_srli_epi16(hbits, 1), 1);
+
+        for (int j = 0; j < QK_K/128; ++j) {
+            const __m256i q3bits = _mm256_loadu_si256((const __m256i*)(q3 + 32*j));
+            const __m512i q3x = _mm512_inserti64x4(_mm512_castsi256_si512(q3bits), _mm256_srli_epi16(q3bits, 2), 1);
+
+            for (int k = 0; k < 2; ++k) {
+                const int c = 2*j + k;
+                const __m512i q3l = _mm512_and_si512(_mm512_srli_epi16(q3x, 4*k), m3);
+                const __mmask64 h = _mm512_test_epi8_mask(hx, _mm512_set1_epi8(1 << (2*c)));
+                const __m512i q3c = _mm512_mask_add_epi8(q3l, h, q3l, m4);
+                const __m512i q8c = _mm512_loadu_si512((const __m512i*)(q8 + 64*c));
+                const __m512i p16 = _mm512_maddubs_epi16(q3c, q8c);
+                const __m512i scale = _mm512_permutexvar_epi16(_mm512_loadu_si512((const __m512i*)k_perm_scales_16[c]), sc);
+                sumi = _mm512_dpwssd_epi32(sumi, scale, p16);
+            }
+        }
+
+        acc = _mm512_fmadd_ps(_mm512_set1_ps(d), _mm512_cvtepi32_ps(sumi), acc);
+    }
+
+    *s = _mm512_reduce_add_ps(acc);
+}
+
+LM_GGML_TARGET_AVX512 void lm_ggml_vec_dot_q4_K_q8_K_avx512(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    assert(n % QK_K == 0);
+
+    const block_q4_K * restrict x = vx;
+    const block_q8_K * restrict y = vy;
+
+    const int nb = n / QK_K;
+
+    const __m512i m4 = _mm512_set1_epi8(0xF);
+
+    __m512 acc = _mm512_setzero_ps();
+
+    uint32_t utmp[4];
+
+    for (int i = 0; i < nb; ++i) {
+
+        const float d = y[i].d * _cvtsh_ss(x[i].d);
+        const float dmin = -y[i].d * _cvtsh_ss(x[i].dmin);
+
+        const uint8_t * restrict q4 = x[i].qs;
+        const int8_t  * restrict q8 = y[i].qs;
+
+        unpack_scales_mins_k4(x[i].scales, utmp);
+        const __m256i mins_and_scales = _mm256_cvtepu8_epi16(_mm_set_epi32(utmp[3], utmp[2], utmp[1], utmp[0]));
+
+        const __m256i q8sums = _mm256_loadu_si256((const __m256i*)y[i].bsums);
+        const __m128i q8s = _mm_hadd_epi16(_mm256_extracti128_si256(q8sums, 0), _mm256_extracti128_si256(q8sums, 1));
+        const __m128i prod = _mm_madd_epi16(_mm256_extracti128_si256(mins_and_scales, 1), q8s);
+
+        acc = _mm512_fmadd_ps(_mm512_set1_ps(dmin), _mm512_cvtepi32_ps(_mm512_zextsi128_si512(prod)), acc);
+
+        const __m512i sc = _mm512_castsi256_si512(mins_and_scales);
+
+        __m512i sumi = _mm512_setzero_si512();
+
+        for (int c = 0; c < QK_K/64; ++c) {
+            const __m256i q4bits = _mm256_loadu_si256((const __m256i*)(q4 + 32*c));
+            const __m512i q4c = _mm512_and_si512(_mm512_inserti64x4(_mm512_castsi256_si512(q4bits), _mm256_srli_epi16(q4bits, 4), 1), m4);
+            const __m512i q8c = _mm512_loadu_si512((const __m512i*)(q8 + 64*c));
+            const __m512i p16 = _mm512_maddubs_epi16(q4c, q8c);
+            const __m512i scale = _mm512_permutexvar_epi16(_mm512_loadu_si512((const __m512i*)k_perm_scales_32[c]), sc);
+            sumi = _mm512_dpwssd_epi32(sumi, scale, p16);
+        }
+
+        acc = _mm512_fmadd_ps(_mm512_set1_ps(d), _mm512_cvtepi32_ps(sumi), acc);
+    }
+
+    *s = _mm512_reduce_add_ps(acc);
+}
+
+LM_GGML_TARGET_AVX512 void lm_ggml_vec_dot_q5_K_q8_K_avx512(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    assert(n % QK_K == 0);
+
+    const block_q5_K * restrict x = vx;
+    const block_q8_K * restrict y = vy;
+
+    const int nb = n / QK_K;
+
+    const __m512i m4  = _mm512_set1_epi8(0xF);
+    const __m512i m16 = _mm512_set1_epi8(16);
+
+    __m512 acc = _mm512_setzero_ps();
+
+    uint32_t utmp[4];
+
+    for (int i = 0; i < nb; ++i) {
+
+        const float d = y[i].d * _cvtsh_ss(x[i].d);
+        const float dmin = -y[i].d * _cvtsh_ss(x[i].dmin);
+
+        const uint8_t * restrict q5 = x[i].qs;
+        const int8_t  * restrict q8 = y[i].qs;
+
+        unpack_scales_mins_k4(x[i].scales, utmp);
+        const __m256i mins_and_scales = _mm256_cvtepu8_epi16(_mm_set_epi32(utmp[3], utmp[2], utmp[1], utmp[0]));
+
+        const __m256i q8sums = _mm256_loadu_si256((const __m256i*)y[i].bsums);
+        const __m128i q8s = _mm_hadd_epi16(_mm256_extracti128_si256(q8sums, 0), _mm256_extracti128_si256(q8sums, 1));
+        const __m128i prod = _mm_madd_epi16(_mm256_extracti128_si256(mins_and_scales, 1), q8s);
+
+        acc = _mm512_fmadd_ps(_mm512_set1_ps(dmin), _mm512_cvtepi32_ps(_mm512_zextsi128_si512(prod)), acc);
+
+        const __m512i sc = _mm512_castsi256_si512(mins_and_scales);
+
+        // high bits 2*c and 2*c+1 of each byte next to each other
+        const __m256i hbits = _mm256_loadu_si256((const __m256i*)x[i].qh);
+        const __m512i hx = _mm512_inserti64x4(_mm512_castsi256_si512(hbits), _mm256_srli_epi16(hbits, 1), 1);
+
+        __m512i sumi = _mm512_setzero_si512();
+
+        for (int c = 0; c < QK_K/64; ++c) {
+            const __m256i q5bits = _mm256_loadu_si256((const __m256i*)(q5 + 32*c));
+            const __m512i q5l = _mm512_and_si512(_mm512_inserti64x4(_mm512_castsi256_si512(q5bits), _mm256_srli_epi16(q5bits, 4), 1), m4);
+            const __mmask64 h = _mm512_test_epi8_mask(hx, _mm512_set1_epi8(1 << (2*c)));
+            const __m512i q5c = _mm512_mask_add_epi8(q5l, h, q5l, m16);
+            const __m512i q8c = _mm512_loadu_si512((const __m512i*)(q8 + 64*c));
+            const __m512i p16 = _mm512_maddubs_epi16(q5c, q8c);
+            const __m512i scale = _mm512_permutexvar_epi16(_mm512_loadu_si512((const __m512i*)k_perm_scales_32[c]), sc);
+            sumi = _mm512_dpwssd_epi32(sumi, scale, p16);
+        }
+
+        acc = _mm512_fmadd_ps(_mm512_set1_ps(d), _mm512_cvtepi32_ps(sumi), acc);
+    }
+
+    *s = _mm512_reduce_add_ps(acc);
+}
+
+LM_GGML_TARGET_AVX512 void lm_ggml_vec_dot_q6_K_q8_K_avx512(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    assert(n % QK_K == 0);
+
+    const block_q6_K * restrict x = vx;
+    const block_q8_K * restrict y = vy;
+
+    const int nb = n / QK_K;
+
+    const __m512i m4  = _mm512_set1_epi8(0xF);
+    const __m512i m30 = _mm512_set1_epi8(0x30);
+
+    __m512 acc = _mm512_setzero_ps();
+
+    for (int i = 0; i < nb; ++i) {
+
+        const float d = y[i].d * _cvtsh_ss(x[i].d);
+
+        const uint8_t * restrict q4 = x[i].ql;
+        const uint8_t * restrict qh = x[i].qh;
+        const int8_t  * restrict q8 = y[i].qs;
+
+        const __m256i scales = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)x[i].scales));
+        const __m512i sc = _mm512_castsi256_si512(scales);
+
+        // the quants are stored with an offset of 32, subtract 32*scale*sum(q8) instead
+        const __m256i prod = _mm256_madd_epi16(scales, _mm256_loadu_si256((const __m256i*)y[i].bsums));
+        __m512i sumi = _mm512_zextsi256_si512(_mm256_sub_epi32(_mm256_setzero_si256(), _mm256_slli_epi32(prod, 5)));
+
+        for (int j = 0; j < QK_K/128; ++j) {
+            const __m512i q4bits = _mm512_loadu_si512((const __m512i*)(q4 + 64*j));
+            // 2-bit fields 0,1 and 2,3 of each byte of qh next to each other
+            const __m256i q4bitsH = _mm256_loadu_si256((const __m256i*)(qh + 32*j));
+            const __m512i hx = _mm512_inserti64x4(_mm512_castsi256_si512(q4bitsH), _mm256_srli_epi16(q4bitsH, 2), 1);
+
+            const __m512i q6_0 = _mm512_or_si512(_mm512_and_si512(q4bits, m4), _mm512_and_si512(_mm512_slli_epi16(hx, 4), m30));
+            const __m512i q6_1 = _mm512_or_si512(_mm512_and_si512(_mm512_srli_epi16(q4bits, 4), m4), _mm512_and_si512(hx, m30));
+
+            const __m512i q8_0 = _mm512_loadu_si512((const __m512i*)(q8 + 128*j));
+            const __m512i q8_1 = _mm512_loadu_si512((const __m512i*)(q8 + 128*j + 64));
+
+            const __m512i p16_0 = _mm512_maddubs_epi16(q6_0, q8_0);
+            const __m512i p16_1 = _mm512_maddubs_epi16(q6_1, q8_1);
+
+            const __m512i scale_0 = _mm512_permutexvar_epi16(_mm512_loadu_si512((const __m512i*)k_perm_scales_16[2*j+0]), sc);
+            const __m512i scale_1 = _mm512_permutexvar_epi16(_mm512_loadu_si512((const __m512i*)k_perm_scales_16[2*j+1]), sc);
+
+            sumi = _mm512_dpwssd_epi32(sumi, scale_0, p16_0);
+            sumi = _mm512_dpwssd_epi32(sumi, scale_1, p16_1);
+        }
+
+        acc = _mm512_fmadd_ps(_mm512_set1_ps(d), _mm512_cvtepi32_ps(sumi), acc);
+    }
+
+    *s = _mm512_reduce_add_ps(acc);
+}
+
+//
+// AVX-VNNI
+//
+
+// horizontally add 8 floats
+static inline LM_GGML_TARGET_AVXVNNI float hsum_float_8_avxvnni(const __m256 x) {
+    __m128 res = _mm256_extractf128_ps(x, 1);
+    res = _mm_add_ps(res, _mm256_castps256_ps128(x));
+    res = _mm_add_ps(res, _mm_movehl_ps(res, res));
+    res = _mm_add_ss(res, _mm_movehdup_ps(res));
+    return _mm_cvtss_f32(res);
+}
+
+LM_GGML_TARGET_AVXVNNI void lm_ggml_vec_dot_q2_K_q8_K_avxvnni(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    assert(n % QK_K == 0);
+
+    const block_q2_K * restrict x = vx;
+    const block_q8_K * restrict y = vy;
+
+    const int nb = n / QK_K;
+
+    const __m256i m3 = _mm256_set1_epi8(3);
+    const __m128i m4 = _mm_set1_epi8(0xF);
+
+    __m256 acc = _mm256_setzero_ps();
+
+    for (int i = 0; i < nb; ++i) {
+
+        const float d = y[i].d * _cvtsh_ss(x[i].d);
+        const float dmin = -y[i].d * _cvtsh_ss(x[i].dmin);
+
+        const uint8_t * restrict q2 = x[i].qs;
+        const int8_t  * restrict q8 = y[i].qs;
+
+        const __m128i mins_and_scales = _mm_loadu_si128((const __m128i*)x[i].scales);
+        const __m256i all_scales = _mm256_cvtepu8_epi16(_mm_and_si128(mins_and_scales, m4));
+        const __m256i mins = _mm256_cvtepu8_epi16(_mm_and_si128(_mm_srli_epi16(mins_and_scales, 4), m4));
+        const __m256i prod = _mm256_madd_epi16(mins, _mm256_loadu_si256((const __m256i*)y[i].bsums));
+
+        acc = _mm256_fmadd_ps(_mm256_set1_ps(dmin), _mm256_cvtepi32_ps(prod), acc);
+
+        const __m128i l_scales = _mm256_extracti128_si256(all_scales, 0);
+        const __m128i h_scales = _mm256_extracti128_si256(all_scales, 1);
+        const __m256i scales[2] = {MM256_SET_M128I(l_scales, l_scales), MM256_SET_M128I(h_scales, h_scales)};
+
+        __m256i sumi = _mm256_setzero_si256();
+
+        for (int j = 0; j < QK_K/128; ++j) {
+            const __m256i q2bits = _mm256_loadu_si256((const __m256i*)(q2 + 32*j));
+
+            for (int k = 0; k < 4; ++k) {
+                const __m256i q2c = _mm256_and_si256(_mm256_srli_epi16(q2bits, 2*k), m3);
+                const __m256i q8c = _mm256_loadu_si256((const __m256i*)(q8 + 128*j + 32*k));
+                const __m256i p16 = _mm256_maddubs_epi16(q2c, q8c);
+                const __m256i scale = _mm256_shuffle_epi8(scales[j], _mm256_loadu_si256((const __m256i*)k_shuffle_scales_16[k]));
+                sumi = _mm256_dpwssd_avx_epi32(sumi, scale, p16);
+            }
+        }
+
+        acc = _mm256_fmadd_ps(_mm256_set1_ps(d), _mm256_cvtepi32_ps(sumi), acc);
+    }
+
+    *s = hsum_float_8_avxvnni(acc);
+}
+
+LM_GGML_TARGET_AVXVNNI void lm_ggml_vec_dot_q3_K_q8_K_avxvnni(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    assert(n % QK_K == 0);
+
+    const block_q3_K * restrict x = vx;
+    const block_q8_K * restrict y = vy;
+
+    const int nb = n / QK_K;
+
+    const __m256i m3 = _mm256_set1_epi8(3);
+    const __m256i mone = _mm256_set1_epi8(1);
+    const __m128i m32 = _mm_set1_epi8(32);
+
+    __m256 acc = _mm256_setzero_ps();
+
+    uint32_t utmp[4];
+
+    for (int i = 0; i < nb; ++i) {
+
+        const float d = y[i].d * _cvtsh_ss(x[i].d);
+
+        const uint8_t * restrict q3 = x[i].qs;
+        const int8_t  * restrict q8 = y[i].qs;
+
+        unpack_scales_q3_K(x[i].scales, utmp);
+        const __m256i all_scales = _mm256_cvtepi8_epi16(_mm_sub_epi8(_mm_set_epi32(utmp[3], utmp[2], utmp[1], utmp[0]), m32));
+        const __m128i l_scales = _mm256_extracti128_si256(all_scales, 0);
+        const __m128i h_scales = _mm256_extracti128_si256(all_scales, 1);
+        const __m256i scales[2] = {MM256_SET_M128I(l_scales, l_scales), MM256_SET_M128I(h_scales, h_scales)};
+
+        // the quants are stored with an offset of 4 when the high bit is set, subtract 4*scale*sum(q8) instead
+        const __m256i prod = _mm256_madd_epi16(all_scales, _mm256_loadu_si256((const __m256i*)y[i].bsums));
+        __m256i sumi = _mm256_sub_epi32(_mm256_setzero_si256(), _mm256_slli_epi32(prod, 2));
+
+        const __m256i hbits = _mm256_loadu_si256((const __m256i*)x[i].hmask);
+
+        for (int j = 0; j < QK_K/128; ++j) {
+            const __m256i q3bits = _mm256_loadu_si256((const __m256i*)(q3 + 32*j));
+
+            for (int k = 0; k < 4; ++k) {
+                const __m256i q3l = _mm256_and_si256(_mm256_srli_epi16(q3bits, 2*k), m3);
+                const __m256i q3h = _mm256_slli_epi16(_mm256_and_si256(_mm256_srli_epi16(hbits, 4*j + k), mone), 2);
+                const __m256i q8c = _mm256_loadu_si256((const __m256i*)(q8 + 128*j + 32*k));
+                const __m256i p16 = _mm256_maddubs_epi16(_mm256_or_si256(q3l, q3h), q8c);
+                const __m256i scale = _mm256_shuffle_epi8(scales[j], _mm256_loadu_si256((const __m256i*)k_shuffle_scales_16[k]));
+                sumi = _mm256_dpwssd_avx_epi32(sumi, scale, p16);
+            }
+        }
+
+        acc = _mm256_fmadd_ps(_mm256_set1_ps(d), _mm256_cvtepi32_ps(sumi), acc);
+    }
+
+    *s = hsum_float_8_avxvnni(acc);
+}
+
+LM_GGML_TARGET_AVXVNNI void lm_ggml_vec_dot_q4_K_q8_K_avxvnni(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    assert(n % QK_K == 0);
+
+    const block_q4_K * restrict x = vx;
+    const block_q8_K * restrict y = vy;
+
+    const int nb = n / QK_K;
+
+    const __m256i m4 = _mm256_set1_epi8(0xF);
+
+    __m256 acc = _mm256_setzero_ps();
+    __m128 acc_m = _mm_setzero_ps();
+
+    uint32_t utmp[4];
+
+    for (int i = 0; i < nb; ++i) {
+
+        const float d = y[i].d * _cvtsh_ss(x[i].d);
+        const float dmin = -y[i].d * _cvtsh_ss(x[i].dmin);
+
+        const uint8_t * restrict q4 = x[i].qs;
+        const int8_t  * restrict q8 = y[i].qs;
+
+        unpack_scales_mins_k4(x[i].scales, utmp);
+        const __m256i mins_and_scales = _mm256_cvtepu8_epi16(_mm_set_epi32(utmp[3], utmp[2], utmp[1], utmp[0]));
+
+        const __m256i q8sums = _mm256_loadu_si256((const __m256i*)y[i].bsums);
+        const __m128i q8s = _mm_hadd_epi16(_mm256_extracti128_si256(q8sums, 0), _mm256_extracti128_si256(q8sums, 1));
+        const __m128i prod = _mm_madd_epi16(_mm256_extracti128_si256(mins_and_scales, 1), q8s);
+        acc_m = _mm_fmadd_ps(_mm_set1_ps(dmin), _mm_cvtepi32_ps(prod), acc_m);
+
+        const __m128i sc128  = _mm256_extracti128_si256(mins_and_scales, 0);
+        const __m256i scales = MM256_SET_M128I(sc128, sc128);
+
+        __m256i sumi = _mm256_setzero_si256();
+
+        for (int j = 0; j < QK_K/64; ++j) {
+            const __m256i q4bits = _mm256_loadu_si256((const __m256i*)(q4 + 32*j));
+
+            for (int k = 0; k < 2; ++k) {
+                const int c = 2*j + k;
+                const __m256i q4c = _mm256_and_si256(_mm256_srli_epi16(q4bits, 4*k), m4);
+                const __m256i q8c = _mm256_loadu_si256((const __m256i*)(q8 + 32*c));
+                const __m256i p16 = _mm256_maddubs_epi16(q4c, q8c);
+                const __m256i scale = _mm256_shuffle_epi8(scales, _mm256_loadu_si256((const __m256i*)k_shuffle_scales_32[c]));
+                sumi = _mm256_dpwssd_avx_epi32(sumi, scale, p16);
+            }
+        }
+
+        acc = _mm256_fmadd_ps(_mm256_set1_ps(d), _mm256_cvtepi32_ps(sumi), acc);
+    }
+
+    acc_m = _mm_add_ps(acc_m, _mm_movehl_ps(acc_m, acc_m));
+    acc_m = _mm_add_ss(acc_m, _mm_movehdup_ps(acc_m));
+
+    *s = hsum_float_8_avxvnni(acc) + _mm_cvtss_f32(acc_m);
+}
+
+LM_GGML_TARGET_AVXVNNI void lm_ggml_vec_dot_q5_K_q8_K_avxvnni(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    assert(n % QK_K == 0);
+
+    const block_q5_K * restrict x = vx;
+    const block_q8_K * restrict y = vy;
+
+    const int nb = n / QK_K;
+
+    const __m256i m4 = _mm256_set1_epi8(0xF);
+    const __m256i mone = _mm256_set1_epi8(1);
+
+    __m256 acc = _mm256_setzero_ps();
+    __m128 acc_m = _mm_setzero_ps();
+
+    uint32_t utmp[4];
+
+    for (int i = 0; i < nb; ++i) {
+
+        const float d = y[i].d * _cvtsh_ss(x[i].d);
+        const float dmin = -y[i].d * _cvtsh_ss(x[i].dmin);
+
+        const uint8_t * restrict q5 = x[i].qs;
+        const int8_t  * restrict q8 = y[i].qs;
+
+        unpack_scales_mins_k4(x[i].scales, utmp);
+        const __m256i mins_and_scales = _mm256_cvtepu8_epi16(_mm_set_epi32(utmp[3], utmp[2], utmp[1], utmp[0]));
+
+        const __m256i q8sums = _mm256_loadu_si256((const __m256i*)y[i].bsums);
+        const __m128i q8s = _mm_hadd_epi16(_mm256_extracti128_si256(q8sums, 0), _mm256_extracti128_si256(q8sums, 1));
+        const __m128i prod = _mm_madd_epi16(_mm256_extracti128_si256(mins_and_scales, 1), q8s);
+        acc_m = _mm_fmadd_ps(_mm_set1_ps(dmin), _mm_cvtepi32_ps(prod), acc_m);
+
+        const __m128i sc128  = _mm256_extracti128_si256(mins_and_scales, 0);
+        const __m256i scales = MM256_SET_M128I(sc128, sc128);
+
+        const __m256i hbits = _mm256_loadu_si256((const __m256i*)x[i].qh);
+
+        __m256i sumi = _mm256_setzero_si256();
+
+        for (int j = 0; j < QK_K/64; ++j) {
+            const __m256i q5bits = _mm256_loadu_si256((const __m256i*)(q5 + 32*j));
+
+            for (int k = 0; k < 2; ++k) {
+                const int c = 2*j + k;
+                const __m256i q5l = _mm256_and_si256(_mm256_srli_epi16(q5bits, 4*k), m4);
+                const __m256i q5h = _mm256_slli_epi16(_mm256_and_si256(_mm256_srli_epi16(hbits, c), mone), 4);
+                const __m256i q8c = _mm256_loadu_si256((const __m256i*)(q8 + 32*c));
+                const __m256i p16 = _mm256_maddubs_epi16(_mm256_or_si256(q5l, q5h), q8c);
+                const __m256i scale = _mm256_shuffle_epi8(scales, _mm256_loadu_si256((const __m256i*)k_shuffle_scales_32[c]));
+                sumi = _mm256_dpwssd_avx_epi32(sumi, scale, p16);
+            }
+        }
+
+        acc = _mm256_fmadd_ps(_mm256_set1_ps(d), _mm256_cvtepi32_ps(sumi), acc);
+    }
+
+    acc_m = _mm_add_ps(acc_m, _mm_movehl_ps(acc_m, acc_m));
+    acc_m = _mm_add_ss(acc_m, _mm_movehdup_ps(acc_m));
+
+    *s = hsum_float_8_avxvnni(acc) + _mm_cvtss_f32(acc_m);
+}
+
+LM_GGML_TARGET_AVXVNNI void lm_ggml_vec_dot_q6_K_q8_K_avxvnni(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    assert(n % QK_K == 0);
+
+    const block_q6_K * restrict x = vx;
+    const block_q8_K * restrict y = vy;
+
+    const int nb = n / QK_K;
+
+    const __m256i m4 = _mm256_set1_epi8(0xF);
+    const __m256i m2 = _mm256_set1_epi8(3);
+
+    __m256 acc = _mm256_setzero_ps();
+
+    for (int i = 0; i < nb; ++i) {
+
+        const float d = y[i].d * _cvtsh_ss(x[i].d);
+
+        const uint8_t * restrict q4 = x[i].ql;
+        const uint8_t * restrict qh = x[i].qh;
+        const int8_t  * restrict q8 = y[i].qs;
+
+        const __m256i all_scales = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)x[i].scales));
+        const __m128i l_scales = _mm256_extracti128_si256(all_scales, 0);
+        const __m128i h_scales = _mm256_extracti128_si256(all_scales, 1);
+        const __m256i scales[2] = {MM256_SET_M128I(l_scales, l_scales), MM256_SET_M128I(h_scales, h_scales)};
+
+        // the quants are stored with an offset of 32, subtract 32*scale*sum(q8) instead
+        const __m256i prod = _mm256_madd_epi16(all_scales, _mm256_loadu_si256((const __m256i*)y[i].bsums));
+        __m256i sumi = _mm256_sub_epi32(_mm256_setzero_si256(), _mm256_slli_epi32(prod, 5));
+
+        for (int j = 0; j < QK_K/128; ++j) {
+            const __m256i q4bitsH = _mm256_loadu_si256((const __m256i*)(qh + 32*j));
+
+            for (int k = 0; k < 4; ++k) {
+                const __m256i q4bits = _mm256_loadu_si256((const __m256i*)(q4 + 64*j + 32*(k & 1)));
+                const __m256i q6l = _mm256_and_si256(_mm256_srli_epi16(q4bits, 4*(k >> 1)), m4);
+                const __m256i q6h = _mm256_slli_epi16(_mm256_and_si256(_mm256_srli_epi16(q4bitsH, 2*k), m2), 4);
+                const __m256i q8c = _mm256_loadu_si256((const __m256i*)(q8 + 128*j + 32*k));
+                const __m256i p16 = _mm256_maddubs_epi16(_mm256_or_si256(q6l, q6h), q8c);
+                const __m256i scale = _mm256_shuffle_epi8(scales[j], _mm256_loadu_si256((const __m256i*)k_shuffle_scales_16[k]));
+                sumi = _mm256_dpwssd_avx_epi32(sumi, scale, p16);
+            }
+        }
+
+        acc = _mm256_fmadd_ps(_mm256_set1_ps(d), _mm256_cvtepi32_ps(sumi), acc);
+    }
+
+    *s = hsum_float_8_avxvnni(acc);
+}
+
+#endif // QK_K == 256 && defined(LM_GGML_X86_DISPATCH)
+
+//
+// arm64 dotprod variants of the NEON dot products, selected at runtime by lm_ggml_setup_cpu_kernels
+//
+
+#if QK_K == 256 && defined(LM_GGML_ARM_DISPATCH)
+
+void lm_ggml_vec_dot_q2_K_q8_K_dotprod(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+
+    const block_q2_K * restrict x = vx;
+    const block_q8_K * restrict y = vy;
+
+    const int nb = n / QK_K;
+
+
+    const uint8x16_t m3 = vdupq_n_u8(0x3);
+    const uint8x16_t m4 = vdupq_n_u8(0xF);
+    const int32x4_t  vzero = vdupq_n_s32(0);
+
+    int8x16x2_t q2bytes;
+    uint8_t aux[16];
+
+    float sum = 0;
+
+    for (int i = 0; i < nb; ++i) {
+
+        const float d = y[i].d * lm_ggml_fp16_to_fp32(x[i].d);
+        const float dmin = -y[i].d * lm_ggml_fp16_to_fp32(x[i].dmin);
+
+        const uint8_t * restrict q2 = x[i].qs;
+        const int8_t  * restrict q8 = y[i].qs;
+        const uint8_t * restrict sc = x[i].scales;
+
+        const uint8x16_t mins_and_scales = vld1q_u8(sc);
+        const uint8x16_t scales = vandq_u8(mins_and_scales, m4);
+        vst1q_u8(aux, scales);
+
+        const uint8x16_t mins = vshrq_n_u8(mins_and_scales, 4);
+        const int16x8x2_t q8sums = vld1q_s16_x2(y[i].bsums);
+        const int16x8x2_t mins16 = {vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(mins))), vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(mins)))};
+        const int32x4_t s0 = vaddq_s32(vmull_s16(vget_low_s16 (mins16.val[0]), vget_low_s16 (q8sums.val[0])),
+                                       vmull_s16(vget_high_s16(mins16.val[0]), vget_high_s16(q8sums.val[0])));
+        const int32x4_t s1 = vaddq_s32(vmull_s16(vget_low_s16 (mins16.val[1]), vget_low_s16 (q8sums.val[1])),
+                                       vmull_s16(vget_high_s16(mins16.val[1]), vget_high_s16(q8sums.val[1])));
+        sum += dmin * vaddvq_s32(vaddq_s32(s0, s1));
+
+        int isum = 0;
+        int is = 0;
+
+// We use this macro instead of a function call because for some reason
+// the code runs 2-3% slower, even if the function is declared inline
+#undef MULTIPLY_ACCUM_WITH_SCALE
+#define MULTIPLY_ACCUM_WITH_SCALE(index)\
+        isum += vaddvq_s32(lm_ggml_sdotq_s32(vzero, q2bytes.val[0], q8bytes.val[0])) * aux[is+(index)];\
+        isum += vaddvq_s32(lm_ggml_sdotq_s32(vzero, q2bytes.val[1], q8bytes.val[1])) * aux[is+1+(index)];
+
+#undef SHIFT_MULTIPLY_ACCUM_WITH_SCALE
+#define SHIFT_MULTIPLY_ACCUM_WITH_SCALE(shift, index)\
+        q8bytes = vld1q_s8_x2(q8); q8 += 32;\
+        q2bytes.val[0] = vreinterpretq_s8_u8(vandq_u8(vshrq_n_u8(q2bits.val[0], (shift)), m3));\
+        q2bytes.val[1] = vreinterpretq_s8_u8(vandq_u8(vshrq_n_u8(q2bits.val[1], (shift)), m3));\
+        MULTIPLY_ACCUM_WITH_SCALE((index));
+
+
+        for (int j = 0; j < QK_K/128; ++j) {
+
+            const uint8x16x2_t q2bits = vld1q_u8_x2(q2); q2 += 32;
+
+            int8x16x2_t q8bytes = vld1q_s8_x2(q8); q8 += 32;
+            q2bytes.val[0] = vreinterpretq_s8_u8(vandq_u8(q2bits.val[0], m3));
+            q2bytes.val[1] = vreinterpretq_s8_u8(vandq_u8(q2bits.val[1], m3));
+            MULTIPLY_ACCUM_WITH_SCALE(0);
+
+            SHIFT_MULTIPLY_ACCUM_WITH_SCALE(2, 2);
+
+            SHIFT_MULTIPLY_ACCUM_WITH_SCALE(4, 4);
+
+            SHIFT_MULTIPLY_ACCUM_WITH_SCALE(6, 6);
+
+            is += 8;
+        }
+        sum += d * isum;
+
+    }
+
+    *s = sum;
+}
+
+void lm_ggml_vec_dot_q3_K_q8_K_dotprod(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    assert(n % QK_K == 0);
+
+    const uint32_t kmask1 = 0x03030303;
+    const uint32_t kmask2 = 0x0f0f0f0f;
+
+    const block_q3_K * restrict x = vx;
+    const block_q8_K * restrict y = vy;
+
+    const int nb = n / QK_K;
+
+
+    uint32_t aux[3];
+    uint32_t utmp[4];
+
+    const uint8x16_t m3b = vdupq_n_u8(0x3);
+    const int32x4_t  vzero = vdupq_n_s32(0);
+
+    const uint8x16_t m0 = vdupq_n_u8(1);
+    const uint8x16_t m1 = vshlq_n_u8(m0, 1);
+    const uint8x16_t m2 = vshlq_n_u8(m0, 2);
+    const uint8x16_t m3 = vshlq_n_u8(m0, 3);
+    const int8_t m32 = 32;
+
+    int8x16x4_t q3bytes;
+
+    float sum = 0;
+
+    for (int i = 0; i < nb; ++i) {
+
+        const float d = y[i].d * lm_ggml_fp16_to_fp32(x[i].d);
+
+        const uint8_t * restrict q3 = x[i].qs;
+        const uint8_t * restrict qh = x[i].hmask;
+        const int8_t  * restrict q8 = y[i].qs;
+
+        uint8x16x2_t qhbits = vld1q_u8_x2(qh);
+
+        uint8x16x4_t q3h;
+
+        int32_t isum = 0;
+
+        // Set up scales
+        memcpy(aux, x[i].scales, 12);
+        utmp[3] = ((aux[1] >> 4) & kmask2) | (((aux[2] >> 6) & kmask1) << 4);
+        utmp[2] = ((aux[0] >> 4) & kmask2) | (((aux[2] >> 4) & kmask1) << 4);
+        utmp[1] = (aux[1] & kmask2) | (((aux[2] >> 2) & kmask1) << 4);
+        utmp[0] = (aux[0] & kmask2) | (((aux[2] >> 0) & kmask1) << 4);
+
+        int8_t * scale = (int8_t *)utmp;
+        for (int j = 0; j < 16; ++j) scale[j] -= m32;
+
+        for (int j = 0; j < QK_K/128; ++j) {
+
+            const uint8x16x2_t q3bits = vld1q_u8_x2(q3); q3 += 32;
+            const int8x16x4_t q8bytes_1 = vld1q_s8_x4(q8); q8 += 64;
+            const int8x16x4_t q8bytes_2 = vld1q_s8_x4(q8); q8 += 64;
+
+            q3h.val[0] = vshlq_n_u8(vbicq_u8(m0, qhbits.val[0]), 2);
+            q3h.val[1] = vshlq_n_u8(vbicq_u8(m0, qhbits.val[1]), 2);
+            q3h.val[2] = vshlq_n_u8(vbicq_u8(m1, qhbits.val[0]), 1);
+            q3h.val[3] = vshlq_n_u8(vbicq_u8(m1, qhbits.val[1]), 1);
+
+            q3bytes.val[0] = vsubq_s8(vreinterpretq_s8_u8(vandq_u8(q3bits.val[0], m3b)), vreinterpretq_s8_u8(q3h.val[0]));
+            q3bytes.val[1] = vsubq_s8(vreinterpretq_s8_u8(vandq_u8(q3bits.val[1], m3b)), vreinterpretq_s8_u8(q3h.val[1]));
+            q3bytes.val[2] = vsubq_s8(vreinterpretq_s8_u8(vandq_u8(vshrq_n_u8(q3bits.val[0], 2), m3b)), vreinterpretq_s8_u8(q3h.val[2]));
+            q3bytes.val[3] = vsubq_s8(vreinterpretq_s8_u8(vandq_u8(vshrq_n_u8(q3bits.val[1], 2), m3b)), vreinterpretq_s8_u8(q3h.val[3]));
+
+            isum += vaddvq_s32(lm_ggml_sdotq_s32(vzero, q3bytes.val[0], q8bytes_1.val[0])) * scale[0];
+            isum += vaddvq_s32(lm_ggml_sdotq_s32(vzero, q3bytes.val[1], q8bytes_1.val[1])) * scale[1];
+            isum += vaddvq_s32(lm_ggml_sdotq_s32(vzero, q3bytes.val[2], q8bytes_1.val[2])) * scale[2];
+            isum += vaddvq_s32(lm_ggml_sdotq_s32(vzero, q3bytes.val[3], q8bytes_1.val[3])) * scale[3];
+            scale += 4;
+
+            q3h.val[0] = vbicq_u8(m2, qhbits.val[0]);
+            q3h.val[1] = vbicq_u8(m2, qhbits.val[1]);
+            q3h.val[2] = vshrq_n_u8(vbicq_u8(m3, qhbits.val[0]), 1);
+            q3h.val[3] = vshrq_n_u8(vbicq_u8(m3, qhbits.val[1]), 1);
+
+            q3bytes.val[0] = vsubq_s8(vreinterpretq_s8_u8(vandq_u8(vshrq_n_u8(q3bits.val[0], 4), m3b)), vreinterpretq_s8_u8(q3h.val[0]));
+            q3bytes.val[1] = vsubq_s8(vreinterpretq_s8_u8(vandq_u8(vshrq_n_u8(q3bits.val[1], 4), m3b)), vreinterpretq_s8_u8(q3h.val[1]));
+            q3bytes.val[2] = vsubq_s8(vreinterpretq_s8_u8(vandq_u8(vshrq_n_u8(q3bits.val[0], 6), m3b)), vreinterpretq_s8_u8(q3h.val[2]));
+            q3bytes.val[3] = vsubq_s8(vreinterpretq_s8_u8(vandq_u8(vshrq_n_u8(q3bits.val[1], 6), m3b)), vreinterpretq_s8_u8(q3h.val[3]));
+
+            isum += vaddvq_s32(lm_ggml_sdotq_s32(vzero, q3bytes.val[0], q8bytes_2.val[0])) * scale[0];
+            isum += vaddvq_s32(lm_ggml_sdotq_s32(vzero, q3bytes.val[1], q8bytes_2.val[1])) * scale[1];
+            isum += vaddvq_s32(lm_ggml_sdotq_s32(vzero, q3bytes.val[2], q8bytes_2.val[2])) * scale[2];
+            isum += vaddvq_s32(lm_ggml_sdotq_s32(vzero, q3bytes.val[3], q8bytes_2.val[3])) * scale[3];
+            scale += 4;
+
+            if (j == 0) {
+                qhbits.val[0] = vshrq_n_u8(qhbits.val[0], 4);
+                qhbits.val[1] = vshrq_n_u8(qhbits.val[1], 4);
+            }
+
+        }
+        sum += d * isum;
+
+    }
+
+    *s = sum;
+}
+
+void lm_ggml_vec_dot_q4_K_q8_K_dotprod(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    assert(n % QK_K == 0);
+
+    const block_q4_K * restrict x = vx;
+    const block_q8_K * restrict y = vy;
+
+    const int nb = n / QK_K;
+
+    static const uint32_t kmask1 = 0x3f3f3f3f;
+    static const uint32_t kmask2 = 0x0f0f0f0f;
+    static const uint32_t kmask3 = 0x03030303;
+
+    uint32_t utmp[4];
+
+
+    const uint8x16_t m4b = vdupq_n_u8(0xf);
+    const int32x4_t mzero = vdupq_n_s32(0);
+
+    int8x16x2_t q4bytes;
+    int8x16x2_t q8bytes;
+
+    float sumf = 0;
+
+    for (int i = 0; i < nb; ++i) {
+
+        const float d = y[i].d * lm_ggml_fp16_to_fp32(x[i].d);
+        const float dmin = y[i].d * lm_ggml_fp16_to_fp32(x[i].dmin);
+
+        const int16x8_t q8sums = vpaddq_s16(vld1q_s16(y[i].bsums), vld1q_s16(y[i].bsums + 8));
+
+        memcpy(utmp, x[i].scales, 12);
+
+        uint32x2_t mins8 = { 0 };
+        mins8 = vset_lane_u32(utmp[1] & kmask1, mins8, 0);
+        mins8 = vset_lane_u32(((utmp[2] >> 4) & kmask2) | (((utmp[1] >> 6) & kmask3) << 4), mins8, 1);
+
+        utmp[1] = (utmp[2] & kmask2) | (((utmp[0] >> 6) & kmask3) << 4);
+        utmp[0] &= kmask1;
+
+        const int16x8_t mins = vreinterpretq_s16_u16(vmovl_u8(vreinterpret_u8_u32(mins8)));
+        const int32x4_t prod = vaddq_s32(vmull_s16(vget_low_s16 (q8sums), vget_low_s16 (mins)),
+                                         vmull_s16(vget_high_s16(q8sums), vget_high_s16(mins)));
+        sumf -= dmin * vaddvq_s32(prod);
+
+        const uint8_t * scales = (const uint8_t *)utmp;
+
+        const uint8_t * restrict q4 = x[i].qs;
+        const int8_t  * restrict q8 = y[i].qs;
+
+        int32_t sumi1 = 0;
+        int32_t sumi2 = 0;
+
+        for (int j = 0; j < QK_K/64; ++j) {
+
+            const uint8x16x2_t q4bits = vld1q_u8_x2(q4); q4 += 32;
+
+            q8bytes = vld1q_s8_x2(q8); q8 += 32;
+            q4bytes.val[0] = vreinterpretq_s8_u8(vandq_u8  (q4bits.val[0], m4b));
+            q4bytes.val[1] = vreinterpretq_s8_u8(vandq_u8  (q4bits.val[1], m4b));
+
+            const int32x4_t p1 = lm_ggml_sdotq_s32(lm_ggml_sdotq_s32(mzero, q4bytes.val[0], q8bytes.val[0]), q4bytes.val[1], q8bytes.val[1]);
+            sumi1 += vaddvq_s32(p1) * scales[2*j+0];
+
+            q8bytes = vld1q_s8_x2(q8); q8 += 32;
+            q4bytes.val[0] = vreinterpretq_s8_u8(vshrq_n_u8(q4bits.val[0], 4));
+            q4bytes.val[1] = vreinterpretq_s8_u8(vshrq_n_u8(q4bits.val[1], 4));
+
+            const int32x4_t p2 = lm_ggml_sdotq_s32(lm_ggml_sdotq_s32(mzero, q4bytes.val[0], q8bytes.val[0]), q4bytes.val[1], q8bytes.val[1]);
+
+            sumi2 += vaddvq_s32(p2) * scales[2*j+1];
+        }
+
+        sumf += d * (sumi1 + sumi2);
+
+    }
+
+    *s = sumf;
+}
+
+void lm_ggml_vec_dot_q5_K_q8_K_dotprod(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    assert(n % QK_K == 0);
+
+    const block_q5_K * restrict x = vx;
+    const block_q8_K * restrict y = vy;
+
+    const int nb = n / QK_K;
+
+    static const uint32_t kmask1 = 0x3f3f3f3f;
+    static const uint32_t kmask2 = 0x0f0f0f0f;
+    static const uint32_t kmask3 = 0x03030303;
+
+    uint32_t utmp[4];
+
+
+
+    const uint8x16_t m4b = vdupq_n_u8(0xf);
+    const uint8x16_t mone = vdupq_n_u8(1);
+    const uint8x16_t mtwo = vdupq_n_u8(2);
+    const int32x4_t mzero = vdupq_n_s32(0);
+
+    int8x16x4_t q5bytes;
+
+    float sumf = 0;
+
+    for (int i = 0; i < nb; ++i) {
+
+        const float d = y[i].d * lm_ggml_fp16_to_fp32(x[i].d);
+        const float dmin = y[i].d * lm_ggml_fp16_to_fp32(x[i].dmin);
+
+        const int16x8_t q8sums = vpaddq_s16(vld1q_s16(y[i].bsums), vld1q_s16(y[i].bsums + 8));
+
+        memcpy(utmp, x[i].scales, 12);
+        utmp[3] = ((utmp[2] >> 4) & kmask2) | (((utmp[1] >> 6) & kmask3) << 4);
+        const uint32_t uaux = utmp[1] & kmask1;
+        utmp[1] = (utmp[2] & kmask2) | (((utmp[0] >> 6) & kmask3) << 4);
+        utmp[2] = uaux;
+        utmp[0] &= kmask1;
+
+        const uint8x8_t mins8 = vld1_u8((const uint8_t*)utmp + 8);
+        const int16x8_t mins = vreinterpretq_s16_u16(vmovl_u8(mins8));
+        const int32x4_t prod = vaddq_s32(vmull_s16(vget_low_s16 (q8sums), vget_low_s16 (mins)),
+                                         vmull_s16(vget_high_s16(q8sums), vget_high_s16(mins)));
+        int32_t sumi_mins = vaddvq_s32(prod);
+
+        const uint8_t * scales = (const uint8_t *)utmp;
+
+        const uint8_t * restrict q5 = x[i].qs;
+        const uint8_t * restrict qh = x[i].qh;
+        const int8_t  * restrict q8 = y[i].qs;
+
+        uint8x16x2_t qhbits = vld1q_u8_x2(qh);
+
+        uint8x16x4_t q5h;
+
+        int32_t sumi = 0;
+
+        for (int j = 0; j < QK_K/64; ++j) {
+
+            const uint8x16x2_t q5bits = vld1q_u8_x2(q5); q5 += 32;
+            const int8x16x4_t q8bytes = vld1q_s8_x4(q8); q8 += 64;
+
+            q5h.val[0] = vshlq_n_u8(vandq_u8(mone, qhbits.val[0]), 4);
+            q5h.val[1] = vshlq_n_u8(vandq_u8(mone, qhbits.val[1]), 4);
+            q5h.val[2] = vshlq_n_u8(vandq_u8(mtwo, qhbits.val[0]), 3);
+            q5h.val[3] = vshlq_n_u8(vandq_u8(mtwo, qhbits.val[1]), 3);
+            qhbits.val[0] = vshrq_n_u8(qhbits.val[0], 2);
+            qhbits.val[1] = vshrq_n_u8(qhbits.val[1], 2);
+
+            q5bytes.val[0] = vreinterpretq_s8_u8(vorrq_u8(vandq_u8(q5bits.val[0], m4b), q5h.val[0]));
+            q5bytes.val[1] = vreinterpretq_s8_u8(vorrq_u8(vandq_u8(q5bits.val[1], m4b), q5h.val[1]));
+            q5bytes.val[2] = vreinterpretq_s8_u8(vorrq_u8(vshrq_n_u8(q5bits.val[0], 4), q5h.val[2]));
+            q5bytes.val[3] = vreinterpretq_s8_u8(vorrq_u8(vshrq_n_u8(q5bits.val[1], 4), q5h.val[3]));
+
+
+            sumi += vaddvq_s32(lm_ggml_sdotq_s32(lm_ggml_sdotq_s32(mzero, q5bytes.val[0], q8bytes.val[0]), q5bytes.val[1], q8bytes.val[1])) * *scales++;
+            sumi += vaddvq_s32(lm_ggml_sdotq_s32(lm_ggml_sdotq_s32(mzero, q5bytes.val[2], q8bytes.val[2]), q5bytes.val[3], q8bytes.val[3])) * *scales++;
+        }
+
+        sumf += d * sumi - dmin * sumi_mins;
+
+    }
+
+    *s = sumf;
+}
+
+void lm_ggml_vec_dot_q6_K_q8_K_dotprod(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    assert(n % QK_K == 0);
+
+    const block_q6_K * restrict x = vx;
+    const block_q8_K * restrict y = vy;
+
+    const int nb = n / QK_K;
+
+
+    float sum = 0;
+
+    const uint8x16_t m4b = vdupq_n_u8(0xF);
+    const int32x4_t  vzero = vdupq_n_s32(0);
+    //const int8x16_t  m32s = vdupq_n_s8(32);
+
+    const uint8x16_t mone = vdupq_n_u8(3);
+
+    int8x16x4_t q6bytes;
+    uint8x16x4_t q6h;
+
+    for (int i = 0; i < nb; ++i) {
+
+        const float d_all = lm_ggml_fp16_to_fp32(x[i].d);
+
+        const uint8_t * restrict q6 = x[i].ql;
+        const uint8_t * restrict qh = x[i].qh;
+        const int8_t  * restrict q8 = y[i].qs;
+
+        const int8_t * restrict scale = x[i].scales;
+
+        const int16x8x2_t q8sums = vld1q_s16_x2(y[i].bsums);
+        const int8x16_t scales = vld1q_s8(scale);
+        const int16x8x2_t q6scales = {vmovl_s8(vget_low_s8(scales)), vmovl_s8(vget_high_s8(scales))};
+
+        const int32x4_t prod = vaddq_s32(vaddq_s32(vmull_s16(vget_low_s16 (q8sums.val[0]), vget_low_s16 (q6scales.val[0])),
+                                                   vmull_s16(vget_high_s16(q8sums.val[0]), vget_high_s16(q6scales.val[0]))),
+                                         vaddq_s32(vmull_s16(vget_low_s16 (q8sums.val[1]), vget_low_s16 (q6scales.val[1])),
+                                                   vmull_s16(vget_high_s16(q8sums.val[1]), vget_high_s16(q6scales.val[1]))));
+        int32_t isum_mins = vaddvq_s32(prod);
+
+        int32_t isum = 0;
+
+        for (int j = 0; j < QK_K/128; ++j) {
+
+            uint8x16x2_t qhbits = vld1q_u8_x2(qh); qh += 32;
+            uint8x16x4_t q6bits = vld1q_u8_x4(q6); q6 += 64;
+            int8x16x4_t q8bytes = vld1q_s8_x4(q8); q8 += 64;
+
+            q6h.val[0] = vshlq_n_u8(vandq_u8(mone, qhbits.val[0]), 4);
+            q6h.val[1] = vshlq_n_u8(vandq_u8(mone, qhbits.val[1]), 4);
+            uint8x16_t shifted = vshrq_n_u8(qhbits.val[0], 2);
+            q6h.val[2] = vshlq_n_u8(vandq_u8(mone, shifted), 4);
+            shifted = vshrq_n_u8(qhbits.val[1], 2);
+            q6h.val[3] = vshlq_n_u8(vandq_u8(mone, shifted), 4);
+
+            //q6bytes.val[0] = vsubq_s8(vreinterpretq_s8_u8(vorrq_u8(vandq_u8(q6bits.val[0], m4b), q6h.val[0])), m32s);
+            //q6bytes.val[1] = vsubq_s8(vreinterpretq_s8_u8(vorrq_u8(vandq_u8(q6bits.val[1], m4b), q6h.val[1])), m32s);
+            //q6bytes.val[2] = vsubq_s8(vreinterpretq_s8_u8(vorrq_u8(vandq_u8(q6bits.val[2], m4b), q6h.val[2])), m32s);
+            //q6bytes.val[3] = vsubq_s8(vreinterpretq_s8_u8(vorrq_u8(vandq_u8(q6bits.val[3], m4b), q6h.val[3])), m32s);
+            q6bytes.val[0] = vreinterpretq_s8_u8(vorrq_u8(vandq_u8(q6bits.val[0], m4b), q6h.val[0]));
+            q6bytes.val[1] = vreinterpretq_s8_u8(vorrq_u8(vandq_u8(q6bits.val[1], m4b), q6h.val[1]));
+            q6bytes.val[2] = vreinterpretq_s8_u8(vorrq_u8(vandq_u8(q6bits.val[2], m4b), q6h.val[2]));
+            q6bytes.val[3] = vreinterpretq_s8_u8(vorrq_u8(vandq_u8(q6bits.val[3], m4b), q6h.val[3]));
+
+
+            isum += vaddvq_s32(lm_ggml_sdotq_s32(vzero, q6bytes.val[0], q8bytes.val[0])) * scale[0] +
+                    vaddvq_s32(lm_ggml_sdotq_s32(vzero, q6bytes.val[1], q8bytes.val[1])) * scale[1] +
+                    vaddvq_s32(lm_ggml_sdotq_s32(vzero, q6bytes.val[2], q8bytes.val[2])) * scale[2] +
+                    vaddvq_s32(lm_ggml_sdotq_s32(vzero, q6bytes.val[3], q8bytes.val[3])) * scale[3];
+            scale += 4;
+
+
+            q8bytes = vld1q_s8_x4(q8); q8 += 64;
+
+            shifted = vshrq_n_u8(qhbits.val[0], 4);
+            q6h.val[0] = vshlq_n_u8(vandq_u8(mone, shifted), 4);
+            shifted = vshrq_n_u8(qhbits.val[1], 4);
+            q6h.val[1] = vshlq_n_u8(vandq_u8(mone, shifted), 4);
+            shifted = vshrq_n_u8(qhbits.val[0], 6);
+            q6h.val[2] = vshlq_n_u8(vandq_u8(mone, shifted), 4);
+            shifted = vshrq_n_u8(qhbits.val[1], 6);
+            q6h.val[3] = vshlq_n_u8(vandq_u8(mone, shifted), 4);
+
+            //q6bytes.val[0] = vsubq_s8(vreinterpretq_s8_u8(vorrq_u8(vshrq_n_u8(q6bits.val[0], 4), q6h.val[0])), m32s);
+            //q6bytes.val[1] = vsubq_s8(vreinterpretq_s8_u8(vorrq_u8(vshrq_n_u8(q6bits.val[1], 4), q6h.val[1])), m32s);
+            //q6bytes.val[2] = vsubq_s8(vreinterpretq_s8_u8(vorrq_u8(vshrq_n_u8(q6bits.val[2], 4), q6h.val[2])), m32s);
+            //q6bytes.val[3] = vsubq_s8(vreinterpretq_s8_u8(vorrq_u8(vshrq_n_u8(q6bits.val[3], 4), q6h.val[3])), m32s);
+            q6bytes.val[0] = vreinterpretq_s8_u8(vorrq_u8(vshrq_n_u8(q6bits.val[0], 4), q6h.val[0]));
+            q6bytes.val[1] = vreinterpretq_s8_u8(vorrq_u8(vshrq_n_u8(q6bits.val[1], 4), q6h.val[1]));
+            q6bytes.val[2] = vreinterpretq_s8_u8(vorrq_u8(vshrq_n_u8(q6bits.val[2], 4), q6h.val[2]));
+            q6bytes.val[3] = vreinterpretq_s8_u8(vorrq_u8(vshrq_n_u8(q6bits.val[3], 4), q6h.val[3]));
+
+
+            isum += vaddvq_s32(lm_ggml_sdotq_s32(vzero, q6bytes.val[0], q8bytes.val[0])) * scale[0] +
+                    vaddvq_s32(lm_ggml_sdotq_s32(vzero, q6bytes.val[1], q8bytes.val[1])) * scale[1] +
+                    vaddvq_s32(lm_ggml_sdotq_s32(vzero, q6bytes.val[2], q8bytes.val[2])) * scale[2] +
+                    vaddvq_s32(lm_ggml_sdotq_s32(vzero, q6bytes.val[3], q8bytes.val[3])) * scale[3];
+            scale += 4;
+
+            //for (int l = 0; l < 4; ++l) {
+            //    const int32x4_t p = lm_ggml_sdotq_s32(vzero, q6bytes.val[l], q8bytes.val[l]);
+            //    isum += vaddvq_s32(p) * *scale++;
+            //}
+
+        }
+        //sum += isum * d_all * y[i].d;
+        sum += d_all * y[i].d * (isum - 32 * isum_mins);
+
+    }
+    *s = sum;
+}
+
+void lm_ggml_vec_dot_q4_K_x4_q8_K_dotprod(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    assert(n % QK_K == 0);
+
+    const block_q4_Kx4 * restrict x = vx;
+    const block_q8_K   * restrict y = vy;
+
+    const int nb = n / QK_K;
+
+
+    const uint8x16_t m4b = vdupq_n_u8(0xf);
+    const uint8x16_t m6b = vdupq_n_u8(0x3f);
+
+    float32x4_t sumv = vdupq_n_f32(0.0f);
+
+    for (int i = 0; i < nb; ++i) {
+
+        // unpack the 6-bit scales and mins of the 4 rows at once, byte 4*j + r belongs to sub-block j of row r
+        const uint8x16_t s0 = vld1q_u8(x[i].scales[0]);
+        const uint8x16_t s1 = vld1q_u8(x[i].scales[4]);
+        const uint8x16_t s2 = vld1q_u8(x[i].scales[8]);
+
+        const uint8x16_t sc_lo = vandq_u8(s0, m6b);
+        const uint8x16_t sc_hi = vorrq_u8(vandq_u8(s2, m4b), vshlq_n_u8(vshrq_n_u8(s0, 6), 4));
+        const uint8x16_t mn_lo = vandq_u8(s1, m6b);
+        const uint8x16_t mn_hi = vorrq_u8(vshrq_n_u8(s2, 4), vshlq_n_u8(vshrq_n_u8(s1, 6), 4));
+
+        const uint16x8_t sc16[QK_K/64] = {
+            vmovl_u8(vget_low_u8(sc_lo)), vmovl_u8(vget_high_u8(sc_lo)),
+            vmovl_u8(vget_low_u8(sc_hi)), vmovl_u8(vget_high_u8(sc_hi)),
+        };
+
+        const int16x8_t q8sums = vpaddq_s16(vld1q_s16(y[i].bsums), vld1q_s16(y[i].bsums + 8));
+
+        const int16x8_t mn16_0 = vreinterpretq_s16_u16(vmovl_u8(vget_low_u8 (mn_lo)));
+        const int16x8_t mn16_1 = vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(mn_lo)));
+        const int16x8_t mn16_2 = vreinterpretq_s16_u16(vmovl_u8(vget_low_u8 (mn_hi)));
+        const int16x8_t mn16_3 = vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(mn_hi)));
+
+        int32x4_t summ = vdupq_n_s32(0);
+        summ = vmlal_laneq_s16(summ, vget_low_s16 (mn16_0), q8sums, 0);
+        summ = vmlal_laneq_s16(summ, vget_high_s16(mn16_0), q8sums, 1);
+        summ = vmlal_laneq_s16(summ, vget_low_s16 (mn16_1), q8sums, 2);
+        summ = vmlal_laneq_s16(summ, vget_high_s16(mn16_1), q8sums, 3);
+        summ = vmlal_laneq_s16(summ, vget_low_s16 (mn16_2), q8sums, 4);
+        summ = vmlal_laneq_s16(summ, vget_high_s16(mn16_2), q8sums, 5);
+        summ = vmlal_laneq_s16(summ, vget_low_s16 (mn16_3), q8sums, 6);
+        summ = vmlal_laneq_s16(summ, vget_high_s16(mn16_3), q8sums, 7);
+
+        const uint8_t * restrict q4 = x[i].qs;
+        const int8_t  * restrict q8 = y[i].qs;
+
+        int32x4_t sumi = vdupq_n_s32(0);
+
+        for (int j = 0; j < QK_K/64; ++j) {
+            const int32x4_t yl0 = vreinterpretq_s32_s8(vld1q_s8(q8 +  0));
+            const int32x4_t yl1 = vreinterpretq_s32_s8(vld1q_s8(q8 + 16));
+            const int32x4_t yh0 = vreinterpretq_s32_s8(vld1q_s8(q8 + 32));
+            const int32x4_t yh1 = vreinterpretq_s32_s8(vld1q_s8(q8 + 48));
+
+            int32x4_t suml = vdupq_n_s32(0);
+            int32x4_t sumh = vdupq_n_s32(0);
+
+            // each 16 bytes of x hold the same group of 4 quants of the 4 rows, multiply them with the broadcast group of y
+#define LM_GGML_Q4_K_X4_GROUP(k, yl, yh, l) \
+            { \
+                const uint8x16_t q = vld1q_u8(q4 + 16*(k)); \
+                suml = lm_ggml_sdotq_s32(suml, vreinterpretq_s8_u8(vandq_u8  (q, m4b)), vreinterpretq_s8_s32(vdupq_laneq_s32(yl, l))); \
+                sumh = lm_ggml_sdotq_s32(sumh, vreinterpretq_s8_u8(vshrq_n_u8(q, 4)),   vreinterpretq_s8_s32(vdupq_laneq_s32(yh, l))); \
+            }
+            LM_GGML_Q4_K_X4_GROUP(0, yl0, yh0, 0)
+            LM_GGML_Q4_K_X4_GROUP(1, yl0, yh0, 1)
+            LM_GGML_Q4_K_X4_GROUP(2, yl0, yh0, 2)
+            LM_GGML_Q4_K_X4_GROUP(3, yl0, yh0, 3)
+            LM_GGML_Q4_K_X4_GROUP(4, yl1, yh1, 0)
+            LM_GGML_Q4_K_X4_GROUP(5, yl1, yh1, 1)
+            LM_GGML_Q4_K_X4_GROUP(6, yl1, yh1, 2)
+            LM_GGML_Q4_K_X4_GROUP(7, yl1, yh1, 3)
+#undef LM_GGML_Q4_K_X4_GROUP
+
+            sumi = vmlaq_s32(sumi, suml, vreinterpretq_s32_u32(vmovl_u16(vget_low_u16 (sc16[j]))));
+            sumi = vmlaq_s32(sumi, sumh, vreinterpretq_s32_u32(vmovl_u16(vget_high_u16(sc16[j]))));
+
+            q4 += 128; q8 += 64;
+        }
+
+        const float d[4] = {
+            lm_ggml_fp16_to_fp32(x[i].d[0]), lm_ggml_fp16_to_fp32(x[i].d[1]),
+            lm_ggml_fp16_to_fp32(x[i].d[2]), lm_ggml_fp16_to_fp32(x[i].d[3]),
+        };
+        const float dmin[4] = {
+            lm_ggml_fp16_to_fp32(x[i].dmin[0]), lm_ggml_fp16_to_fp32(x[i].dmin[1]),
+            lm_ggml_fp16_to_fp32(x[i].dmin[2]), lm_ggml_fp16_to_fp32(x[i].dmin[3]),
+        };
+
+        sumv = vmlaq_f32(sumv, vcvtq_f32_s32(sumi), vmulq_n_f32(vld1q_f32(d),    y[i].d));
+        sumv = vmlsq_f32(sumv, vcvtq_f32_s32(summ), vmulq_n_f32(vld1q_f32(dmin), y[i].d));
+    }
+
+    vst1q_f32(s, sumv);
+}
+
+void lm_ggml_vec_dot_q4_K_q8_K_mxn_dotprod(const int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by) {
+    assert(n % QK_K == 0);
+
+    const block_q4_K * restrict x[LM_GGML_VEC_DOT_MXN_NR0];
+    const block_q8_K * restrict y[LM_GGML_VEC_DOT_MXN_NR1];
+
+    for (int r = 0; r < LM_GGML_VEC_DOT_MXN_NR0; ++r) {
+        x[r] = (const block_q4_K *) ((const char *) vx + r*bx);
+    }
+    for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+        y[c] = (const block_q8_K *) ((const char *) vy + c*by);
+    }
+
+    const int nb = n / QK_K;
+
+    static const uint32_t kmask1 = 0x3f3f3f3f;
+    static const uint32_t kmask2 = 0x0f0f0f0f;
+    static const uint32_t kmask3 = 0x03030303;
+
+    uint32_t utmp[4];
+
+
+    const uint8x16_t m4b = vdupq_n_u8(0xf);
+    const int32x4_t mzero = vdupq_n_s32(0);
+
+    float sumf[LM_GGML_VEC_DOT_MXN_NR1][LM_GGML_VEC_DOT_MXN_NR0] = { { 0 } };
+
+    for (int i = 0; i < nb; ++i) {
+
+        // unpack the scales and mins of the x super-blocks once for all columns of y
+        uint32_t   scales[LM_GGML_VEC_DOT_MXN_NR0][2];
+        int16x8_t  mins  [LM_GGML_VEC_DOT_MXN_NR0];
+
+        for (int r = 0; r < LM_GGML_VEC_DOT_MXN_NR0; ++r) {
+            memcpy(utmp, x[r][i].scales, 12);
+
+            uint32x2_t mins8 = { 0 };
+            mins8 = vset_lane_u32(utmp[1] & kmask1, mins8, 0);
+            mins8 = vset_lane_u32(((utmp[2] >> 4) & kmask2) | (((utmp[1] >> 6) & kmask3) << 4), mins8, 1);
+
+            scales[r][1] = (utmp[2] & kmask2) | (((utmp[0] >> 6) & kmask3) << 4);
+            scales[r][0] = utmp[0] & kmask1;
+
+            mins[r] = vreinterpretq_s16_u16(vmovl_u8(vreinterpret_u8_u32(mins8)));
+        }
+
+        for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+            const int16x8_t q8sums = vpaddq_s16(vld1q_s16(y[c][i].bsums), vld1q_s16(y[c][i].bsums + 8));
+
+            for (int r = 0; r < LM_GGML_VEC_DOT_MXN_NR0; ++r) {
+                const float dmin = y[c][i].d * lm_ggml_fp16_to_fp32(x[r][i].dmin);
+
+                const int32x4_t prod = vaddq_s32(vmull_s16(vget_low_s16 (q8sums), vget_low_s16 (mins[r])),
+                                                 vmull_s16(vget_high_s16(q8sums), vget_high_s16(mins[r])));
+                sumf[c][r] -= dmin * vaddvq_s32(prod);
+            }
+        }
+
+        // accumulate the scaled products in vectors and reduce them once per super-block
+        int32x4_t sumv[LM_GGML_VEC_DOT_MXN_NR1][LM_GGML_VEC_DOT_MXN_NR0];
+
+        for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+            for (int r = 0; r < LM_GGML_VEC_DOT_MXN_NR0; ++r) {
+                sumv[c][r] = mzero;
+            }
+        }
+
+        for (int j = 0; j < QK_K/64; ++j) {
+
+            uint8x16x2_t q4bits[LM_GGML_VEC_DOT_MXN_NR0];
+
+            for (int r = 0; r < LM_GGML_VEC_DOT_MXN_NR0; ++r) {
+                q4bits[r] = vld1q_u8_x2(x[r][i].qs + 32*j);
+            }
+
+            for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+                const int8x16x2_t q8l = vld1q_s8_x2(y[c][i].qs + 64*j);
+                const int8x16x2_t q8h = vld1q_s8_x2(y[c][i].qs + 64*j + 32);
+
+                for (int r = 0; r < LM_GGML_VEC_DOT_MXN_NR0; ++r) {
+                    const uint8_t * sc = (const uint8_t *) scales[r];
+
+                    int8x16x2_t q4bytes;
+
+                    q4bytes.val[0] = vreinterpretq_s8_u8(vandq_u8  (q4bits[r].val[0], m4b));
+                    q4bytes.val[1] = vreinterpretq_s8_u8(vandq_u8  (q4bits[r].val[1], m4b));
+
+                    const int32x4_t p1 = lm_ggml_sdotq_s32(lm_ggml_sdotq_s32(mzero, q4bytes.val[0], q8l.val[0]), q4bytes.val[1], q8l.val[1]);
+                    sumv[c][r] = vmlaq_n_s32(sumv[c][r], p1, sc[2*j+0]);
+
+                    q4bytes.val[0] = vreinterpretq_s8_u8(vshrq_n_u8(q4bits[r].val[0], 4));
+                    q4bytes.val[1] = vreinterpretq_s8_u8(vshrq_n_u8(q4bits[r].val[1], 4));
+
+                    const int32x4_t p2 = lm_ggml_sdotq_s32(lm_ggml_sdotq_s32(mzero, q4bytes.val[0], q8h.val[0]), q4bytes.val[1], q8h.val[1]);
+                    sumv[c][r] = vmlaq_n_s32(sumv[c][r], p2, sc[2*j+1]);
+                }
+            }
+        }
+
+        for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+            for (int r = 0; r < LM_GGML_VEC_DOT_MXN_NR0; ++r) {
+                const float d = y[c][i].d * lm_ggml_fp16_to_fp32(x[r][i].d);
+                sumf[c][r] += d * vaddvq_s32(sumv[c][r]);
+            }
+        }
+    }
+
+    for (int c = 0; c < LM_GGML_VEC_DOT_MXN_NR1; ++c) {
+        for (int r = 0; r < LM_GGML_VEC_DOT_MXN_NR0; ++r) {
+            s[c*bs + r] = sumf[c][r];
+        }
+    }
+}
+
+#endif // QK_K == 256 && defined(LM_GGML_ARM_DISPATCH)
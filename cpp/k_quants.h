@@ -126,6 +126,19 @@ typedef struct {
 static_assert(sizeof(block_q8_K) == sizeof(float) + QK_K + QK_K/16*sizeof(int16_t), "wrong q8_K block size/padding");
 
 
+#if QK_K == 256
+// 4 rows of q4_K blocks interleaved for the multi-row dot kernel (see lm_ggml_repack)
+// the quants of the rows are interleaved in groups of 4 bytes: qs[16*k + 4*r + j] = row r qs[4*k + j]
+// and the scales byte-wise, so that the 6-bit scales and mins of the 4 rows are unpacked at once
+typedef struct {
+    lm_ggml_fp16_t d[4];                // super-block scales of the 4 rows
+    lm_ggml_fp16_t dmin[4];             // super-block mins of the 4 rows
+    uint8_t scales[K_SCALE_SIZE][4]; // scales and mins, scales[k][r] = row r scales[k]
+    uint8_t qs[4*QK_K/2];            // interleaved 4-bit quants
+} block_q4_Kx4;
+static_assert(sizeof(block_q4_Kx4) == 4*sizeof(block_q4_K), "wrong q4_Kx4 block size/padding");
+#endif
+
 // Quantization
 void quantize_row_q2_K_reference(const float * restrict x, block_q2_K * restrict y, int k);
 void quantize_row_q3_K_reference(const float * restrict x, block_q3_K * restrict y, int k);
@@ -141,6 +154,11 @@ void quantize_row_q5_K(const float * restrict x, void * restrict y, int k);
 void quantize_row_q6_K(const float * restrict x, void * restrict y, int k);
 void quantize_row_q8_K(const float * restrict x, void * restrict y, int k);
 
+// Repacking into interleaved rows
+#if QK_K == 256
+void repack_q4_K_x4(const block_q4_K * restrict x, block_q4_Kx4 * restrict y, int nrows, int k);
+#endif
+
 // Dequantization
 void dequantize_row_q2_K(const block_q2_K * restrict x, float * restrict y, int k);
 void dequantize_row_q3_K(const block_q3_K * restrict x, float * restrict y, int k);
@@ -156,6 +174,42 @@ void lm_ggml_vec_dot_q4_K_q8_K(int n, float * restrict s, const void * restrict
 void lm_ggml_vec_dot_q5_K_q8_K(int n, float * restrict s, const void * restrict vx, const void * restrict vy);
 void lm_ggml_vec_dot_q6_K_q8_K(int n, float * restrict s, const void * restrict vx, const void * restrict vy);
 
+#if QK_K == 256
+void lm_ggml_vec_dot_q4_K_x4_q8_K(int n, float * restrict s, const void * restrict vx, const void * restrict vy);
+#endif
+
+#if QK_K == 256 && (defined(__AVX2__) || defined(__ARM_NEON))
+#define LM_GGML_VEC_DOT_Q4_K_Q8_K_MXN
+void lm_ggml_vec_dot_q4_K_q8_K_mxn(int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by);
+#endif
+
+// AVX-512 (BW, VL, VNNI) and AVX-VNNI variants, selected at runtime by lm_ggml_init
+#if QK_K == 256 && defined(LM_GGML_X86_DISPATCH)
+LM_GGML_TARGET_AVX512 void lm_ggml_vec_dot_q2_K_q8_K_avx512(int n, float * restrict s, const void * restrict vx, const void * restrict vy);
+LM_GGML_TARGET_AVX512 void lm_ggml_vec_dot_q3_K_q8_K_avx512(int n, float * restrict s, const void * restrict vx, const void * restrict vy);
+LM_GGML_TARGET_AVX512 void lm_ggml_vec_dot_q4_K_q8_K_avx512(int n, float * restrict s, const void * restrict vx, const void * restrict vy);
+LM_GGML_TARGET_AVX512 void lm_ggml_vec_dot_q5_K_q8_K_avx512(int n, float * restrict s, const void * restrict vx, const void * restrict vy);
+LM_GGML_TARGET_AVX512 void lm_ggml_vec_dot_q6_K_q8_K_avx512(int n, float * restrict s, const void * restrict vx, const void * restrict vy);
+
+LM_GGML_TARGET_AVXVNNI void lm_ggml_vec_dot_q2_K_q8_K_avxvnni(int n, float * restrict s, const void * restrict vx, const void * restrict vy);
+LM_GGML_TARGET_AVXVNNI void lm_ggml_vec_dot_q3_K_q8_K_avxvnni(int n, float * restrict s, const void * restrict vx, const void * restrict vy);
+LM_GGML_TARGET_AVXVNNI void lm_ggml_vec_dot_q4_K_q8_K_avxvnni(int n, float * restrict s, const void * restrict vx, const void * restrict vy);
+LM_GGML_TARGET_AVXVNNI void lm_ggml_vec_dot_q5_K_q8_K_avxvnni(int n, float * restrict s, const void * restrict vx, const void * restrict vy);
+LM_GGML_TARGET_AVXVNNI void lm_ggml_vec_dot_q6_K_q8_K_avxvnni(int n, float * restrict s, const void * restrict vx, const void * restrict vy);
+#endif
+
+// arm64 dotprod variants, selected at runtime by lm_ggml_init
+#if QK_K == 256 && defined(LM_GGML_ARM_DISPATCH)
+void lm_ggml_vec_dot_q2_K_q8_K_dotprod(int n, float * restrict s, const void * restrict vx, const void * restrict vy);
+void lm_ggml_vec_dot_q3_K_q8_K_dotprod(int n, float * restrict s, const void * restrict vx, const void * restrict vy);
+void lm_ggml_vec_dot_q4_K_q8_K_dotprod(int n, float * restrict s, const void * restrict vx, const void * restrict vy);
+void lm_ggml_vec_dot_q5_K_q8_K_dotprod(int n, float * restrict s, const void * restrict vx, const void * restrict vy);
+void lm_ggml_vec_dot_q6_K_q8_K_dotprod(int n, float * restrict s, const void * restrict vx, const void * restrict vy);
+
+void lm_ggml_vec_dot_q4_K_x4_q8_K_dotprod(int n, float * restrict s, const void * restrict vx, const void * restrict vy);
+void lm_ggml_vec_dot_q4_K_q8_K_mxn_dotprod(int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by);
+#endif
+
 // Quantization with histogram collection
 size_t lm_ggml_quantize_q2_K(const float * src, void * dst, int n, int k, int64_t * hist);
 size_t lm_ggml_quantize_q3_K(const float * src, void * dst, int n, int k, int64_t * hist);
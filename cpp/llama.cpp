@@ -32,6 +32,7 @@
 #ifdef __has_include
     #if __has_include(<unistd.h>)
         #include <unistd.h>
+        #include <fcntl.h>
         #if defined(_POSIX_MAPPED_FILES)
             #include <sys/mman.h>
         #endif
@@ -53,6 +54,7 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <cassert>
 #include <cinttypes>
 #include <climits>
@@ -61,8 +63,11 @@
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
+#include <condition_variable>
 #include <ctime>
+#include <deque>
 #include <fstream>
+#include <functional>
 #include <initializer_list>
 #include <map>
 #include <memory>
@@ -124,6 +129,28 @@ static size_t utf8_len(char src) {
     return lookup[highbits];
 }
 
+// true if the text is a sequence of whole UTF-8 characters: every lead byte is a 1 to 4 byte sequence start
+// followed by as many continuation bytes, and no sequence is cut off by the end of the text
+static bool utf8_is_valid(const char * text, size_t n) {
+    for (size_t i = 0; i < n;) {
+        const uint8_t c = text[i];
+        const size_t len = (c & 0x80) == 0x00 ? 1 :
+                           (c & 0xe0) == 0xc0 ? 2 :
+                           (c & 0xf0) == 0xe0 ? 3 :
+                           (c & 0xf8) == 0xf0 ? 4 : 0;
+        if (len == 0 || len > n - i) {
+            return false;
+        }
+        for (size_t j = 1; j < len; ++j) {
+            if ((text[i + j] & 0xc0) != 0x80) {
+                return false;
+            }
+        }
+        i += len;
+    }
+    return true;
+}
+
 static void replace_all(std::string & s, const std::string & search, const std::string & replace) {
     std::string result;
     for (size_t pos = 0; ; pos += search.length()) {
@@ -568,7 +595,8 @@ do { \
 // ggml helpers
 //
 
-static void lm_ggml_graph_compute_helper(std::vector<uint8_t> & buf, lm_ggml_cgraph * graph, int n_threads) {
+static void lm_ggml_graph_compute_helper(std::vector<uint8_t> & buf, lm_ggml_cgraph * graph, int n_threads,
+        void (*node_callback)(int node_n, void * data) = nullptr, void * node_callback_data = nullptr) {
     struct lm_ggml_cplan plan = lm_ggml_graph_plan(graph, n_threads);
 
     if (plan.work_size > 0) {
@@ -576,6 +604,9 @@ static void lm_ggml_graph_compute_helper(std::vector<uint8_t> & buf, lm_ggml_cgr
         plan.work_data = buf.data();
     }
 
+    plan.node_callback      = node_callback;
+    plan.node_callback_data = node_callback_data;
+
     lm_ggml_graph_compute(graph, &plan);
 }
 
@@ -611,6 +642,117 @@ static std::string llama_format_win_err(DWORD err) {
 }
 #endif
 
+//
+// transparent huge pages
+//
+// large buffers and file mappings can be advised with MADV_HUGEPAGE so that the kernel backs them with huge pages
+// (fewer TLB misses when streaming the weights), this only works where THP is enabled ("always" or "madvise"),
+// otherwise the memory silently stays on regular pages
+//
+
+#if defined(__linux__) && defined(_POSIX_MAPPED_FILES) && defined(MADV_HUGEPAGE)
+#define LLAMA_HUGEPAGES_SUPPORTED
+
+static size_t llama_hugepage_size() {
+    static const size_t size = []() {
+        size_t res = 2*1024*1024;
+        FILE * f = std::fopen("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size", "r");
+        if (f) {
+            unsigned long long val = 0;
+            if (std::fscanf(f, "%llu", &val) == 1 && val > 0) {
+                res = (size_t) val;
+            }
+            std::fclose(f);
+        }
+        return res;
+    }();
+    return size;
+}
+
+// maps anonymous memory at a huge page boundary, the size is rounded up to whole huge pages
+static void * llama_hugepage_alloc(size_t n, size_t & mapped_size) {
+    if (n == 0) {
+        return NULL;
+    }
+
+    const size_t page = llama_hugepage_size();
+    const size_t size = LM_GGML_PAD(n, page);
+
+    // over-allocate by one huge page and trim the unaligned head and tail
+    uint8_t * area = (uint8_t *) mmap(NULL, size + page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (area == MAP_FAILED) {
+        return NULL;
+    }
+
+    uint8_t * addr = (uint8_t *) LM_GGML_PAD((uintptr_t) area, page);
+    if (addr > area) {
+        munmap(area, addr - area);
+    }
+    if (addr + size < area + size + page) {
+        munmap(addr + size, (area + size + page) - (addr + size));
+    }
+
+    if (madvise(addr, size, MADV_HUGEPAGE)) {
+        // THP is not available in this kernel, the memory is still usable
+        LLAMA_LOG_WARN("%s: madvise(.., MADV_HUGEPAGE) failed: %s\n", __func__, strerror(errno));
+    }
+
+    mapped_size = size;
+    return addr;
+}
+
+static void llama_hugepage_free(void * data, size_t mapped_size) {
+    munmap(data, mapped_size);
+}
+
+// number of bytes in [addr, addr + size) that are currently backed by huge pages, from /proc/self/smaps
+// the kernel reports the huge pages per mapping, so a mapping that only partially overlaps the range is clamped to the overlap
+static size_t llama_hugepage_backed_size(const void * addr, size_t size) {
+    if (addr == NULL || size == 0) {
+        return 0;
+    }
+
+    FILE * f = std::fopen("/proc/self/smaps", "r");
+    if (!f) {
+        return 0;
+    }
+
+    const uintptr_t beg = (uintptr_t) addr;
+    const uintptr_t end = beg + size;
+
+    size_t res     = 0;
+    size_t overlap = 0;
+
+    char line[512];
+    while (std::fgets(line, sizeof(line), f)) {
+        unsigned long vm_beg;
+        unsigned long vm_end;
+        unsigned long kb;
+        if (std::sscanf(line, "%lx-%lx ", &vm_beg, &vm_end) == 2) {
+            overlap = vm_end > beg && vm_beg < end ? std::min<uintptr_t>(vm_end, end) - std::max<uintptr_t>(vm_beg, beg) : 0;
+        } else if (overlap > 0 && (std::sscanf(line, "AnonHugePages: %lu kB", &kb) == 1 ||
+                                   std::sscanf(line, "FilePmdMapped: %lu kB", &kb) == 1)) {
+            res += std::min<size_t>((size_t) kb*1024, overlap);
+        }
+    }
+
+    std::fclose(f);
+
+    return std::min(res, size);
+}
+#else
+static void llama_hugepage_free(void * data, size_t mapped_size) {
+    (void) data;
+    (void) mapped_size;
+}
+
+static size_t llama_hugepage_backed_size(const void * addr, size_t size) {
+    (void) addr;
+    (void) size;
+    return 0;
+}
+#endif
+
 struct llama_buffer {
     void * data = NULL;
     size_t size = 0;
@@ -619,8 +761,27 @@ struct llama_buffer {
     // useful in cases where CUDA can try to allocate PINNED memory
     bool fallback = false;
 
-    void resize(size_t n) {
-        llama_host_free(data);
+    // > 0 if the data is an aligned mapping advised for huge pages (the size rounded up to whole huge pages)
+    size_t mapped_size = 0;
+
+    llama_buffer() = default;
+    llama_buffer(const llama_buffer &) = delete;
+
+    // hugepages: map the buffer at a huge page boundary and advise it for THP, only used for plain host memory
+    void resize(size_t n, bool hugepages = false) {
+        release();
+
+#if defined(LLAMA_HUGEPAGES_SUPPORTED) && !defined(LM_GGML_USE_CUBLAS) && !defined(LM_GGML_USE_CPU_HBM)
+        if (hugepages) {
+            data = llama_hugepage_alloc(n, mapped_size);
+            if (data) {
+                size = n;
+                return;
+            }
+        }
+#else
+        (void) hugepages;
+#endif
 
         data = llama_host_malloc(n);
         if (!data) {
@@ -634,9 +795,49 @@ struct llama_buffer {
         size = n;
     }
 
+    size_t hugepage_size() const {
+        return mapped_size > 0 ? llama_hugepage_backed_size(data, size) : 0;
+    }
+
+    // returns the whole pages of [offs, offs + n) to the system, the buffer stays usable: on Linux the pages read
+    // back as zeros, elsewhere they may keep their content until the kernel reclaims them
+    // returns the number of bytes released
+    size_t release_pages(size_t offs, size_t n) {
+#if defined(_POSIX_MAPPED_FILES) && !defined(LM_GGML_USE_CUBLAS)
+        const size_t page = (size_t) sysconf(_SC_PAGESIZE);
+        const uintptr_t beg = LM_GGML_PAD((uintptr_t) data + offs, page);
+        const uintptr_t end = ((uintptr_t) data + offs + n) & ~(uintptr_t) (page - 1);
+        if (data == NULL || end <= beg) {
+            return 0;
+        }
+#if defined(__linux__)
+        const int advice = MADV_DONTNEED;
+#elif defined(MADV_FREE)
+        const int advice = MADV_FREE;
+#else
+        const int advice = MADV_DONTNEED;
+#endif
+        if (madvise((void *) beg, end - beg, advice)) {
+            return 0;
+        }
+        return end - beg;
+#else
+        // pinned CUDA host memory cannot be released page by page
+        (void) offs;
+        (void) n;
+        return 0;
+#endif
+    }
+
     ~llama_buffer() {
+        release();
+    }
+
+    void release() {
         if (data) {
-            if (fallback) { // NOLINT
+            if (mapped_size > 0) {
+                llama_hugepage_free(data, mapped_size);
+            } else if (fallback) { // NOLINT
                 free(data);
             } else {
                 llama_host_free(data);
@@ -644,6 +845,8 @@ struct llama_buffer {
         }
 
         data = NULL;
+        size = 0;
+        mapped_size = 0;
     }
 };
 
@@ -695,6 +898,29 @@ struct llama_file {
         }
     }
 
+#ifndef _WIN32
+    // reads at an absolute offset without moving the file position, so it can be called from several threads
+    void read_raw_at(void * ptr, size_t len, size_t offset) const {
+        const int fd = fileno(fp);
+        char * dst = (char *) ptr;
+        while (len > 0) {
+            const ssize_t ret = pread(fd, dst, len, (off_t) offset);
+            if (ret < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error(format("read error: %s", strerror(errno)));
+            }
+            if (ret == 0) {
+                throw std::runtime_error(std::string("unexpectedly reached end of file"));
+            }
+            dst    += ret;
+            len    -= ret;
+            offset += ret;
+        }
+    }
+#endif
+
     uint32_t read_u32() const {
         uint32_t ret;
         read_raw(&ret, sizeof(ret));
@@ -732,20 +958,44 @@ struct llama_mmap {
 #ifdef _POSIX_MAPPED_FILES
     static constexpr bool SUPPORTED = true;
 
-    llama_mmap(struct llama_file * file, size_t prefetch = (size_t) -1 /* -1 = max value */, bool numa = false) {
+    llama_mmap(struct llama_file * file, size_t prefetch = (size_t) -1 /* -1 = max value */, bool numa = false, bool hugepages = false) {
         size = file->size;
         int fd = fileno(file->fp);
         int flags = MAP_SHARED;
         // prefetch/readahead impairs performance on NUMA systems
         if (numa) { prefetch = 0; }
 #ifdef __linux__
-        if (prefetch) { flags |= MAP_POPULATE; }
+        // with huge pages the mapping is populated after it has been advised
+        if (prefetch && !hugepages) { flags |= MAP_POPULATE; }
+#endif
+        addr = MAP_FAILED;
+#ifdef LLAMA_HUGEPAGES_SUPPORTED
+        if (hugepages) {
+            addr = map_hugepage_aligned(fd, flags);
+        }
 #endif
-        addr = mmap(NULL, file->size, PROT_READ, flags, fd, 0);
+        if (addr == MAP_FAILED) {
+            addr = mmap(NULL, file->size, PROT_READ, flags, fd, 0);
+        }
         if (addr == MAP_FAILED) {
             throw std::runtime_error(format("mmap failed: %s", strerror(errno)));
         }
 
+#ifdef LLAMA_HUGEPAGES_SUPPORTED
+        if (hugepages) {
+            if (madvise(addr, file->size, MADV_HUGEPAGE)) {
+                fprintf(stderr, "warning: madvise(.., MADV_HUGEPAGE) failed: %s\n",
+                        strerror(errno));
+            }
+#ifdef MADV_POPULATE_READ
+            // fails with EINVAL before Linux 5.14, the MADV_WILLNEED readahead below still applies
+            if (prefetch > 0) {
+                madvise(addr, std::min(file->size, prefetch), MADV_POPULATE_READ);
+            }
+#endif
+        }
+#endif
+
         if (prefetch > 0) {
             // Advise the kernel to preload the mapped memory
             if (madvise(addr, std::min(file->size, prefetch), MADV_WILLNEED)) {
@@ -766,11 +1016,43 @@ struct llama_mmap {
     ~llama_mmap() {
         munmap(addr, size);
     }
+
+#ifdef LLAMA_HUGEPAGES_SUPPORTED
+    // the page cache can only map huge pages where the file offset and the address are both huge page aligned,
+    // so reserve an aligned range and map the file over it, returns MAP_FAILED on error
+    void * map_hugepage_aligned(int fd, int flags) const {
+        const size_t page = llama_hugepage_size();
+
+        uint8_t * area = (uint8_t *) mmap(NULL, size + page, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (area == MAP_FAILED) {
+            return MAP_FAILED;
+        }
+
+        uint8_t * aligned = (uint8_t *) LM_GGML_PAD((uintptr_t) area, page);
+        void * res = mmap(aligned, size, PROT_READ, flags | MAP_FIXED, fd, 0);
+        if (res == MAP_FAILED) {
+            munmap(area, size + page);
+            return MAP_FAILED;
+        }
+
+        // release the unused parts of the reservation
+        uint8_t * end = aligned + LM_GGML_PAD(size, (size_t) sysconf(_SC_PAGESIZE));
+        if (aligned > area) {
+            munmap(area, aligned - area);
+        }
+        if (end < area + size + page) {
+            munmap(end, (area + size + page) - end);
+        }
+
+        return res;
+    }
+#endif
 #elif defined(_WIN32)
     static constexpr bool SUPPORTED = true;
 
-    llama_mmap(struct llama_file * file, bool prefetch = true, bool numa = false) {
+    llama_mmap(struct llama_file * file, bool prefetch = true, bool numa = false, bool hugepages = false) {
         (void) numa;
+        (void) hugepages;
 
         size = file->size;
 
@@ -821,10 +1103,11 @@ struct llama_mmap {
 #else
     static constexpr bool SUPPORTED = false;
 
-    llama_mmap(struct llama_file * file, bool prefetch = true, bool numa = false) {
+    llama_mmap(struct llama_file * file, bool prefetch = true, bool numa = false, bool hugepages = false) {
         (void) file;
         (void) prefetch;
         (void) numa;
+        (void) hugepages;
 
         throw std::runtime_error(std::string("mmap not supported"));
     }
@@ -980,25 +1263,223 @@ struct llama_mlock {
 #endif
 };
 
-typedef void (*offload_func_t)(struct lm_ggml_tensor * tensor);
+// Streams the layer weights of a memory-mapped model during evaluation:
+// when the graph reaches a layer, the layers after it are prefetched by a background thread as far as the resident
+// budget allows, and the layers that are needed furthest in the future (usually the completed ones) are released.
+// This is only advice to the kernel, a released page that is used again is simply read back on demand.
+struct llama_layer_streamer {
+#ifdef _POSIX_MAPPED_FILES
+    static constexpr bool SUPPORTED = true;
+#else
+    static constexpr bool SUPPORTED = false;
+#endif
 
-static void llama_nop(struct lm_ggml_tensor * tensor) { // don't offload by default
-    (void) tensor;
-}
+    struct span {
+        uint8_t * addr;
+        size_t    size;
+    };
+
+    struct op {
+        int  il;
+        bool prefetch; // false - release
+    };
+
+    std::vector<std::vector<span>> layers; // page-aligned ranges of the layer weights in the mapping
+    std::vector<size_t>            layer_size;
+    std::vector<bool>              resident;
+
+    std::unordered_map<const lm_ggml_tensor *, int> tensor_layer;
 
-static std::string llama_token_to_piece(const struct llama_context * ctx, llama_token token) {
-    std::vector<char> result(8, 0);
-    const int n_tokens = llama_token_to_piece(llama_get_model(ctx), token, result.data(), result.size());
-    if (n_tokens < 0) {
-        result.resize(-n_tokens);
-        int check = llama_token_to_piece(llama_get_model(ctx), token, result.data(), result.size());
-        LM_GGML_ASSERT(check == -n_tokens);
+    size_t budget;
+    size_t page_size;
+
+    std::mutex              mutex;
+    std::condition_variable cv;
+    std::deque<op>          ops;
+    bool                    stop = false;
+    std::thread             worker;
+
+    llama_layer_streamer(const std::vector<std::pair<std::string, struct lm_ggml_tensor *>> & tensors, const llama_mmap & mapping, int n_layer, size_t budget)
+        : layers(n_layer), layer_size(n_layer, 0), resident(n_layer, false), budget(budget), page_size(llama_mlock::lock_granularity()) {
+        uint8_t * map_beg = (uint8_t *) mapping.addr;
+        uint8_t * map_end = map_beg + mapping.size;
+
+        std::vector<std::vector<span>> ranges(n_layer);
+        for (const auto & it : tensors) {
+            int il = -1;
+            if (sscanf(it.first.c_str(), "blk.%d.", &il) != 1 || il < 0 || il >= n_layer) {
+                continue;
+            }
+            uint8_t * data = (uint8_t *) it.second->data;
+            if (data < map_beg || data >= map_end || it.second->backend != LM_GGML_BACKEND_CPU) {
+                // repacked or offloaded
+                continue;
+            }
+            ranges[il].push_back({data, lm_ggml_nbytes(it.second)});
+            tensor_layer[it.second] = il;
+        }
+
+        // merge the tensors of a layer into contiguous page ranges
+        for (int il = 0; il < n_layer; il++) {
+            std::sort(ranges[il].begin(), ranges[il].end(), [](const span & a, const span & b) { return a.addr < b.addr; });
+            for (const span & r : ranges[il]) {
+                uint8_t * beg = (uint8_t *) ((uintptr_t) r.addr & ~(page_size - 1));
+                uint8_t * end = (uint8_t *) LM_GGML_PAD((uintptr_t) (r.addr + r.size), page_size);
+                if (!layers[il].empty() && beg <= layers[il].back().addr + layers[il].back().size) {
+                    span & last = layers[il].back();
+                    last.size = std::max(last.size, (size_t) (end - last.addr));
+                } else {
+                    layers[il].push_back({beg, (size_t) (end - beg)});
+                }
+            }
+            for (const span & s : layers[il]) {
+                layer_size[il] += s.size;
+            }
+        }
+
+        worker = std::thread([this]() { run(); });
     }
-    else {
-        result.resize(n_tokens);
+
+    ~llama_layer_streamer() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        cv.notify_one();
+        worker.join();
+    }
+
+    size_t total_size() const {
+        return std::accumulate(layer_size.begin(), layer_size.end(), (size_t) 0);
+    }
+
+    size_t max_layer_size() const {
+        return layer_size.empty() ? 0 : *std::max_element(layer_size.begin(), layer_size.end());
+    }
+
+    // for each node of the graph: the layer whose weights it is the first to use, -1 otherwise
+    void find_layer_starts(const struct lm_ggml_cgraph * gf, std::vector<int32_t> & starts) const {
+        starts.assign(gf->n_nodes, -1);
+        int il_cur = -1;
+        for (int i = 0; i < gf->n_nodes; i++) {
+            for (int j = 0; j < LM_GGML_MAX_SRC; j++) {
+                const lm_ggml_tensor * src = gf->nodes[i]->src[j];
+                if (src == NULL) {
+                    continue;
+                }
+                auto it = tensor_layer.find(src);
+                if (it != tensor_layer.end() && it->second != il_cur) {
+                    starts[i] = il_cur = it->second;
+                    break;
+                }
+            }
+        }
     }
 
-    return std::string(result.data(), result.size());
+    // the graph is about to compute layer il
+    void begin_layer(int il) {
+        const int n_layer = (int) layers.size();
+
+        // the layers are evaluated in order, so keep the ones needed soonest: il, il + 1, ... wrapping to the next evaluation
+        std::vector<bool> keep(n_layer, false);
+        size_t size_keep = 0;
+        for (int k = 0; k < n_layer; k++) {
+            const int j = (il + k) % n_layer;
+            if (k > 0 && size_keep + layer_size[j] > budget) {
+                break;
+            }
+            keep[j] = true;
+            size_keep += layer_size[j];
+        }
+
+        bool notify = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            // release first, so that the prefetched pages can reuse the memory
+            for (int j = 0; j < n_layer; j++) {
+                if (resident[j] && !keep[j]) {
+                    ops.push_back({j, false});
+                    resident[j] = false;
+                    notify = true;
+                }
+            }
+            for (int k = 0; k < n_layer; k++) {
+                const int j = (il + k) % n_layer;
+                if (!keep[j]) {
+                    break;
+                }
+                if (!resident[j]) {
+                    ops.push_back({j, true});
+                    resident[j] = true;
+                    notify = true;
+                }
+            }
+        }
+        if (notify) {
+            cv.notify_one();
+        }
+    }
+
+private:
+    void run() {
+        while (true) {
+            op cur;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [&]() { return stop || !ops.empty(); });
+                if (stop) {
+                    return;
+                }
+                cur = ops.front();
+                ops.pop_front();
+            }
+            for (const span & s : layers[cur.il]) {
+                if (cur.prefetch) {
+                    prefetch(s);
+                } else {
+                    release(s);
+                }
+            }
+        }
+    }
+
+    void prefetch(const span & s) {
+#ifdef _POSIX_MAPPED_FILES
+        madvise(s.addr, s.size, MADV_WILLNEED);
+#endif
+#ifdef MADV_POPULATE_READ
+        // Linux 5.14+, maps the pages without faulting them in one by one
+        if (madvise(s.addr, s.size, MADV_POPULATE_READ) == 0) {
+            return;
+        }
+#endif
+        // touch every page from this thread, so that the evaluation does not wait for the reads
+        volatile uint8_t sum = 0;
+        for (size_t offs = 0; offs < s.size; offs += page_size) {
+            sum += s.addr[offs];
+        }
+        (void) sum;
+    }
+
+    void release(const span & s) {
+#ifdef MADV_PAGEOUT
+        // Linux 5.4+, also drops the pages from the page cache when no one else maps them
+        if (madvise(s.addr, s.size, MADV_PAGEOUT) == 0) {
+            return;
+        }
+#endif
+#ifdef _POSIX_MAPPED_FILES
+        madvise(s.addr, s.size, MADV_DONTNEED);
+#else
+        (void) s;
+#endif
+    }
+};
+
+typedef void (*offload_func_t)(struct lm_ggml_tensor * tensor);
+
+static void llama_nop(struct lm_ggml_tensor * tensor) { // don't offload by default
+    (void) tensor;
 }
 
 //
@@ -1090,6 +1571,7 @@ struct llama_hparams {
 struct llama_cparams {
     uint32_t n_ctx;       // context size used during inference
     uint32_t n_batch;
+    uint32_t n_ubatch;        // micro-batch size: larger batches are split to fit the compute buffer cap
     uint32_t n_threads;       // number of threads to use for generation
     uint32_t n_threads_batch; // number of threads to use for batch processing
 
@@ -1097,6 +1579,10 @@ struct llama_cparams {
     float rope_freq_scale;
 
     bool mul_mat_q;
+    bool embedding_only; // build the graph without the output layer
+    bool flash_attn;     // fused attention, the KQ matrix is never materialized
+    bool fused_ops;      // fused norm, residual and SwiGLU nodes (CPU only)
+    bool use_hugepages;  // the KV cache and the compute buffer are advised for huge pages
 };
 
 struct llama_layer {
@@ -1166,17 +1652,319 @@ struct llama_kv_cache {
 
     struct lm_ggml_context * ctx = NULL;
 
-    llama_buffer buf;
+    llama_buffer buf;
+
+    ~llama_kv_cache() {
+        if (ctx) {
+            lm_ggml_free(ctx);
+        }
+
+#ifdef LM_GGML_USE_CUBLAS
+        lm_ggml_cuda_free_data(k);
+        lm_ggml_cuda_free_data(v);
+#endif // LM_GGML_USE_CUBLAS
+    }
+};
+
+// Aho-Corasick automaton over the special token texts, used to split a text into special tokens and the
+// raw text between them in a single pass instead of searching the text once per special token
+struct llama_special_token_matcher {
+    struct node {
+        uint32_t edges_begin = 0;  // children of the node in edges[edges_begin, edges_end), sorted by byte
+        uint32_t edges_end   = 0;
+        uint32_t fail        = 0;  // node of the longest proper suffix of the node text
+        uint32_t depth       = 0;
+        int32_t  out_id      = -1; // longest special token that is a suffix of the node text
+        uint32_t out_len     = 0;
+    };
+
+    struct edge {
+        uint8_t  c;
+        uint32_t node;
+    };
+
+    std::vector<node> nodes;
+    std::vector<edge> edges;
+    uint32_t root_next[256] = {};
+
+    void build(const std::unordered_map<std::string, int32_t> & tokens) {
+        // sorted for a deterministic node order, the trie is first built with temporary child maps
+        std::vector<std::pair<std::string, int32_t>> sorted(tokens.begin(), tokens.end());
+        std::sort(sorted.begin(), sorted.end());
+
+        std::vector<std::map<uint8_t, uint32_t>> children(1);
+        nodes.assign(1, node());
+        edges.clear();
+        std::fill(std::begin(root_next), std::end(root_next), 0);
+
+        for (const auto & t : sorted) {
+            uint32_t cur = 0;
+            for (const char ch : t.first) {
+                const uint8_t c = ch;
+                const auto it = children[cur].find(c);
+                if (it != children[cur].end()) {
+                    cur = it->second;
+                    continue;
+                }
+                const uint32_t child = nodes.size();
+                children[cur][c] = child;
+                children.emplace_back();
+                nodes.emplace_back();
+                nodes[child].depth = nodes[cur].depth + 1;
+                cur = child;
+            }
+            nodes[cur].out_id  = t.second;
+            nodes[cur].out_len = nodes[cur].depth;
+        }
+
+        // breadth-first, so the fail node and its output are final before they are used
+        std::vector<uint32_t> queue(1, 0);
+        for (size_t qi = 0; qi < queue.size(); ++qi) {
+            const uint32_t u = queue[qi];
+            nodes[u].edges_begin = edges.size();
+            for (const auto & ch : children[u]) {
+                const uint8_t  c = ch.first;
+                const uint32_t v = ch.second;
+                edges.push_back({c, v});
+                if (u == 0) {
+                    root_next[c] = v;
+                } else {
+                    nodes[v].fail = next(nodes[u].fail, c);
+                }
+                if (nodes[v].out_id < 0) {
+                    nodes[v].out_id  = nodes[nodes[v].fail].out_id;
+                    nodes[v].out_len = nodes[nodes[v].fail].out_len;
+                }
+                queue.push_back(v);
+            }
+            nodes[u].edges_end = edges.size();
+        }
+    }
+
+    uint32_t next(uint32_t state, uint8_t c) const {
+        while (state != 0) {
+            const node & n = nodes[state];
+            for (uint32_t e = n.edges_begin; e < n.edges_end; ++e) {
+                if (edges[e].c == c) {
+                    return edges[e].node;
+                }
+            }
+            state = n.fail;
+        }
+        return root_next[c];
+    }
+
+    // finds the leftmost special token in text[begin, end), the longest one if several start there
+    bool find(const std::string & text, size_t begin, size_t end, size_t & match_pos, size_t & match_len, int32_t & match_id) const {
+        if (nodes.size() <= 1) {
+            return false;
+        }
+
+        bool found = false;
+        uint32_t state = 0;
+        for (size_t i = begin; i < end; ++i) {
+            state = next(state, text[i]);
+            const node & n = nodes[state];
+
+            // the partial match in progress starts after the match found so far, it cannot be improved
+            if (found && i + 1 - n.depth > match_pos) {
+                break;
+            }
+
+            if (n.out_id >= 0) {
+                const size_t pos = i + 1 - n.out_len;
+                if (!found || pos < match_pos || (pos == match_pos && n.out_len > match_len)) {
+                    found     = true;
+                    match_pos = pos;
+                    match_len = n.out_len;
+                    match_id  = n.out_id;
+                }
+            }
+        }
+
+        return found;
+    }
+};
+
+// FNV-1a, h continues a previous hash
+static uint64_t llama_fnv1a(const void * data, size_t n, uint64_t h = 0xcbf29ce484222325ull) {
+    const uint8_t * p = (const uint8_t *) data;
+    for (size_t i = 0; i < n; ++i) {
+        h ^= p[i];
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+
+// perfect hash of the token texts, by hash and displace: the texts are split into buckets by their hash and
+// each bucket gets a seed that sends all of its texts to free slots, so a lookup is one hash of the text, two array
+// reads and a compare with the text of the only candidate token
+struct llama_token_text_index {
+    std::vector<uint32_t> seeds; // per bucket
+    std::vector<int32_t>  slots; // token id, -1 for a free slot
+
+    static uint64_t hash(const char * text, size_t n) {
+        return llama_fnv1a(text, n);
+    }
+
+    static uint64_t mix(uint64_t h) {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdull;
+        h ^= h >> 33;
+        return h;
+    }
+
+    // fnv-1a of short texts differs only in a few bits, so the bucket is taken from the mixed hash
+    size_t bucket(uint64_t h) const {
+        return (size_t) (mix(h) >> 32) % seeds.size();
+    }
+
+    size_t slot(uint64_t h, uint32_t seed) const {
+        return (size_t) mix(h ^ (uint64_t) seed * 0x9E3779B97F4A7C15ull) & (slots.size() - 1);
+    }
+
+    // hashes[i] is the hash of the text of token i, returns false if two tokens have the same hash
+    bool build(const std::vector<uint64_t> & hashes) {
+        const size_t n = hashes.size();
+
+        size_t n_slots = 16;
+        while (n_slots < n + n/4) {
+            n_slots *= 2;
+        }
+
+        seeds.assign(std::max<size_t>(1, n/4), 0);
+        slots.assign(n_slots, -1);
+
+        // the ids of each bucket, largest buckets first
+        std::vector<std::vector<int32_t>> buckets(seeds.size());
+        for (size_t i = 0; i < n; ++i) {
+            buckets[bucket(hashes[i])].push_back(i);
+        }
+
+        std::vector<uint32_t> order(buckets.size());
+        for (size_t b = 0; b < order.size(); ++b) {
+            order[b] = b;
+        }
+        std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+            return buckets[a].size() > buckets[b].size();
+        });
+
+        std::vector<size_t> placed;
+        for (const uint32_t b : order) {
+            const auto & ids = buckets[b];
+            if (ids.empty()) {
+                break;
+            }
+
+            for (uint32_t seed = 0;; ++seed) {
+                if (seed == UINT32_MAX) {
+                    return false;
+                }
+
+                placed.clear();
+                for (const int32_t id : ids) {
+                    const size_t i = slot(hashes[id], seed);
+                    if (slots[i] != -1 || std::find(placed.begin(), placed.end(), i) != placed.end()) {
+                        break;
+                    }
+                    placed.push_back(i);
+                }
+
+                if (placed.size() == ids.size()) {
+                    for (size_t k = 0; k < ids.size(); ++k) {
+                        slots[placed[k]] = ids[k];
+                    }
+                    seeds[b] = seed;
+                    break;
+                }
+
+                // texts with the same hash can never be told apart
+                if (seed == 0) {
+                    for (size_t k = 1; k < ids.size(); ++k) {
+                        for (size_t l = 0; l < k; ++l) {
+                            if (hashes[ids[k]] == hashes[ids[l]]) {
+                                return false;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+
+        return true;
+    }
+
+    // the only token the text can be, the caller compares the texts
+    int32_t find(uint64_t h) const {
+        if (seeds.empty()) {
+            return -1;
+        }
+        return slots[slot(h, seeds[bucket(h)])];
+    }
+};
+
+// BPE merges keyed by the token ids of the merged pair, open addressing with linear probing
+struct llama_bpe_rank_table {
+    struct entry {
+        uint64_t key  = UINT64_MAX; // (left id << 32) | right id, UINT64_MAX for an empty slot
+        int32_t  rank = -1;
+        int32_t  id   = -1;         // token id of the merge result
+    };
+
+    std::vector<entry> entries;
+    size_t n_merges = 0;
+
+    static uint64_t make_key(int32_t left, int32_t right) {
+        return ((uint64_t) (uint32_t) left << 32) | (uint32_t) right;
+    }
+
+    size_t slot(uint64_t key) const {
+        return (size_t) ((key * 0x9E3779B97F4A7C15ull) >> 32) & (entries.size() - 1);
+    }
+
+    void reserve(size_t n) {
+        size_t n_slots = 16;
+        while (n_slots < 2*n) {
+            n_slots *= 2;
+        }
+        entries.assign(n_slots, entry());
+        n_merges = 0;
+    }
+
+    // keeps the first (lowest) rank of a pair that is listed more than once
+    void insert(int32_t left, int32_t right, int32_t rank, int32_t id) {
+        const uint64_t key = make_key(left, right);
+        for (size_t i = slot(key);; i = (i + 1) & (entries.size() - 1)) {
+            if (entries[i].key == key) {
+                return;
+            }
+            if (entries[i].key == UINT64_MAX) {
+                entries[i].key  = key;
+                entries[i].rank = rank;
+                entries[i].id   = id;
+                n_merges++;
+                return;
+            }
+        }
+    }
 
-    ~llama_kv_cache() {
-        if (ctx) {
-            lm_ggml_free(ctx);
+    const entry * find(int32_t left, int32_t right) const {
+        if (entries.empty()) {
+            return nullptr;
+        }
+        const uint64_t key = make_key(left, right);
+        for (size_t i = slot(key);; i = (i + 1) & (entries.size() - 1)) {
+            if (entries[i].key == key) {
+                return &entries[i];
+            }
+            if (entries[i].key == UINT64_MAX) {
+                return nullptr;
+            }
         }
+    }
 
-#ifdef LM_GGML_USE_CUBLAS
-        lm_ggml_cuda_free_data(k);
-        lm_ggml_cuda_free_data(v);
-#endif // LM_GGML_USE_CUBLAS
+    size_t size() const {
+        return n_merges;
     }
 };
 
@@ -1185,20 +1973,45 @@ struct llama_vocab {
     using token = std::string;
     using ttype = llama_token_type;
 
+    // a token text in text_data, followed by a 0 byte
+    struct token_text {
+        const char * data = "";
+        uint32_t     size = 0;
+
+        const char * c_str() const { return data; }
+        std::string  str()   const { return std::string(data, size); }
+    };
+
     struct token_data {
-        token text;
-        float score;
-        ttype type;
+        token_text text;
+        float      score;
+        ttype      type;
     };
 
     enum llama_vocab_type type = LLAMA_VOCAB_TYPE_SPM;
 
-    std::unordered_map<token, id> token_to_id;
-    std::vector<token_data>       id_to_token;
+    std::vector<token_data> id_to_token;
+
+    // the texts of all the tokens back to back, and the perfect hash from a text to its token, see find_token
+    std::vector<char>      text_data;
+    llama_token_text_index text_index;
 
     std::unordered_map<token, id> special_tokens_cache;
+    llama_special_token_matcher   special_tokens_matcher;
+
+    llama_bpe_rank_table bpe_ranks;
 
-    std::map<std::pair<std::string, std::string>, int> bpe_ranks;
+    // tokens of the single UTF-8 characters the BPE merges start from, keyed by the character bytes
+    std::unordered_map<uint32_t, id> bpe_char_ids;
+
+    // no SPM token contains a space that follows other text, so the escaped text can be tokenized in pieces
+    // split before such spaces
+    bool spm_split_at_spaces = false;
+
+    // decoded piece of every token, see llama_token_get_piece: token i is
+    // token_piece_data[token_piece_offset[i] .. token_piece_offset[i + 1] - 1), followed by a 0 byte
+    std::vector<char>     token_piece_data;
+    std::vector<uint32_t> token_piece_offset;
 
     // default LLaMA special tokens
     id special_bos_id = 1;
@@ -1213,18 +2026,47 @@ struct llama_vocab {
     id special_suffix_id = 32008;
     id special_eot_id    = 32010;
 
-    int find_bpe_rank(std::string token_left, std::string token_right) const {
-        LM_GGML_ASSERT(token_left.find(" ") == std::string::npos);
-        LM_GGML_ASSERT(token_left.find("\n") == std::string::npos);
-        LM_GGML_ASSERT(token_right.find(" ") == std::string::npos);
-        LM_GGML_ASSERT(token_right.find("\n") == std::string::npos);
+    static uint32_t bpe_char_key(const char * text, size_t n) {
+        uint32_t key = 0;
+        for (size_t i = 0; i < n; ++i) {
+            key = (key << 8) | (uint8_t) text[i];
+        }
+        return key;
+    }
+
+    id find_bpe_char(const char * text, size_t n) const {
+        if (n > 4) {
+            return -1;
+        }
+        auto it = bpe_char_ids.find(bpe_char_key(text, n));
+        return it == bpe_char_ids.end() ? -1 : it->second;
+    }
+
+    const llama_bpe_rank_table::entry * find_bpe_merge(id token_left, id token_right) const {
+        return bpe_ranks.find(token_left, token_right);
+    }
 
-        auto it = bpe_ranks.find(std::make_pair(token_left, token_right));
-        if (it == bpe_ranks.end()) {
+    // the token with exactly this text, -1 if there is none
+    id find_token(const char * text, size_t n) const {
+        const id id = text_index.find(llama_token_text_index::hash(text, n));
+        if (id < 0) {
             return -1;
         }
+        const token_text & t = id_to_token[id].text;
+        return t.size == n && memcmp(t.data, text, n) == 0 ? id : -1;
+    }
+
+    id find_token(const std::string & text) const {
+        return find_token(text.data(), text.size());
+    }
 
-        return it->second;
+    // throws std::out_of_range if there is no token with this text
+    id token_id(const std::string & text) const {
+        const id id = find_token(text);
+        if (id < 0) {
+            throw std::out_of_range("token not in vocab: " + text);
+        }
+        return id;
     }
 };
 
@@ -1260,9 +2102,19 @@ struct llama_model {
     // model memory mapped file
     std::unique_ptr<llama_mmap> mapping;
 
+    // weights repacked into interleaved layouts, when they cannot be repacked in place (mmap)
+    llama_buffer buf_repack;
+
+    // the weight buffers and the file mapping are advised for transparent huge pages
+    bool use_hugepages = false;
+
+    // streams the layer weights from the mapping during evaluation, destroyed before the mapping
+    std::unique_ptr<llama_layer_streamer> streamer;
+
     // objects representing data potentially being locked in memory
     llama_mlock mlock_buf;
     llama_mlock mlock_mmap;
+    llama_mlock mlock_repack;
 
     // for quantize-stats only
     std::vector<std::pair<std::string, struct lm_ggml_tensor *>> tensors_by_name;
@@ -1270,6 +2122,14 @@ struct llama_model {
     int64_t t_load_us = 0;
     int64_t t_start_us = 0;
 
+    // prepared-model cache, see llama_prepared_cache_save
+    std::string cache_path;
+    uint64_t    cache_model_hash = 0;
+    std::mutex  cache_mutex;
+
+    // compute buffer size measured for each set of context parameters, see llama_compute_size_key
+    std::vector<std::pair<uint64_t, uint64_t>> cache_compute_sizes;
+
     ~llama_model() {
         if (ctx) {
             lm_ggml_free(ctx);
@@ -1326,18 +2186,29 @@ struct llama_context {
     std::vector<float> logits;
     bool logits_all = false;
 
+    // batch rows that produce an output in the current decode (empty - all rows)
+    std::vector<int32_t> out_ids;
+
     // input embedding (1-dimensional array: [n_embd])
     std::vector<float> embedding;
 
     // reusable buffer for `struct lm_ggml_graph_plan.work_data`
     std::vector<uint8_t> work_buffer;
 
+    // weight streaming: for each node of the current graph, the layer it starts (-1 - none)
+    std::vector<int32_t> stream_layer_starts;
+
     // memory buffers used to evaluate the model
     llama_buffer buf_compute;
 
     llama_buffer buf_alloc;
     lm_ggml_allocr * alloc = NULL;
 
+    // measured sizes of buf_alloc, for a micro-batch and for a single token: the buffer is sized for the batch being
+    // decoded (alloc_size_decode is 0 when the buffer is not tiered), and allocated again after llama_trim released it
+    size_t alloc_size        = 0;
+    size_t alloc_size_decode = 0;
+
 #ifdef LM_GGML_USE_METAL
     lm_ggml_metal_context * ctx_metal = NULL;
 #endif
@@ -1347,6 +2218,24 @@ struct llama_context {
 #endif
 };
 
+static const size_t LLAMA_TENSOR_ALIGNMENT = 32;
+
+static void llama_compute_buffers_alloc(llama_context & ctx, uint32_t n_tokens) {
+    const size_t size = n_tokens == 1 && ctx.alloc_size_decode > 0 ? ctx.alloc_size_decode : ctx.alloc_size;
+    if (ctx.alloc && ctx.buf_alloc.size == size) {
+        return;
+    }
+
+    if (!ctx.buf_compute.data) {
+        ctx.buf_compute.resize(lm_ggml_tensor_overhead()*LM_GGML_MAX_NODES + lm_ggml_graph_overhead());
+    }
+    if (ctx.alloc) {
+        lm_ggml_allocr_free(ctx.alloc);
+    }
+    ctx.buf_alloc.resize(size, ctx.cparams.use_hugepages);
+    ctx.alloc = lm_ggml_allocr_new(ctx.buf_alloc.data, ctx.buf_alloc.size, LLAMA_TENSOR_ALIGNMENT);
+}
+
 //
 // kv cache helpers
 //
@@ -1356,7 +2245,8 @@ static bool llama_kv_cache_init(
              struct llama_kv_cache & cache,
                          lm_ggml_type   wtype,
                           uint32_t   n_ctx,
-                               int   n_gpu_layers) {
+                               int   n_gpu_layers,
+                              bool   use_hugepages) {
     const uint32_t n_embd  = hparams.n_embd_gqa();
     const uint32_t n_layer = hparams.n_layer;
 
@@ -1371,7 +2261,7 @@ static bool llama_kv_cache_init(
     cache.cells.clear();
     cache.cells.resize(n_ctx);
 
-    cache.buf.resize(2u*n_elements*lm_ggml_type_size(wtype) + 2u*lm_ggml_tensor_overhead());
+    cache.buf.resize(2u*n_elements*lm_ggml_type_size(wtype) + 2u*lm_ggml_tensor_overhead(), use_hugepages);
     memset(cache.buf.data, 0, cache.buf.size);
 
     struct lm_ggml_init_params params;
@@ -1479,6 +2369,42 @@ static int32_t llama_kv_cache_cell_max(const struct llama_kv_cache & cache) {
     return 0;
 }
 
+// releases the pages of the cells past the last used one: the K rows of a layer are contiguous, the V is stored
+// transposed so its free cells are at the end of every row of every layer - the released cells read back as zeros
+// (or as their old values), which are masked out like the cells never used
+static size_t llama_kv_cache_trim(struct llama_kv_cache & cache, const struct llama_hparams & hparams) {
+    if (!cache.k || cache.k->backend != LM_GGML_BACKEND_CPU || cache.v->backend != LM_GGML_BACKEND_CPU) {
+        return 0;
+    }
+
+    const size_t n_ctx      = cache.size;
+    const size_t n_embd_gqa = hparams.n_embd_gqa();
+    const size_t n_layer    = hparams.n_layer;
+    const size_t cell_max   = llama_kv_cache_cell_max(cache);
+    const size_t esize      = lm_ggml_element_size(cache.k);
+
+    const size_t offs_k = (uint8_t *) cache.k->data - (uint8_t *) cache.buf.data;
+    const size_t offs_v = (uint8_t *) cache.v->data - (uint8_t *) cache.buf.data;
+
+    if (cell_max == 0) {
+        return cache.buf.release_pages(offs_k, lm_ggml_nbytes(cache.k)) + cache.buf.release_pages(offs_v, lm_ggml_nbytes(cache.v));
+    }
+
+    size_t released = 0;
+    for (size_t il = 0; il < n_layer; ++il) {
+        released += cache.buf.release_pages(offs_k + esize*n_embd_gqa*(il*n_ctx + cell_max), esize*n_embd_gqa*(n_ctx - cell_max));
+    }
+
+    // a row shorter than a page has nothing to release
+    if (esize*(n_ctx - cell_max) >= llama_mlock::lock_granularity()) {
+        for (size_t row = 0; row < n_layer*n_embd_gqa; ++row) {
+            released += cache.buf.release_pages(offs_v + esize*(row*n_ctx + cell_max), esize*(n_ctx - cell_max));
+        }
+    }
+
+    return released;
+}
+
 static void llama_kv_cache_tokens_rm(struct llama_kv_cache & cache, int32_t c0, int32_t c1) {
     if (c0 < 0) c0 = 0;
     if (c1 < 0) c1 = cache.size;
@@ -1618,6 +2544,93 @@ static std::string llama_format_tensor_shape(const struct lm_ggml_tensor * t) {
     return buf;
 }
 
+// reads the CPU tensors of a non-mmap load on a few I/O threads, in large chunks and in file order, while the
+// loader waits for each tensor in turn and post-processes the ones already read
+struct llama_tensor_prefetcher {
+    static const size_t CHUNK_SIZE   = 8*1024*1024;
+    static const int    MAX_THREADS  = 4;
+
+    struct chunk {
+        int       idx; // tensor index in the gguf file
+        size_t    offs;
+        uint8_t * dst;
+        size_t    size;
+    };
+
+    std::vector<chunk>    chunks;
+    std::map<int, int>    pending; // tensor index -> chunks not read yet
+
+    std::vector<std::thread> workers;
+    std::atomic<size_t>      next_chunk;
+    std::atomic<bool>        stop;
+
+    std::mutex              mutex;
+    std::condition_variable cv;
+    std::string             error;
+
+    llama_tensor_prefetcher() : next_chunk(0), stop(false) {}
+
+    ~llama_tensor_prefetcher() {
+        stop = true;
+        for (auto & w : workers) {
+            w.join();
+        }
+    }
+
+    void add(int idx, size_t offs, uint8_t * dst, size_t size) {
+        pending[idx] = 0;
+        for (size_t i = 0; i < size; i += CHUNK_SIZE) {
+            chunks.push_back({idx, offs + i, dst + i, std::min((size_t) CHUNK_SIZE, size - i)});
+            pending[idx]++;
+        }
+    }
+
+#ifndef _WIN32
+    void start(const llama_file & file) {
+        if (chunks.empty()) {
+            return;
+        }
+#ifdef POSIX_FADV_SEQUENTIAL
+        posix_fadvise(fileno(file.fp), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+        const int n_threads = std::max(1, std::min((int) MAX_THREADS, (int) std::thread::hardware_concurrency()));
+        for (int i = 0; i < n_threads; i++) {
+            workers.emplace_back([this, &file]() {
+                for (size_t c = next_chunk++; c < chunks.size() && !stop; c = next_chunk++) {
+                    const chunk & ch = chunks[c];
+                    try {
+                        file.read_raw_at(ch.dst, ch.size, ch.offs);
+                    } catch (const std::exception & err) {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        error = err.what();
+                        stop = true;
+                        cv.notify_all();
+                        return;
+                    }
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (--pending[ch.idx] == 0) {
+                        cv.notify_all();
+                    }
+                }
+            });
+        }
+    }
+#endif
+
+    bool has(int idx) const {
+        return pending.find(idx) != pending.end();
+    }
+
+    // blocks until all chunks of the tensor are read
+    void wait(int idx) {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&]() { return pending[idx] == 0 || !error.empty(); });
+        if (!error.empty()) {
+            throw std::runtime_error(error);
+        }
+    }
+};
+
 struct llama_model_loader {
     int n_kv      = 0;
     int n_tensors = 0;
@@ -1627,6 +2640,8 @@ struct llama_model_loader {
     size_t  n_bytes    = 0;
 
     bool use_mmap = false;
+    bool use_hugepages = false; // advise the file mapping for transparent huge pages
+    bool no_prefetch   = false; // the weights are streamed during evaluation, do not populate the mapping
 
     llama_file  file;
     llama_ftype ftype;
@@ -1855,7 +2870,10 @@ struct llama_model_loader {
         }
     }
 
-    void load_all_data(struct lm_ggml_context * ctx, llama_progress_callback progress_callback, void * progress_callback_user_data, llama_mlock * lmlock) {
+    // returns false if the load was cancelled by the progress callback
+    // post_load is called for every CPU tensor, in file order, once its data is in memory
+    bool load_all_data(struct lm_ggml_context * ctx, llama_progress_callback progress_callback, void * progress_callback_user_data, llama_mlock * lmlock,
+            const std::function<void(struct lm_ggml_tensor *)> & post_load = nullptr) {
         size_t size_data = 0;
         size_t size_lock = 0;
         size_t size_pref = 0; // prefetch
@@ -1869,19 +2887,34 @@ struct llama_model_loader {
         }
 
         if (use_mmap) {
-            mapping.reset(new llama_mmap(&file, size_pref, lm_ggml_is_numa()));
+            mapping.reset(new llama_mmap(&file, no_prefetch ? 0 : size_pref, lm_ggml_is_numa(), use_hugepages));
             if (lmlock) {
                 lmlock->init(mapping->addr);
             }
         }
 
+        llama_tensor_prefetcher prefetcher;
+#ifndef _WIN32
+        if (!use_mmap) {
+            for (int i = 0; i < lm_gguf_get_n_tensors(ctx_gguf); i++) {
+                struct lm_ggml_tensor * cur = lm_ggml_get_tensor(ctx, lm_gguf_get_tensor_name(ctx_gguf, i));
+                if (cur->backend == LM_GGML_BACKEND_CPU) {
+                    prefetcher.add(i, file_offset(lm_ggml_get_name(cur)), (uint8_t *) cur->data, lm_ggml_nbytes(cur));
+                }
+            }
+            prefetcher.start(file);
+        }
+#endif
+
         size_t done_size = 0;
         for (int i = 0; i < lm_gguf_get_n_tensors(ctx_gguf); i++) {
             struct lm_ggml_tensor * cur = lm_ggml_get_tensor(ctx, lm_gguf_get_tensor_name(ctx_gguf, i));
             LM_GGML_ASSERT(cur); // unused tensors should have been caught by load_data already
 
             if (progress_callback) {
-                progress_callback((float) done_size / size_data, progress_callback_user_data);
+                if (!progress_callback((float) done_size / size_data, progress_callback_user_data)) {
+                    return false;
+                }
             }
 
             // allocate temp buffer if not using mmap
@@ -1894,7 +2927,11 @@ struct llama_model_loader {
                 #endif
             }
 
-            load_data_for(cur);
+            if (prefetcher.has(i)) {
+                prefetcher.wait(i);
+            } else {
+                load_data_for(cur);
+            }
 
             switch (cur->backend) {
                 case LM_GGML_BACKEND_CPU:
@@ -1902,6 +2939,9 @@ struct llama_model_loader {
                         size_lock += lm_ggml_nbytes(cur);
                         lmlock->grow_to(size_lock);
                     }
+                    if (post_load) {
+                        post_load(cur);
+                    }
                     break;
 #ifdef LM_GGML_USE_CUBLAS
                 case LM_GGML_BACKEND_GPU:
@@ -1929,6 +2969,8 @@ struct llama_model_loader {
 
             done_size += lm_ggml_nbytes(cur);
         }
+
+        return true;
     }
 };
 
@@ -2143,7 +3185,8 @@ static void llm_load_hparams(
 }
 
 // TODO: This should probably be in llama.h
-static std::vector<llama_vocab::id> llama_tokenize_internal(const llama_vocab & vocab, std::string raw_text, bool bos, bool special = false);
+static std::vector<llama_vocab::id> llama_tokenize_internal(const llama_vocab & vocab, std::string raw_text, bool bos, bool special = false, int n_threads = 1);
+static void llama_build_token_pieces(llama_vocab & vocab);
 static llama_token llama_byte_to_token(const llama_vocab & vocab, uint8_t ch);
 
 static void llm_load_vocab(
@@ -2172,6 +3215,9 @@ static void llm_load_vocab(
         toktypes = (const int * ) lm_gguf_get_arr_data(ctx, toktype_idx);
     }
 
+    // BPE merges as read from the model, resolved to token ids once the token list is loaded
+    int merges_keyidx = -1;
+
     // determine vocab type
     {
         std::string tokenizer_name;
@@ -2190,31 +3236,11 @@ static void llm_load_vocab(
         } else if (tokenizer_name == "gpt2") {
             vocab.type = LLAMA_VOCAB_TYPE_BPE;
 
-            // read bpe merges and populate bpe ranks
-            const int merges_keyidx = lm_gguf_find_key(ctx, kv(LLM_KV_TOKENIZER_MERGES).c_str());
+            merges_keyidx = lm_gguf_find_key(ctx, kv(LLM_KV_TOKENIZER_MERGES).c_str());
             if (merges_keyidx == -1) {
                 throw std::runtime_error("cannot find tokenizer merges in model file\n");
             }
 
-            const int n_merges = lm_gguf_get_arr_n(ctx, merges_keyidx);
-
-            for (int i = 0; i < n_merges; i++) {
-                const std::string word = lm_gguf_get_arr_str(ctx, merges_keyidx, i);
-                LM_GGML_ASSERT(codepoints_from_utf8(word).size() > 0);
-
-                std::string first;
-                std::string second;
-
-                const size_t pos = word.find(' ', 1);
-
-                if (pos != std::string::npos) {
-                    first  = word.substr(0, pos);
-                    second = word.substr(pos + 1);
-                }
-
-                vocab.bpe_ranks.emplace(std::make_pair(first, second), i);
-            }
-
             // default special tokens
             vocab.special_bos_id = 11;
             vocab.special_eos_id = 11;
@@ -2233,18 +3259,110 @@ static void llm_load_vocab(
 
     vocab.id_to_token.resize(n_vocab);
 
+    // the texts are copied out of the gguf context into one buffer
+    std::vector<uint64_t> text_hashes(n_vocab);
+    std::vector<uint32_t> text_sizes(n_vocab);
+    vocab.text_data.clear();
+
     for (uint32_t i = 0; i < n_vocab; i++) {
-        std::string word = lm_gguf_get_arr_str(ctx, token_idx, i);
-        LM_GGML_ASSERT(codepoints_from_utf8(word).size() > 0);
+        const char * word = lm_gguf_get_arr_str(ctx, token_idx, i);
+        const size_t n    = strlen(word);
+        LM_GGML_ASSERT(n > 0);
+        if (!utf8_is_valid(word, n)) {
+            throw std::runtime_error(format("invalid UTF-8 in the text of token %u", i));
+        }
 
-        vocab.token_to_id[word] = i;
+        vocab.text_data.insert(vocab.text_data.end(), word, word + n + 1);
+        text_hashes[i] = llama_token_text_index::hash(word, n);
+        text_sizes[i]  = n;
 
         auto & token_data = vocab.id_to_token[i];
-        token_data.text  = std::move(word);
         token_data.score = scores ? scores[i] : 0.0f;
         token_data.type  = toktypes ? (llama_token_type) toktypes[i] : LLAMA_TOKEN_TYPE_NORMAL;
     }
-    LM_GGML_ASSERT(vocab.id_to_token.size() == vocab.token_to_id.size());
+
+    for (uint32_t i = 0, offs = 0; i < n_vocab; i++) {
+        vocab.id_to_token[i].text.data = vocab.text_data.data() + offs;
+        vocab.id_to_token[i].text.size = text_sizes[i];
+        offs += text_sizes[i] + 1;
+    }
+
+    if (!vocab.text_index.build(text_hashes)) {
+        throw std::runtime_error("the vocab has tokens with the same text");
+    }
+
+    // the BPE merges are resolved to token ids, pairs whose parts or result are not in the vocab can never apply
+    if (vocab.type == LLAMA_VOCAB_TYPE_BPE) {
+        for (uint32_t i = 0; i < n_vocab; i++) {
+            const auto & text = vocab.id_to_token[i].text;
+            if (text.size == 1 || (text.size <= 4 && (size_t) utf8_len(text.data[0]) == text.size)) {
+                vocab.bpe_char_ids.emplace(llama_vocab::bpe_char_key(text.data, text.size), i);
+            }
+        }
+
+        const int n_merges = lm_gguf_get_arr_n(ctx, merges_keyidx);
+
+        vocab.bpe_ranks.reserve(n_merges);
+
+        int n_skipped = 0;
+        std::string merged;
+        for (int i = 0; i < n_merges; i++) {
+            const char * word = lm_gguf_get_arr_str(ctx, merges_keyidx, i);
+            const size_t n    = strlen(word);
+            LM_GGML_ASSERT(n > 0);
+            if (!utf8_is_valid(word, n)) {
+                throw std::runtime_error(format("invalid UTF-8 in BPE merge %d", i));
+            }
+
+            // "first second", split at the first space after the first character
+            const char * space = (const char *) memchr(word + 1, ' ', n - 1);
+            if (space == nullptr) {
+                n_skipped++;
+                continue;
+            }
+
+            const size_t n_first  = space - word;
+            const size_t n_second = n - n_first - 1;
+
+            merged.assign(word, n_first);
+            merged.append(space + 1, n_second);
+
+            const llama_vocab::id id_left   = vocab.find_token(word, n_first);
+            const llama_vocab::id id_right  = vocab.find_token(space + 1, n_second);
+            const llama_vocab::id id_merged = vocab.find_token(merged);
+            if (id_left < 0 || id_right < 0 || id_merged < 0) {
+                n_skipped++;
+                continue;
+            }
+
+            vocab.bpe_ranks.insert(id_left, id_right, i, id_merged);
+        }
+
+        if (n_skipped > 0) {
+            LLAMA_LOG_WARN("%s: %d BPE merges refer to tokens missing from the vocab\n", __func__, n_skipped);
+        }
+    }
+
+    if (vocab.type == LLAMA_VOCAB_TYPE_SPM) {
+        static const std::string space = "\xe2\x96\x81";
+
+        vocab.spm_split_at_spaces = true;
+        for (const auto & token_data : vocab.id_to_token) {
+            const auto & text = token_data.text;
+            for (size_t pos = 1; pos + space.size() <= text.size; pos++) {
+                if (memcmp(text.data + pos, space.data(), space.size()) != 0) {
+                    continue;
+                }
+                if (pos < space.size() || memcmp(text.data + pos - space.size(), space.data(), space.size()) != 0) {
+                    vocab.spm_split_at_spaces = false;
+                    break;
+                }
+            }
+            if (!vocab.spm_split_at_spaces) {
+                break;
+            }
+        }
+    }
 
     // determine the newline token: LLaMA "<0x0A>" == 10 == '\n', Falcon 193 == '\n'
     if (vocab.type == LLAMA_VOCAB_TYPE_SPM) {
@@ -2298,9 +3416,8 @@ static void llm_load_vocab(
 
         bool special_tokens_definition_mismatch = false;
 
-        for (const auto & t : vocab.token_to_id) {
-            const auto & token = t.first;
-            const auto & id    = t.second;
+        for (llama_vocab::id id = 0; id < (llama_vocab::id) vocab.id_to_token.size(); id++) {
+            const auto & token = vocab.id_to_token[id].text;
 
             // Count all non-normal tokens in the vocab while iterating
             if (vocab.id_to_token[id].type != LLAMA_TOKEN_TYPE_NORMAL) {
@@ -2308,21 +3425,18 @@ static void llm_load_vocab(
             }
 
             // Skip single character tokens
-            if (token.length() > 1) {
+            if (token.size > 1) {
                 bool is_tokenizable = false;
 
                 // Split token string representation in two, in all possible ways
                 //  and check if both halves can be matched to a valid token
-                for (unsigned i = 1; i < token.length();) {
-                    const auto left  = token.substr(0, i);
-                    const auto right = token.substr(i);
-
+                for (unsigned i = 1; i < token.size;) {
                     // check if we didnt partition in the middle of a utf sequence
-                    auto utf = utf8_len(left.at(left.length() - 1));
+                    auto utf = utf8_len(token.data[i - 1]);
 
                     if (utf == 1) {
-                        if (vocab.token_to_id.find(left)  != vocab.token_to_id.end() &&
-                            vocab.token_to_id.find(right) != vocab.token_to_id.end() ) {
+                        if (vocab.find_token(token.data,     i)              != -1 &&
+                            vocab.find_token(token.data + i, token.size - i) != -1) {
                             is_tokenizable = true;
                             break;
                         }
@@ -2337,43 +3451,323 @@ static void llm_load_vocab(
                     // Some tokens are multibyte, but they are utf sequences with equivalent text length of 1
                     //  it's faster to re-filter them here, since there are way less candidates now
 
-                    // Calculate a total "utf" length of a token string representation
-                    size_t utf8_str_len = 0;
-                    for (unsigned i = 0; i < token.length();) {
-                        utf8_str_len++;
-                        i += utf8_len(token.at(i));
-                    }
+                    // Calculate a total "utf" length of a token string representation
+                    size_t utf8_str_len = 0;
+                    for (unsigned i = 0; i < token.size;) {
+                        utf8_str_len++;
+                        i += utf8_len(token.data[i]);
+                    }
+
+                    // And skip the ones which are one character
+                    if (utf8_str_len > 1) {
+                        // At this point what we have left are special tokens only
+                        vocab.special_tokens_cache[token.str()] = id;
+
+                        // Count manually found special tokens
+                        special_tokens_count_from_verification++;
+
+                        // If this manually found special token is not marked as such, flag a mismatch
+                        if (vocab.id_to_token[id].type == LLAMA_TOKEN_TYPE_NORMAL) {
+                            special_tokens_definition_mismatch = true;
+                        }
+                    }
+                }
+            }
+        }
+
+        if (special_tokens_definition_mismatch || special_tokens_count_from_verification != special_tokens_count_by_type) {
+            LLAMA_LOG_WARN("%s: mismatch in special tokens definition ( %u/%zu vs %u/%zu ).\n",
+                __func__,
+                special_tokens_count_from_verification, vocab.id_to_token.size(),
+                special_tokens_count_by_type, vocab.id_to_token.size()
+            );
+        } else {
+            LLAMA_LOG_INFO("%s: special tokens definition check successful ( %u/%zu ).\n",
+                __func__,
+                special_tokens_count_from_verification, vocab.id_to_token.size()
+            );
+        }
+
+        vocab.special_tokens_matcher.build(vocab.special_tokens_cache);
+    }
+
+    llama_build_token_pieces(vocab);
+}
+
+//
+// prepared-model cache
+//
+
+// an opt-in sidecar file (llama_model_params.cache_path) with what every load otherwise derives again from the gguf:
+// the vocab tables and the compute buffer size measured for each set of context parameters used so far. it is tied
+// to the hash of the gguf metadata, bump the version whenever something stored in it is derived differently
+#define LLAMA_PREPARED_CACHE_MAGIC   0x67677063u // 'ggpc'
+#define LLAMA_PREPARED_CACHE_VERSION 2
+
+// compute buffer sizes kept in the cache, the oldest are dropped first
+#define LLAMA_PREPARED_CACHE_MAX_COMPUTE_SIZES 64
+
+struct llama_prepared_cache_writer {
+    std::vector<uint8_t> buf;
+
+    void write(const void * src, size_t size) {
+        buf.insert(buf.end(), (const uint8_t *) src, (const uint8_t *) src + size);
+    }
+
+    template <typename T>
+    void write_val(const T & val) {
+        write(&val, sizeof(val));
+    }
+
+    template <typename T>
+    void write_vec(const std::vector<T> & vec) {
+        write_val<uint64_t>(vec.size());
+        write(vec.data(), vec.size()*sizeof(T));
+    }
+};
+
+struct llama_prepared_cache_reader {
+    const uint8_t * ptr;
+    size_t          size;
+
+    void read(void * dst, size_t n) {
+        if (n > size) {
+            throw std::runtime_error("unexpected end of data");
+        }
+        memcpy(dst, ptr, n);
+        ptr  += n;
+        size -= n;
+    }
+
+    template <typename T>
+    T read_val() {
+        T val;
+        read(&val, sizeof(val));
+        return val;
+    }
+
+    template <typename T>
+    void read_vec(std::vector<T> & vec) {
+        const uint64_t n = read_val<uint64_t>();
+        if (n > size/sizeof(T)) {
+            throw std::runtime_error("unexpected end of data");
+        }
+        vec.resize(n);
+        read(vec.data(), n*sizeof(T));
+    }
+};
+
+// the cached data only depends on the metadata (header, key-value pairs and tensor infos), which is hashed with the file size
+static uint64_t llama_model_metadata_hash(llama_model_loader & ml) {
+    std::vector<uint8_t> buf(lm_gguf_get_data_offset(ml.ctx_gguf));
+    ml.file.seek(0, SEEK_SET);
+    ml.file.read_raw(buf.data(), buf.size());
+
+    const uint64_t file_size = ml.file.size;
+    return llama_fnv1a(buf.data(), buf.size(), llama_fnv1a(&file_size, sizeof(file_size)));
+}
+
+static void llama_vocab_write(llama_prepared_cache_writer & w, const llama_vocab & vocab) {
+    const size_t n_vocab = vocab.id_to_token.size();
+
+    std::vector<float>    scores(n_vocab);
+    std::vector<int32_t>  types(n_vocab);
+    std::vector<uint32_t> text_sizes(n_vocab);
+    for (size_t i = 0; i < n_vocab; i++) {
+        scores[i]     = vocab.id_to_token[i].score;
+        types[i]      = vocab.id_to_token[i].type;
+        text_sizes[i] = vocab.id_to_token[i].text.size;
+    }
+
+    w.write_val<int32_t>(vocab.type);
+    w.write_vec(scores);
+    w.write_vec(types);
+    w.write_vec(text_sizes);
+    w.write_vec(vocab.text_data);
+    w.write_vec(vocab.text_index.seeds);
+    w.write_vec(vocab.text_index.slots);
+
+    std::vector<int32_t> special_ids;
+    for (const auto & it : vocab.special_tokens_cache) {
+        special_ids.push_back(it.second);
+    }
+    w.write_vec(special_ids);
+    w.write_vec(vocab.special_tokens_matcher.nodes);
+    w.write_vec(vocab.special_tokens_matcher.edges);
+    w.write(vocab.special_tokens_matcher.root_next, sizeof(vocab.special_tokens_matcher.root_next));
+
+    w.write_vec(vocab.bpe_ranks.entries);
+    w.write_val<uint64_t>(vocab.bpe_ranks.n_merges);
+
+    std::vector<std::pair<uint32_t, int32_t>> bpe_char_ids(vocab.bpe_char_ids.begin(), vocab.bpe_char_ids.end());
+    w.write_vec(bpe_char_ids);
+
+    w.write_val<uint8_t>(vocab.spm_split_at_spaces);
+    w.write_vec(vocab.token_piece_data);
+    w.write_vec(vocab.token_piece_offset);
+
+    const int32_t ids[] = {
+        vocab.special_bos_id, vocab.special_eos_id, vocab.special_unk_id, vocab.special_sep_id, vocab.special_pad_id,
+        vocab.linefeed_id, vocab.special_prefix_id, vocab.special_middle_id, vocab.special_suffix_id, vocab.special_eot_id,
+    };
+    w.write(ids, sizeof(ids));
+}
+
+static void llama_vocab_read(llama_prepared_cache_reader & r, llama_vocab & vocab) {
+    vocab.type = (enum llama_vocab_type) r.read_val<int32_t>();
+
+    std::vector<float>    scores;
+    std::vector<int32_t>  types;
+    std::vector<uint32_t> text_sizes;
+    r.read_vec(scores);
+    r.read_vec(types);
+    r.read_vec(text_sizes);
+    r.read_vec(vocab.text_data);
+    r.read_vec(vocab.text_index.seeds);
+    r.read_vec(vocab.text_index.slots);
+
+    const size_t n_vocab = scores.size();
+    if (types.size() != n_vocab || text_sizes.size() != n_vocab) {
+        throw std::runtime_error("inconsistent vocab size");
+    }
+
+    vocab.id_to_token.resize(n_vocab);
+    for (size_t i = 0, offs = 0; i < n_vocab; i++) {
+        if (text_sizes[i] >= vocab.text_data.size() - offs) {
+            throw std::runtime_error("inconsistent token texts");
+        }
+        auto & token_data = vocab.id_to_token[i];
+        token_data.text.data = vocab.text_data.data() + offs;
+        token_data.text.size = text_sizes[i];
+        token_data.score     = scores[i];
+        token_data.type      = (llama_token_type) types[i];
+        offs += text_sizes[i] + 1;
+    }
+
+    std::vector<int32_t> special_ids;
+    r.read_vec(special_ids);
+    vocab.special_tokens_cache.clear();
+    for (const int32_t id : special_ids) {
+        vocab.special_tokens_cache[vocab.id_to_token.at(id).text.str()] = id;
+    }
+    r.read_vec(vocab.special_tokens_matcher.nodes);
+    r.read_vec(vocab.special_tokens_matcher.edges);
+    r.read(vocab.special_tokens_matcher.root_next, sizeof(vocab.special_tokens_matcher.root_next));
+
+    r.read_vec(vocab.bpe_ranks.entries);
+    vocab.bpe_ranks.n_merges = r.read_val<uint64_t>();
+
+    std::vector<std::pair<uint32_t, int32_t>> bpe_char_ids;
+    r.read_vec(bpe_char_ids);
+    vocab.bpe_char_ids = std::unordered_map<uint32_t, llama_vocab::id>(bpe_char_ids.begin(), bpe_char_ids.end());
+
+    vocab.spm_split_at_spaces = r.read_val<uint8_t>() != 0;
+    r.read_vec(vocab.token_piece_data);
+    r.read_vec(vocab.token_piece_offset);
+
+    int32_t ids[10];
+    r.read(ids, sizeof(ids));
+    vocab.special_bos_id    = ids[0];
+    vocab.special_eos_id    = ids[1];
+    vocab.special_unk_id    = ids[2];
+    vocab.special_sep_id    = ids[3];
+    vocab.special_pad_id    = ids[4];
+    vocab.linefeed_id       = ids[5];
+    vocab.special_prefix_id = ids[6];
+    vocab.special_middle_id = ids[7];
+    vocab.special_suffix_id = ids[8];
+    vocab.special_eot_id    = ids[9];
+}
+
+// writes the whole cache, replacing the file atomically, the caller holds model.cache_mutex
+// file: magic, version, model hash, payload size, payload hash, payload (vocab, compute sizes)
+static void llama_prepared_cache_save(llama_model & model) {
+    if (model.cache_path.empty()) {
+        return;
+    }
+
+    llama_prepared_cache_writer payload;
+    llama_vocab_write(payload, model.vocab);
+    payload.write_vec(model.cache_compute_sizes);
+
+    const std::string tmp_path = model.cache_path + ".tmp";
+    try {
+        {
+            llama_file file(tmp_path.c_str(), "wb");
+            file.write_u32(LLAMA_PREPARED_CACHE_MAGIC);
+            file.write_u32(LLAMA_PREPARED_CACHE_VERSION);
+
+            const uint64_t header[3] = { model.cache_model_hash, payload.buf.size(), llama_fnv1a(payload.buf.data(), payload.buf.size()) };
+            file.write_raw(header, sizeof(header));
+            file.write_raw(payload.buf.data(), payload.buf.size());
+        }
+        if (rename(tmp_path.c_str(), model.cache_path.c_str()) != 0) {
+            throw std::runtime_error(format("failed to rename %s: %s", tmp_path.c_str(), strerror(errno)));
+        }
+    } catch (const std::exception & err) {
+        LLAMA_LOG_WARN("%s: failed to write prepared-model cache %s: %s\n", __func__, model.cache_path.c_str(), err.what());
+        remove(tmp_path.c_str());
+    }
+}
+
+// returns false if there is no usable cache for the model, the vocab must then be loaded from the gguf
+static bool llama_prepared_cache_load(llama_model & model) {
+    if (model.cache_path.empty()) {
+        return false;
+    }
+
+    // a missing file is the normal first run
+    FILE * fp = fopen(model.cache_path.c_str(), "rb");
+    if (fp == NULL) {
+        return false;
+    }
+    fclose(fp);
 
-                    // And skip the ones which are one character
-                    if (utf8_str_len > 1) {
-                        // At this point what we have left are special tokens only
-                        vocab.special_tokens_cache[token] = id;
+    std::vector<uint8_t> buf;
+    try {
+        llama_file file(model.cache_path.c_str(), "rb");
 
-                        // Count manually found special tokens
-                        special_tokens_count_from_verification++;
+        const uint32_t magic   = file.read_u32();
+        const uint32_t version = file.read_u32();
+        if (magic != LLAMA_PREPARED_CACHE_MAGIC || version != LLAMA_PREPARED_CACHE_VERSION) {
+            LLAMA_LOG_INFO("%s: prepared-model cache %s is from another version, rebuilding it\n", __func__, model.cache_path.c_str());
+            return false;
+        }
 
-                        // If this manually found special token is not marked as such, flag a mismatch
-                        if (vocab.id_to_token[id].type == LLAMA_TOKEN_TYPE_NORMAL) {
-                            special_tokens_definition_mismatch = true;
-                        }
-                    }
-                }
-            }
+        uint64_t header[3];
+        file.read_raw(header, sizeof(header));
+        if (header[0] != model.cache_model_hash) {
+            LLAMA_LOG_INFO("%s: prepared-model cache %s is for another model, rebuilding it\n", __func__, model.cache_path.c_str());
+            return false;
+        }
+        if (header[1] != file.size - file.tell()) {
+            throw std::runtime_error("truncated file");
         }
 
-        if (special_tokens_definition_mismatch || special_tokens_count_from_verification != special_tokens_count_by_type) {
-            LLAMA_LOG_WARN("%s: mismatch in special tokens definition ( %u/%zu vs %u/%zu ).\n",
-                __func__,
-                special_tokens_count_from_verification, vocab.id_to_token.size(),
-                special_tokens_count_by_type, vocab.id_to_token.size()
-            );
-        } else {
-            LLAMA_LOG_INFO("%s: special tokens definition check successful ( %u/%zu ).\n",
-                __func__,
-                special_tokens_count_from_verification, vocab.id_to_token.size()
-            );
+        buf.resize(header[1]);
+        file.read_raw(buf.data(), buf.size());
+        if (llama_fnv1a(buf.data(), buf.size()) != header[2]) {
+            throw std::runtime_error("checksum mismatch");
         }
+    } catch (const std::exception & err) {
+        LLAMA_LOG_WARN("%s: ignoring prepared-model cache %s: %s\n", __func__, model.cache_path.c_str(), err.what());
+        return false;
     }
+
+    try {
+        llama_prepared_cache_reader r = { buf.data(), buf.size() };
+        llama_vocab_read(r, model.vocab);
+        r.read_vec(model.cache_compute_sizes);
+    } catch (const std::exception & err) {
+        LLAMA_LOG_WARN("%s: ignoring prepared-model cache %s: %s\n", __func__, model.cache_path.c_str(), err.what());
+        model.vocab = llama_vocab();
+        model.cache_compute_sizes.clear();
+        return false;
+    }
+
+    LLAMA_LOG_INFO("%s: loaded the vocab and %zu compute buffer sizes from %s\n", __func__, model.cache_compute_sizes.size(), model.cache_path.c_str());
+
+    return true;
 }
 
 static void llm_load_print_meta(llama_model_loader & ml, llama_model & model) {
@@ -2421,13 +3815,89 @@ static void llm_load_print_meta(llama_model_loader & ml, llama_model & model) {
     if (vocab.linefeed_id    != -1) { LLAMA_LOG_INFO( "%s: LF token  = %d '%s'\n", __func__, vocab.linefeed_id,    vocab.id_to_token[vocab.linefeed_id].text.c_str() );    }
 }
 
-static void llm_load_tensors(
+// the CPU weights that are only used as mul_mat src0 can be repacked into the interleaved layouts of the multi-row dot kernels
+static bool llm_can_repack(const llama_model & model, const lm_ggml_tensor * cur) {
+    // the embeddings are read with get_rows
+    if (cur == model.tok_embeddings || cur == model.pos_embeddings) {
+        return false;
+    }
+
+    if (cur->backend != LM_GGML_BACKEND_CPU || cur->n_dims != 2 || lm_ggml_repack_type(cur->type) == LM_GGML_TYPE_COUNT) {
+        return false;
+    }
+
+    return cur->ne[1] % lm_ggml_internal_get_type_traits(lm_ggml_repack_type(cur->type)).blck_rows == 0;
+}
+
+// repacks a tensor that owns its data in place, tmp is scratch space
+static void llm_repack_tensor_in_place(lm_ggml_tensor * cur, std::vector<uint8_t> & tmp) {
+    const size_t nbytes = lm_ggml_nbytes(cur);
+
+    tmp.resize(nbytes);
+    memcpy(tmp.data(), cur->data, nbytes);
+
+    lm_ggml_repack(cur->type, tmp.data(), cur->data, cur->ne[1], cur->ne[0]);
+
+    cur->type = lm_ggml_repack_type(cur->type);
+}
+
+// repack the weights of a mmap load: they are copied out of the file mapping into model.buf_repack
+// (without mmap the loader repacks each tensor in place as soon as it is read, see llm_load_tensors)
+static void llm_repack_tensors(llama_model & model, bool use_mlock) {
+    std::vector<lm_ggml_tensor *> tensors;
+    size_t size = 0;
+
+    for (const auto & it : model.tensors_by_name) {
+        lm_ggml_tensor * cur = it.second;
+
+        if (!llm_can_repack(model, cur)) {
+            continue;
+        }
+
+        tensors.push_back(cur);
+        size += LM_GGML_PAD(lm_ggml_nbytes(cur), LM_GGML_MEM_ALIGN);
+    }
+
+    if (tensors.empty()) {
+        return;
+    }
+
+    const int64_t t_start_us = lm_ggml_time_us();
+
+    model.buf_repack.resize(size, model.use_hugepages);
+    if (use_mlock) {
+        model.mlock_repack.init   (model.buf_repack.data);
+        model.mlock_repack.grow_to(model.buf_repack.size);
+    }
+
+    size_t offs = 0;
+
+    for (lm_ggml_tensor * cur : tensors) {
+        const size_t nbytes = lm_ggml_nbytes(cur);
+
+        void * dst = (char *) model.buf_repack.data + offs;
+        offs += LM_GGML_PAD(nbytes, LM_GGML_MEM_ALIGN);
+
+        lm_ggml_repack(cur->type, cur->data, dst, cur->ne[1], cur->ne[0]);
+
+        cur->type = lm_ggml_repack_type(cur->type);
+        cur->data = dst;
+    }
+
+    LLAMA_LOG_INFO("%s: repacked %d tensors (%.2f MB, copied out of the mapping) in %.2f ms\n", __func__, (int) tensors.size(), size/1024.0/1024.0,
+            (lm_ggml_time_us() - t_start_us)/1000.0);
+}
+
+// returns false if the load was cancelled by the progress callback
+static bool llm_load_tensors(
         llama_model_loader & ml,
         llama_model & model,
         int n_gpu_layers,
         int main_gpu,
         const float * tensor_split,
         bool use_mlock,
+        bool repack_weights,
+        size_t stream_budget,
         llama_progress_callback progress_callback,
         void * progress_callback_user_data) {
     model.t_start_us = lm_ggml_time_us();
@@ -2446,7 +3916,7 @@ static void llm_load_tensors(
 
     // create the ggml context
     {
-        model.buf.resize(ctx_size);
+        model.buf.resize(ctx_size, model.use_hugepages);
         if (use_mlock) {
             model.mlock_buf.init   (model.buf.data);
             model.mlock_buf.grow_to(model.buf.size);
@@ -3043,20 +4513,72 @@ static void llm_load_tensors(
     }
 #endif
 
-    ml.load_all_data(ctx, progress_callback, progress_callback_user_data, use_mlock ? &model.mlock_mmap : NULL);
+#ifdef LM_GGML_USE_METAL
+    if (repack_weights && n_gpu_layers > 0) {
+        // the Metal kernels read the weights from the file mapping in the original layout
+        LLAMA_LOG_WARN("%s: weight repacking is not supported with Metal, skipping\n", __func__);
+        repack_weights = false;
+    }
+#endif
 
-    if (progress_callback) {
-        progress_callback(1.0f, progress_callback_user_data);
+    // without mmap, each tensor is repacked while the following ones are still being read
+    std::function<void(lm_ggml_tensor *)> post_load;
+    std::vector<uint8_t> repack_tmp;
+    int n_repacked = 0;
+    if (repack_weights && !ml.use_mmap) {
+        post_load = [&](lm_ggml_tensor * cur) {
+            if (llm_can_repack(model, cur)) {
+                llm_repack_tensor_in_place(cur, repack_tmp);
+                n_repacked++;
+            }
+        };
+    }
+
+    if (!ml.load_all_data(ctx, progress_callback, progress_callback_user_data, use_mlock ? &model.mlock_mmap : NULL, post_load)) {
+        return false;
+    }
+
+    if (repack_weights) {
+        if (ml.use_mmap) {
+            llm_repack_tensors(model, use_mlock);
+        } else {
+            LLAMA_LOG_INFO("%s: repacked %d tensors while loading\n", __func__, n_repacked);
+        }
     }
 
     model.mapping = std::move(ml.mapping);
 
+    if (stream_budget > 0 && model.mapping) {
+        model.streamer.reset(new llama_layer_streamer(model.tensors_by_name, *model.mapping, hparams.n_layer, stream_budget));
+
+        LLAMA_LOG_INFO("%s: streaming %.2f MB of layer weights with a resident budget of %.2f MB\n", __func__,
+                model.streamer->total_size()/1024.0/1024.0, stream_budget/1024.0/1024.0);
+        if (stream_budget < 2*model.streamer->max_layer_size()) {
+            LLAMA_LOG_WARN("%s: the budget holds less than two layers (%.2f MB each), the next layer cannot be prefetched\n", __func__,
+                    model.streamer->max_layer_size()/1024.0/1024.0);
+        }
+    }
+
+    if (model.use_hugepages) {
+        const size_t size_advised = model.buf.size + model.buf_repack.size + (model.mapping ? model.mapping->size : 0);
+        LLAMA_LOG_INFO("%s: huge pages = %7.2f MB of %7.2f MB\n", __func__,
+                llama_model_hugepage_size(&model)/1024.0/1024.0, size_advised/1024.0/1024.0);
+    }
+
     // loading time will be recalculate after the first eval, so
     // we take page faults deferred by mmap() into consideration
     model.t_load_us = lm_ggml_time_us() - model.t_start_us;
+
+    if (progress_callback) {
+        // the weights are all loaded, but a cancellation still means the caller does not want the model
+        return progress_callback(1.0f, progress_callback_user_data);
+    }
+
+    return true;
 }
 
-static bool llama_model_load(
+// returns 0 on success, -1 on error, and -2 on cancellation via the progress callback
+static int llama_model_load(
         const std::string & fname,
         llama_model & model,
         int n_gpu_layers,
@@ -3064,17 +4586,47 @@ static bool llama_model_load(
         const float * tensor_split,
         bool use_mmap,
         bool use_mlock,
+        bool repack_weights,
+        bool use_hugepages,
+        size_t stream_budget,
         bool vocab_only,
+        const char * cache_path,
         llama_progress_callback progress_callback,
         void *progress_callback_user_data) {
     try {
         llama_model_loader ml(fname, use_mmap);
 
+        ml.use_hugepages = use_hugepages;
+
+        if (stream_budget > 0) {
+            bool offload = false;
+#if defined(LM_GGML_USE_CUBLAS) || defined(LM_GGML_USE_CLBLAST) || defined(LM_GGML_USE_METAL)
+            offload = n_gpu_layers > 0;
+#endif
+            if (!ml.use_mmap || use_mlock || offload || !llama_layer_streamer::SUPPORTED) {
+                LLAMA_LOG_WARN("%s: weight streaming needs mmap, no mlock and no GPU offload - disabling\n", __func__);
+                stream_budget = 0;
+            }
+        }
+        ml.no_prefetch = stream_budget > 0;
+
         model.hparams.vocab_only = vocab_only;
+        model.use_hugepages      = use_hugepages;
 
         llm_load_arch   (ml, model);
         llm_load_hparams(ml, model);
-        llm_load_vocab  (ml, model);
+
+        if (cache_path != nullptr && cache_path[0] != '\0') {
+            model.cache_path       = cache_path;
+            model.cache_model_hash = llama_model_metadata_hash(ml);
+        }
+
+        if (!llama_prepared_cache_load(model)) {
+            llm_load_vocab(ml, model);
+
+            std::lock_guard<std::mutex> lock(model.cache_mutex);
+            llama_prepared_cache_save(model);
+        }
 
         llm_load_print_meta(ml, model);
 
@@ -3084,19 +4636,48 @@ static bool llama_model_load(
 
         if (vocab_only) {
             LLAMA_LOG_INFO("%s: vocab only - skipping tensors\n", __func__);
-            return true;
+            return 0;
         }
 
-        llm_load_tensors(
+        if (!llm_load_tensors(
                 ml, model, n_gpu_layers,
                 main_gpu, tensor_split,
-                use_mlock, progress_callback, progress_callback_user_data);
+                use_mlock, repack_weights, stream_budget, progress_callback, progress_callback_user_data)) {
+            return -2;
+        }
     } catch (const std::exception & err) {
         LLAMA_LOG_ERROR("error loading model: %s\n", err.what());
-        return false;
+        return -1;
     }
 
-    return true;
+    return 0;
+}
+
+//
+// llm_build
+//
+
+// keep only the rows for which an output (logits or embeddings) was requested,
+// so that the final norm and the lm_head are not computed for the rest of the batch
+static struct lm_ggml_tensor * llm_build_out_rows(
+        llama_context & lctx,
+     lm_ggml_context * ctx0,
+      lm_ggml_tensor * cur) {
+    const auto & out_ids = lctx.out_ids;
+
+    if (lm_ggml_allocr_is_measure(lctx.alloc) || out_ids.empty()) {
+        return cur;
+    }
+
+    struct lm_ggml_tensor * inp_out_ids = lm_ggml_new_tensor_1d(ctx0, LM_GGML_TYPE_I32, out_ids.size());
+    lm_ggml_allocr_alloc(lctx.alloc, inp_out_ids);
+    memcpy(inp_out_ids->data, out_ids.data(), out_ids.size()*lm_ggml_element_size(inp_out_ids));
+    lm_ggml_set_name(inp_out_ids, "inp_out_ids");
+
+    cur = lm_ggml_get_rows(ctx0, cur, inp_out_ids);
+    lm_ggml_set_name(cur, "out_rows");
+
+    return cur;
 }
 
 static struct lm_ggml_cgraph * llm_build_llama(
@@ -3277,7 +4858,11 @@ static struct lm_ggml_cgraph * llm_build_llama(
         struct lm_ggml_tensor * inpSA = inpL;
 
         // norm
-        {
+        if (cparams.fused_ops) {
+            // cur = rms_norm(inpL)*attn_norm(broadcasted)
+            cur = lm_ggml_rms_norm_mul(ctx0, inpL, model.layers[il].attn_norm, norm_rms_eps);
+            lm_ggml_set_name(cur, "attention_norm_0");
+        } else {
             cur = lm_ggml_rms_norm(ctx0, inpL, norm_rms_eps);
             offload_func(cur);
             lm_ggml_set_name(cur, "rms_norm_0");
@@ -3347,58 +4932,79 @@ static struct lm_ggml_cgraph * llm_build_llama(
             offload_func_kq(K);
             lm_ggml_set_name(K, "K");
 
-            // K * Q
-            struct lm_ggml_tensor * KQ = lm_ggml_mul_mat(ctx0, K, Q);
-            offload_func_kq(KQ);
-            lm_ggml_set_name(KQ, "KQ");
-
-            // KQ_scaled = KQ / sqrt(n_embd_head)
-            // KQ_scaled shape [n_kv, n_tokens, n_head, 1]
-            struct lm_ggml_tensor * KQ_scaled = lm_ggml_scale(ctx0, KQ, KQ_scale);
-            offload_func_kq(KQ_scaled);
-            lm_ggml_set_name(KQ_scaled, "KQ_scaled");
-
-            // KQ_masked = mask_past(KQ_scaled)
-            struct lm_ggml_tensor * KQ_masked = lm_ggml_add(ctx0, KQ_scaled, KQ_mask);
-            offload_func_kq(KQ_masked);
-            lm_ggml_set_name(KQ_masked, "KQ_masked");
-
-            // KQ = soft_max(KQ_masked)
-            struct lm_ggml_tensor * KQ_soft_max = lm_ggml_soft_max(ctx0, KQ_masked);
-            offload_func_v(KQ_soft_max);
-            lm_ggml_set_name(KQ_soft_max, "KQ_soft_max");
-
-            // split cached V into n_head heads
-            struct lm_ggml_tensor * V =
-                lm_ggml_view_3d(ctx0, kv_self.v,
-                        n_kv, n_embd_head, n_head_kv,
-                        lm_ggml_element_size(kv_self.v)*n_ctx,
-                        lm_ggml_element_size(kv_self.v)*n_ctx*n_embd_head,
-                        lm_ggml_element_size(kv_self.v)*n_ctx*n_embd_gqa*il);
-            offload_func_v(V);
-            lm_ggml_set_name(V, "V");
+            if (cparams.flash_attn) {
+                // split cached V into n_head heads
+                struct lm_ggml_tensor * V =
+                    lm_ggml_view_3d(ctx0, kv_self.v,
+                            n_kv, n_embd_head, n_head_kv,
+                            lm_ggml_element_size(kv_self.v)*n_ctx,
+                            lm_ggml_element_size(kv_self.v)*n_ctx*n_embd_head,
+                            lm_ggml_element_size(kv_self.v)*n_ctx*n_embd_gqa*il);
+                offload_func_v(V);
+                lm_ggml_set_name(V, "V");
+
+                // fused KQ, scale, mask, soft_max and KQV - the KQ matrix is never materialized
+                cur = lm_ggml_flash_attn_ext(ctx0, Q, K, V, KQ_mask, 1.0f/sqrtf(float(n_embd_head)));
+                offload_func_v(cur);
+                lm_ggml_set_name(cur, "KQV_merged");
+
+                cur = lm_ggml_reshape_2d(ctx0, cur, n_embd, n_tokens);
+                offload_func_v(cur);
+                lm_ggml_set_name(cur, "KQV_merged_contiguous");
+            } else {
+                // K * Q
+                struct lm_ggml_tensor * KQ = lm_ggml_mul_mat(ctx0, K, Q);
+                offload_func_kq(KQ);
+                lm_ggml_set_name(KQ, "KQ");
+
+                // KQ_scaled = KQ / sqrt(n_embd_head)
+                // KQ_scaled shape [n_kv, n_tokens, n_head, 1]
+                struct lm_ggml_tensor * KQ_scaled = lm_ggml_scale(ctx0, KQ, KQ_scale);
+                offload_func_kq(KQ_scaled);
+                lm_ggml_set_name(KQ_scaled, "KQ_scaled");
+
+                // KQ_masked = mask_past(KQ_scaled)
+                struct lm_ggml_tensor * KQ_masked = lm_ggml_add(ctx0, KQ_scaled, KQ_mask);
+                offload_func_kq(KQ_masked);
+                lm_ggml_set_name(KQ_masked, "KQ_masked");
+
+                // KQ = soft_max(KQ_masked)
+                struct lm_ggml_tensor * KQ_soft_max = lm_ggml_soft_max(ctx0, KQ_masked);
+                offload_func_v(KQ_soft_max);
+                lm_ggml_set_name(KQ_soft_max, "KQ_soft_max");
+
+                // split cached V into n_head heads
+                struct lm_ggml_tensor * V =
+                    lm_ggml_view_3d(ctx0, kv_self.v,
+                            n_kv, n_embd_head, n_head_kv,
+                            lm_ggml_element_size(kv_self.v)*n_ctx,
+                            lm_ggml_element_size(kv_self.v)*n_ctx*n_embd_head,
+                            lm_ggml_element_size(kv_self.v)*n_ctx*n_embd_gqa*il);
+                offload_func_v(V);
+                lm_ggml_set_name(V, "V");
 
 #if 1
-            struct lm_ggml_tensor * KQV = lm_ggml_mul_mat(ctx0, V, KQ_soft_max);
-            offload_func_v(KQV);
-            lm_ggml_set_name(KQV, "KQV");
+                struct lm_ggml_tensor * KQV = lm_ggml_mul_mat(ctx0, V, KQ_soft_max);
+                offload_func_v(KQV);
+                lm_ggml_set_name(KQV, "KQV");
 #else
-            // make V contiguous in memory to speed up the matmul, however we waste time on the copy
-            // on M1 this is faster for the perplexity computation, but ~5% slower for the single-token generation
-            // is there a better way?
-            struct lm_ggml_tensor * V_cont = lm_ggml_cpy(ctx0, V, lm_ggml_new_tensor_3d(ctx0, kv_self.v->type, n_ctx, n_embd_head, n_head));
-            struct lm_ggml_tensor * KQV = lm_ggml_mul_mat(ctx0, V_cont, KQ_soft_max);
+                // make V contiguous in memory to speed up the matmul, however we waste time on the copy
+                // on M1 this is faster for the perplexity computation, but ~5% slower for the single-token generation
+                // is there a better way?
+                struct lm_ggml_tensor * V_cont = lm_ggml_cpy(ctx0, V, lm_ggml_new_tensor_3d(ctx0, kv_self.v->type, n_ctx, n_embd_head, n_head));
+                struct lm_ggml_tensor * KQV = lm_ggml_mul_mat(ctx0, V_cont, KQ_soft_max);
 #endif
 
-            // KQV_merged = KQV.permute(0, 2, 1, 3)
-            struct lm_ggml_tensor * KQV_merged = lm_ggml_permute(ctx0, KQV, 0, 2, 1, 3);
-            offload_func_v(KQV_merged);
-            lm_ggml_set_name(KQV_merged, "KQV_merged");
+                // KQV_merged = KQV.permute(0, 2, 1, 3)
+                struct lm_ggml_tensor * KQV_merged = lm_ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+                offload_func_v(KQV_merged);
+                lm_ggml_set_name(KQV_merged, "KQV_merged");
 
-            // cur = KQV_merged.contiguous().view(n_embd, n_tokens)
-            cur = lm_ggml_cont_2d(ctx0, KQV_merged, n_embd, n_tokens);
-            offload_func_v(cur);
-            lm_ggml_set_name(cur, "KQV_merged_contiguous");
+                // cur = KQV_merged.contiguous().view(n_embd, n_tokens)
+                cur = lm_ggml_cont_2d(ctx0, KQV_merged, n_embd, n_tokens);
+                offload_func_v(cur);
+                lm_ggml_set_name(cur, "KQV_merged_contiguous");
+            }
 
             // projection (no bias)
             cur = lm_ggml_mul_mat(ctx0,
@@ -3408,14 +5014,26 @@ static struct lm_ggml_cgraph * llm_build_llama(
             lm_ggml_set_name(cur, "result_wo");
         }
 
-        struct lm_ggml_tensor * inpFF = lm_ggml_add(ctx0, cur, inpSA);
-        offload_func(inpFF);
-        lm_ggml_set_name(inpFF, "inpFF");
+        struct lm_ggml_tensor * inpFF;
 
         // feed-forward network
         {
             // norm
-            {
+            if (cparams.fused_ops) {
+                // inpFF = cur + inpSA, cur = rms_norm(inpFF)*ffn_norm(broadcasted)
+                struct lm_ggml_tensor * res = lm_ggml_add_rms_norm_mul(ctx0, cur, inpSA, model.layers[il].ffn_norm, norm_rms_eps);
+                lm_ggml_set_name(res, "inpFF_ffn_norm");
+
+                inpFF = lm_ggml_view_2d(ctx0, res, n_embd, n_tokens, res->nb[1], 0);
+                lm_ggml_set_name(inpFF, "inpFF");
+
+                cur = lm_ggml_view_2d(ctx0, res, n_embd, n_tokens, res->nb[1], res->nb[2]);
+                lm_ggml_set_name(cur, "ffn_norm");
+            } else {
+                inpFF = lm_ggml_add(ctx0, cur, inpSA);
+                offload_func(inpFF);
+                lm_ggml_set_name(inpFF, "inpFF");
+
                 cur = lm_ggml_rms_norm(ctx0, inpFF, norm_rms_eps);
                 offload_func(cur);
                 lm_ggml_set_name(cur, "rms_norm_1");
@@ -3438,14 +5056,20 @@ static struct lm_ggml_cgraph * llm_build_llama(
             offload_func(cur);
             lm_ggml_set_name(cur, "result_w1");
 
-            // SILU activation
-            cur = lm_ggml_silu(ctx0, cur);
-            offload_func(cur);
-            lm_ggml_set_name(cur, "silu");
+            if (cparams.fused_ops) {
+                // cur = silu(cur)*tmp
+                cur = lm_ggml_swiglu(ctx0, cur, tmp);
+                lm_ggml_set_name(cur, "silu_x_result_w3");
+            } else {
+                // SILU activation
+                cur = lm_ggml_silu(ctx0, cur);
+                offload_func(cur);
+                lm_ggml_set_name(cur, "silu");
 
-            cur = lm_ggml_mul(ctx0, cur, tmp);
-            offload_func(cur);
-            lm_ggml_set_name(cur, "silu_x_result_w3");
+                cur = lm_ggml_mul(ctx0, cur, tmp);
+                offload_func(cur);
+                lm_ggml_set_name(cur, "silu_x_result_w3");
+            }
 
             cur = lm_ggml_mul_mat(ctx0,
                     model.layers[il].w2,
@@ -3462,10 +5086,14 @@ static struct lm_ggml_cgraph * llm_build_llama(
         inpL = cur;
     }
 
-    cur = inpL;
+    cur = llm_build_out_rows(lctx, ctx0, inpL);
 
     // norm
-    {
+    if (cparams.fused_ops) {
+        // cur = rms_norm(cur)*norm(broadcasted)
+        cur = lm_ggml_rms_norm_mul(ctx0, cur, model.output_norm, norm_rms_eps);
+        lm_ggml_set_name(cur, "result_norm");
+    } else {
         cur = lm_ggml_rms_norm(ctx0, cur, norm_rms_eps);
         offload_func_nr(cur);
         lm_ggml_set_name(cur, "rms_norm_2");
@@ -3477,8 +5105,10 @@ static struct lm_ggml_cgraph * llm_build_llama(
     }
 
     // lm_head
-    cur = lm_ggml_mul_mat(ctx0, model.output, cur);
-    lm_ggml_set_name(cur, "result_output");
+    if (!cparams.embedding_only) {
+        cur = lm_ggml_mul_mat(ctx0, model.output, cur);
+        lm_ggml_set_name(cur, "result_output");
+    }
 
     lm_ggml_build_forward_expand(gf, cur);
 
@@ -3663,7 +5293,11 @@ static struct lm_ggml_cgraph * llm_build_baichaun(
         struct lm_ggml_tensor * inpSA = inpL;
 
         // norm
-        {
+        if (cparams.fused_ops) {
+            // cur = rms_norm(inpL)*attn_norm(broadcasted)
+            cur = lm_ggml_rms_norm_mul(ctx0, inpL, model.layers[il].attn_norm, norm_rms_eps);
+            lm_ggml_set_name(cur, "attention_norm_0");
+        } else {
             cur = lm_ggml_rms_norm(ctx0, inpL, norm_rms_eps);
             offload_func(cur);
             lm_ggml_set_name(cur, "rms_norm_0");
@@ -3746,62 +5380,83 @@ static struct lm_ggml_cgraph * llm_build_baichaun(
             offload_func_kq(K);
             lm_ggml_set_name(K, "K");
 
-            // K * Q
-            struct lm_ggml_tensor * KQ = lm_ggml_mul_mat(ctx0, K, Q);
-            offload_func_kq(KQ);
-            lm_ggml_set_name(KQ, "KQ");
-
-            // KQ_scaled = KQ / sqrt(n_embd_head)
-            // KQ_scaled shape [n_past + n_tokens, n_tokens, n_head, 1]
-            struct lm_ggml_tensor * KQ_scaled = lm_ggml_scale(ctx0, KQ, KQ_scale);
-            offload_func_kq(KQ_scaled);
-            lm_ggml_set_name(KQ_scaled, "KQ_scaled");
-
-            struct lm_ggml_tensor * KQ_masked;
-            struct lm_ggml_tensor * KQ_scaled_alibi;
-
-            switch (model.type) {
-                case MODEL_7B:
-                    KQ_masked = lm_ggml_add(ctx0, KQ_scaled, KQ_mask);
-                    break;
-                case MODEL_13B:
-                    // TODO: replace with lm_ggml_add()
-                    KQ_scaled_alibi = lm_ggml_alibi(ctx0, KQ_scaled, /*n_past*/ 0, n_head, 8);
-                    lm_ggml_set_name(KQ_scaled_alibi, "KQ_scaled_alibi");
-                    KQ_masked = lm_ggml_add(ctx0, KQ_scaled_alibi, KQ_mask);
-                    break;
-                default:
-                    LM_GGML_ASSERT(false);
-            }
-
-            // KQ = soft_max(KQ_masked)
-            struct lm_ggml_tensor * KQ_soft_max = lm_ggml_soft_max(ctx0, KQ_masked);
-            offload_func_v(KQ_soft_max);
-            lm_ggml_set_name(KQ_soft_max, "KQ_soft_max");
-
-            // split cached V into n_head heads
-            struct lm_ggml_tensor * V =
-                lm_ggml_view_3d(ctx0, kv_self.v,
-                        n_kv, n_embd_head, n_head_kv,
-                        lm_ggml_element_size(kv_self.v)*n_ctx,
-                        lm_ggml_element_size(kv_self.v)*n_ctx*n_embd_head,
-                        lm_ggml_element_size(kv_self.v)*n_ctx*n_embd_gqa*il);
-            offload_func_v(V);
-            lm_ggml_set_name(V, "V");
-
-            struct lm_ggml_tensor * KQV = lm_ggml_mul_mat(ctx0, V, KQ_soft_max);
-            offload_func_v(KQV);
-            lm_ggml_set_name(KQV, "KQV");
-
-            // KQV_merged = KQV.permute(0, 2, 1, 3)
-            struct lm_ggml_tensor * KQV_merged = lm_ggml_permute(ctx0, KQV, 0, 2, 1, 3);
-            offload_func_v(KQV_merged);
-            lm_ggml_set_name(KQV_merged, "KQV_merged");
-
-            // cur = KQV_merged.contiguous().view(n_embd, n_tokens)
-            cur = lm_ggml_cont_2d(ctx0, KQV_merged, n_embd, n_tokens);
-            offload_func_v(cur);
-            lm_ggml_set_name(cur, "KQV_merged_contiguous");
+            if (cparams.flash_attn && model.type == MODEL_7B) {
+                // split cached V into n_head heads
+                struct lm_ggml_tensor * V =
+                    lm_ggml_view_3d(ctx0, kv_self.v,
+                            n_kv, n_embd_head, n_head_kv,
+                            lm_ggml_element_size(kv_self.v)*n_ctx,
+                            lm_ggml_element_size(kv_self.v)*n_ctx*n_embd_head,
+                            lm_ggml_element_size(kv_self.v)*n_ctx*n_embd_gqa*il);
+                offload_func_v(V);
+                lm_ggml_set_name(V, "V");
+
+                // fused KQ, scale, mask, soft_max and KQV - the KQ matrix is never materialized
+                cur = lm_ggml_flash_attn_ext(ctx0, Q, K, V, KQ_mask, 1.0f/sqrtf(float(n_embd_head)));
+                offload_func_v(cur);
+                lm_ggml_set_name(cur, "KQV_merged");
+
+                cur = lm_ggml_reshape_2d(ctx0, cur, n_embd, n_tokens);
+                offload_func_v(cur);
+                lm_ggml_set_name(cur, "KQV_merged_contiguous");
+            } else {
+                // K * Q
+                struct lm_ggml_tensor * KQ = lm_ggml_mul_mat(ctx0, K, Q);
+                offload_func_kq(KQ);
+                lm_ggml_set_name(KQ, "KQ");
+
+                // KQ_scaled = KQ / sqrt(n_embd_head)
+                // KQ_scaled shape [n_past + n_tokens, n_tokens, n_head, 1]
+                struct lm_ggml_tensor * KQ_scaled = lm_ggml_scale(ctx0, KQ, KQ_scale);
+                offload_func_kq(KQ_scaled);
+                lm_ggml_set_name(KQ_scaled, "KQ_scaled");
+
+                struct lm_ggml_tensor * KQ_masked;
+                struct lm_ggml_tensor * KQ_scaled_alibi;
+
+                switch (model.type) {
+                    case MODEL_7B:
+                        KQ_masked = lm_ggml_add(ctx0, KQ_scaled, KQ_mask);
+                        break;
+                    case MODEL_13B:
+                        // TODO: replace with lm_ggml_add()
+                        KQ_scaled_alibi = lm_ggml_alibi(ctx0, KQ_scaled, /*n_past*/ 0, n_head, 8);
+                        lm_ggml_set_name(KQ_scaled_alibi, "KQ_scaled_alibi");
+                        KQ_masked = lm_ggml_add(ctx0, KQ_scaled_alibi, KQ_mask);
+                        break;
+                    default:
+                        LM_GGML_ASSERT(false);
+                }
+
+                // KQ = soft_max(KQ_masked)
+                struct lm_ggml_tensor * KQ_soft_max = lm_ggml_soft_max(ctx0, KQ_masked);
+                offload_func_v(KQ_soft_max);
+                lm_ggml_set_name(KQ_soft_max, "KQ_soft_max");
+
+                // split cached V into n_head heads
+                struct lm_ggml_tensor * V =
+                    lm_ggml_view_3d(ctx0, kv_self.v,
+                            n_kv, n_embd_head, n_head_kv,
+                            lm_ggml_element_size(kv_self.v)*n_ctx,
+                            lm_ggml_element_size(kv_self.v)*n_ctx*n_embd_head,
+                            lm_ggml_element_size(kv_self.v)*n_ctx*n_embd_gqa*il);
+                offload_func_v(V);
+                lm_ggml_set_name(V, "V");
+
+                struct lm_ggml_tensor * KQV = lm_ggml_mul_mat(ctx0, V, KQ_soft_max);
+                offload_func_v(KQV);
+                lm_ggml_set_name(KQV, "KQV");
+
+                // KQV_merged = KQV.permute(0, 2, 1, 3)
+                struct lm_ggml_tensor * KQV_merged = lm_ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+                offload_func_v(KQV_merged);
+                lm_ggml_set_name(KQV_merged, "KQV_merged");
+
+                // cur = KQV_merged.contiguous().view(n_embd, n_tokens)
+                cur = lm_ggml_cont_2d(ctx0, KQV_merged, n_embd, n_tokens);
+                offload_func_v(cur);
+                lm_ggml_set_name(cur, "KQV_merged_contiguous");
+            }
 
             // projection (no bias)
             cur = lm_ggml_mul_mat(ctx0,
@@ -3811,14 +5466,26 @@ static struct lm_ggml_cgraph * llm_build_baichaun(
             lm_ggml_set_name(cur, "result_wo");
         }
 
-        struct lm_ggml_tensor * inpFF = lm_ggml_add(ctx0, cur, inpSA);
-        offload_func(inpFF);
-        lm_ggml_set_name(inpFF, "inpFF");
+        struct lm_ggml_tensor * inpFF;
 
         // feed-forward network
         {
             // norm
-            {
+            if (cparams.fused_ops) {
+                // inpFF = cur + inpSA, cur = rms_norm(inpFF)*ffn_norm(broadcasted)
+                struct lm_ggml_tensor * res = lm_ggml_add_rms_norm_mul(ctx0, cur, inpSA, model.layers[il].ffn_norm, norm_rms_eps);
+                lm_ggml_set_name(res, "inpFF_ffn_norm");
+
+                inpFF = lm_ggml_view_2d(ctx0, res, n_embd, n_tokens, res->nb[1], 0);
+                lm_ggml_set_name(inpFF, "inpFF");
+
+                cur = lm_ggml_view_2d(ctx0, res, n_embd, n_tokens, res->nb[1], res->nb[2]);
+                lm_ggml_set_name(cur, "ffn_norm");
+            } else {
+                inpFF = lm_ggml_add(ctx0, cur, inpSA);
+                offload_func(inpFF);
+                lm_ggml_set_name(inpFF, "inpFF");
+
                 cur = lm_ggml_rms_norm(ctx0, inpFF, norm_rms_eps);
                 offload_func(cur);
                 lm_ggml_set_name(cur, "rms_norm_1");
@@ -3841,14 +5508,20 @@ static struct lm_ggml_cgraph * llm_build_baichaun(
             offload_func(cur);
             lm_ggml_set_name(cur, "result_w1");
 
-            // SILU activation
-            cur = lm_ggml_silu(ctx0, cur);
-            offload_func(cur);
-            lm_ggml_set_name(cur, "silu");
+            if (cparams.fused_ops) {
+                // cur = silu(cur)*tmp
+                cur = lm_ggml_swiglu(ctx0, cur, tmp);
+                lm_ggml_set_name(cur, "silu_x_result_w3");
+            } else {
+                // SILU activation
+                cur = lm_ggml_silu(ctx0, cur);
+                offload_func(cur);
+                lm_ggml_set_name(cur, "silu");
 
-            cur = lm_ggml_mul(ctx0, cur, tmp);
-            offload_func(cur);
-            lm_ggml_set_name(cur, "silu_x_result_w3");
+                cur = lm_ggml_mul(ctx0, cur, tmp);
+                offload_func(cur);
+                lm_ggml_set_name(cur, "silu_x_result_w3");
+            }
 
             cur = lm_ggml_mul_mat(ctx0,
                     model.layers[il].w2,
@@ -3865,10 +5538,14 @@ static struct lm_ggml_cgraph * llm_build_baichaun(
         inpL = cur;
     }
 
-    cur = inpL;
+    cur = llm_build_out_rows(lctx, ctx0, inpL);
 
     // norm
-    {
+    if (cparams.fused_ops) {
+        // cur = rms_norm(cur)*norm(broadcasted)
+        cur = lm_ggml_rms_norm_mul(ctx0, cur, model.output_norm, norm_rms_eps);
+        lm_ggml_set_name(cur, "result_norm");
+    } else {
         cur = lm_ggml_rms_norm(ctx0, cur, norm_rms_eps);
         offload_func_nr(cur);
         lm_ggml_set_name(cur, "rms_norm_2");
@@ -3880,8 +5557,10 @@ static struct lm_ggml_cgraph * llm_build_baichaun(
     }
 
     // lm_head
-    cur = lm_ggml_mul_mat(ctx0, model.output, cur);
-    lm_ggml_set_name(cur, "result_output");
+    if (!cparams.embedding_only) {
+        cur = lm_ggml_mul_mat(ctx0, model.output, cur);
+        lm_ggml_set_name(cur, "result_output");
+    }
 
     lm_ggml_build_forward_expand(gf, cur);
 
@@ -4023,7 +5702,11 @@ static struct lm_ggml_cgraph * llm_build_refact(
         struct lm_ggml_tensor * inpSA = inpL;
 
         // norm
-        {
+        if (cparams.fused_ops) {
+            // cur = rms_norm(inpL)*attn_norm(broadcasted)
+            cur = lm_ggml_rms_norm_mul(ctx0, inpL, model.layers[il].attn_norm, norm_rms_eps);
+            lm_ggml_set_name(cur, "attention_norm_0");
+        } else {
             cur = lm_ggml_rms_norm(ctx0, inpL, norm_rms_eps);
             offload_func(cur);
             lm_ggml_set_name(cur, "rms_norm_0");
@@ -4156,14 +5839,26 @@ static struct lm_ggml_cgraph * llm_build_refact(
             lm_ggml_set_name(cur, "result_wo");
         }
 
-        struct lm_ggml_tensor * inpFF = lm_ggml_add(ctx0, cur, inpSA);
-        offload_func(inpFF);
-        lm_ggml_set_name(inpFF, "inpFF");
+        struct lm_ggml_tensor * inpFF;
 
         // feed-forward network
         {
             // norm
-            {
+            if (cparams.fused_ops) {
+                // inpFF = cur + inpSA, cur = rms_norm(inpFF)*ffn_norm(broadcasted)
+                struct lm_ggml_tensor * res = lm_ggml_add_rms_norm_mul(ctx0, cur, inpSA, model.layers[il].ffn_norm, norm_rms_eps);
+                lm_ggml_set_name(res, "inpFF_ffn_norm");
+
+                inpFF = lm_ggml_view_2d(ctx0, res, n_embd, n_tokens, res->nb[1], 0);
+                lm_ggml_set_name(inpFF, "inpFF");
+
+                cur = lm_ggml_view_2d(ctx0, res, n_embd, n_tokens, res->nb[1], res->nb[2]);
+                lm_ggml_set_name(cur, "ffn_norm");
+            } else {
+                inpFF = lm_ggml_add(ctx0, cur, inpSA);
+                offload_func(inpFF);
+                lm_ggml_set_name(inpFF, "inpFF");
+
                 cur = lm_ggml_rms_norm(ctx0, inpFF, norm_rms_eps);
                 offload_func(cur);
                 lm_ggml_set_name(cur, "rms_norm_1");
@@ -4186,14 +5881,20 @@ static struct lm_ggml_cgraph * llm_build_refact(
             offload_func(cur);
             lm_ggml_set_name(cur, "result_w1");
 
-            // SILU activation
-            cur = lm_ggml_silu(ctx0, cur);
-            offload_func(cur);
-            lm_ggml_set_name(cur, "silu");
+            if (cparams.fused_ops) {
+                // cur = silu(cur)*tmp
+                cur = lm_ggml_swiglu(ctx0, cur, tmp);
+                lm_ggml_set_name(cur, "silu_x_result_w3");
+            } else {
+                // SILU activation
+                cur = lm_ggml_silu(ctx0, cur);
+                offload_func(cur);
+                lm_ggml_set_name(cur, "silu");
 
-            cur = lm_ggml_mul(ctx0, cur, tmp);
-            offload_func(cur);
-            lm_ggml_set_name(cur, "silu_x_result_w3");
+                cur = lm_ggml_mul(ctx0, cur, tmp);
+                offload_func(cur);
+                lm_ggml_set_name(cur, "silu_x_result_w3");
+            }
 
             cur = lm_ggml_mul_mat(ctx0,
                     model.layers[il].w2,
@@ -4210,10 +5911,14 @@ static struct lm_ggml_cgraph * llm_build_refact(
         inpL = cur;
     }
 
-    cur = inpL;
+    cur = llm_build_out_rows(lctx, ctx0, inpL);
 
     // norm
-    {
+    if (cparams.fused_ops) {
+        // cur = rms_norm(cur)*norm(broadcasted)
+        cur = lm_ggml_rms_norm_mul(ctx0, cur, model.output_norm, norm_rms_eps);
+        lm_ggml_set_name(cur, "result_norm");
+    } else {
         cur = lm_ggml_rms_norm(ctx0, cur, norm_rms_eps);
         offload_func_nr(cur);
         lm_ggml_set_name(cur, "rms_norm_2");
@@ -4225,8 +5930,10 @@ static struct lm_ggml_cgraph * llm_build_refact(
     }
 
     // lm_head
-    cur = lm_ggml_mul_mat(ctx0, model.output, cur);
-    lm_ggml_set_name(cur, "result_output");
+    if (!cparams.embedding_only) {
+        cur = lm_ggml_mul_mat(ctx0, model.output, cur);
+        lm_ggml_set_name(cur, "result_output");
+    }
 
     lm_ggml_build_forward_expand(gf, cur);
 
@@ -4513,42 +6220,62 @@ static struct lm_ggml_cgraph * llm_build_falcon(
             offload_func_kq(K);
             lm_ggml_set_name(K, "K");
 
-            struct lm_ggml_tensor * KQ = lm_ggml_mul_mat(ctx0, K, Q);
-            offload_func_kq(KQ);
-            lm_ggml_set_name(KQ, "KQ");
-
-            struct lm_ggml_tensor * KQ_scaled = lm_ggml_scale(ctx0, KQ, KQ_scale);
-            offload_func_kq(KQ_scaled);
-            lm_ggml_set_name(KQ_scaled, "KQ_scaled");
-
-            struct lm_ggml_tensor * KQ_masked = lm_ggml_add(ctx0, KQ_scaled, KQ_mask);
-            offload_func_kq(KQ_masked);
-            lm_ggml_set_name(KQ_masked, "KQ_masked");
-
-            struct lm_ggml_tensor * KQ_soft_max = lm_ggml_soft_max(ctx0, KQ_masked);
-            offload_func_v(KQ_soft_max);
-            lm_ggml_set_name(KQ_soft_max, "KQ_soft_max");
-
-            struct lm_ggml_tensor * V =
-                lm_ggml_view_3d(ctx0, kv_self.v,
-                        n_kv, n_embd_head, n_head_kv,
-                        lm_ggml_element_size(kv_self.v)*n_ctx,
-                        lm_ggml_element_size(kv_self.v)*n_ctx*n_embd_head,
-                        lm_ggml_element_size(kv_self.v)*n_ctx*n_embd_gqa*il);
-            offload_func_v(V);
-            lm_ggml_set_name(V, "V");
-
-            struct lm_ggml_tensor * KQV = lm_ggml_mul_mat(ctx0, V, KQ_soft_max);
-            offload_func_v(KQV);
-            lm_ggml_set_name(KQV, "KQV");
-
-            struct lm_ggml_tensor * KQV_merged = lm_ggml_permute(ctx0, KQV, 0, 2, 1, 3);
-            offload_func_v(KQV_merged);
-            lm_ggml_set_name(KQV_merged, "KQV_merged");
-
-            cur = lm_ggml_cont_2d(ctx0, KQV_merged, n_embd, n_tokens);
-            offload_func_v(cur);
-            lm_ggml_set_name(cur, "KQV_merged_contiguous");
+            if (cparams.flash_attn) {
+                struct lm_ggml_tensor * V =
+                    lm_ggml_view_3d(ctx0, kv_self.v,
+                            n_kv, n_embd_head, n_head_kv,
+                            lm_ggml_element_size(kv_self.v)*n_ctx,
+                            lm_ggml_element_size(kv_self.v)*n_ctx*n_embd_head,
+                            lm_ggml_element_size(kv_self.v)*n_ctx*n_embd_gqa*il);
+                offload_func_v(V);
+                lm_ggml_set_name(V, "V");
+
+                // fused KQ, scale, mask, soft_max and KQV - the KQ matrix is never materialized
+                cur = lm_ggml_flash_attn_ext(ctx0, Q, K, V, KQ_mask, 1.0f/sqrtf(float(n_embd_head)));
+                offload_func_v(cur);
+                lm_ggml_set_name(cur, "KQV_merged");
+
+                cur = lm_ggml_reshape_2d(ctx0, cur, n_embd, n_tokens);
+                offload_func_v(cur);
+                lm_ggml_set_name(cur, "KQV_merged_contiguous");
+            } else {
+                struct lm_ggml_tensor * KQ = lm_ggml_mul_mat(ctx0, K, Q);
+                offload_func_kq(KQ);
+                lm_ggml_set_name(KQ, "KQ");
+
+                struct lm_ggml_tensor * KQ_scaled = lm_ggml_scale(ctx0, KQ, KQ_scale);
+                offload_func_kq(KQ_scaled);
+                lm_ggml_set_name(KQ_scaled, "KQ_scaled");
+
+                struct lm_ggml_tensor * KQ_masked = lm_ggml_add(ctx0, KQ_scaled, KQ_mask);
+                offload_func_kq(KQ_masked);
+                lm_ggml_set_name(KQ_masked, "KQ_masked");
+
+                struct lm_ggml_tensor * KQ_soft_max = lm_ggml_soft_max(ctx0, KQ_masked);
+                offload_func_v(KQ_soft_max);
+                lm_ggml_set_name(KQ_soft_max, "KQ_soft_max");
+
+                struct lm_ggml_tensor * V =
+                    lm_ggml_view_3d(ctx0, kv_self.v,
+                            n_kv, n_embd_head, n_head_kv,
+                            lm_ggml_element_size(kv_self.v)*n_ctx,
+                            lm_ggml_element_size(kv_self.v)*n_ctx*n_embd_head,
+                            lm_ggml_element_size(kv_self.v)*n_ctx*n_embd_gqa*il);
+                offload_func_v(V);
+                lm_ggml_set_name(V, "V");
+
+                struct lm_ggml_tensor * KQV = lm_ggml_mul_mat(ctx0, V, KQ_soft_max);
+                offload_func_v(KQV);
+                lm_ggml_set_name(KQV, "KQV");
+
+                struct lm_ggml_tensor * KQV_merged = lm_ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+                offload_func_v(KQV_merged);
+                lm_ggml_set_name(KQV_merged, "KQV_merged");
+
+                cur = lm_ggml_cont_2d(ctx0, KQV_merged, n_embd, n_tokens);
+                offload_func_v(cur);
+                lm_ggml_set_name(cur, "KQV_merged_contiguous");
+            }
 
             cur = lm_ggml_mul_mat(ctx0, model.layers[il].wo, cur);
             offload_func(cur);
@@ -4579,7 +6306,7 @@ static struct lm_ggml_cgraph * llm_build_falcon(
         inpL = cur;
     }
 
-    cur = inpL;
+    cur = llm_build_out_rows(lctx, ctx0, inpL);
 
     // norm
     {
@@ -4592,8 +6319,10 @@ static struct lm_ggml_cgraph * llm_build_falcon(
         lm_ggml_set_name(cur, "result_norm");
     }
 
-    cur = lm_ggml_mul_mat(ctx0, model.output, cur);
-    lm_ggml_set_name(cur, "result_output");
+    if (!cparams.embedding_only) {
+        cur = lm_ggml_mul_mat(ctx0, model.output, cur);
+        lm_ggml_set_name(cur, "result_output");
+    }
 
     lm_ggml_build_forward_expand(gf, cur);
 
@@ -4765,42 +6494,60 @@ static struct lm_ggml_cgraph * llm_build_starcoder(
                         lm_ggml_element_size(kv_self.k)*n_embd_gqa*n_ctx*il);
             lm_ggml_set_name(K, "K");
 
-            // K * Q
-            struct lm_ggml_tensor * KQ = lm_ggml_mul_mat(ctx0, K, Q);
-            lm_ggml_set_name(KQ, "KQ");
-
-            // KQ_scaled = KQ / sqrt(n_embd_head)
-            // KQ_scaled shape [n_past + n_tokens, n_tokens, n_head, 1]
-            struct lm_ggml_tensor * KQ_scaled = lm_ggml_scale_inplace(ctx0, KQ, KQ_scale);
-            lm_ggml_set_name(KQ_scaled, "KQ_scaled");
-
-            // KQ_masked = mask_past(KQ_scaled)
-            struct lm_ggml_tensor * KQ_masked = lm_ggml_add(ctx0, KQ_scaled, KQ_mask);
-            lm_ggml_set_name(KQ_masked, "KQ_masked");
-
-            // KQ = soft_max(KQ_masked)
-            struct lm_ggml_tensor * KQ_soft_max = lm_ggml_soft_max_inplace(ctx0, KQ_masked);
-            lm_ggml_set_name(KQ_soft_max, "KQ_soft_max");
-
-            // split cached V into n_head heads
-            struct lm_ggml_tensor * V =
-                lm_ggml_view_3d(ctx0, kv_self.v,
-                        n_kv, n_embd_head, n_head_kv,
-                        lm_ggml_element_size(kv_self.v)*n_ctx,
-                        lm_ggml_element_size(kv_self.v)*n_ctx*n_embd_head,
-                        lm_ggml_element_size(kv_self.v)*n_ctx*n_embd_gqa*il);
-            lm_ggml_set_name(V, "V");
-
-            struct lm_ggml_tensor * KQV = lm_ggml_mul_mat(ctx0, V, KQ_soft_max);
-            lm_ggml_set_name(KQV, "KQV");
-
-            // KQV_merged = KQV.permute(0, 2, 1, 3)
-            struct lm_ggml_tensor * KQV_merged = lm_ggml_permute(ctx0, KQV, 0, 2, 1, 3);
-            lm_ggml_set_name(KQV_merged, "KQV_merged");
-
-            // cur = KQV_merged.contiguous().view(n_embd, n_tokens)
-            cur = lm_ggml_cont_2d(ctx0, KQV_merged, n_embd, n_tokens);
-            lm_ggml_set_name(cur, "KQV_merged_contiguous");
+            if (cparams.flash_attn) {
+                // split cached V into n_head heads
+                struct lm_ggml_tensor * V =
+                    lm_ggml_view_3d(ctx0, kv_self.v,
+                            n_kv, n_embd_head, n_head_kv,
+                            lm_ggml_element_size(kv_self.v)*n_ctx,
+                            lm_ggml_element_size(kv_self.v)*n_ctx*n_embd_head,
+                            lm_ggml_element_size(kv_self.v)*n_ctx*n_embd_gqa*il);
+                lm_ggml_set_name(V, "V");
+
+                // fused KQ, scale, mask, soft_max and KQV - the KQ matrix is never materialized
+                cur = lm_ggml_flash_attn_ext(ctx0, Q, K, V, KQ_mask, 1.0f/sqrtf(float(n_embd_head)));
+                lm_ggml_set_name(cur, "KQV_merged");
+
+                cur = lm_ggml_reshape_2d(ctx0, cur, n_embd, n_tokens);
+                lm_ggml_set_name(cur, "KQV_merged_contiguous");
+            } else {
+                // K * Q
+                struct lm_ggml_tensor * KQ = lm_ggml_mul_mat(ctx0, K, Q);
+                lm_ggml_set_name(KQ, "KQ");
+
+                // KQ_scaled = KQ / sqrt(n_embd_head)
+                // KQ_scaled shape [n_past + n_tokens, n_tokens, n_head, 1]
+                struct lm_ggml_tensor * KQ_scaled = lm_ggml_scale_inplace(ctx0, KQ, KQ_scale);
+                lm_ggml_set_name(KQ_scaled, "KQ_scaled");
+
+                // KQ_masked = mask_past(KQ_scaled)
+                struct lm_ggml_tensor * KQ_masked = lm_ggml_add(ctx0, KQ_scaled, KQ_mask);
+                lm_ggml_set_name(KQ_masked, "KQ_masked");
+
+                // KQ = soft_max(KQ_masked)
+                struct lm_ggml_tensor * KQ_soft_max = lm_ggml_soft_max_inplace(ctx0, KQ_masked);
+                lm_ggml_set_name(KQ_soft_max, "KQ_soft_max");
+
+                // split cached V into n_head heads
+                struct lm_ggml_tensor * V =
+                    lm_ggml_view_3d(ctx0, kv_self.v,
+                            n_kv, n_embd_head, n_head_kv,
+                            lm_ggml_element_size(kv_self.v)*n_ctx,
+                            lm_ggml_element_size(kv_self.v)*n_ctx*n_embd_head,
+                            lm_ggml_element_size(kv_self.v)*n_ctx*n_embd_gqa*il);
+                lm_ggml_set_name(V, "V");
+
+                struct lm_ggml_tensor * KQV = lm_ggml_mul_mat(ctx0, V, KQ_soft_max);
+                lm_ggml_set_name(KQV, "KQV");
+
+                // KQV_merged = KQV.permute(0, 2, 1, 3)
+                struct lm_ggml_tensor * KQV_merged = lm_ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+                lm_ggml_set_name(KQV_merged, "KQV_merged");
+
+                // cur = KQV_merged.contiguous().view(n_embd, n_tokens)
+                cur = lm_ggml_cont_2d(ctx0, KQV_merged, n_embd, n_tokens);
+                lm_ggml_set_name(cur, "KQV_merged_contiguous");
+            }
         }
 
         // Projection
@@ -4831,6 +6578,8 @@ static struct lm_ggml_cgraph * llm_build_starcoder(
         inpL = lm_ggml_add(ctx0, cur, inpFF);
     }
 
+    inpL = llm_build_out_rows(lctx, ctx0, inpL);
+
     // Output Norm
     {
         cur = lm_ggml_norm(ctx0, inpL, norm_eps);
@@ -4838,8 +6587,10 @@ static struct lm_ggml_cgraph * llm_build_starcoder(
     }
     lm_ggml_set_name(cur, "result_norm");
 
-    cur = lm_ggml_mul_mat(ctx0, model.output, cur);
-    lm_ggml_set_name(cur, "result_output");
+    if (!cparams.embedding_only) {
+        cur = lm_ggml_mul_mat(ctx0, model.output, cur);
+        lm_ggml_set_name(cur, "result_output");
+    }
 
     lm_ggml_build_forward_expand(gf, cur);
     lm_ggml_free(ctx0);
@@ -5140,42 +6891,62 @@ static struct lm_ggml_cgraph * llm_build_persimmon(
             offload_func_kq(K);
             lm_ggml_format_name(K, "K_%d", il);
 
-            struct lm_ggml_tensor * KQ = lm_ggml_mul_mat(ctx0, K, Q);
-            offload_func_kq(KQ);
-            lm_ggml_set_name(KQ, "KQ");
-
-            struct lm_ggml_tensor * KQ_scaled = lm_ggml_scale(ctx0, KQ, KQ_scale);
-            offload_func_kq(KQ_scaled);
-            lm_ggml_set_name(KQ_scaled, "KQ_scaled");
-
-            struct lm_ggml_tensor * KQ_masked = lm_ggml_add(ctx0, KQ_scaled, KQ_mask);
-            offload_func_kq(KQ_masked);
-            lm_ggml_set_name(KQ_masked, "KQ_masked");
-
-            struct lm_ggml_tensor * KQ_soft_max = lm_ggml_soft_max_inplace(ctx0, KQ_masked);
-            offload_func_kq(KQ_soft_max);
-            lm_ggml_set_name(KQ_soft_max, "KQ_soft_max");
-
-            struct lm_ggml_tensor * V =
-                lm_ggml_view_3d(ctx0, kv_self.v,
-                        n_kv, n_embd_head, n_head_kv,
-                        lm_ggml_element_size(kv_self.v)*n_ctx,
-                        lm_ggml_element_size(kv_self.v)*n_ctx*n_embd_head,
-                        lm_ggml_element_size(kv_self.v)*n_ctx*n_embd_gqa*il);
-            offload_func_v(V);
-            lm_ggml_set_name(V, "V");
-
-            struct lm_ggml_tensor * KQV = lm_ggml_mul_mat(ctx0, V, KQ_soft_max);
-            offload_func_v(KQV);
-            lm_ggml_set_name(KQV, "KQV");
-
-            struct lm_ggml_tensor * KQV_merged = lm_ggml_permute(ctx0, KQV, 0, 2, 1, 3);
-            offload_func_v(KQV_merged);
-            lm_ggml_set_name(KQV_merged, "KQV_merged");
-
-            cur = lm_ggml_cont_2d(ctx0, KQV_merged, n_embd, n_tokens);
-            offload_func_v(cur);
-            lm_ggml_set_name(cur, "KQV_merged_contiguous");
+            if (cparams.flash_attn) {
+                struct lm_ggml_tensor * V =
+                    lm_ggml_view_3d(ctx0, kv_self.v,
+                            n_kv, n_embd_head, n_head_kv,
+                            lm_ggml_element_size(kv_self.v)*n_ctx,
+                            lm_ggml_element_size(kv_self.v)*n_ctx*n_embd_head,
+                            lm_ggml_element_size(kv_self.v)*n_ctx*n_embd_gqa*il);
+                offload_func_v(V);
+                lm_ggml_set_name(V, "V");
+
+                // fused KQ, scale, mask, soft_max and KQV - the KQ matrix is never materialized
+                cur = lm_ggml_flash_attn_ext(ctx0, Q, K, V, KQ_mask, 1.0f/sqrtf(float(n_embd_head)));
+                offload_func_v(cur);
+                lm_ggml_set_name(cur, "KQV_merged");
+
+                cur = lm_ggml_reshape_2d(ctx0, cur, n_embd, n_tokens);
+                offload_func_v(cur);
+                lm_ggml_set_name(cur, "KQV_merged_contiguous");
+            } else {
+                struct lm_ggml_tensor * KQ = lm_ggml_mul_mat(ctx0, K, Q);
+                offload_func_kq(KQ);
+                lm_ggml_set_name(KQ, "KQ");
+
+                struct lm_ggml_tensor * KQ_scaled = lm_ggml_scale(ctx0, KQ, KQ_scale);
+                offload_func_kq(KQ_scaled);
+                lm_ggml_set_name(KQ_scaled, "KQ_scaled");
+
+                struct lm_ggml_tensor * KQ_masked = lm_ggml_add(ctx0, KQ_scaled, KQ_mask);
+                offload_func_kq(KQ_masked);
+                lm_ggml_set_name(KQ_masked, "KQ_masked");
+
+                struct lm_ggml_tensor * KQ_soft_max = lm_ggml_soft_max_inplace(ctx0, KQ_masked);
+                offload_func_kq(KQ_soft_max);
+                lm_ggml_set_name(KQ_soft_max, "KQ_soft_max");
+
+                struct lm_ggml_tensor * V =
+                    lm_ggml_view_3d(ctx0, kv_self.v,
+                            n_kv, n_embd_head, n_head_kv,
+                            lm_ggml_element_size(kv_self.v)*n_ctx,
+                            lm_ggml_element_size(kv_self.v)*n_ctx*n_embd_head,
+                            lm_ggml_element_size(kv_self.v)*n_ctx*n_embd_gqa*il);
+                offload_func_v(V);
+                lm_ggml_set_name(V, "V");
+
+                struct lm_ggml_tensor * KQV = lm_ggml_mul_mat(ctx0, V, KQ_soft_max);
+                offload_func_v(KQV);
+                lm_ggml_set_name(KQV, "KQV");
+
+                struct lm_ggml_tensor * KQV_merged = lm_ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+                offload_func_v(KQV_merged);
+                lm_ggml_set_name(KQV_merged, "KQV_merged");
+
+                cur = lm_ggml_cont_2d(ctx0, KQV_merged, n_embd, n_tokens);
+                offload_func_v(cur);
+                lm_ggml_set_name(cur, "KQV_merged_contiguous");
+            }
 
             cur = lm_ggml_mul_mat(ctx0, model.layers[il].wo, cur);
             offload_func(cur);
@@ -5225,7 +6996,7 @@ static struct lm_ggml_cgraph * llm_build_persimmon(
         lm_ggml_set_name(cur, "inpFF_+_outFF");
         inpL = cur;
     }
-    cur = inpL;
+    cur = llm_build_out_rows(lctx, ctx0, inpL);
     {
         cur = lm_ggml_norm(ctx0, cur, norm_eps);
         offload_func_nr(cur);
@@ -5237,8 +7008,10 @@ static struct lm_ggml_cgraph * llm_build_persimmon(
 
         lm_ggml_set_name(cur, "result_norm");
     }
-    cur = lm_ggml_mul_mat(ctx0, model.output, cur);
-    lm_ggml_set_name(cur, "result_output");
+    if (!cparams.embedding_only) {
+        cur = lm_ggml_mul_mat(ctx0, model.output, cur);
+        lm_ggml_set_name(cur, "result_output");
+    }
     lm_ggml_build_forward_expand(gf, cur);
     lm_ggml_free(ctx0);
     return gf;
@@ -5469,6 +7242,8 @@ static struct lm_ggml_cgraph * llm_build_bloom(
         inpL = lm_ggml_add(ctx0, cur, inpFF);
     }
 
+    inpL = llm_build_out_rows(lctx, ctx0, inpL);
+
     // Output Norm
     {
         cur = lm_ggml_norm(ctx0, inpL, norm_eps);
@@ -5476,8 +7251,10 @@ static struct lm_ggml_cgraph * llm_build_bloom(
     }
     lm_ggml_set_name(cur, "result_norm");
 
-    cur = lm_ggml_mul_mat(ctx0, model.output, cur);
-    lm_ggml_set_name(cur, "result_output");
+    if (!cparams.embedding_only) {
+        cur = lm_ggml_mul_mat(ctx0, model.output, cur);
+        lm_ggml_set_name(cur, "result_output");
+    }
 
     lm_ggml_build_forward_expand(gf, cur);
 
@@ -5782,7 +7559,7 @@ static struct lm_ggml_cgraph * llm_build_mpt(
         inpL = cur;
     }
 
-    cur = inpL;
+    cur = llm_build_out_rows(lctx, ctx0, inpL);
 
     // norm
     {
@@ -5793,8 +7570,10 @@ static struct lm_ggml_cgraph * llm_build_mpt(
         lm_ggml_set_name(cur, "result_norm");
     }
 
-    cur = lm_ggml_mul_mat(ctx0, model.output, cur);
-    lm_ggml_set_name(cur, "result_output");
+    if (!cparams.embedding_only) {
+        cur = lm_ggml_mul_mat(ctx0, model.output, cur);
+        lm_ggml_set_name(cur, "result_output");
+    }
 
     lm_ggml_build_forward_expand(gf, cur);
 
@@ -5850,6 +7629,16 @@ static struct lm_ggml_cgraph * llama_build_graph(
     return result;
 }
 
+// called by the graph computation before each node, hands the layer boundaries to the weight streamer
+static void llama_stream_node_callback(int node_n, void * data) {
+    llama_context & lctx = *(llama_context *) data;
+
+    const int il = lctx.stream_layer_starts[node_n];
+    if (il >= 0) {
+        lctx.model.streamer->begin_layer(il);
+    }
+}
+
 // decode a batch of tokens by evaluating the transformer
 //
 //   - lctx:      llama context
@@ -5873,9 +7662,8 @@ static int llama_decode_internal(
     const auto & hparams = model.hparams;
     const auto & cparams = lctx.cparams;
 
-    const auto n_batch = cparams.n_batch;
-
-    LM_GGML_ASSERT(n_tokens <= n_batch);
+    // llama_decode splits the larger batches
+    LM_GGML_ASSERT(n_tokens <= cparams.n_ubatch);
 
     int n_threads = n_tokens == 1 ? cparams.n_threads : cparams.n_threads_batch;
     LM_GGML_ASSERT((!batch.token && batch.embd) || (batch.token && !batch.embd)); // NOLINT
@@ -5941,17 +7729,50 @@ static int llama_decode_internal(
 
     //printf("kv_self.n = %d\n", kv_self.n);
 
+    // rows of the batch for which the final norm and the lm_head have to be evaluated
+    auto & out_ids = lctx.out_ids;
+    out_ids.clear();
+
+    if (cparams.embedding_only) {
+        out_ids.push_back(n_tokens - 1);
+    } else if (batch.logits) {
+        for (uint32_t i = 0; i < n_tokens; i++) {
+            if (batch.logits[i] != 0) {
+                out_ids.push_back(i);
+            }
+        }
+    } else if (!lctx.logits_all) {
+        out_ids.push_back(n_tokens - 1);
+    }
+
+    // with logits_all and no batch.logits every row is an output, which out_ids leaves empty for;
+    // otherwise there is at least one row, and the embeddings are taken from the last token of the batch
+    const bool all_rows = lctx.logits_all && !batch.logits && !cparams.embedding_only;
+    if (!all_rows && (out_ids.empty() || (!lctx.embedding.empty() && out_ids.back() != (int32_t) n_tokens - 1))) {
+        out_ids.push_back(n_tokens - 1);
+    }
+
+    if (out_ids.size() == n_tokens) {
+        out_ids.clear();
+    }
+
+    const int32_t n_outputs = out_ids.empty() ? n_tokens : out_ids.size();
+
+    // the decode or the micro-batch tier, allocated again if llama_trim released it while the context was idle
+    llama_compute_buffers_alloc(lctx, n_tokens);
+
     lm_ggml_allocr_reset(lctx.alloc);
 
     lm_ggml_cgraph * gf = llama_build_graph(lctx, batch);
 
     lm_ggml_allocr_alloc_graph(lctx.alloc, gf);
 
-    struct lm_ggml_tensor * res        = gf->nodes[gf->n_nodes - 1];
-    struct lm_ggml_tensor * embeddings = gf->nodes[gf->n_nodes - 2];
+    // without the output layer the graph ends with the final norm
+    struct lm_ggml_tensor * res        = cparams.embedding_only ? nullptr : gf->nodes[gf->n_nodes - 1];
+    struct lm_ggml_tensor * embeddings = gf->nodes[gf->n_nodes - (cparams.embedding_only ? 1 : 2)];
 
-    LM_GGML_ASSERT(strcmp(res->name,        "result_output") == 0);
-    LM_GGML_ASSERT(strcmp(embeddings->name, "result_norm")   == 0);
+    LM_GGML_ASSERT(!res || strcmp(res->name, "result_output") == 0);
+    LM_GGML_ASSERT(strcmp(embeddings->name, "result_norm") == 0);
 
 
 #ifdef LM_GGML_USE_CUBLAS
@@ -5976,7 +7797,9 @@ static int llama_decode_internal(
     if (!lctx.embedding.empty()) {
         embeddings->backend = LM_GGML_BACKEND_CPU;
     }
-    res->backend = LM_GGML_BACKEND_CPU;
+    if (res) {
+        res->backend = LM_GGML_BACKEND_CPU;
+    }
 #endif
 
     // LLAMA_LOG_INFO("graph build time: %.3f ms (%d nodes, %d leafs)\n", (lm_ggml_time_us() - t_start_us)/1000.0, gf->n_nodes, gf->n_leafs);
@@ -6006,15 +7829,21 @@ static int llama_decode_internal(
     lm_ggml_mpi_graph_compute_pre(lctx.ctx_mpi, gf, n_layer);
 #endif
 
+    void (*node_callback)(int, void *) = nullptr;
+    if (model.streamer) {
+        model.streamer->find_layer_starts(gf, lctx.stream_layer_starts);
+        node_callback = llama_stream_node_callback;
+    }
+
 #ifdef LM_GGML_USE_METAL
     if (lctx.ctx_metal) {
         lm_ggml_metal_set_n_cb     (lctx.ctx_metal, n_threads);
         lm_ggml_metal_graph_compute(lctx.ctx_metal, gf);
     } else {
-        lm_ggml_graph_compute_helper(lctx.work_buffer, gf, n_threads);
+        lm_ggml_graph_compute_helper(lctx.work_buffer, gf, n_threads, node_callback, &lctx);
     }
 #else
-    lm_ggml_graph_compute_helper(lctx.work_buffer, gf, n_threads);
+    lm_ggml_graph_compute_helper(lctx.work_buffer, gf, n_threads, node_callback, &lctx);
 #endif
 
 #if LM_GGML_USE_MPI
@@ -6041,23 +7870,25 @@ static int llama_decode_internal(
     //}
 
     // extract logits
-    {
+    if (res) {
         auto & logits_out = lctx.logits;
 
+        // row k of the result belongs to token out_ids[k] of the batch
         if (batch.logits) {
             logits_out.resize(n_vocab * n_tokens);
-            for (uint32_t i = 0; i < n_tokens; i++) {
+            for (int32_t k = 0; k < n_outputs; k++) {
+                const int32_t i = out_ids.empty() ? k : out_ids[k];
                 if (batch.logits[i] == 0) {
                     continue;
                 }
-                memcpy(logits_out.data() + (n_vocab*i), (float *) lm_ggml_get_data(res) + (n_vocab*i), sizeof(float)*n_vocab);
+                memcpy(logits_out.data() + (n_vocab*i), (float *) lm_ggml_get_data(res) + (n_vocab*k), sizeof(float)*n_vocab);
             }
         } else if (lctx.logits_all) {
             logits_out.resize(n_vocab * n_tokens);
             memcpy(logits_out.data(), (float *) lm_ggml_get_data(res), sizeof(float)*n_vocab*n_tokens);
         } else {
             logits_out.resize(n_vocab);
-            memcpy(logits_out.data(), (float *) lm_ggml_get_data(res) + (n_vocab*(n_tokens - 1)), sizeof(float)*n_vocab);
+            memcpy(logits_out.data(), (float *) lm_ggml_get_data(res) + (n_vocab*(n_outputs - 1)), sizeof(float)*n_vocab);
         }
     }
 
@@ -6066,7 +7897,7 @@ static int llama_decode_internal(
         auto & embedding_out = lctx.embedding;
 
         embedding_out.resize(n_embd);
-        memcpy(embedding_out.data(), (float *) lm_ggml_get_data(embeddings) + (n_embd*(n_tokens - 1)), sizeof(float)*n_embd);
+        memcpy(embedding_out.data(), (float *) lm_ggml_get_data(embeddings) + (n_embd*(n_outputs - 1)), sizeof(float)*n_embd);
     }
 
     // measure the performance only for the single-token evals
@@ -6122,12 +7953,12 @@ static uint8_t llama_token_to_byte(const llama_vocab& vocab, llama_token id) {
     const auto& token_data = vocab.id_to_token.at(id);
     switch (llama_vocab_get_type(vocab)) {
     case LLAMA_VOCAB_TYPE_SPM: {
-        auto buf = token_data.text.substr(3, 2);
+        const std::string buf(token_data.text.data + 3, 2);
         return strtol(buf.c_str(), NULL, 16);
     }
     case LLAMA_VOCAB_TYPE_BPE: {
         LM_GGML_ASSERT(false);
-        return unicode_to_bytes_bpe(token_data.text);
+        return unicode_to_bytes_bpe(token_data.text.str());
     }
     default:
         LM_GGML_ASSERT(false);
@@ -6139,10 +7970,10 @@ static llama_token llama_byte_to_token(const llama_vocab & vocab, uint8_t ch) {
     switch (llama_vocab_get_type(vocab)) {
     case LLAMA_VOCAB_TYPE_SPM: {
         const char buf[7] = { '<', '0', 'x', hex[ch >> 4], hex[ch & 15], '>', 0 };
-        return vocab.token_to_id.at(buf);
+        return vocab.token_id(buf);
     }
     case LLAMA_VOCAB_TYPE_BPE: {
-        return vocab.token_to_id.at(bytes_to_unicode_bpe(ch));
+        return vocab.token_id(bytes_to_unicode_bpe(ch));
     }
     default:
         LM_GGML_ASSERT(false);
@@ -6248,16 +8079,15 @@ struct llm_tokenizer_spm {
 
 private:
     void resegment(llm_symbol & symbol, std::vector<llama_vocab::id> & output) {
-        auto text = std::string(symbol.text, symbol.n);
-        auto token = vocab.token_to_id.find(text);
+        const llama_vocab::id token = vocab.find_token(symbol.text, symbol.n);
 
         // Do we need to support is_unused?
-        if (token != vocab.token_to_id.end()) {
-            output.push_back((*token).second);
+        if (token != -1) {
+            output.push_back(token);
             return;
         }
 
-        const auto p = rev_merge.find(text);
+        const auto p = rev_merge.find(std::string(symbol.text, symbol.n));
 
         if (p == rev_merge.end()) {
             // output any symbols that did not form tokens as bytes.
@@ -6277,18 +8107,16 @@ private:
             return;
         }
 
-        const std::string text = std::string(symbols[left].text, symbols[left].n + symbols[right].n);
-        auto token = vocab.token_to_id.find(text);
+        const size_t n = symbols[left].n + symbols[right].n;
+        const llama_vocab::id token = vocab.find_token(symbols[left].text, n);
 
-        if (token == vocab.token_to_id.end()) {
+        if (token == -1) {
             return;
         }
 
-        if (static_cast<size_t>((*token).second) >= vocab.id_to_token.size()) {
-            return;
-        }
+        const std::string text = std::string(symbols[left].text, n);
 
-        const auto & tok_data = vocab.id_to_token[(*token).second];
+        const auto & tok_data = vocab.id_to_token[token];
 
         llm_bigram_spm bigram;
         bigram.left  = left;
@@ -6327,260 +8155,241 @@ struct llm_bigram_bpe {
     using queue = std::priority_queue<llm_bigram_bpe, queue_storage, comparator>;
     llm_symbol::index left;
     llm_symbol::index right;
-    std::string text;
+    llama_vocab::id left_id;  // tokens of the pair when the bigram was queued, to detect outdated bigrams
+    llama_vocab::id right_id;
+    llama_vocab::id id;       // token of the merged pair
     int rank;
-    size_t size;
 };
 
 struct llm_tokenizer_bpe {
     llm_tokenizer_bpe(const llama_vocab & vocab): vocab(vocab) {}
 
     void tokenize(const std::string & text, std::vector<llama_vocab::id> & output) {
-        int final_prev_index = -1;
-        auto word_collection = bpe_gpt2_preprocess(text);
+        bpe_gpt2_preprocess(text);
 
-        symbols_final.clear();
-
-        for (auto & word : word_collection) {
-            work_queue = llm_bigram_bpe::queue();
-            symbols.clear();
-
-            int index = 0;
-            size_t offset = 0;
+        for (const auto & span : word_spans) {
+            tokenize_word(text, span.first, span.second, output);
+        }
+    }
 
-            while (offset < word.size()) {
-                llm_symbol sym;
-                size_t char_len = std::min(word.size() - offset, (size_t) ::utf8_len(word[offset]));
-                sym.text = word.c_str() + offset;
-                sym.n = char_len;
-                offset += sym.n;
-                sym.prev = index - 1;
-                sym.next = offset == word.size() ? -1 : index + 1;
-                index++;
-                symbols.emplace_back(sym);
-            }
-            for (size_t i = 1; i < symbols.size(); ++i) {
-                add_new_bigram(i - 1, i);
+    // merges the word text[begin, end) found by bpe_gpt2_preprocess into tokens
+    void tokenize_word(const std::string & text, size_t begin, size_t end, std::vector<llama_vocab::id> & output) {
+        // byte-level encoding of each byte value, see bytes_to_unicode_bpe
+        static const std::vector<std::string> byte_encoding = [] {
+            std::vector<std::string> encoding(256);
+            for (int b = 0; b < 256; ++b) {
+                encoding[b] = bytes_to_unicode_bpe(b);
             }
+            return encoding;
+        }();
 
-            // build token(s)
-            while (!work_queue.empty()) {
-                auto bigram = work_queue.top();
-                work_queue.pop();
+        word.clear();
+        for (size_t i = begin; i < end; ++i) {
+            word += byte_encoding[(uint8_t) text[i]];
+        }
 
-                auto & left_symbol = symbols[bigram.left];
-                auto & right_symbol = symbols[bigram.right];
+        work_queue = llm_bigram_bpe::queue();
+        symbols.clear();
+        symbol_ids.clear();
 
-                if (left_symbol.n == 0 || right_symbol.n == 0) {
-                    continue;
-                }
-                std::string left_token = std::string(left_symbol.text, left_symbol.n);
-                std::string right_token = std::string(right_symbol.text, right_symbol.n);
-                if (left_token + right_token != bigram.text) {
-                    continue;  // Skip this bigram if it's outdated
-                }
+        int index = 0;
+        size_t offset = 0;
+
+        while (offset < word.size()) {
+            llm_symbol sym;
+            size_t char_len = std::min(word.size() - offset, (size_t) ::utf8_len(word[offset]));
+            sym.text = word.c_str() + offset;
+            sym.n = char_len;
+            offset += sym.n;
+            sym.prev = index - 1;
+            sym.next = offset == word.size() ? -1 : index + 1;
+            index++;
+            symbols.emplace_back(sym);
+            symbol_ids.push_back(vocab.find_bpe_char(sym.text, sym.n));
+        }
+        for (size_t i = 1; i < symbols.size(); ++i) {
+            add_new_bigram(i - 1, i);
+        }
 
-                // merge the right sym into the left one
-                left_symbol.n += right_symbol.n;
-                right_symbol.n = 0;
+        // build token(s)
+        while (!work_queue.empty()) {
+            auto bigram = work_queue.top();
+            work_queue.pop();
 
-                // remove the right sym from the chain
-                left_symbol.next = right_symbol.next;
-                if (right_symbol.next >= 0) {
-                    symbols[right_symbol.next].prev = bigram.left;
-                }
+            auto & left_symbol = symbols[bigram.left];
+            auto & right_symbol = symbols[bigram.right];
 
-                add_new_bigram(left_symbol.prev, bigram.left);  // left side of current symbol
-                add_new_bigram(bigram.left, left_symbol.next);  // right side of current symbol
+            if (left_symbol.n == 0 || right_symbol.n == 0) {
+                continue;
+            }
+            if (symbol_ids[bigram.left] != bigram.left_id || symbol_ids[bigram.right] != bigram.right_id) {
+                continue;  // Skip this bigram if it's outdated
             }
 
-            // add the fnished tokens to the final list keeping correct order for next and prev
-            for (auto & sym : symbols) {
-                if (sym.n > 0) {
-                    sym.prev = final_prev_index;
-                    sym.next = -1;
-                    if (final_prev_index != -1) {
-                        symbols_final[final_prev_index].next = symbols_final.size();
-                    }
-                    symbols_final.emplace_back(sym);
-                    final_prev_index = symbols_final.size() - 1;
-                }
+            // merge the right sym into the left one
+            left_symbol.n += right_symbol.n;
+            right_symbol.n = 0;
+            symbol_ids[bigram.left] = bigram.id;
+
+            // remove the right sym from the chain
+            left_symbol.next = right_symbol.next;
+            if (right_symbol.next >= 0) {
+                symbols[right_symbol.next].prev = bigram.left;
             }
-        }
 
-        symbols = symbols_final;
+            add_new_bigram(left_symbol.prev, bigram.left);  // left side of current symbol
+            add_new_bigram(bigram.left, left_symbol.next);  // right side of current symbol
+        }
 
-        if (!symbols.empty()) {
-            for (int i = 0; i != -1; i = symbols[i].next) {
-                auto & symbol = symbols[i];
-                if (symbol.n == 0) {
-                    continue;
-                }
+        // the symbols that are left are the tokens of the word, in order
+        for (size_t i = 0; i < symbols.size(); ++i) {
+            const auto & symbol = symbols[i];
+            if (symbol.n == 0) {
+                continue;
+            }
 
-                const std::string str = std::string(symbol.text, symbol.n);
-                const auto token = vocab.token_to_id.find(str);
+            if (symbol_ids[i] >= 0) {
+                output.push_back(symbol_ids[i]);
+                continue;
+            }
 
-                if (token == vocab.token_to_id.end()) {
-                    for (auto j = str.begin(); j != str.end(); ++j) {
-                        std::string byte_str(1, *j);
-                        auto token_multibyte = vocab.token_to_id.find(byte_str);
-                        if (token_multibyte == vocab.token_to_id.end()) {
-                            throw std::runtime_error("ERROR: byte not found in vocab");
-                        }
-                        output.push_back((*token_multibyte).second);
-                    }
-                } else {
-                    output.push_back((*token).second);
+            for (size_t j = 0; j < symbol.n; ++j) {
+                const llama_vocab::id byte_id = vocab.find_bpe_char(symbol.text + j, 1);
+                if (byte_id < 0) {
+                    throw std::runtime_error("ERROR: byte not found in vocab");
                 }
+                output.push_back(byte_id);
             }
         }
     }
 
-private:
-    void add_new_bigram(int left, int right) {
-        if (left == -1 || right == -1) {
-            return;
-        }
-
-        std::string left_token  = std::string(symbols[left].text,  symbols[left].n);
-        std::string right_token = std::string(symbols[right].text, symbols[right].n);
-
-        int rank_found = -1;
+    // splits the text into the byte spans of its words, following the GPT2 system regex:
+    //   's|'t|'re|'ve|'m|'ll|'d| ?\p{L}+| ?\p{N}+| ?[^\s\p{L}\p{N}]+|\s+(?!\S)|\s+
+    // the codepoints are decoded and classified once, the words are appended to word_spans
+    void bpe_gpt2_preprocess(const std::string & text) {
+        word_spans.clear();
+        cpts.clear();
+        cpt_offsets.clear();
+        cpt_types.clear();
 
-        rank_found = vocab.find_bpe_rank(left_token, right_token);
-
-        if (rank_found < 0) {
-            return;
+        size_t offset = 0;
+        while (offset < text.size()) {
+            cpt_offsets.push_back(offset);
+            const uint32_t cpt = codepoint_from_utf8(text, offset);
+            cpts.push_back(cpt);
+            cpt_types.push_back(codepoint_type(cpt));
         }
+        cpt_offsets.push_back(text.size());
 
-        llm_bigram_bpe bigram;
-
-        bigram.left  = left;
-        bigram.right = right;
-        bigram.text  = left_token + right_token;
-        bigram.size  = left_token.size() + right_token.size();
-        bigram.rank  = rank_found;
+        const int n_cpts = cpts.size();
 
-        work_queue.push(bigram);
-    }
+        // the word being collected is the codepoints [token_begin, token_end)
+        int token_begin = 0;
+        int token_end   = 0;
 
-    std::vector<std::string> bpe_gpt2_preprocess(const std::string & text) {
-        std::vector<std::string> bpe_words;
-        std::vector<std::string> bpe_encoded_words;
+        auto push_word = [&](int begin, int end) {
+            word_spans.emplace_back(cpt_offsets[begin], cpt_offsets[end]);
+        };
 
-        std::string token = "";
-        // GPT2 system regex:  's|'t|'re|'ve|'m|'ll|'d| ?\p{L}+| ?\p{N}+| ?[^\s\p{L}\p{N}]+|\s+(?!\S)|\s+
         bool collecting_numeric = false;
         bool collecting_letter = false;
         bool collecting_special = false;
         bool collecting_whitespace_lookahead = false;
         bool collecting = false;
 
-        std::vector<std::string> text_utf;
-        text_utf.reserve(text.size());
-        bpe_words.reserve(text.size());
-        bpe_encoded_words.reserve(text.size());
+        for (int i = 0; i < n_cpts; i++) {
+            const uint32_t cpt           = cpts[i];
+            const uint32_t cpt_next      = i + 1 < n_cpts ? cpts[i + 1] : 0;
+            const uint32_t cpt_next_next = i + 2 < n_cpts ? cpts[i + 2] : 0;
+
+            const int type      = cpt_types[i];
+            const int type_next = i + 1 < n_cpts ? cpt_types[i + 1] : CODEPOINT_TYPE_UNIDENTIFIED;
 
-        auto cps = codepoints_from_utf8(text);
-        for (size_t i = 0; i < cps.size(); ++i)
-            text_utf.emplace_back(codepoint_to_utf8(cps[i]));
+            const bool token_empty = token_end == token_begin;
 
-        for (int i = 0; i < (int)text_utf.size(); i++) {
-            const std::string & utf_char = text_utf[i];
             bool split_condition = false;
-            int bytes_remain = text_utf.size() - i;
-            // forward backward lookups
-            const std::string & utf_char_next = (i + 1 < (int)text_utf.size()) ? text_utf[i + 1] : "";
-            const std::string & utf_char_next_next = (i + 2 < (int)text_utf.size()) ? text_utf[i + 2] : "";
+            int bytes_remain = n_cpts - i;
 
             // handling contractions
-            if (!split_condition && bytes_remain >= 2) {
+            if (bytes_remain >= 2) {
                 // 's|'t|'m|'d
-                if (utf_char == "\'" && (utf_char_next == "s" || utf_char_next == "t" || utf_char_next == "m" || utf_char_next == "d")) {
-                    split_condition = true;
-                }
-                if (split_condition) {
-                    if (token.size()) {
-                        bpe_words.emplace_back(token); // push previous content as token
+                if (cpt == '\'' && (cpt_next == 's' || cpt_next == 't' || cpt_next == 'm' || cpt_next == 'd')) {
+                    if (!token_empty) {
+                        push_word(token_begin, token_end); // push previous content as token
                     }
-                    token = utf_char + utf_char_next;
-                    bpe_words.emplace_back(token);
-                    token = "";
+                    push_word(i, i + 2);
                     i++;
+                    token_begin = token_end = i + 1;
                     continue;
                 }
             }
-            if (!split_condition && bytes_remain >= 3) {
+            if (bytes_remain >= 3) {
                 // 're|'ve|'ll
-                if (utf_char == "\'" && (
-                    (utf_char_next == "r" && utf_char_next_next == "e") ||
-                    (utf_char_next == "v" && utf_char_next_next == "e") ||
-                    (utf_char_next == "l" && utf_char_next_next == "l"))
+                if (cpt == '\'' && (
+                    (cpt_next == 'r' && cpt_next_next == 'e') ||
+                    (cpt_next == 'v' && cpt_next_next == 'e') ||
+                    (cpt_next == 'l' && cpt_next_next == 'l'))
                     ) {
-                    split_condition = true;
-                }
-                if (split_condition) {
-                    // current token + next token can be defined
-                    if (token.size()) {
-                        bpe_words.emplace_back(token); // push previous content as token
+                    if (!token_empty) {
+                        push_word(token_begin, token_end); // push previous content as token
                     }
-                    token = utf_char + utf_char_next + utf_char_next_next;
-                    bpe_words.emplace_back(token); // the contraction
-                    token = "";
+                    push_word(i, i + 3); // the contraction
                     i += 2;
+                    token_begin = token_end = i + 1;
                     continue;
                 }
             }
 
-            if (!split_condition && !collecting) {
-                if (codepoint_type(utf_char) == CODEPOINT_TYPE_LETTER || (!token.size() && utf_char == " " && codepoint_type(utf_char_next) == CODEPOINT_TYPE_LETTER)) {
+            if (!collecting) {
+                if (type == CODEPOINT_TYPE_LETTER || (token_empty && cpt == ' ' && type_next == CODEPOINT_TYPE_LETTER)) {
                     collecting_letter = true;
                     collecting = true;
                 }
-                else if (codepoint_type(utf_char) == CODEPOINT_TYPE_DIGIT || (!token.size() && utf_char == " " && codepoint_type(utf_char_next) == CODEPOINT_TYPE_DIGIT)) {
+                else if (type == CODEPOINT_TYPE_DIGIT || (token_empty && cpt == ' ' && type_next == CODEPOINT_TYPE_DIGIT)) {
                     collecting_numeric = true;
                     collecting = true;
                 }
                 else if (
-                    ((codepoint_type(utf_char) != CODEPOINT_TYPE_LETTER && codepoint_type(utf_char) != CODEPOINT_TYPE_DIGIT) && (codepoint_type(utf_char) != CODEPOINT_TYPE_WHITESPACE)) ||
-                    (!token.size() && utf_char == " " && codepoint_type(utf_char_next) != CODEPOINT_TYPE_LETTER && codepoint_type(utf_char_next) != CODEPOINT_TYPE_DIGIT && codepoint_type(utf_char_next) != CODEPOINT_TYPE_WHITESPACE)
+                    (type != CODEPOINT_TYPE_LETTER && type != CODEPOINT_TYPE_DIGIT && type != CODEPOINT_TYPE_WHITESPACE) ||
+                    (token_empty && cpt == ' ' && type_next != CODEPOINT_TYPE_LETTER && type_next != CODEPOINT_TYPE_DIGIT && type_next != CODEPOINT_TYPE_WHITESPACE)
                     ) {
                     collecting_special = true;
                     collecting = true;
                 }
-                else if (codepoint_type(utf_char) == CODEPOINT_TYPE_WHITESPACE && codepoint_type(utf_char_next) == CODEPOINT_TYPE_WHITESPACE) {
+                else if (type == CODEPOINT_TYPE_WHITESPACE && type_next == CODEPOINT_TYPE_WHITESPACE) {
                     collecting_whitespace_lookahead = true;
                     collecting = true;
                 }
-                else if (codepoint_type(utf_char) == CODEPOINT_TYPE_WHITESPACE) {
+                else if (type == CODEPOINT_TYPE_WHITESPACE) {
                     split_condition = true;
                 }
             }
-            else if (!split_condition && collecting) {
-                if (collecting_letter && codepoint_type(utf_char) != CODEPOINT_TYPE_LETTER) {
+            else {
+                if (collecting_letter && type != CODEPOINT_TYPE_LETTER) {
                     split_condition = true;
                 }
-                else if (collecting_numeric && codepoint_type(utf_char) != CODEPOINT_TYPE_DIGIT) {
+                else if (collecting_numeric && type != CODEPOINT_TYPE_DIGIT) {
                     split_condition = true;
                 }
-                else if (collecting_special && (codepoint_type(utf_char) == CODEPOINT_TYPE_LETTER || codepoint_type(utf_char) == CODEPOINT_TYPE_DIGIT || codepoint_type(utf_char) == CODEPOINT_TYPE_WHITESPACE)) {
+                else if (collecting_special && (type == CODEPOINT_TYPE_LETTER || type == CODEPOINT_TYPE_DIGIT || type == CODEPOINT_TYPE_WHITESPACE)) {
                     split_condition = true;
                 }
-                else if (collecting_whitespace_lookahead && (codepoint_type(utf_char_next) == CODEPOINT_TYPE_LETTER || codepoint_type(utf_char_next) == CODEPOINT_TYPE_DIGIT)) {
+                else if (collecting_whitespace_lookahead && (type_next == CODEPOINT_TYPE_LETTER || type_next == CODEPOINT_TYPE_DIGIT)) {
                     split_condition = true;
                 }
             }
 
-            if (utf_char_next == "") {
+            if (i + 1 == n_cpts) {
                 split_condition = true; // final
-                token += utf_char;
+                token_end = i + 1;
             }
 
             if (split_condition) {
-                if (token.size()) {
-                    bpe_words.emplace_back(token);
+                if (token_end > token_begin) {
+                    push_word(token_begin, token_end);
                 }
-                token = utf_char;
+                token_begin = i;
+                token_end   = i + 1;
                 collecting = false;
                 collecting_letter = false;
                 collecting_numeric = false;
@@ -6588,25 +8397,52 @@ private:
                 collecting_whitespace_lookahead = false;
             }
             else {
-                token += utf_char;
+                token_end = i + 1;
             }
         }
+    }
+
+    std::vector<std::pair<size_t, size_t>> word_spans; // byte range of each word in the text
+
+private:
+    void add_new_bigram(int left, int right) {
+        if (left == -1 || right == -1) {
+            return;
+        }
+
+        const llama_vocab::id left_id  = symbol_ids[left];
+        const llama_vocab::id right_id = symbol_ids[right];
+        if (left_id < 0 || right_id < 0) {
+            return;
+        }
 
-        for (std::string & word : bpe_words) {
-            std::string encoded_token = "";
-            for (char & c : word) {
-                encoded_token += bytes_to_unicode_bpe(c);
-            }
-            bpe_encoded_words.emplace_back(encoded_token);
+        const auto * merge = vocab.find_bpe_merge(left_id, right_id);
+        if (merge == nullptr) {
+            return;
         }
 
-        return bpe_encoded_words;
+        llm_bigram_bpe bigram;
+
+        bigram.left     = left;
+        bigram.right    = right;
+        bigram.left_id  = left_id;
+        bigram.right_id = right_id;
+        bigram.id       = merge->id;
+        bigram.rank     = merge->rank;
+
+        work_queue.push(bigram);
     }
 
     const llama_vocab & vocab;
 
-    std::vector<llm_symbol> symbols;
-    std::vector<llm_symbol> symbols_final;
+    // reused across words and calls
+    std::vector<uint32_t> cpts;
+    std::vector<size_t>   cpt_offsets;
+    std::vector<int>      cpt_types;
+    std::string           word; // byte-level encoding of the current word
+
+    std::vector<llm_symbol>      symbols;
+    std::vector<llama_vocab::id> symbol_ids; // token of each symbol, -1 if its text is not a token
 
     llm_bigram_bpe::queue work_queue;
 };
@@ -6648,100 +8484,173 @@ struct fragment_buffer_variant{
 
 static void tokenizer_st_partition(const llama_vocab & vocab, std::forward_list<fragment_buffer_variant> & buffer)
 {
-    // for each special token
-    for (const auto & st: vocab.special_tokens_cache) {
-        const auto & special_token = st.first;
-        const auto & special_id    = st.second;
-
-        // for each text fragment
-        std::forward_list<fragment_buffer_variant>::iterator it = buffer.begin();
-        while (it != buffer.end()) {
-            auto & fragment = (*it);
-
-            // if a fragment is text ( not yet processed )
-            if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_RAW_TEXT) {
-                auto * raw_text = &(fragment.raw_text);
+    const auto & matcher = vocab.special_tokens_matcher;
 
-                auto raw_text_base_offset = fragment.offset;
-                auto raw_text_base_length = fragment.length;
+    std::forward_list<fragment_buffer_variant> result;
+    auto tail = result.before_begin();
 
-                // loop over the text
-                while (true) {
-                    // find the first occurence of a given special token in this fragment
-                    //  passing offset argument only limit the "search area" but match coordinates
-                    //  are still relative to the source full raw_text
-                    auto match = raw_text->find(special_token, raw_text_base_offset);
+    for (const auto & fragment : buffer) {
+        if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_TOKEN) {
+            tail = result.emplace_after(tail, fragment.token);
+            continue;
+        }
 
-                    // no occurences found, stop processing this fragment for a given special token
-                    if (match == std::string::npos) break;
+        const std::string & raw_text = fragment.raw_text;
 
-                    // check if match is within bounds of offset <-> length
-                    if (match + special_token.length() > raw_text_base_offset + raw_text_base_length) break;
+        // split the text fragment at the special tokens, left to right
+        size_t begin = fragment.offset;
+        const size_t end = fragment.offset + fragment.length;
 
+        size_t match_pos = 0;
+        size_t match_len = 0;
+        llama_vocab::id match_id = -1;
+        while (begin < end && matcher.find(raw_text, begin, end, match_pos, match_len, match_id)) {
+            if (match_pos > begin) {
+                tail = result.emplace_after(tail, raw_text, begin, match_pos - begin);
 #ifdef PRETOKENIZERDEBUG
-                    fprintf(stderr, "FF: (%ld %ld %ld) '%s'\n", raw_text->length(), raw_text_base_offset, raw_text_base_length, raw_text->substr(raw_text_base_offset, raw_text_base_length).c_str());
+                fprintf(stderr, "FL: (%zu %zu) '%s'\n", begin, match_pos - begin, raw_text.substr(begin, match_pos - begin).c_str());
 #endif
-                    auto source = std::distance(buffer.begin(), it);
-
-                    // if match is further than base offset
-                    //  then we have some text to the left of it
-                    if (match > raw_text_base_offset) {
-                        // left
-                        const int64_t left_reminder_offset = raw_text_base_offset + 0;
-                        const int64_t left_reminder_length = match - raw_text_base_offset;
-                        buffer.emplace_after(it, (*raw_text), left_reminder_offset, left_reminder_length);
+            }
+            tail = result.emplace_after(tail, match_id);
+            begin = match_pos + match_len;
+        }
 
+        if (begin < end) {
+            tail = result.emplace_after(tail, raw_text, begin, end - begin);
 #ifdef PRETOKENIZERDEBUG
-                        fprintf(stderr, "FL: (%ld %ld) '%s'\n", left_reminder_offset, left_reminder_length, raw_text->substr(left_reminder_offset, left_reminder_length).c_str());
+            fprintf(stderr, "FR: (%zu %zu) '%s'\n", begin, end - begin, raw_text.substr(begin, end - begin).c_str());
 #endif
-                        it++;
-                    }
+        }
+    }
 
-                    // special token
-                    buffer.emplace_after(it, special_id);
-                    it++;
+    buffer.swap(result);
+}
 
-                    // right
-                    if (match + special_token.length() < raw_text_base_offset + raw_text_base_length) {
-                        const int64_t right_reminder_offset = match + special_token.length();
-                        const int64_t right_reminder_length = raw_text_base_length - ((match - raw_text_base_offset) + special_token.length());
-                        buffer.emplace_after(it, (*raw_text), right_reminder_offset, right_reminder_length);
+// texts shorter than this are always tokenized on the calling thread
+static const size_t LLAMA_TOKENIZE_PARALLEL_MIN_TEXT = 16*1024;
 
-#ifdef PRETOKENIZERDEBUG
-                        fprintf(stderr, "FR: (%ld %ld) '%s'\n", right_reminder_offset, right_reminder_length, raw_text->substr(right_reminder_offset, right_reminder_length).c_str());
-#endif
+// piece of the input that is tokenized independently of the others: a special token, a piece of an
+// escaped SPM fragment or a BPE word
+struct llm_tokenize_job {
+    llama_vocab::id     token; // special token, -1 for text
+    const std::string * text;
+    size_t              begin;
+    size_t              end;
+};
 
-                        it++;
+// tokenizes the fragments on n_threads threads with the same result as the serial loop in llama_tokenize_internal:
+// the input is cut only where the tokenizers cannot merge across, the BPE words found by the pre-tokenizer and
+// the SPM text before the spaces that follow other text when the vocab allows it
+static void llama_tokenize_parallel_internal(
+        const llama_vocab & vocab,
+        const std::forward_list<fragment_buffer_variant> & fragments,
+        bool special,
+        int n_threads,
+        std::vector<llama_vocab::id> & output) {
+    // SPM pieces are at least this long, BPE jobs are single words
+    const size_t min_spm_piece = 256;
 
-                        if (source == 0) {
-                            buffer.erase_after(buffer.before_begin());
-                        } else {
-                            buffer.erase_after(std::next(buffer.begin(), (source-1)));
-                        }
+    static const std::string space = "\xe2\x96\x81";
 
-                        // repeat for the right side
-                        raw_text_base_offset = right_reminder_offset;
-                        raw_text_base_length = right_reminder_length;
+    std::deque<std::string> texts; // jobs keep pointers, so no reallocation
+    std::vector<llm_tokenize_job> jobs;
 
-#ifdef PRETOKENIZERDEBUG
-                        fprintf(stderr, "RR: (%ld %ld) '%s'\n", raw_text_base_offset, raw_text_base_length, raw_text->substr(raw_text_base_offset, raw_text_base_length).c_str());
-#endif
-                    } else {
-                        if (source == 0) {
-                            buffer.erase_after(buffer.before_begin());
-                        } else {
-                            buffer.erase_after(std::next(buffer.begin(), (source-1)));
-                        }
-                        break;
+    llm_tokenizer_bpe splitter(vocab);
+
+    for (const auto & fragment : fragments) {
+        if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_TOKEN) {
+            jobs.push_back({fragment.token, nullptr, 0, 0});
+            continue;
+        }
+
+        if (vocab.type == LLAMA_VOCAB_TYPE_SPM) {
+            texts.push_back((special ? "" : " ") + fragment.raw_text.substr(fragment.offset, fragment.length));
+            std::string & text = texts.back();
+            llama_escape_whitespace(text);
+
+            size_t begin = 0;
+            if (vocab.spm_split_at_spaces) {
+                for (size_t pos = text.find(space, std::max(min_spm_piece, space.size())); pos != std::string::npos; pos = text.find(space, pos + 1)) {
+                    if (pos - begin < min_spm_piece || text.compare(pos - space.size(), space.size(), space) == 0) {
+                        continue;
                     }
+                    jobs.push_back({-1, &text, begin, pos});
+                    begin = pos;
+                }
+            }
+            jobs.push_back({-1, &text, begin, text.size()});
+        } else {
+            texts.push_back(fragment.raw_text.substr(fragment.offset, fragment.length));
+            const std::string & text = texts.back();
+
+            splitter.bpe_gpt2_preprocess(text);
+            for (const auto & span : splitter.word_spans) {
+                jobs.push_back({-1, &text, span.first, span.second});
+            }
+        }
+    }
+
+    // contiguous ranges of jobs of about the same text length for each thread
+    size_t n_bytes = 0;
+    for (const auto & job : jobs) {
+        n_bytes += job.end - job.begin + 1;
+    }
+
+    std::vector<size_t> job_begin(n_threads + 1, jobs.size());
+    job_begin[0] = 0;
+    {
+        size_t acc = 0;
+        int    t   = 1;
+        for (size_t j = 0; j < jobs.size() && t < n_threads; ++j) {
+            acc += jobs[j].end - jobs[j].begin + 1;
+            if (acc >= n_bytes*t/n_threads) {
+                job_begin[t++] = j + 1;
+            }
+        }
+    }
+
+    std::vector<std::vector<llama_vocab::id>> results(n_threads);
+    std::vector<std::exception_ptr> errors(n_threads);
+
+    auto worker = [&](int ith) {
+        try {
+            llm_tokenizer_bpe tokenizer_bpe(vocab);
+            auto & out = results[ith];
+            for (size_t j = job_begin[ith]; j < job_begin[ith + 1]; ++j) {
+                const auto & job = jobs[j];
+                if (job.text == nullptr) {
+                    out.push_back(job.token);
+                } else if (vocab.type == LLAMA_VOCAB_TYPE_SPM) {
+                    llm_tokenizer_spm tokenizer(vocab);
+                    tokenizer.tokenize(job.text->substr(job.begin, job.end - job.begin), out);
+                } else {
+                    tokenizer_bpe.tokenize_word(*job.text, job.begin, job.end, out);
                 }
             }
-            it++;
+        } catch (...) {
+            errors[ith] = std::current_exception();
+        }
+    };
+
+    std::vector<std::thread> workers;
+    workers.reserve(n_threads - 1);
+    for (int ith = 1; ith < n_threads; ++ith) {
+        workers.emplace_back(worker, ith);
+    }
+    worker(0);
+    for (auto & w : workers) {
+        w.join();
+    }
+
+    for (int ith = 0; ith < n_threads; ++ith) {
+        if (errors[ith]) {
+            std::rethrow_exception(errors[ith]);
         }
+        output.insert(output.end(), results[ith].begin(), results[ith].end());
     }
 }
 
-static std::vector<llama_vocab::id> llama_tokenize_internal(const llama_vocab & vocab, std::string raw_text, bool bos, bool special) {
+static std::vector<llama_vocab::id> llama_tokenize_internal(const llama_vocab & vocab, std::string raw_text, bool bos, bool special, int n_threads) {
     std::vector<llama_vocab::id> output;
 
     // OG tokenizer behavior:
@@ -6762,6 +8671,11 @@ static std::vector<llama_vocab::id> llama_tokenize_internal(const llama_vocab &
 
     if (special) tokenizer_st_partition( vocab, fragment_buffer );
 
+    if (n_threads > 1 && raw_text.size() >= LLAMA_TOKENIZE_PARALLEL_MIN_TEXT) {
+        llama_tokenize_parallel_internal(vocab, fragment_buffer, special, n_threads, output);
+        return output;
+    }
+
     switch (vocab.type) {
         case LLAMA_VOCAB_TYPE_SPM:
             {
@@ -7510,16 +9424,17 @@ void llama_sample_grammar(struct llama_context * ctx, llama_token_data_array * c
     std::vector<llama_grammar_candidate>                              candidates_grammar;
 
     for (size_t i = 0; i < candidates->size; ++i) {
-        const llama_token id    = candidates->data[i].id;
-        const std::string piece = llama_token_to_piece(ctx, id);
+        const llama_token id = candidates->data[i].id;
+        int n_piece = 0;
+        const char * piece = llama_token_get_piece(&ctx->model, id, &n_piece);
         if (id == eos) {
             if (!allow_eos) {
                 candidates->data[i].logit = -INFINITY;
             }
-        } else if (piece.empty() || piece[0] == 0) {
+        } else if (n_piece == 0 || piece[0] == 0) {
             candidates->data[i].logit = -INFINITY;
         } else {
-            candidates_decoded.push_back(decode_utf8(piece.c_str(), grammar->partial_utf8));
+            candidates_decoded.push_back(decode_utf8(piece, grammar->partial_utf8));
             candidates_grammar.push_back({ i, candidates_decoded.back().first.data(), candidates_decoded.back().second });
         }
     }
@@ -7723,10 +9638,11 @@ void llama_grammar_accept_token(struct llama_context * ctx, struct llama_grammar
         LM_GGML_ASSERT(false);
     }
 
-    const std::string piece = llama_token_to_piece(ctx, token);
+    int n_piece = 0;
+    const char * piece = llama_token_get_piece(&ctx->model, token, &n_piece);
 
     // Note terminating 0 in decoded string
-    const auto   decoded     = decode_utf8(piece.c_str(), grammar->partial_utf8);
+    const auto   decoded     = decode_utf8(piece, grammar->partial_utf8);
     const auto & code_points = decoded.first;
     for (auto it = code_points.begin(), end = code_points.end() - 1; it != end; ++it) {
         grammar->stacks = llama_grammar_accept(grammar->rules, grammar->stacks, *it);
@@ -8498,6 +10414,67 @@ static int llama_apply_lora_from_file_internal(
         model_tensors.insert(kv);
     }
 
+    // check the tensors the adapter patches before any of them is modified, so that a failure
+    // cannot leave the model half adapted
+    {
+        const std::streampos tensors_pos = fin.tellg();
+
+        while (true) {
+            int32_t n_dims;
+            int32_t length;
+            int32_t ftype;
+
+            fin.read(reinterpret_cast<char *>(&n_dims), sizeof(n_dims));
+            fin.read(reinterpret_cast<char *>(&length), sizeof(length));
+            fin.read(reinterpret_cast<char *>(&ftype),  sizeof(ftype));
+            if (fin.eof()) {
+                break;
+            }
+
+            if (n_dims != 2) {
+                LLAMA_LOG_ERROR("%s: unsupported tensor dimension %d\n", __func__, n_dims);
+                return 1;
+            }
+
+            int32_t ne[2];
+            fin.read(reinterpret_cast<char *>(ne), sizeof(ne));
+
+            std::string name(length, '\0');
+            fin.read(&name[0], length);
+
+            if (ftype != 0 && ftype != 1) {
+                LLAMA_LOG_ERROR("%s: invalid tensor data type '%d'\n", __func__, ftype);
+                return 1;
+            }
+
+            const size_t pos = name.rfind(".lora");
+            if (pos == std::string::npos) {
+                LLAMA_LOG_ERROR("%s: error: '%s' is not a lora tensor\n", __func__, name.c_str());
+                return 1;
+            }
+
+            const std::string base_name = name.substr(0, pos);
+            const auto it = model_tensors.find(base_name);
+            if (it == model_tensors.end()) {
+                LLAMA_LOG_ERROR("%s: unknown tensor '%s' in lora adapter\n", __func__, name.c_str());
+                return 1;
+            }
+            if (lm_ggml_internal_get_type_traits(it->second->type).blck_rows > 0) {
+                LLAMA_LOG_ERROR("%s: error: tensor '%s' has been repacked, load the model without repack_weights to apply a lora adapter\n",
+                        __func__, base_name.c_str());
+                return 1;
+            }
+
+            // skip the data, aligned to 32 bytes like below
+            size_t offset = fin.tellg();
+            offset = (offset + 31) & -32;
+            fin.seekg(offset + (size_t) ne[0] * ne[1] * (ftype == 0 ? sizeof(float) : sizeof(lm_ggml_fp16_t)));
+        }
+
+        fin.clear();
+        fin.seekg(tensors_pos);
+    }
+
     // load base model
     std::unique_ptr<llama_model_loader> ml;
     lm_ggml_context * base_ctx = NULL;
@@ -8732,9 +10709,13 @@ struct llama_model_params llama_model_default_params() {
         /*.tensor_split                =*/ nullptr,
         /*.progress_callback           =*/ nullptr,
         /*.progress_callback_user_data =*/ nullptr,
+        /*.cache_path                  =*/ nullptr,
+        /*.stream_budget               =*/ 0,
         /*.vocab_only                  =*/ false,
         /*.use_mmap                    =*/ true,
         /*.use_mlock                   =*/ false,
+        /*.repack_weights              =*/ false,
+        /*.use_hugepages               =*/ false,
     };
 
 #ifdef LM_GGML_USE_METAL
@@ -8753,10 +10734,14 @@ struct llama_context_params llama_context_default_params() {
         /*.n_threads_batch             =*/ LM_GGML_DEFAULT_N_THREADS,
         /*.rope_freq_base              =*/ 0.0f,
         /*.rope_freq_scale             =*/ 0.0f,
+        /*.compute_buffer_cap          =*/ 0,
         /*.mul_mat_q                   =*/ true,
         /*.f16_kv                      =*/ true,
         /*.logits_all                  =*/ false,
         /*.embedding                   =*/ false,
+        /*.embedding_only              =*/ false,
+        /*.flash_attn                  =*/ false,
+        /*.use_hugepages               =*/ false,
     };
 
     return result;
@@ -8835,14 +10820,20 @@ struct llama_model * llama_load_model_from_file(
                     LLAMA_LOG_INFO("\n");
                 }
             }
+            return true;
         };
     }
 
-    if (!llama_model_load(path_model, *model, params.n_gpu_layers,
+    const int status = llama_model_load(path_model, *model, params.n_gpu_layers,
                 params.main_gpu, params.tensor_split,
-                params.use_mmap, params.use_mlock, params.vocab_only,
-                params.progress_callback, params.progress_callback_user_data)) {
-        LLAMA_LOG_ERROR("%s: failed to load model\n", __func__);
+                params.use_mmap, params.use_mlock, params.repack_weights, params.use_hugepages, params.stream_budget, params.vocab_only, params.cache_path,
+                params.progress_callback, params.progress_callback_user_data);
+    if (status != 0) {
+        if (status == -2) {
+            LLAMA_LOG_INFO("%s: cancelled model load\n", __func__);
+        } else {
+            LLAMA_LOG_ERROR("%s: failed to load model\n", __func__);
+        }
         delete model;
         return nullptr;
     }
@@ -8854,6 +10845,109 @@ void llama_free_model(struct llama_model * model) {
     delete model;
 }
 
+// the worst-case compute buffer size depends on the model (cache_model_hash), the type and placement of the weights,
+// the context parameters that shape the graph and the number of tokens of the batch
+static uint64_t llama_compute_size_key(const llama_context & ctx, lm_ggml_type memory_type, uint32_t n_tokens) {
+    const auto & model   = ctx.model;
+    const auto & cparams = ctx.cparams;
+
+    uint64_t h = llama_fnv1a(&model.cache_model_hash, sizeof(model.cache_model_hash));
+    for (const auto & it : model.tensors_by_name) {
+        const int32_t tensor[2] = { it.second->type, it.second->backend };
+        h = llama_fnv1a(tensor, sizeof(tensor), h);
+    }
+
+    const int64_t values[] = {
+        model.n_gpu_layers, cparams.n_ctx, cparams.n_batch, cparams.mul_mat_q, cparams.embedding_only, cparams.flash_attn,
+        cparams.fused_ops, memory_type, ctx.logits_all, !ctx.embedding.empty(), n_tokens,
+    };
+    return llama_fnv1a(values, sizeof(values), h);
+}
+
+static bool llama_prepared_cache_get_compute_size(llama_model & model, uint64_t key, size_t & size) {
+    std::lock_guard<std::mutex> lock(model.cache_mutex);
+    for (const auto & it : model.cache_compute_sizes) {
+        if (it.first == key) {
+            size = it.second;
+            return true;
+        }
+    }
+    return false;
+}
+
+// adds the sizes measured for a context and writes the cache once for all of them, if any of them is new
+static void llama_prepared_cache_add_compute_sizes(llama_model & model, const std::vector<std::pair<uint64_t, uint64_t>> & sizes) {
+    std::lock_guard<std::mutex> lock(model.cache_mutex);
+    if (model.cache_path.empty()) {
+        return;
+    }
+
+    auto & cached = model.cache_compute_sizes;
+
+    bool changed = false;
+    for (const auto & size : sizes) {
+        auto it = std::find_if(cached.begin(), cached.end(), [&](const std::pair<uint64_t, uint64_t> & c) {
+            return c.first == size.first;
+        });
+        if (it != cached.end()) {
+            if (it->second == size.second) {
+                continue;
+            }
+            cached.erase(it);
+        }
+        cached.push_back(size);
+        changed = true;
+    }
+
+    if (cached.size() > LLAMA_PREPARED_CACHE_MAX_COMPUTE_SIZES) {
+        cached.erase(cached.begin(), cached.end() - LLAMA_PREPARED_CACHE_MAX_COMPUTE_SIZES);
+    }
+
+    if (changed) {
+        llama_prepared_cache_save(model);
+    }
+}
+
+// size of the allocator buffer for a batch of n_tokens at the end of the context, the worst case for that batch size
+// the size measured by an earlier launch is reused from the prepared-model cache, new sizes are appended to measured
+static size_t llama_measure_compute_size(llama_context & ctx, llama_model & model, lm_ggml_type memory_type, uint32_t n_tokens,
+        std::vector<std::pair<uint64_t, uint64_t>> & measured) {
+    const uint64_t key = llama_compute_size_key(ctx, memory_type, n_tokens);
+
+    for (const auto & it : measured) {
+        if (it.first == key) {
+            return it.second;
+        }
+    }
+
+    size_t size = 0;
+    if (llama_prepared_cache_get_compute_size(model, key, size)) {
+        return size;
+    }
+
+    // create measure allocator
+    ctx.alloc = lm_ggml_allocr_new_measure(LLAMA_TENSOR_ALIGNMENT);
+
+    // build worst-case graph
+    const int n_past = ctx.cparams.n_ctx - n_tokens;
+    llama_token token = llama_token_bos(&ctx.model); // not actually used by llama_build_graph, but required to choose between token and embedding inputs graph
+    lm_ggml_cgraph * gf = llama_build_graph(ctx, llama_batch_get_one(&token, n_tokens, n_past, 0));
+
+#ifdef LM_GGML_USE_METAL
+    //lm_ggml_metal_graph_find_concurrency(ctx.ctx_metal, gf, false);
+    //lm_ggml_allocr_set_parse_seq(ctx.alloc, lm_ggml_metal_get_concur_list(ctx.ctx_metal), lm_ggml_metal_if_optimized(ctx.ctx_metal));
+#endif
+    // measure memory requirements for the graph
+    size = lm_ggml_allocr_alloc_graph(ctx.alloc, gf) + LLAMA_TENSOR_ALIGNMENT;
+
+    lm_ggml_allocr_free(ctx.alloc);
+    ctx.alloc = NULL;
+
+    measured.emplace_back(key, size);
+
+    return size;
+}
+
 struct llama_context * llama_new_context_with_model(
                  struct llama_model * model,
         struct llama_context_params   params) {
@@ -8868,12 +10962,28 @@ struct llama_context * llama_new_context_with_model(
     auto       & cparams = ctx->cparams;
 
     cparams.n_batch         = params.n_batch;
+    cparams.n_ubatch        = params.n_batch;
     cparams.n_ctx           = params.n_ctx == 0           ? hparams.n_ctx_train           : params.n_ctx;
     cparams.rope_freq_base  = params.rope_freq_base == 0  ? hparams.rope_freq_base_train  : params.rope_freq_base;
     cparams.rope_freq_scale = params.rope_freq_scale == 0 ? hparams.rope_freq_scale_train : params.rope_freq_scale;
     cparams.n_threads       = params.n_threads;
     cparams.n_threads_batch = params.n_threads_batch;
     cparams.mul_mat_q       = params.mul_mat_q;
+    cparams.embedding_only  = params.embedding_only;
+    cparams.flash_attn      = params.flash_attn;
+    cparams.fused_ops       = true;
+    cparams.use_hugepages   = params.use_hugepages;
+
+#if defined(LM_GGML_USE_METAL) || defined(LM_GGML_USE_CUBLAS)
+    // the fused ops are only implemented on the CPU
+    if (model->n_gpu_layers > 0) {
+        if (cparams.flash_attn) {
+            LLAMA_LOG_WARN("%s: flash_attn is only implemented on the CPU - disabling\n", __func__);
+        }
+        cparams.flash_attn = false;
+        cparams.fused_ops  = false;
+    }
+#endif
 
     if (params.seed == LLAMA_DEFAULT_SEED) {
         params.seed = time(NULL);
@@ -8882,6 +10992,7 @@ struct llama_context * llama_new_context_with_model(
     LLAMA_LOG_INFO("%s: n_ctx      = %u\n",     __func__, cparams.n_ctx);
     LLAMA_LOG_INFO("%s: freq_base  = %.1f\n",   __func__, cparams.rope_freq_base);
     LLAMA_LOG_INFO("%s: freq_scale = %g\n",     __func__, cparams.rope_freq_scale);
+    LLAMA_LOG_INFO("%s: flash_attn = %d\n",     __func__, cparams.flash_attn);
 
     ctx->rng = std::mt19937(params.seed);
     ctx->logits_all = params.logits_all;
@@ -8890,7 +11001,7 @@ struct llama_context * llama_new_context_with_model(
 
     // reserve memory for context buffers
     if (!hparams.vocab_only) {
-        if (!llama_kv_cache_init(ctx->model.hparams, ctx->kv_self, memory_type, cparams.n_ctx, model->n_gpu_layers)) {
+        if (!llama_kv_cache_init(ctx->model.hparams, ctx->kv_self, memory_type, cparams.n_ctx, model->n_gpu_layers, cparams.use_hugepages)) {
             LLAMA_LOG_ERROR("%s: llama_kv_cache_init() failed for self-attention cache\n", __func__);
             llama_free(ctx);
             return nullptr;
@@ -8899,33 +11010,28 @@ struct llama_context * llama_new_context_with_model(
         {
             const size_t memory_size = lm_ggml_nbytes(ctx->kv_self.k) + lm_ggml_nbytes(ctx->kv_self.v);
             LLAMA_LOG_INFO("%s: kv self size  = %7.2f MB\n", __func__, memory_size / 1024.0 / 1024.0);
+            if (cparams.use_hugepages) {
+                LLAMA_LOG_INFO("%s: kv huge pages = %7.2f MB\n", __func__, ctx->kv_self.buf.hugepage_size() / 1024.0 / 1024.0);
+            }
         }
 
-        // resized during inference
-        if (params.logits_all) {
-            ctx->logits.reserve(cparams.n_ctx*hparams.n_vocab);
-        } else {
-            ctx->logits.reserve(hparams.n_vocab);
+        // resized during inference, never used without the output layer
+        if (!params.embedding_only) {
+            if (params.logits_all) {
+                ctx->logits.reserve(cparams.n_ctx*hparams.n_vocab);
+            } else {
+                ctx->logits.reserve(hparams.n_vocab);
+            }
         }
 
-        if (params.embedding){
+        if (params.embedding || params.embedding_only) {
             ctx->embedding.resize(hparams.n_embd);
         }
 
         {
-            static const size_t tensor_alignment = 32;
             // the compute buffer is used to store the tensor and graph structs, while the allocator buffer is used for the tensor data
             ctx->buf_compute.resize(lm_ggml_tensor_overhead()*LM_GGML_MAX_NODES + lm_ggml_graph_overhead());
 
-            // create measure allocator
-            ctx->alloc = lm_ggml_allocr_new_measure(tensor_alignment);
-
-            // build worst-case graph
-            int n_tokens = (int)std::min(cparams.n_ctx, cparams.n_batch);
-            int n_past = cparams.n_ctx - n_tokens;
-            llama_token token = llama_token_bos(&ctx->model); // not actually used by llama_build_graph, but required to choose between token and embedding inputs graph
-            lm_ggml_cgraph * gf = llama_build_graph(*ctx, llama_batch_get_one(&token, n_tokens, n_past, 0));
-
 #ifdef LM_GGML_USE_METAL
             if (model->n_gpu_layers > 0) {
                 lm_ggml_metal_log_set_callback(llama_log_callback_default, NULL);
@@ -8936,20 +11042,53 @@ struct llama_context * llama_new_context_with_model(
                     llama_free(ctx);
                     return NULL;
                 }
-                //lm_ggml_metal_graph_find_concurrency(ctx->ctx_metal, gf, false);
-                //lm_ggml_allocr_set_parse_seq(ctx->alloc, lm_ggml_metal_get_concur_list(ctx->ctx_metal), lm_ggml_metal_if_optimized(ctx->ctx_metal));
             }
 #endif
-            // measure memory requirements for the graph
-            size_t alloc_size = lm_ggml_allocr_alloc_graph(ctx->alloc, gf) + tensor_alignment;
 
-            LLAMA_LOG_INFO("%s: compute buffer total size = %.2f MB\n", __func__, (ctx->buf_compute.size + alloc_size) / 1024.0 / 1024.0);
+            // the sizes measured while the micro-batch is searched, written to the prepared-model cache at once
+            std::vector<std::pair<uint64_t, uint64_t>> measured;
+
+            uint32_t n_ubatch = std::min(cparams.n_ctx, cparams.n_batch);
+            size_t alloc_size = llama_measure_compute_size(*ctx, *model, memory_type, n_ubatch, measured);
+
+            // the micro-batch is the largest batch whose buffer fits the cap, the size grows with the number of tokens
+            if (params.compute_buffer_cap > 0 && alloc_size > params.compute_buffer_cap) {
+                uint32_t lo = 1;        // fits, or the smallest micro-batch possible
+                uint32_t hi = n_ubatch; // does not fit
+                while (hi - lo > 1) {
+                    const uint32_t mid = lo + (hi - lo)/2;
+                    if (llama_measure_compute_size(*ctx, *model, memory_type, mid, measured) <= params.compute_buffer_cap) {
+                        lo = mid;
+                    } else {
+                        hi = mid;
+                    }
+                }
+                n_ubatch   = lo;
+                alloc_size = llama_measure_compute_size(*ctx, *model, memory_type, n_ubatch, measured);
+                if (alloc_size > params.compute_buffer_cap) {
+                    LLAMA_LOG_WARN("%s: the compute buffer of a single token (%.2f MB) exceeds the cap (%.2f MB)\n", __func__,
+                            alloc_size / 1024.0 / 1024.0, params.compute_buffer_cap / 1024.0 / 1024.0);
+                }
+            }
+            cparams.n_ubatch = n_ubatch;
+
+            // most evaluations decode a single token: the buffer for a micro-batch is only allocated while batches are
+            // decoded, the Metal context needs a buffer that does not move
+            bool tiered = n_ubatch > 1;
+#ifdef LM_GGML_USE_METAL
+            tiered = tiered && ctx->ctx_metal == NULL;
+#endif
+            ctx->alloc_size        = alloc_size;
+            ctx->alloc_size_decode = tiered ? llama_measure_compute_size(*ctx, *model, memory_type, 1, measured) : 0;
+
+            llama_prepared_cache_add_compute_sizes(*model, measured);
 
-            // recreate allocator with exact memory requirements
-            lm_ggml_allocr_free(ctx->alloc);
+            LLAMA_LOG_INFO("%s: compute buffer total size = %.2f MB (decode: %.2f MB), micro-batch = %u\n", __func__,
+                    (ctx->buf_compute.size + alloc_size) / 1024.0 / 1024.0,
+                    (ctx->buf_compute.size + (tiered ? ctx->alloc_size_decode : alloc_size)) / 1024.0 / 1024.0, n_ubatch);
 
-            ctx->buf_alloc.resize(alloc_size);
-            ctx->alloc = lm_ggml_allocr_new(ctx->buf_alloc.data, ctx->buf_alloc.size, tensor_alignment);
+            // create the allocator with the exact memory requirements
+            llama_compute_buffers_alloc(*ctx, 1);
 #ifdef LM_GGML_USE_METAL
             if (ctx->ctx_metal) {
                 //lm_ggml_allocr_set_parse_seq(ctx->alloc, lm_ggml_metal_get_concur_list(ctx->ctx_metal), lm_ggml_metal_if_optimized(ctx->ctx_metal));
@@ -9043,6 +11182,52 @@ const llama_model * llama_get_model(const struct llama_context * ctx) {
     return &ctx->model;
 }
 
+size_t llama_get_hugepage_size(const struct llama_context * ctx) {
+    return ctx->kv_self.buf.hugepage_size() + ctx->buf_alloc.hugepage_size();
+}
+
+size_t llama_get_memory_size(const struct llama_context * ctx) {
+    return ctx->kv_self.buf.size +
+           ctx->buf_compute.size +
+           ctx->buf_alloc.size +
+           ctx->work_buffer.capacity() +
+           ctx->logits.capacity()*sizeof(float) +
+           ctx->embedding.capacity()*sizeof(float);
+}
+
+size_t llama_trim(struct llama_context * ctx, bool trim_kv) {
+    size_t released = 0;
+
+#ifdef LM_GGML_USE_METAL
+    // the buffers are registered with the Metal context
+    const bool trim_compute = ctx->ctx_metal == NULL;
+#else
+    const bool trim_compute = true;
+#endif
+
+    if (trim_compute && ctx->alloc) {
+        released += ctx->buf_compute.size + ctx->buf_alloc.size;
+        lm_ggml_allocr_free(ctx->alloc);
+        ctx->alloc = NULL;
+        ctx->buf_alloc.release();
+        ctx->buf_compute.release();
+    }
+
+    released += ctx->work_buffer.capacity();
+    std::vector<uint8_t>().swap(ctx->work_buffer);
+
+    // the reserve for the logits of a whole batch, the logits of the last decode are kept
+    const size_t logits_capacity = ctx->logits.capacity();
+    ctx->logits.shrink_to_fit();
+    released += (logits_capacity - ctx->logits.capacity())*sizeof(float);
+
+    if (trim_kv) {
+        released += llama_kv_cache_trim(ctx->kv_self, ctx->model.hparams);
+    }
+
+    return released;
+}
+
 int llama_n_ctx(const struct llama_context * ctx) {
     return ctx->cparams.n_ctx;
 }
@@ -9082,6 +11267,17 @@ uint64_t llama_model_size(const struct llama_model * model) {
     return size;
 }
 
+uint64_t llama_model_hugepage_size(const struct llama_model * model) {
+    if (!model->use_hugepages) {
+        return 0;
+    }
+    uint64_t size = model->buf.hugepage_size() + model->buf_repack.hugepage_size();
+    if (model->mapping) {
+        size += llama_hugepage_backed_size(model->mapping->addr, model->mapping->size);
+    }
+    return size;
+}
+
 uint64_t llama_model_n_params(const struct llama_model * model) {
     uint64_t nparams = 0;
     for (const auto & it : model->tensors_by_name) {
@@ -9661,10 +11857,65 @@ void llama_batch_free(struct llama_batch batch) {
     if (batch.logits)   free(batch.logits);
 }
 
+// decodes a batch larger than the micro-batch in evenly sized parts, the logits of the parts are gathered by batch
+// row, on failure the parts already decoded stay in the KV cache
+static int llama_decode_split(llama_context & lctx, const llama_batch & batch) {
+    const uint32_t n_tokens = batch.n_tokens;
+    const uint32_t n_ubatch = lctx.cparams.n_ubatch;
+    const uint32_t n_parts  = (n_tokens + n_ubatch - 1)/n_ubatch;
+    const int64_t  n_vocab  = lctx.model.hparams.n_vocab;
+    const int64_t  n_embd   = lctx.model.hparams.n_embd;
+
+    // the logits of every row are kept, otherwise the last part produces the logits of the last token
+    const bool all_rows = batch.logits || lctx.logits_all;
+
+    std::vector<float> logits;
+    if (all_rows && !lctx.cparams.embedding_only) {
+        logits.resize(n_vocab*n_tokens);
+    }
+
+    for (uint32_t i0 = 0, part = 0; i0 < n_tokens; ++part) {
+        const uint32_t n = (n_tokens - i0 + (n_parts - part) - 1)/(n_parts - part);
+
+        llama_batch ubatch = batch;
+        ubatch.n_tokens = n;
+        if (batch.token)    ubatch.token    = batch.token + i0;
+        if (batch.embd)     ubatch.embd     = batch.embd + i0*n_embd;
+        if (batch.pos)      ubatch.pos      = batch.pos + i0;
+        if (batch.n_seq_id) ubatch.n_seq_id = batch.n_seq_id + i0;
+        if (batch.seq_id)   ubatch.seq_id   = batch.seq_id + i0;
+        if (batch.logits)   ubatch.logits   = batch.logits + i0;
+        ubatch.all_pos_0 = batch.all_pos_0 + (llama_pos) i0*batch.all_pos_1;
+
+        const int ret = llama_decode_internal(lctx, ubatch);
+        if (ret != 0) {
+            return ret;
+        }
+
+        if (!logits.empty()) {
+            for (uint32_t i = 0; i < n; ++i) {
+                if (!batch.logits || batch.logits[i0 + i]) {
+                    memcpy(logits.data() + n_vocab*(i0 + i), lctx.logits.data() + n_vocab*i, sizeof(float)*n_vocab);
+                }
+            }
+        }
+
+        i0 += n;
+    }
+
+    if (!logits.empty()) {
+        lctx.logits.swap(logits);
+    }
+
+    return 0;
+}
+
 int llama_decode(
         struct llama_context * ctx,
           struct llama_batch   batch) {
-    const int ret = llama_decode_internal(*ctx, batch);
+    const int ret = (uint32_t) batch.n_tokens > ctx->cparams.n_ubatch
+        ? llama_decode_split(*ctx, batch)
+        : llama_decode_internal(*ctx, batch);
     if (ret < 0) {
         LLAMA_LOG_ERROR("%s: failed to decode, ret = %d\n", __func__, ret);
     }
@@ -9732,7 +11983,19 @@ int llama_tokenize(
                          int   n_max_tokens,
                         bool   add_bos,
                         bool   special) {
-    auto res = llama_tokenize_internal(model->vocab, std::string(text, text_len), add_bos, special);
+    return llama_tokenize_parallel(model, text, text_len, tokens, n_max_tokens, add_bos, special, 1);
+}
+
+int llama_tokenize_parallel(
+    const struct llama_model * model,
+                  const char * text,
+                         int   text_len,
+                 llama_token * tokens,
+                         int   n_max_tokens,
+                        bool   add_bos,
+                        bool   special,
+                         int   n_threads) {
+    auto res = llama_tokenize_internal(model->vocab, std::string(text, text_len), add_bos, special, std::max(1, n_threads));
 
     if (n_max_tokens < (int) res.size()) {
         // LLAMA_LOG_ERROR("%s: too many tokens\n", __func__);
@@ -9747,72 +12010,118 @@ int llama_tokenize(
 }
 
 static std::string llama_decode_text(const std::string & text) {
+    // byte of each codepoint of the byte-level BPE alphabet, -1 for the codepoints outside of it
+    static const std::vector<int> codepoint_to_byte = []() {
+        std::vector<int> table;
+        for (const auto & it : unicode_to_bytes_map_bpe()) {
+            size_t offset = 0;
+            const uint32_t cp = codepoint_from_utf8(it.first, offset);
+            if (cp >= table.size()) {
+                table.resize(cp + 1, -1);
+            }
+            table[cp] = it.second;
+        }
+        return table;
+    }();
+
     std::string decoded_text;
-    auto unicode_sequences = codepoints_from_utf8(text);
-    for (auto& unicode_sequence : unicode_sequences) {
-        decoded_text += unicode_to_bytes_bpe(codepoint_to_utf8(unicode_sequence));
+    decoded_text.reserve(text.size());
+    for (size_t offset = 0; offset < text.size();) {
+        const uint32_t cp = codepoint_from_utf8(text, offset);
+        if (cp >= codepoint_to_byte.size() || codepoint_to_byte[cp] < 0) {
+            throw std::out_of_range("codepoint outside of the byte-level BPE alphabet");
+        }
+        decoded_text += (char) codepoint_to_byte[cp];
     }
 
     return decoded_text;
 }
 
-// does not write null-terminator to buf
-int llama_token_to_piece(const struct llama_model * model, llama_token token, char * buf, int length) {
-    if (0 <= token && token < llama_n_vocab(model)) {
-        switch (llama_vocab_get_type(model->vocab)) {
-        case LLAMA_VOCAB_TYPE_SPM: {
-            if (llama_is_normal_token(model->vocab, token)) {
-                std::string result = model->vocab.id_to_token[token].text;
-                llama_unescape_whitespace(result);
-                if (length < (int) result.length()) {
-                    return -result.length();
-                }
-                memcpy(buf, result.c_str(), result.length());
-                return result.length();
-            } else if (llama_is_unknown_token(model->vocab, token)) { // NOLINT
-                if (length < 3) {
-                    return -3;
-                }
-                memcpy(buf, "\xe2\x96\x85", 3);
-                return 3;
-            } else if (llama_is_control_token(model->vocab, token)) {
-                ;
-            } else if (llama_is_byte_token(model->vocab, token)) {
-                if (length < 1) {
-                    return -1;
-                }
-                buf[0] = llama_token_to_byte(model->vocab, token);
-                return 1;
-            } else {
-                // TODO: for now we accept all unsupported token types,
-                // suppressing them like CONTROL tokens.
-                // LM_GGML_ASSERT(false);
-            }
-            break;
+static std::string llama_token_to_piece_impl(const llama_vocab & vocab, llama_token token) {
+    switch (llama_vocab_get_type(vocab)) {
+    case LLAMA_VOCAB_TYPE_SPM: {
+        if (llama_is_normal_token(vocab, token)) {
+            std::string result = vocab.id_to_token[token].text.str();
+            llama_unescape_whitespace(result);
+            return result;
+        } else if (llama_is_unknown_token(vocab, token)) { // NOLINT
+            return "\xe2\x96\x85";
+        } else if (llama_is_control_token(vocab, token)) {
+            ;
+        } else if (llama_is_byte_token(vocab, token)) {
+            return std::string(1, llama_token_to_byte(vocab, token));
+        } else {
+            // TODO: for now we accept all unsupported token types,
+            // suppressing them like CONTROL tokens.
+            // LM_GGML_ASSERT(false);
         }
-        case LLAMA_VOCAB_TYPE_BPE: {
-            if (llama_is_normal_token(model->vocab, token)) {
-                std::string result = model->vocab.id_to_token[token].text;
-                result = llama_decode_text(result);
-                if (length < (int) result.length()) {
-                    return -result.length();
-                }
-                memcpy(buf, result.c_str(), result.length());
-                return result.length();
-            } else if (llama_is_control_token(model->vocab, token)) {
-                ;
-            } else {
-                // TODO: for now we accept all unsupported token types,
-                // suppressing them like CONTROL tokens.
-                // LM_GGML_ASSERT(false);
-            }
-            break;
+        break;
+    }
+    case LLAMA_VOCAB_TYPE_BPE: {
+        if (llama_is_normal_token(vocab, token)) {
+            return llama_decode_text(vocab.id_to_token[token].text.str());
+        } else if (llama_is_control_token(vocab, token)) {
+            ;
+        } else {
+            // TODO: for now we accept all unsupported token types,
+            // suppressing them like CONTROL tokens.
+            // LM_GGML_ASSERT(false);
         }
-        default:
-            LM_GGML_ASSERT(false);
+        break;
+    }
+    default:
+        LM_GGML_ASSERT(false);
+    }
+    return "";
+}
+
+// decodes the pieces of all tokens once, so that detokenization and the grammar never have to
+static void llama_build_token_pieces(llama_vocab & vocab) {
+    const size_t n_vocab = vocab.id_to_token.size();
+
+    vocab.token_piece_data.clear();
+    vocab.token_piece_offset.resize(n_vocab + 1);
+
+    size_t n_raw = 0;
+    for (size_t i = 0; i < n_vocab; ++i) {
+        std::string piece;
+        try {
+            piece = llama_token_to_piece_impl(vocab, (llama_token) i);
+        } catch (const std::exception &) {
+            // tokens outside of the byte-level BPE alphabet keep their raw text
+            piece = vocab.id_to_token[i].text.str();
+            n_raw++;
         }
+        vocab.token_piece_offset[i] = vocab.token_piece_data.size();
+        vocab.token_piece_data.insert(vocab.token_piece_data.end(), piece.begin(), piece.end());
+        vocab.token_piece_data.push_back(0);
     }
-    return 0;
+    vocab.token_piece_offset[n_vocab] = vocab.token_piece_data.size();
+
+    if (n_raw > 0) {
+        LLAMA_LOG_WARN("%s: %zu tokens are outside of the byte-level BPE alphabet, using their raw text\n", __func__, n_raw);
+    }
+}
+
+const char * llama_token_get_piece(const struct llama_model * model, llama_token token, int * length) {
+    if (token < 0 || token >= llama_n_vocab(model)) {
+        *length = 0;
+        return "";
+    }
+    const auto & vocab = model->vocab;
+    *length = vocab.token_piece_offset[token + 1] - vocab.token_piece_offset[token] - 1;
+    return vocab.token_piece_data.data() + vocab.token_piece_offset[token];
+}
+
+// does not write null-terminator to buf
+int llama_token_to_piece(const struct llama_model * model, llama_token token, char * buf, int length) {
+    int n_piece = 0;
+    const char * piece = llama_token_get_piece(model, token, &n_piece);
+    if (length < n_piece) {
+        return -n_piece;
+    }
+    memcpy(buf, piece, n_piece);
+    return n_piece;
 }
 
 struct llama_timings llama_get_timings(struct llama_context * ctx) {
@@ -9862,11 +12171,13 @@ const char * llama_print_system_info(void) {
     s += "AVX512 = "      + std::to_string(lm_ggml_cpu_has_avx512())      + " | ";
     s += "AVX512_VBMI = " + std::to_string(lm_ggml_cpu_has_avx512_vbmi()) + " | ";
     s += "AVX512_VNNI = " + std::to_string(lm_ggml_cpu_has_avx512_vnni()) + " | ";
+    s += "AVX_VNNI = "    + std::to_string(lm_ggml_cpu_has_avx_vnni())    + " | ";
     s += "FMA = "         + std::to_string(lm_ggml_cpu_has_fma())         + " | ";
     s += "NEON = "        + std::to_string(lm_ggml_cpu_has_neon())        + " | ";
     s += "ARM_FMA = "     + std::to_string(lm_ggml_cpu_has_arm_fma())     + " | ";
     s += "F16C = "        + std::to_string(lm_ggml_cpu_has_f16c())        + " | ";
     s += "FP16_VA = "     + std::to_string(lm_ggml_cpu_has_fp16_va())     + " | ";
+    s += "DOTPROD = "     + std::to_string(lm_ggml_cpu_has_dotprod())     + " | ";
     s += "WASM_SIMD = "   + std::to_string(lm_ggml_cpu_has_wasm_simd())   + " | ";
     s += "BLAS = "        + std::to_string(lm_ggml_cpu_has_blas())        + " | ";
     s += "SSE3 = "        + std::to_string(lm_ggml_cpu_has_sse3())        + " | ";
@@ -118,7 +118,9 @@ extern "C" {
         bool sorted;
     } llama_token_data_array;
 
-    typedef void (*llama_progress_callback)(float progress, void *ctx);
+    // Called with a progress value between 0 and 1 while the model is loaded.
+    // Returning false cancels the load: the weights read so far are freed and llama_load_model_from_file returns NULL.
+    typedef bool (*llama_progress_callback)(float progress, void *ctx);
 
     // Input data for llama_decode
     // A llama_batch object can contain input about one or many sequences
@@ -155,15 +157,25 @@ extern "C" {
         int32_t main_gpu;     // the GPU that is used for scratch and small tensors
         const float * tensor_split; // how to split layers across multiple GPUs (size: LLAMA_MAX_DEVICES)
 
-        // called with a progress value between 0 and 1, pass NULL to disable
+        // called with a progress value between 0 and 1, return false to cancel loading, pass NULL to disable
         llama_progress_callback progress_callback;
         // context pointer passed to the progress callback
         void * progress_callback_user_data;
 
+        // optional prepared-model cache file: the vocab tables and the measured compute buffer sizes are saved there
+        // and reused by later loads of the same model, pass NULL to disable
+        const char * cache_path;
+
+        // > 0: stream the layer weights from the file mapping during evaluation, the next layers are prefetched and the
+        // completed ones released so that about this many bytes stay resident (needs mmap, no mlock, no GPU offload)
+        size_t stream_budget;
+
         // Keep the booleans together to avoid misalignment during copy-by-value.
         bool vocab_only; // only load the vocabulary, no weights
         bool use_mmap;   // use mmap if possible
         bool use_mlock;  // force system to keep model in RAM
+        bool repack_weights; // repack the CPU weights into interleaved layouts for faster matmul (not shared with mmap)
+        bool use_hugepages;  // advise the weights for transparent huge pages (Linux only, needs THP "always" or "madvise")
     };
 
     struct llama_context_params {
@@ -177,11 +189,16 @@ extern "C" {
         float rope_freq_base;  // RoPE base frequency, 0 = from model
         float rope_freq_scale; // RoPE frequency scaling factor, 0 = from model
 
+        size_t compute_buffer_cap; // max compute buffer size in bytes, larger batches are split into micro-batches that fit (0 = n_batch)
+
         // Keep the booleans together to avoid misalignment during copy-by-value.
         bool mul_mat_q;  // if true, use experimental mul_mat_q kernels
         bool f16_kv;     // use fp16 for KV cache, fp32 otherwise
         bool logits_all; // the llama_eval() call computes all logits, not just the last one
         bool embedding;  // embedding mode only
+        bool embedding_only; // skip the output layer entirely, only embeddings are computed (no logits)
+        bool flash_attn;     // use the fused attention kernel (CPU only, ignored when offloading to the GPU)
+        bool use_hugepages;  // advise the KV cache and the compute buffer for transparent huge pages (Linux only)
     };
 
     // model quantization parameters
@@ -277,6 +294,18 @@ extern "C" {
 
     LLAMA_API int llama_n_ctx      (const struct llama_context * ctx);
 
+    // Returns the number of bytes of the KV cache and the compute buffer currently backed by transparent huge pages
+    LLAMA_API size_t llama_get_hugepage_size(const struct llama_context * ctx);
+
+    // Returns the host memory held by the context in bytes: KV cache, compute buffers, logits and embeddings
+    // (the model weights are not included, they can be shared between contexts)
+    LLAMA_API size_t llama_get_memory_size(const struct llama_context * ctx);
+
+    // Releases the memory an idle context does not need: the compute buffers are freed and allocated again by the
+    // next llama_decode, with trim_kv the pages of the KV cache past the last used cell are also returned to the system
+    // Returns the number of bytes released
+    LLAMA_API size_t llama_trim(struct llama_context * ctx, bool trim_kv);
+
     LLAMA_API enum llama_vocab_type llama_vocab_type(const struct llama_model * model);
 
     LLAMA_API int llama_n_vocab    (const struct llama_model * model);
@@ -295,6 +324,9 @@ extern "C" {
     // Returns the total number of parameters in the model
     LLAMA_API uint64_t llama_model_n_params(const struct llama_model * model);
 
+    // Returns the number of bytes of the weights currently backed by transparent huge pages (0 without use_hugepages)
+    LLAMA_API uint64_t llama_model_hugepage_size(const struct llama_model * model);
+
     // Get a llama model tensor
     LLAMA_API struct lm_ggml_tensor * llama_get_model_tensor(struct llama_model * model, const char * name);
 
@@ -480,6 +512,7 @@ extern "C" {
     // Logits for which llama_batch.logits[i] == 0 are undefined
     // Rows: n_tokens provided with llama_batch
     // Cols: n_vocab
+    // No logits are produced for contexts created with embedding_only
     LLAMA_API float * llama_get_logits(struct llama_context * ctx);
 
     // Logits for the ith token. Equivalent to:
@@ -530,6 +563,26 @@ extern "C" {
                             bool   add_bos,
                             bool   special);
 
+    // Same as llama_tokenize, but texts of 16 KB or more are split where the tokenizer cannot merge across
+    // and the pieces are tokenized on up to n_threads threads. The result is identical to llama_tokenize.
+    LLAMA_API int llama_tokenize_parallel(
+        const struct llama_model * model,
+                      const char * text,
+                             int   text_len,
+                     llama_token * tokens,
+                             int   n_max_tokens,
+                            bool   add_bos,
+                            bool   special,
+                             int   n_threads);
+
+    // Token Id -> Piece, without copying.
+    // Returns the decoded piece from a table built when the model is loaded, valid for the lifetime of the model.
+    // The piece is followed by a null terminator; its length in bytes, which may include 0 bytes, is written to length.
+    LLAMA_API const char * llama_token_get_piece(
+              const struct llama_model * model,
+                           llama_token   token,
+                                   int * length);
+
     // Token Id -> Piece.
     // Uses the vocabulary in the provided context.
     // Does not write null terminator to the buffer.
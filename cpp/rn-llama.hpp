@@ -1,8 +1,19 @@
 #ifndef RNLLAMA_H
 #define RNLLAMA_H
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <functional>
 #include <sstream>
 #include <iostream>
+#include <iterator>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 #include "common.h"
 #include "llama.h"
 
@@ -70,37 +81,152 @@ static size_t common_part(const std::vector<llama_token> &a, const std::vector<l
     return i;
 }
 
-static bool ends_with(const std::string &str, const std::string &suffix)
+// streaming Aho-Corasick automaton over the stop strings: the generated text is fed once, byte by byte, as it
+// grows, and the state always tells the longest suffix of the text that is a prefix of some stop string
+struct stop_string_matcher
 {
-    return str.size() >= suffix.size() &&
-           0 == str.compare(str.size() - suffix.size(), suffix.size(), suffix);
-}
+    struct node
+    {
+        std::vector<std::pair<unsigned char, int>> next;
+        int fail = 0;
+        int depth = 0;
+        int word = -1; // index of the stop string ending at this node
+        int out = -1;  // nearest node on the fail chain, this one included, where a stop string ends
+    };
 
-static size_t find_partial_stop_string(const std::string &stop,
-                                       const std::string &text)
-{
-    if (!text.empty() && !stop.empty())
+    std::vector<node> nodes = std::vector<node>(1);
+    int state = 0;
+    size_t n_fed = 0; // bytes of the text consumed so far
+
+    int child(int n, unsigned char c) const
+    {
+        for (const auto &e : nodes[n].next)
+        {
+            if (e.first == c)
+            {
+                return e.second;
+            }
+        }
+        return -1;
+    }
+
+    void build(const std::vector<std::string> &words)
+    {
+        nodes.assign(1, node());
+        state = 0;
+        n_fed = 0;
+
+        for (size_t i = 0; i < words.size(); i++)
+        {
+            int n = 0;
+            for (unsigned char c : words[i])
+            {
+                int t = child(n, c);
+                if (t < 0)
+                {
+                    t = nodes.size();
+                    nodes.push_back(node());
+                    nodes[t].depth = nodes[n].depth + 1;
+                    nodes[n].next.emplace_back(c, t);
+                }
+                n = t;
+            }
+            if (n != 0 && nodes[n].word < 0)
+            {
+                nodes[n].word = i;
+            }
+        }
+
+        // fail links in breadth-first order, so that they always point to a node already done
+        std::vector<int> queue;
+        queue.reserve(nodes.size());
+        for (const auto &e : nodes[0].next)
+        {
+            queue.push_back(e.second);
+        }
+        for (size_t qi = 0; qi < queue.size(); qi++)
+        {
+            const int n = queue[qi];
+            nodes[n].out = nodes[n].word >= 0 ? n : nodes[nodes[n].fail].out;
+            for (const auto &e : nodes[n].next)
+            {
+                int f = nodes[n].fail;
+                int t;
+                while ((t = child(f, e.first)) < 0 && f != 0)
+                {
+                    f = nodes[f].fail;
+                }
+                nodes[e.second].fail = t >= 0 ? t : 0;
+                queue.push_back(e.second);
+            }
+        }
+    }
+
+    // consumes text[n_fed..), returns true if a stop string ends in it and starts at or after from,
+    // with the position and index of the leftmost such match
+    bool feed(const std::string &text, size_t from, size_t &match_pos, int &match_word)
     {
-        const char text_last_char = text.back();
-        for (int64_t char_index = stop.size() - 1; char_index >= 0; char_index--)
+        bool found = false;
+        for (; n_fed < text.size(); n_fed++)
         {
-            if (stop[char_index] == text_last_char)
+            const unsigned char c = text[n_fed];
+            int t;
+            while ((t = child(state, c)) < 0 && state != 0)
             {
-                const std::string current_partial = stop.substr(0, char_index + 1);
-                if (ends_with(text, current_partial))
+                state = nodes[state].fail;
+            }
+            state = t >= 0 ? t : 0;
+
+            for (int o = nodes[state].out; o >= 0; o = nodes[nodes[o].fail].out)
+            {
+                const size_t pos = n_fed + 1 - nodes[o].depth;
+                if (pos >= from && (!found || pos < match_pos || (pos == match_pos && nodes[o].word < match_word)))
                 {
-                    return text.size() - char_index - 1;
+                    found = true;
+                    match_pos = pos;
+                    match_word = nodes[o].word;
                 }
             }
         }
+        return found;
+    }
+
+    // position of the longest suffix of the consumed text that starts at or after from and is a prefix of a stop string
+    size_t partial(size_t from) const
+    {
+        int s = state;
+        while (s != 0 && (size_t) nodes[s].depth > n_fed - from)
+        {
+            s = nodes[s].fail;
+        }
+        return s == 0 ? std::string::npos : n_fed - nodes[s].depth;
+    }
+};
+
+// decoded piece of a token, points into the model's piece table (no copy)
+struct token_piece
+{
+    const char *data = "";
+    size_t size = 0;
+};
+
+static token_piece get_token_piece(const llama_context *ctx, const llama_token token)
+{
+    token_piece piece;
+    if (token != -1)
+    {
+        int n_piece = 0;
+        piece.data = llama_token_get_piece(llama_get_model(ctx), token, &n_piece);
+        piece.size = n_piece;
     }
-    return std::string::npos;
+    return piece;
 }
 
 // format incomplete utf-8 multibyte character for output
 static std::string tokens_to_output_formatted_string(const llama_context *ctx, const llama_token token)
 {
-    std::string out = token == -1 ? "" : llama_token_to_piece(ctx, token);
+    const token_piece piece = get_token_piece(ctx, token);
+    std::string out(piece.data, piece.size);
     // if the size is 1 and first bit is 1, meaning it's a partial character
     //   (size > 1 meaning it's already a known token)
     if (out.size() == 1 && (out[0] & 0x80) == 0x80)
@@ -119,11 +245,287 @@ static std::string tokens_to_str(llama_context *ctx, Iter begin, Iter end)
     std::string ret;
     for (; begin != end; ++begin)
     {
-        ret += llama_token_to_piece(ctx, *begin);
+        const token_piece piece = get_token_piece(ctx, *begin);
+        ret.append(piece.data, piece.size);
     }
     return ret;
 }
 
+// process-wide registry of loaded models: contexts created from the same file with the same load options
+// (mmap, mlock, repacking, GPU layers, LoRA adapters) share one llama_model, freed when the last one releases it
+struct llama_rn_model_registry
+{
+    struct entry
+    {
+        std::string key;
+        llama_model *model;
+        int n_refs;
+        bool loading; // the model is being loaded outside of the mutex, model is null until then
+    };
+
+    std::mutex mutex;
+    std::condition_variable loaded_cv;
+    std::vector<entry> entries;
+
+    static std::string make_key(const gpt_params &params)
+    {
+        std::stringstream ss;
+        ss << params.model << '\n'
+           << params.use_mmap << params.use_mlock << params.repack_weights << params.use_hugepages << ' ' << params.stream_budget_mb << ' '
+           << params.n_gpu_layers << ' ' << params.main_gpu << '\n'
+           << params.model_cache_path << '\n'
+           << params.lora_base;
+        for (const auto &lora : params.lora_adapter)
+        {
+            ss << '\n' << std::get<0>(lora) << ' ' << std::get<1>(lora);
+        }
+        return ss.str();
+    }
+
+    // returns a shared model for the params, loading it (and applying the LoRA adapters) if needed;
+    // the progress callback is only called when the model is actually loaded. the mutex is not held during
+    // the load: other models can be acquired and released meanwhile, and a request for the same model waits
+    // for this load to share its result
+    llama_model *acquire(const gpt_params &params, llama_progress_callback progress_callback = nullptr, void *progress_callback_user_data = nullptr)
+    {
+        const std::string key = make_key(params);
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            for (;;)
+            {
+                auto it = find(key);
+                if (it == entries.end())
+                {
+                    break;
+                }
+                if (!it->loading)
+                {
+                    it->n_refs++;
+                    return it->model;
+                }
+                // if that load fails, this request loads the model itself
+                loaded_cv.wait(lock);
+            }
+            entries.push_back({key, nullptr, 0, true});
+        }
+
+        llama_model *model = load(params, progress_callback, progress_callback_user_data);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = find(key);
+            if (model == nullptr)
+            {
+                entries.erase(it);
+            }
+            else
+            {
+                it->model = model;
+                it->n_refs = 1;
+                it->loading = false;
+            }
+        }
+        loaded_cv.notify_all();
+        return model;
+    }
+
+    void release(llama_model *model)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        for (size_t i = 0; i < entries.size(); i++)
+        {
+            if (entries[i].model == model)
+            {
+                if (--entries[i].n_refs == 0)
+                {
+                    llama_free_model(model);
+                    entries.erase(entries.begin() + i);
+                }
+                return;
+            }
+        }
+    }
+
+private:
+    std::vector<entry>::iterator find(const std::string &key)
+    {
+        return std::find_if(entries.begin(), entries.end(), [&key](const entry &e) { return e.key == key; });
+    }
+
+    static llama_model *load(const gpt_params &params, llama_progress_callback progress_callback, void *progress_callback_user_data)
+    {
+        auto mparams = llama_model_params_from_gpt_params(params);
+        mparams.progress_callback = progress_callback;
+        mparams.progress_callback_user_data = progress_callback_user_data;
+
+        llama_model *model = llama_load_model_from_file(params.model.c_str(), mparams);
+        if (model == nullptr)
+        {
+            return nullptr;
+        }
+
+        for (size_t i = 0; i < params.lora_adapter.size(); ++i)
+        {
+            const std::string &lora_adapter = std::get<0>(params.lora_adapter[i]);
+            const float lora_scale = std::get<1>(params.lora_adapter[i]);
+            const int err = llama_model_apply_lora_from_file(model,
+                                                             lora_adapter.c_str(),
+                                                             lora_scale,
+                                                             ((i > 0) || params.lora_base.empty())
+                                                                 ? NULL
+                                                                 : params.lora_base.c_str(),
+                                                             params.n_threads);
+            if (err != 0)
+            {
+                LOG_ERROR("failed to apply lora adapter: %s", lora_adapter.c_str());
+                llama_free_model(model);
+                return nullptr;
+            }
+        }
+
+        return model;
+    }
+};
+
+inline llama_rn_model_registry &model_registry()
+{
+    static llama_rn_model_registry registry;
+    return registry;
+}
+
+// bounded LRU cache of tokenized prompt segments, keyed by a hash of the segment text
+struct llama_rn_token_cache
+{
+    struct entry
+    {
+        uint64_t hash;
+        bool add_bos;
+        std::string text;
+        std::vector<llama_token> tokens;
+    };
+
+    size_t max_tokens = 64 * 1024;
+    size_t n_tokens = 0;
+
+    std::list<entry> entries; // most recently used first
+    std::unordered_map<uint64_t, std::list<entry>::iterator> index;
+
+    static uint64_t hash_text(const std::string &text, bool add_bos)
+    {
+        uint64_t h = 14695981039346656037ull ^ (uint64_t) add_bos;
+        for (unsigned char c : text)
+        {
+            h = (h ^ c) * 1099511628211ull;
+        }
+        return h;
+    }
+
+    const std::vector<llama_token> &tokenize(llama_context *ctx, const std::string &text, bool add_bos, int n_threads)
+    {
+        const uint64_t hash = hash_text(text, add_bos);
+        auto it = index.find(hash);
+        if (it != index.end())
+        {
+            if (it->second->add_bos == add_bos && it->second->text == text)
+            {
+                entries.splice(entries.begin(), entries, it->second);
+                return entries.front().tokens;
+            }
+            // hash collision, the new segment replaces the old one
+            n_tokens -= it->second->tokens.size();
+            entries.erase(it->second);
+            index.erase(it);
+        }
+
+        entries.push_front({hash, add_bos, text, ::llama_tokenize(ctx, text, add_bos, false, n_threads)});
+        index[hash] = entries.begin();
+        n_tokens += entries.front().tokens.size();
+
+        // keep the segment just added even if it is larger than the budget
+        while (n_tokens > max_tokens && entries.size() > 1)
+        {
+            n_tokens -= entries.back().tokens.size();
+            index.erase(entries.back().hash);
+            entries.pop_back();
+        }
+        return entries.front().tokens;
+    }
+
+    void clear()
+    {
+        entries.clear();
+        index.clear();
+        n_tokens = 0;
+    }
+};
+
+struct llama_rn_context;
+
+// process-wide memory budget over the contexts: tracks the bytes held by each context (KV cache, compute buffers,
+// logits) and by the models they use, and when the total is over the budget evicts the least recently used idle
+// contexts - their state is saved to a session file and their llama_context freed, to be restored on the next use
+// contexts left idle for idle_timeout_ms are trimmed: their compute buffers and free KV cache pages are released
+struct llama_rn_memory_manager
+{
+    std::mutex mutex;
+    size_t budget = 0; // 0 - unlimited
+    std::string evict_dir;
+    uint64_t n_evictions = 0;
+
+    std::list<llama_rn_context *> contexts; // most recently used first
+
+    // the session files are saved and restored outside of the mutex, a context is marked busy meanwhile
+    // and state_cv is notified when it is done
+    std::condition_variable state_cv;
+
+    int64_t idle_timeout_ms = 0; // 0 - no idle trimming
+    std::thread idle_thread;
+    std::condition_variable idle_cv;
+    bool stopping = false;
+
+    ~llama_rn_memory_manager();
+
+    void set_budget(size_t budget_, const std::string &evict_dir_);
+    void set_idle_timeout(int64_t timeout_ms);
+
+    // trims every idle context now, e.g. when the app goes to the background, returns the bytes released
+    size_t trim_idle();
+    void add(llama_rn_context *llama);
+    void remove(llama_rn_context *llama);
+
+    // a context is about to be used: restores it if it was evicted (making room for it first) and keeps it
+    // from being evicted until end_use, returns false if it could not be restored
+    bool begin_use(llama_rn_context *llama);
+    void end_use(llama_rn_context *llama);
+
+    size_t total_size() const;
+
+private:
+    struct eviction
+    {
+        llama_rn_context *llama;
+        std::string path;
+    };
+
+    // picks the idle contexts to evict, least recently used first, until extra more bytes fit in the budget,
+    // and marks them busy, called with the mutex held
+    std::vector<eviction> pick_victims(size_t extra);
+
+    // saves and frees the picked contexts, called without the mutex
+    void evict(const std::vector<eviction> &victims);
+
+    // trims the contexts idle since before the deadline
+    size_t trim(std::chrono::steady_clock::time_point deadline);
+    void idle_loop();
+};
+
+inline llama_rn_memory_manager &memory_manager()
+{
+    static llama_rn_memory_manager manager;
+    return manager;
+}
+
 struct llama_rn_context
 {
     bool is_predicting = false;
@@ -141,6 +543,11 @@ struct llama_rn_context
 
     gpt_params params;
 
+    // when set, used instead of params.prompt: each segment is tokenized on its own and the tokens are
+    // concatenated, so unchanged segments (system prompt, previous turns) come from token_cache
+    std::vector<std::string> prompt_segments;
+    llama_rn_token_cache token_cache;
+
     llama_model *model = nullptr;
     llama_context *ctx = nullptr;
     llama_sampling_context *ctx_sampling = nullptr;
@@ -152,10 +559,32 @@ struct llama_rn_context
     bool stopped_word = false;
     bool stopped_limit = false;
     std::string stopping_word;
+    stop_string_matcher stop_matcher;
+
+    // called from loadModel while the weights are read, with the progress in [0, 1];
+    // returning false cancels the load and frees what was read so far
+    std::function<bool(float)> on_load_progress;
+    float load_progress = 0.0f;
     int32_t multibyte_pending = 0;
 
+    // memory manager state: an evicted context has no llama_context, its state is in evict_path
+    std::string evict_path;
+    size_t evicted_size = 0;
+    int n_uses = 0;
+    std::chrono::steady_clock::time_point last_use = std::chrono::steady_clock::now();
+    bool trimmed = false;
+    // set while the context is evicted or restored outside of the manager's mutex, only the thread that set it
+    // touches ctx until it is cleared, busy_size is the size counted for the context meanwhile
+    bool busy = false;
+    size_t busy_size = 0;
+    size_t use_size = 0; // memorySize() when the context was last taken into use
+
     ~llama_rn_context()
     {
+        if (model)
+        {
+            memory_manager().remove(this);
+        }
         if (ctx)
         {
             llama_free(ctx);
@@ -163,7 +592,7 @@ struct llama_rn_context
         }
         if (model)
         {
-            llama_free_model(model);
+            model_registry().release(model);
             model = nullptr;
         }
         if (ctx_sampling != nullptr)
@@ -177,6 +606,7 @@ struct llama_rn_context
         is_interrupted = false;
         params.antiprompt.clear();
         params.sparams.grammar.clear();
+        prompt_segments.clear();
         num_prompt_tokens = 0;
         num_tokens_predicted = 0;
         generated_text = "";
@@ -201,16 +631,109 @@ struct llama_rn_context
         return ctx_sampling != nullptr;
     }
 
+    static bool load_progress_callback(float progress, void *user_data)
+    {
+        llama_rn_context *llama = static_cast<llama_rn_context *>(user_data);
+        llama->load_progress = progress;
+        return llama->on_load_progress(progress);
+    }
+
     bool loadModel(gpt_params &params_)
     {
         params = params_;
-        std::tie(model, ctx) = llama_init_from_gpt_params(params);
+        if (params.embedding_only)
+        {
+            params.embedding = true;
+        }
+        model = model_registry().acquire(params, on_load_progress ? load_progress_callback : nullptr, this);
         if (model == nullptr)
         {
            LOG_ERROR("unable to load model: %s", params_.model.c_str());
            return false;
         }
+        if (on_load_progress && load_progress < 1.0f && !on_load_progress(1.0f))
+        {
+           // the model was already loaded for another context, nothing was reported yet
+           model_registry().release(model);
+           model = nullptr;
+           return false;
+        }
+        ctx = llama_new_context_with_model(model, llama_context_params_from_gpt_params(params));
+        if (ctx == nullptr)
+        {
+           LOG_ERROR("unable to create context: %s", params_.model.c_str());
+           model_registry().release(model);
+           model = nullptr;
+           return false;
+        }
+
+        if (params.ignore_eos)
+        {
+            params.sparams.logit_bias[llama_token_eos(model)] = -INFINITY;
+        }
+
+        // warm up the model with an empty run
+        std::vector<llama_token> tmp = { llama_token_bos(model), llama_token_eos(model), };
+        llama_decode(ctx, llama_batch_get_one(tmp.data(), std::min(tmp.size(), (size_t) params.n_batch), 0, 0));
+        llama_kv_cache_tokens_rm(ctx, -1, -1);
+        llama_reset_timings(ctx);
+
         n_ctx = llama_n_ctx(ctx);
+        memory_manager().add(this);
+        return true;
+    }
+
+    // bytes held by the context, without the model weights
+    size_t memorySize() const
+    {
+        return ctx ? llama_get_memory_size(ctx) : 0;
+    }
+
+    // saves the state (KV cache, logits, RNG) to path and frees the llama_context with its buffers
+    bool evict(const std::string &path)
+    {
+        const size_t size = memorySize();
+        try
+        {
+            if (!llama_save_session_file(ctx, path.c_str(), embd.data(), std::min(embd.size(), (size_t) n_ctx)))
+            {
+                return false;
+            }
+        }
+        catch (const std::exception &err)
+        {
+            LOG_WARNING("unable to save the state to %s: %s", path.c_str(), err.what());
+            std::remove(path.c_str());
+            return false;
+        }
+        llama_free(ctx);
+        ctx = nullptr;
+        evict_path = path;
+        evicted_size = size;
+        return true;
+    }
+
+    bool restore()
+    {
+        ctx = llama_new_context_with_model(model, llama_context_params_from_gpt_params(params));
+        if (ctx == nullptr)
+        {
+            LOG_ERROR("unable to recreate the evicted context: %s", params.model.c_str());
+            return false;
+        }
+
+        std::vector<llama_token> tokens(n_ctx);
+        size_t n_tokens = 0;
+        if (!llama_load_session_file(ctx, evict_path.c_str(), tokens.data(), tokens.size(), &n_tokens))
+        {
+            // the cache is rebuilt from the prompt on the next completion
+            LOG_WARNING("unable to restore the state from %s", evict_path.c_str());
+            embd.clear();
+            n_past = 0;
+        }
+        std::remove(evict_path.c_str());
+        evict_path.clear();
+        evicted_size = 0;
         return true;
     }
 
@@ -238,8 +761,23 @@ struct llama_rn_context
 
     void loadPrompt()
     {
-        params.prompt.insert(0, 1, ' '); // always add a first space
-        std::vector<llama_token> prompt_tokens = ::llama_tokenize(ctx, params.prompt, true);
+        std::vector<llama_token> prompt_tokens;
+        if (prompt_segments.empty())
+        {
+            params.prompt.insert(0, 1, ' '); // always add a first space
+            prompt_tokens = token_cache.tokenize(ctx, params.prompt, true, params.n_threads);
+        }
+        else
+        {
+            for (size_t i = 0; i < prompt_segments.size(); i++)
+            {
+                // always add a first space, BOS only before the first segment
+                const auto &tokens = i == 0
+                    ? token_cache.tokenize(ctx, " " + prompt_segments[i], true, params.n_threads)
+                    : token_cache.tokenize(ctx, prompt_segments[i], false, params.n_threads);
+                prompt_tokens.insert(prompt_tokens.end(), tokens.begin(), tokens.end());
+            }
+        }
         num_prompt_tokens = prompt_tokens.size();
 
         if (params.n_keep < 0)
@@ -286,6 +824,8 @@ struct llama_rn_context
 
     void beginCompletion()
     {
+        stop_matcher.build(params.antiprompt);
+
         // number of tokens to keep when resetting context
         n_remain = params.n_predict;
         llama_set_rng_seed(ctx, params.seed);
@@ -353,6 +893,13 @@ struct llama_rn_context
             return result;
         }
 
+        if (params.embedding_only)
+        {
+            LOG_ERROR("no logits to sample from, the context was created with embedding_only");
+            has_next_token = false;
+            return result;
+        }
+
         {
             // out of user input, sample next token
             std::vector<llama_token_data> candidates;
@@ -397,44 +944,34 @@ struct llama_rn_context
         return result;
     }
 
-    size_t findStoppingStrings(const std::string &text, const size_t last_token_size,
-                               const stop_type type)
+    // looks for the stop strings in generated_text from the given position, feeding only the bytes added since
+    // the last call to the matcher; returns the match position relative to from
+    size_t findStoppingStrings(const size_t from, const stop_type type)
     {
-        size_t stop_pos = std::string::npos;
-        for (const std::string &word : params.antiprompt)
+        if (type == STOP_FULL)
         {
             size_t pos;
-            if (type == STOP_FULL)
-            {
-                const size_t tmp = word.size() + last_token_size;
-                const size_t from_pos = text.size() > tmp ? text.size() - tmp : 0;
-                pos = text.find(word, from_pos);
-            }
-            else
+            int word;
+            if (!stop_matcher.feed(generated_text, from, pos, word))
             {
-                pos = find_partial_stop_string(word, text);
-            }
-            if (pos != std::string::npos &&
-                (stop_pos == std::string::npos || pos < stop_pos))
-            {
-                if (type == STOP_FULL)
-                {
-                    stopping_word = word;
-                    stopped_word = true;
-                    has_next_token = false;
-                }
-                stop_pos = pos;
+                return std::string::npos;
             }
+            stopping_word = params.antiprompt[word];
+            stopped_word = true;
+            has_next_token = false;
+            return pos - from;
         }
-        return stop_pos;
+
+        const size_t pos = stop_matcher.partial(from);
+        return pos == std::string::npos ? pos : pos - from;
     }
 
     completion_token_output doCompletion()
     {
         const completion_token_output token_with_probs = nextToken();
 
-        const std::string token_text = token_with_probs.tok == -1 ? "" : llama_token_to_piece(ctx, token_with_probs.tok);
-        generated_text += token_text;
+        const token_piece token_text = get_token_piece(ctx, token_with_probs.tok);
+        generated_text.append(token_text.data, token_text.size);
 
         if (params.sparams.n_probs > 0)
         {
@@ -443,11 +980,11 @@ struct llama_rn_context
 
         if (multibyte_pending > 0)
         {
-            multibyte_pending -= token_text.size();
+            multibyte_pending -= token_text.size;
         }
-        else if (token_text.size() == 1)
+        else if (token_text.size == 1)
         {
-            const char c = token_text[0];
+            const char c = token_text.data[0];
             // 2-byte characters: 110xxxxx 10xxxxxx
             if ((c & 0xE0) == 0xC0)
             {
@@ -481,7 +1018,7 @@ struct llama_rn_context
         }
 
         LOG_VERBOSE("next token, token: %s, token_text: %s, has_next_token: %d, n_remain: %d, num_tokens_predicted: %d, stopped_eos: %d, stopped_word: %d, stopped_limit: %d, stopping_word: %s",
-            llama_token_to_piece(ctx, token_with_probs.tok),
+            token_text.data,
             tokens_to_output_formatted_string(ctx, token_with_probs.tok).c_str(),
             has_next_token,
             n_remain,
@@ -508,6 +1045,266 @@ struct llama_rn_context
     }
 };
 
+inline llama_rn_memory_manager::~llama_rn_memory_manager()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    idle_cv.notify_all();
+    if (idle_thread.joinable())
+    {
+        idle_thread.join();
+    }
+}
+
+inline void llama_rn_memory_manager::set_budget(size_t budget_, const std::string &evict_dir_)
+{
+    std::vector<eviction> victims;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        budget = budget_;
+        evict_dir = evict_dir_;
+        victims = pick_victims(0);
+    }
+    evict(victims);
+}
+
+inline void llama_rn_memory_manager::set_idle_timeout(int64_t timeout_ms)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        idle_timeout_ms = timeout_ms;
+        if (timeout_ms > 0 && !idle_thread.joinable())
+        {
+            idle_thread = std::thread(&llama_rn_memory_manager::idle_loop, this);
+        }
+    }
+    idle_cv.notify_all();
+}
+
+inline size_t llama_rn_memory_manager::trim_idle()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return trim(std::chrono::steady_clock::now());
+}
+
+inline size_t llama_rn_memory_manager::trim(std::chrono::steady_clock::time_point deadline)
+{
+    size_t released = 0;
+    for (llama_rn_context *llama : contexts)
+    {
+        if (!llama->busy && llama->ctx != nullptr && llama->n_uses == 0 && !llama->trimmed && llama->last_use <= deadline)
+        {
+            released += llama_trim(llama->ctx, true);
+            llama->trimmed = true;
+        }
+    }
+    if (released > 0)
+    {
+        LOG_INFO("trimmed the idle contexts, released %.2f MB", released / 1024.0 / 1024.0);
+    }
+    return released;
+}
+
+inline void llama_rn_memory_manager::idle_loop()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stopping)
+    {
+        if (idle_timeout_ms <= 0)
+        {
+            idle_cv.wait(lock);
+            continue;
+        }
+        const auto timeout = std::chrono::milliseconds(idle_timeout_ms);
+        const auto now = std::chrono::steady_clock::now();
+        trim(now - timeout);
+
+        // sleep until the next context reaches the timeout, or until a context is used again
+        auto wakeup = now + timeout;
+        for (const llama_rn_context *llama : contexts)
+        {
+            if (!llama->busy && llama->ctx != nullptr && llama->n_uses == 0 && !llama->trimmed)
+            {
+                wakeup = std::min(wakeup, llama->last_use + timeout);
+            }
+        }
+        idle_cv.wait_until(lock, wakeup);
+    }
+}
+
+inline void llama_rn_memory_manager::add(llama_rn_context *llama)
+{
+    std::vector<eviction> victims;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        contexts.push_front(llama);
+        victims = pick_victims(0);
+    }
+    evict(victims);
+}
+
+inline void llama_rn_memory_manager::remove(llama_rn_context *llama)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    state_cv.wait(lock, [llama] { return !llama->busy; });
+    contexts.remove(llama);
+    if (!llama->evict_path.empty())
+    {
+        std::remove(llama->evict_path.c_str());
+        llama->evict_path.clear();
+    }
+}
+
+inline bool llama_rn_memory_manager::begin_use(llama_rn_context *llama)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    // an eviction of this context, or its restore for another call, finishes first
+    state_cv.wait(lock, [llama] { return !llama->busy; });
+    auto it = std::find(contexts.begin(), contexts.end(), llama);
+    if (it != contexts.end())
+    {
+        contexts.splice(contexts.begin(), contexts, it);
+    }
+    llama->n_uses++;
+    // the trimmed buffers are allocated again by the next decode
+    llama->trimmed = false;
+    if (llama->ctx != nullptr)
+    {
+        if (llama->n_uses == 1)
+        {
+            llama->use_size = llama->memorySize();
+        }
+        return true;
+    }
+
+    // make room for the context and restore it without holding the mutex
+    llama->busy = true;
+    llama->busy_size = llama->evicted_size;
+    std::vector<eviction> victims = pick_victims(llama->evicted_size);
+    lock.unlock();
+
+    evict(victims);
+    const bool restored = llama->restore();
+
+    lock.lock();
+    llama->busy = false;
+    if (restored)
+    {
+        llama->use_size = llama->memorySize();
+    }
+    else
+    {
+        llama->n_uses--;
+    }
+    lock.unlock();
+    state_cv.notify_all();
+    return restored;
+}
+
+inline void llama_rn_memory_manager::end_use(llama_rn_context *llama)
+{
+    std::vector<eviction> victims;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        llama->n_uses--;
+        llama->last_use = std::chrono::steady_clock::now();
+        // the budget only needs checking again if the logits or the compute buffer grew during the use
+        if (llama->n_uses == 0 && llama->memorySize() > llama->use_size)
+        {
+            victims = pick_victims(0);
+        }
+    }
+    idle_cv.notify_all();
+    evict(victims);
+}
+
+inline size_t llama_rn_memory_manager::total_size() const
+{
+    size_t size = 0;
+    std::vector<const llama_model *> models;
+    for (const llama_rn_context *llama : contexts)
+    {
+        size += llama->busy ? llama->busy_size : llama->memorySize();
+        if (std::find(models.begin(), models.end(), llama->model) == models.end())
+        {
+            models.push_back(llama->model);
+            size += llama_model_size(llama->model);
+        }
+    }
+    return size;
+}
+
+inline std::vector<llama_rn_memory_manager::eviction> llama_rn_memory_manager::pick_victims(size_t extra)
+{
+    std::vector<eviction> victims;
+    if (budget == 0)
+    {
+        return victims;
+    }
+    size_t total = total_size();
+    // the most recently used context is kept, evicting it would only trade memory for a reload on every call
+    for (auto it = contexts.rbegin(); it != contexts.rend() && std::next(it) != contexts.rend() && total + extra > budget; ++it)
+    {
+        llama_rn_context *llama = *it;
+        if (llama->busy || llama->ctx == nullptr || llama->n_uses > 0)
+        {
+            continue;
+        }
+        if (evict_dir.empty())
+        {
+            LOG_WARNING("over the memory budget, but no directory to evict the contexts to");
+            break;
+        }
+        llama->busy = true;
+        llama->busy_size = llama->memorySize();
+        victims.push_back({llama, evict_dir + "/rnllama-evicted-" + std::to_string(++n_evictions) + ".session"});
+        total -= llama->busy_size;
+    }
+    return victims;
+}
+
+inline void llama_rn_memory_manager::evict(const std::vector<eviction> &victims)
+{
+    if (victims.empty())
+    {
+        return;
+    }
+    for (const eviction &victim : victims)
+    {
+        const size_t size = victim.llama->busy_size;
+        if (victim.llama->evict(victim.path))
+        {
+            LOG_INFO("evicted an idle context (%.2f MB) to stay within the memory budget", size / 1024.0 / 1024.0);
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        victim.llama->busy = false;
+    }
+    state_cv.notify_all();
+}
+
+// held by a binding call that uses a context: restores the context if it was evicted, and keeps it from being
+// evicted until the call returns
+struct llama_rn_context_use
+{
+    llama_rn_context *llama;
+    bool ok;
+
+    explicit llama_rn_context_use(llama_rn_context *llama_) : llama(llama_), ok(memory_manager().begin_use(llama_)) {}
+
+    ~llama_rn_context_use()
+    {
+        if (ok)
+        {
+            memory_manager().end_use(llama);
+        }
+    }
+
+    llama_rn_context_use(const llama_rn_context_use &) = delete;
+    llama_rn_context_use &operator=(const llama_rn_context_use &) = delete;
+};
+
 }
 
 #endif /* LLAMA_H */
@@ -78,7 +78,9 @@ std::string llama_sampling_prev_str(llama_sampling_context * ctx_sampling, llama
     std::string result;
 
     for (int i = size - n; i < size; i++) {
-        result += llama_token_to_piece(ctx_main, ctx_sampling->prev[i]);
+        int n_piece = 0;
+        const char * piece = llama_token_get_piece(llama_get_model(ctx_main), ctx_sampling->prev[i], &n_piece);
+        result.append(piece, n_piece);
     }
 
     return result;
@@ -0,0 +1,389 @@
+// checks the kernels lm_ggml_setup_cpu_kernels installs for each set of CPU features it can detect, and their
+// results against the dequantized rows, built together with ggml.c to reach the static detection flags and type traits
+
+#include "../ggml.c"
+
+static lm_ggml_type_traits_t default_traits[LM_GGML_TYPE_COUNT];
+
+static int n_failed = 0;
+
+#define CHECK_KERNEL(features, type, field, expected) \
+    do { \
+        if ((void *) type_traits[type].field != (void *) (expected)) { \
+            fprintf(stderr, "%s: %s: %s.%s is not %s\n", __func__, features, type_traits[type].type_name, #field, #expected); \
+            n_failed++; \
+        } \
+    } while (0)
+
+// the dot kernels checked against the dequantized rows, the x4 types on rows of their base type repacked
+static const struct {
+    enum lm_ggml_type type;
+    enum lm_ggml_type base_type;
+} dot_types[] = {
+    { LM_GGML_TYPE_F16,     LM_GGML_TYPE_F16  },
+    { LM_GGML_TYPE_Q4_0,    LM_GGML_TYPE_Q4_0 },
+    { LM_GGML_TYPE_Q8_0,    LM_GGML_TYPE_Q8_0 },
+    { LM_GGML_TYPE_Q4_0_X4, LM_GGML_TYPE_Q4_0 },
+    { LM_GGML_TYPE_Q8_0_X4, LM_GGML_TYPE_Q8_0 },
+#if defined(LM_GGML_USE_K_QUANTS) && QK_K == 256
+    { LM_GGML_TYPE_Q2_K,    LM_GGML_TYPE_Q2_K },
+    { LM_GGML_TYPE_Q3_K,    LM_GGML_TYPE_Q3_K },
+    { LM_GGML_TYPE_Q4_K,    LM_GGML_TYPE_Q4_K },
+    { LM_GGML_TYPE_Q5_K,    LM_GGML_TYPE_Q5_K },
+    { LM_GGML_TYPE_Q6_K,    LM_GGML_TYPE_Q6_K },
+    { LM_GGML_TYPE_Q4_K_X4, LM_GGML_TYPE_Q4_K },
+#endif
+};
+
+// odd and even block counts, to cover the kernels that unroll over pairs of blocks and their leftovers
+static const int dot_n_blocks[] = { 1, 2, 3, 4, 7, 16 };
+
+#define NR0 LM_GGML_VEC_DOT_MXN_NR0
+#define NR1 LM_GGML_VEC_DOT_MXN_NR1
+
+static uint32_t rng_state = 1;
+
+static float random_float(void) {
+    rng_state = rng_state*1664525u + 1013904223u;
+    return (float) (rng_state >> 8)/(1 << 23) - 1.0f;
+}
+
+static size_t row_size(enum lm_ggml_type type, int n) {
+    return (size_t) n/type_traits[type].blck_size*type_traits[type].type_size;
+}
+
+static void dequantize_row(enum lm_ggml_type type, const void * src, float * dst, int n) {
+#if defined(LM_GGML_USE_K_QUANTS)
+    // q8_K is only a vec_dot_type and has no to_float
+    if (type == LM_GGML_TYPE_Q8_K) {
+        dequantize_row_q8_K(src, dst, n);
+        return;
+    }
+#endif
+    type_traits[type].to_float(src, dst, n);
+}
+
+// s[c*bs + r] against ref[c*NR0 + r], to the rounding of the kernel relative to sum(|x*y|)
+static void check_dot_results(const char * features, const char * kernel, enum lm_ggml_type type, int nb,
+        const float * s, size_t bs, const double * ref, const double * mag) {
+    // the fp16 kernels also accumulate in fp16
+    const double rel = type == LM_GGML_TYPE_F16 ? 1e-2 : 1e-4;
+
+    for (int c = 0; c < NR1; ++c) {
+        for (int r = 0; r < NR0; ++r) {
+            const double diff = fabs(s[c*bs + r] - ref[c*NR0 + r]);
+            if (!(diff <= rel*mag[c*NR0 + r] + 1e-5)) {
+                fprintf(stderr, "%s: %s: %s.%s with %d blocks: row %d, col %d is %f instead of %f\n", __func__, features,
+                        type_traits[type].type_name, kernel, nb, r, c, s[c*bs + r], ref[c*NR0 + r]);
+                n_failed++;
+                return;
+            }
+        }
+    }
+}
+
+static void check_dot(const char * features, enum lm_ggml_type type, enum lm_ggml_type base_type, int nb) {
+    const lm_ggml_type_traits_t * traits = &type_traits[type];
+    const enum lm_ggml_type y_type = traits->vec_dot_type;
+
+    // f16 has no blocks, give it a tail after the 32 element vector loop instead
+    const int n = base_type == LM_GGML_TYPE_F16 ? nb*33 : nb*type_traits[base_type].blck_size;
+
+    const size_t x_row = row_size(base_type, n);
+    const size_t y_row = row_size(y_type, n);
+
+    float * xf = malloc(NR0*n*sizeof(float));
+    float * yf = malloc(NR1*n*sizeof(float));
+    char  * xq = malloc(NR0*x_row);
+    char  * x4 = malloc(NR0*x_row);
+    char  * yq = malloc(NR1*y_row);
+
+    for (int i = 0; i < NR0*n; ++i) {
+        xf[i] = random_float();
+    }
+    for (int i = 0; i < NR1*n; ++i) {
+        yf[i] = random_float();
+    }
+    for (int r = 0; r < NR0; ++r) {
+        type_traits[base_type].from_float(xf + r*n, xq + r*x_row, n);
+        dequantize_row(base_type, xq + r*x_row, xf + r*n, n);
+    }
+    for (int c = 0; c < NR1; ++c) {
+        type_traits[y_type].from_float(yf + c*n, yq + c*y_row, n);
+        dequantize_row(y_type, yq + c*y_row, yf + c*n, n);
+    }
+
+    double ref[NR0*NR1];
+    double mag[NR0*NR1];
+    for (int c = 0; c < NR1; ++c) {
+        for (int r = 0; r < NR0; ++r) {
+            double sum  = 0.0;
+            double sumt = 0.0;
+            for (int i = 0; i < n; ++i) {
+                sum  += (double) xf[r*n + i]*yf[c*n + i];
+                sumt += fabs((double) xf[r*n + i]*yf[c*n + i]);
+            }
+            ref[c*NR0 + r] = sum;
+            mag[c*NR0 + r] = sumt;
+        }
+    }
+
+    // the rows of the x4 types are interleaved, and vec_dot computes all of them at once
+    const char * x = xq;
+    if (type != base_type) {
+        lm_ggml_repack(base_type, xq, x4, NR0, n);
+        x = x4;
+    }
+
+    float s[NR1*(NR0 + 1)];
+
+    for (int i = 0; i < NR1*(NR0 + 1); ++i) {
+        s[i] = NAN;
+    }
+    for (int c = 0; c < NR1; ++c) {
+        if (traits->blck_rows > 0) {
+            traits->vec_dot(n, s + c*NR0, x, yq + c*y_row);
+        } else {
+            for (int r = 0; r < NR0; ++r) {
+                traits->vec_dot(n, s + c*NR0 + r, x + r*x_row, yq + c*y_row);
+            }
+        }
+    }
+    check_dot_results(features, "vec_dot", type, nb, s, NR0, ref, mag);
+
+    if (traits->vec_dot_mxn) {
+        // a wider output stride than NR0, as for a slice of the rows of dst
+        for (int i = 0; i < NR1*(NR0 + 1); ++i) {
+            s[i] = NAN;
+        }
+        traits->vec_dot_mxn(n, s, NR0 + 1, x, x_row, yq, y_row);
+        check_dot_results(features, "vec_dot_mxn", type, nb, s, NR0 + 1, ref, mag);
+    }
+
+    free(xf);
+    free(yf);
+    free(xq);
+    free(x4);
+    free(yq);
+}
+
+// runs the installed kernels, so only for the features the running CPU has
+static void check_dot_kernels(const char * features) {
+    for (size_t i = 0; i < sizeof(dot_types)/sizeof(dot_types[0]); ++i) {
+        for (size_t j = 0; j < sizeof(dot_n_blocks)/sizeof(dot_n_blocks[0]); ++j) {
+            check_dot(features, dot_types[i].type, dot_types[i].base_type, dot_n_blocks[j]);
+        }
+    }
+}
+
+#if defined(LM_GGML_X86_DISPATCH)
+static void install_x86(bool avx512_vnni, bool avx_vnni) {
+    memcpy(type_traits, default_traits, sizeof(type_traits));
+    lm_ggml_x86_avx512_vnni = avx512_vnni;
+    lm_ggml_x86_avx_vnni    = avx_vnni;
+    lm_ggml_install_cpu_kernels();
+}
+
+static void check_x86_baseline(const char * features) {
+    CHECK_KERNEL(features, LM_GGML_TYPE_Q4_0, vec_dot, lm_ggml_vec_dot_q4_0_q8_0);
+    CHECK_KERNEL(features, LM_GGML_TYPE_Q8_0, vec_dot, lm_ggml_vec_dot_q8_0_q8_0);
+#if defined(LM_GGML_USE_K_QUANTS) && QK_K == 256
+    CHECK_KERNEL(features, LM_GGML_TYPE_Q2_K, vec_dot, lm_ggml_vec_dot_q2_K_q8_K);
+    CHECK_KERNEL(features, LM_GGML_TYPE_Q4_K, vec_dot, lm_ggml_vec_dot_q4_K_q8_K);
+    CHECK_KERNEL(features, LM_GGML_TYPE_Q6_K, vec_dot, lm_ggml_vec_dot_q6_K_q8_K);
+#endif
+}
+
+static void check_x86_mxn(const char * features) {
+#ifdef LM_GGML_VEC_DOT_Q4_0_Q8_0_MXN
+    CHECK_KERNEL(features, LM_GGML_TYPE_Q4_0, vec_dot_mxn, lm_ggml_vec_dot_q4_0_q8_0_mxn);
+#endif
+#ifdef LM_GGML_VEC_DOT_Q8_0_Q8_0_MXN
+    CHECK_KERNEL(features, LM_GGML_TYPE_Q8_0, vec_dot_mxn, lm_ggml_vec_dot_q8_0_q8_0_mxn);
+#endif
+#if defined(LM_GGML_USE_K_QUANTS) && defined(LM_GGML_VEC_DOT_Q4_K_Q8_K_MXN)
+    CHECK_KERNEL(features, LM_GGML_TYPE_Q4_K, vec_dot_mxn, lm_ggml_vec_dot_q4_K_q8_K_mxn);
+#endif
+}
+
+static void check_x86_avx512(const char * features) {
+    CHECK_KERNEL(features, LM_GGML_TYPE_Q4_0, vec_dot,     lm_ggml_vec_dot_q4_0_q8_0_avx512);
+    CHECK_KERNEL(features, LM_GGML_TYPE_Q4_0, vec_dot_mxn, NULL);
+    CHECK_KERNEL(features, LM_GGML_TYPE_Q8_0, vec_dot,     lm_ggml_vec_dot_q8_0_q8_0_avx512);
+    CHECK_KERNEL(features, LM_GGML_TYPE_Q8_0, vec_dot_mxn, NULL);
+#if defined(LM_GGML_USE_K_QUANTS) && QK_K == 256
+    CHECK_KERNEL(features, LM_GGML_TYPE_Q2_K, vec_dot,     lm_ggml_vec_dot_q2_K_q8_K_avx512);
+    CHECK_KERNEL(features, LM_GGML_TYPE_Q4_K, vec_dot,     lm_ggml_vec_dot_q4_K_q8_K_avx512);
+    CHECK_KERNEL(features, LM_GGML_TYPE_Q4_K, vec_dot_mxn, NULL);
+    CHECK_KERNEL(features, LM_GGML_TYPE_Q6_K, vec_dot,     lm_ggml_vec_dot_q6_K_q8_K_avx512);
+#endif
+}
+
+static void check_x86_avxvnni(const char * features) {
+    CHECK_KERNEL(features, LM_GGML_TYPE_Q4_0, vec_dot, lm_ggml_vec_dot_q4_0_q8_0_avxvnni);
+    CHECK_KERNEL(features, LM_GGML_TYPE_Q8_0, vec_dot, lm_ggml_vec_dot_q8_0_q8_0_avxvnni);
+#if defined(LM_GGML_USE_K_QUANTS) && QK_K == 256
+    CHECK_KERNEL(features, LM_GGML_TYPE_Q2_K, vec_dot, lm_ggml_vec_dot_q2_K_q8_K_avxvnni);
+    CHECK_KERNEL(features, LM_GGML_TYPE_Q4_K, vec_dot, lm_ggml_vec_dot_q4_K_q8_K_avxvnni);
+    CHECK_KERNEL(features, LM_GGML_TYPE_Q6_K, vec_dot, lm_ggml_vec_dot_q6_K_q8_K_avxvnni);
+#endif
+    check_x86_mxn(features);
+}
+
+static void test_x86(void) {
+    lm_ggml_x86_detect();
+    const bool has_avx512_vnni = lm_ggml_x86_avx512_vnni;
+    const bool has_avx_vnni    = lm_ggml_x86_avx_vnni;
+
+    install_x86(false, false);
+    check_x86_baseline("none");
+    check_x86_mxn("none");
+    check_dot_kernels("none");
+
+    install_x86(false, true);
+    check_x86_avxvnni("avx-vnni");
+    if (has_avx_vnni) {
+        check_dot_kernels("avx-vnni");
+    }
+
+    // AVX-512 takes precedence over AVX-VNNI and over the tiled AVX2 kernels
+    install_x86(true, false);
+    check_x86_avx512("avx512-vnni");
+    if (has_avx512_vnni) {
+        check_dot_kernels("avx512-vnni");
+    }
+
+    install_x86(true, true);
+    check_x86_avx512("avx512-vnni + avx-vnni");
+    if (has_avx512_vnni && has_avx_vnni) {
+        check_dot_kernels("avx512-vnni + avx-vnni");
+    }
+
+    // whatever the running CPU reports
+    memcpy(type_traits, default_traits, sizeof(type_traits));
+    lm_ggml_setup_cpu_kernels();
+    if (lm_ggml_x86_avx512_vnni) {
+        check_x86_avx512("detected");
+    } else if (lm_ggml_x86_avx_vnni) {
+        check_x86_avxvnni("detected");
+    } else {
+        check_x86_baseline("detected");
+        check_x86_mxn("detected");
+    }
+    printf("%s: detected avx512-vnni %d, avx-vnni %d\n", __func__, lm_ggml_x86_avx512_vnni, lm_ggml_x86_avx_vnni);
+}
+#endif
+
+#if defined(LM_GGML_ARM_DISPATCH)
+static void install_arm(bool dotprod, bool fp16) {
+    memcpy(type_traits, default_traits, sizeof(type_traits));
+    lm_ggml_arm_dotprod = dotprod;
+    lm_ggml_arm_fp16    = fp16;
+    lm_ggml_install_cpu_kernels();
+}
+
+static void check_arm_dotprod(const char * features, bool dotprod) {
+    if (!dotprod) {
+        CHECK_KERNEL(features, LM_GGML_TYPE_Q4_0,    vec_dot,     lm_ggml_vec_dot_q4_0_q8_0);
+        CHECK_KERNEL(features, LM_GGML_TYPE_Q4_0,    vec_dot_mxn, lm_ggml_vec_dot_q4_0_q8_0_mxn);
+        CHECK_KERNEL(features, LM_GGML_TYPE_Q8_0,    vec_dot,     lm_ggml_vec_dot_q8_0_q8_0);
+        CHECK_KERNEL(features, LM_GGML_TYPE_Q8_0,    vec_dot_mxn, lm_ggml_vec_dot_q8_0_q8_0_mxn);
+        CHECK_KERNEL(features, LM_GGML_TYPE_Q4_0_X4, vec_dot,     lm_ggml_vec_dot_q4_0_x4_q8_0);
+        CHECK_KERNEL(features, LM_GGML_TYPE_Q4_0_X4, vec_dot_mxn, lm_ggml_vec_dot_q4_0_x4_q8_0_mxn);
+        CHECK_KERNEL(features, LM_GGML_TYPE_Q8_0_X4, vec_dot,     lm_ggml_vec_dot_q8_0_x4_q8_0);
+        CHECK_KERNEL(features, LM_GGML_TYPE_Q8_0_X4, vec_dot_mxn, lm_ggml_vec_dot_q8_0_x4_q8_0_mxn);
+#if defined(LM_GGML_USE_K_QUANTS) && QK_K == 256
+        CHECK_KERNEL(features, LM_GGML_TYPE_Q2_K,    vec_dot,     lm_ggml_vec_dot_q2_K_q8_K);
+        CHECK_KERNEL(features, LM_GGML_TYPE_Q4_K,    vec_dot,     lm_ggml_vec_dot_q4_K_q8_K);
+        CHECK_KERNEL(features, LM_GGML_TYPE_Q4_K,    vec_dot_mxn, lm_ggml_vec_dot_q4_K_q8_K_mxn);
+        CHECK_KERNEL(features, LM_GGML_TYPE_Q6_K,    vec_dot,     lm_ggml_vec_dot_q6_K_q8_K);
+        CHECK_KERNEL(features, LM_GGML_TYPE_Q4_K_X4, vec_dot,     lm_ggml_vec_dot_q4_K_x4_q8_K);
+#endif
+    } else {
+        CHECK_KERNEL(features, LM_GGML_TYPE_Q4_0,    vec_dot,     lm_ggml_vec_dot_q4_0_q8_0_dotprod);
+        CHECK_KERNEL(features, LM_GGML_TYPE_Q4_0,    vec_dot_mxn, lm_ggml_vec_dot_q4_0_q8_0_mxn_dotprod);
+        CHECK_KERNEL(features, LM_GGML_TYPE_Q8_0,    vec_dot,     lm_ggml_vec_dot_q8_0_q8_0_dotprod);
+        CHECK_KERNEL(features, LM_GGML_TYPE_Q8_0,    vec_dot_mxn, lm_ggml_vec_dot_q8_0_q8_0_mxn_dotprod);
+        CHECK_KERNEL(features, LM_GGML_TYPE_Q4_0_X4, vec_dot,     lm_ggml_vec_dot_q4_0_x4_q8_0_dotprod);
+        CHECK_KERNEL(features, LM_GGML_TYPE_Q4_0_X4, vec_dot_mxn, lm_ggml_vec_dot_q4_0_x4_q8_0_mxn_dotprod);
+        CHECK_KERNEL(features, LM_GGML_TYPE_Q8_0_X4, vec_dot,     lm_ggml_vec_dot_q8_0_x4_q8_0_dotprod);
+        CHECK_KERNEL(features, LM_GGML_TYPE_Q8_0_X4, vec_dot_mxn, lm_ggml_vec_dot_q8_0_x4_q8_0_mxn_dotprod);
+#if defined(LM_GGML_USE_K_QUANTS) && QK_K == 256
+        CHECK_KERNEL(features, LM_GGML_TYPE_Q2_K,    vec_dot,     lm_ggml_vec_dot_q2_K_q8_K_dotprod);
+        CHECK_KERNEL(features, LM_GGML_TYPE_Q4_K,    vec_dot,     lm_ggml_vec_dot_q4_K_q8_K_dotprod);
+        CHECK_KERNEL(features, LM_GGML_TYPE_Q4_K,    vec_dot_mxn, lm_ggml_vec_dot_q4_K_q8_K_mxn_dotprod);
+        CHECK_KERNEL(features, LM_GGML_TYPE_Q6_K,    vec_dot,     lm_ggml_vec_dot_q6_K_q8_K_dotprod);
+        CHECK_KERNEL(features, LM_GGML_TYPE_Q4_K_X4, vec_dot,     lm_ggml_vec_dot_q4_K_x4_q8_K_dotprod);
+#endif
+    }
+}
+
+static void check_arm_fp16(const char * features, bool fp16) {
+#if !defined(__ARM_FEATURE_FP16_VECTOR_ARITHMETIC)
+    if (fp16) {
+        CHECK_KERNEL(features, LM_GGML_TYPE_F16, vec_dot, lm_ggml_vec_dot_f16_fp16);
+        return;
+    }
+#else
+    UNUSED(fp16);
+#endif
+    CHECK_KERNEL(features, LM_GGML_TYPE_F16, vec_dot, lm_ggml_vec_dot_f16);
+}
+
+static void test_arm(void) {
+    static const struct {
+        const char * name;
+        bool         dotprod;
+        bool         fp16;
+    } feature_sets[] = {
+        { "none",           false, false },
+        { "dotprod",        true,  false },
+        { "fp16",           false, true  },
+        { "dotprod + fp16", true,  true  },
+    };
+
+    lm_ggml_arm_detect();
+    const bool has_dotprod = lm_ggml_arm_dotprod;
+    const bool has_fp16    = lm_ggml_arm_fp16;
+
+    for (size_t i = 0; i < sizeof(feature_sets)/sizeof(feature_sets[0]); ++i) {
+        install_arm(feature_sets[i].dotprod, feature_sets[i].fp16);
+        check_arm_dotprod(feature_sets[i].name, feature_sets[i].dotprod);
+        check_arm_fp16(feature_sets[i].name, feature_sets[i].fp16);
+        if ((has_dotprod || !feature_sets[i].dotprod) && (has_fp16 || !feature_sets[i].fp16)) {
+            check_dot_kernels(feature_sets[i].name);
+        }
+    }
+
+    // whatever the running CPU reports
+    memcpy(type_traits, default_traits, sizeof(type_traits));
+    lm_ggml_setup_cpu_kernels();
+    check_arm_dotprod("detected", lm_ggml_arm_dotprod);
+    check_arm_fp16("detected", lm_ggml_arm_fp16);
+    printf("%s: detected dotprod %d, fp16 %d\n", __func__, lm_ggml_arm_dotprod, lm_ggml_arm_fp16);
+}
+#endif
+
+int main(void) {
+    memcpy(default_traits, type_traits, sizeof(type_traits));
+
+    // fills the fp16 tables the dequantization and the scalar kernels use, the tests install their own kernels
+    {
+        struct lm_ggml_init_params params = { 0, NULL, true };
+        lm_ggml_free(lm_ggml_init(params));
+    }
+
+#if defined(LM_GGML_X86_DISPATCH)
+    test_x86();
+#endif
+#if defined(LM_GGML_ARM_DISPATCH)
+    test_arm();
+#endif
+
+    if (n_failed > 0) {
+        fprintf(stderr, "%s: %d kernel checks failed\n", __func__, n_failed);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,217 @@
+// checks the output rows of a batch decode against decoding the same tokens one at a time:
+// all the rows with logits_all, the flagged rows with batch.logits, and the embedding of the last token
+
+#include "ggml.h"
+#include "llama.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+static const char * fname = "test-decode-outputs.gguf";
+
+static const int n_vocab  = 64;
+static const int n_embd   = 64;
+static const int n_ff     = 128;
+static const int n_layer  = 2;
+static const int n_tokens = 20;
+
+static void add_tensor(struct lm_gguf_context * gctx, struct lm_ggml_context * ctx, std::mt19937 & rng,
+        const char * name, int64_t ne0, int64_t ne1, float mean, float stddev) {
+    struct lm_ggml_tensor * t = ne1 > 0 ? lm_ggml_new_tensor_2d(ctx, LM_GGML_TYPE_F32, ne0, ne1) : lm_ggml_new_tensor_1d(ctx, LM_GGML_TYPE_F32, ne0);
+    lm_ggml_set_name(t, name);
+
+    std::normal_distribution<float> dist(mean, stddev);
+    float * data = (float *) t->data;
+    for (int64_t i = 0; i < lm_ggml_nelements(t); ++i) {
+        data[i] = dist(rng);
+    }
+    lm_gguf_add_tensor(gctx, t);
+}
+
+static void write_model(void) {
+    // the spm vocab needs the newline byte token
+    std::vector<std::string> tokens = { "<unk>", "<s>", "</s>", "<0x0A>" };
+    while ((int) tokens.size() < n_vocab) {
+        tokens.push_back("t" + std::to_string(tokens.size()));
+    }
+    std::vector<const char *> token_ptrs;
+    for (const auto & token : tokens) {
+        token_ptrs.push_back(token.c_str());
+    }
+    std::vector<float>   scores(n_vocab, 0.0f);
+    std::vector<int32_t> types(n_vocab, LLAMA_TOKEN_TYPE_NORMAL);
+    types[0] = LLAMA_TOKEN_TYPE_UNKNOWN;
+    types[1] = LLAMA_TOKEN_TYPE_CONTROL;
+    types[2] = LLAMA_TOKEN_TYPE_CONTROL;
+    types[3] = LLAMA_TOKEN_TYPE_BYTE;
+
+    struct lm_gguf_context * gctx = lm_gguf_init_empty();
+    lm_gguf_set_val_str(gctx, "general.architecture", "llama");
+    lm_gguf_set_val_u32(gctx, "llama.context_length", 128);
+    lm_gguf_set_val_u32(gctx, "llama.embedding_length", n_embd);
+    lm_gguf_set_val_u32(gctx, "llama.feed_forward_length", n_ff);
+    lm_gguf_set_val_u32(gctx, "llama.attention.head_count", 4);
+    lm_gguf_set_val_u32(gctx, "llama.block_count", n_layer);
+    lm_gguf_set_val_u32(gctx, "llama.rope.dimension_count", n_embd / 4);
+    lm_gguf_set_val_f32(gctx, "llama.attention.layer_norm_rms_epsilon", 1e-5f);
+    lm_gguf_set_val_str(gctx, "tokenizer.ggml.model", "llama");
+    lm_gguf_set_arr_str(gctx, "tokenizer.ggml.tokens", token_ptrs.data(), token_ptrs.size());
+    lm_gguf_set_arr_data(gctx, "tokenizer.ggml.scores", LM_GGUF_TYPE_FLOAT32, scores.data(), scores.size());
+    lm_gguf_set_arr_data(gctx, "tokenizer.ggml.token_type", LM_GGUF_TYPE_INT32, types.data(), types.size());
+
+    struct lm_ggml_init_params params = { 16*1024*1024, NULL, false };
+    struct lm_ggml_context * ctx = lm_ggml_init(params);
+
+    std::mt19937 rng(42);
+    add_tensor(gctx, ctx, rng, "token_embd.weight",  n_embd, n_vocab, 0.0f, 1.0f);
+    add_tensor(gctx, ctx, rng, "output_norm.weight", n_embd, 0,       1.0f, 0.1f);
+    add_tensor(gctx, ctx, rng, "output.weight",      n_embd, n_vocab, 0.0f, 0.1f);
+    for (int il = 0; il < n_layer; ++il) {
+        char name[64];
+        const auto blk = [&](const char * suffix) {
+            snprintf(name, sizeof(name), "blk.%d.%s.weight", il, suffix);
+            return name;
+        };
+        add_tensor(gctx, ctx, rng, blk("attn_norm"),   n_embd, 0,      1.0f, 0.1f);
+        add_tensor(gctx, ctx, rng, blk("attn_q"),      n_embd, n_embd, 0.0f, 0.1f);
+        add_tensor(gctx, ctx, rng, blk("attn_k"),      n_embd, n_embd, 0.0f, 0.1f);
+        add_tensor(gctx, ctx, rng, blk("attn_v"),      n_embd, n_embd, 0.0f, 0.1f);
+        add_tensor(gctx, ctx, rng, blk("attn_output"), n_embd, n_embd, 0.0f, 0.1f);
+        add_tensor(gctx, ctx, rng, blk("ffn_norm"),    n_embd, 0,      1.0f, 0.1f);
+        add_tensor(gctx, ctx, rng, blk("ffn_gate"),    n_embd, n_ff,   0.0f, 0.1f);
+        add_tensor(gctx, ctx, rng, blk("ffn_down"),    n_ff,   n_embd, 0.0f, 0.1f);
+        add_tensor(gctx, ctx, rng, blk("ffn_up"),      n_embd, n_ff,   0.0f, 0.1f);
+    }
+
+    lm_gguf_write_to_file(gctx, fname, false);
+    lm_gguf_free(gctx);
+    lm_ggml_free(ctx);
+}
+
+static struct llama_context * new_context(struct llama_model * model, bool logits_all) {
+    auto cparams = llama_context_default_params();
+    cparams.n_ctx           = 64;
+    cparams.n_batch         = 32;
+    cparams.seed            = 1;
+    cparams.n_threads       = 1;
+    cparams.n_threads_batch = 1;
+    cparams.logits_all      = logits_all;
+    cparams.embedding       = true;
+    return llama_new_context_with_model(model, cparams);
+}
+
+static float max_diff(const float * a, const float * b, int n) {
+    float diff = 0.0f;
+    for (int i = 0; i < n; ++i) {
+        diff = std::max(diff, std::fabs(a[i] - b[i]));
+    }
+    return diff;
+}
+
+int main(void) {
+    write_model();
+
+    llama_backend_init(false);
+
+    auto mparams = llama_model_default_params();
+    mparams.use_mmap = false;
+
+    struct llama_model * model = llama_load_model_from_file(fname, mparams);
+    if (model == NULL) {
+        fprintf(stderr, "%s: failed to load the model\n", __func__);
+        return 1;
+    }
+
+    std::vector<llama_token> tokens(n_tokens);
+    for (int i = 0; i < n_tokens; ++i) {
+        tokens[i] = 4 + (i*7) % (n_vocab - 4);
+    }
+
+    // reference: one token per decode
+    std::vector<float> ref_logits(n_tokens*n_vocab);
+    std::vector<float> ref_embd(n_embd);
+    {
+        struct llama_context * ctx = new_context(model, false);
+        for (int i = 0; i < n_tokens; ++i) {
+            if (llama_decode(ctx, llama_batch_get_one(&tokens[i], 1, i, 0)) != 0) {
+                fprintf(stderr, "%s: decode of token %d failed\n", __func__, i);
+                return 1;
+            }
+            memcpy(ref_logits.data() + i*n_vocab, llama_get_logits_ith(ctx, 0), n_vocab*sizeof(float));
+        }
+        memcpy(ref_embd.data(), llama_get_embeddings(ctx), n_embd*sizeof(float));
+        llama_free(ctx);
+    }
+
+    const float tolerance = 1e-3f;
+    int ret = 0;
+
+    // logits_all without batch.logits: every row
+    {
+        struct llama_context * ctx = new_context(model, true);
+        if (llama_decode(ctx, llama_batch_get_one(tokens.data(), n_tokens, 0, 0)) != 0) {
+            fprintf(stderr, "%s: logits_all decode failed\n", __func__);
+            return 1;
+        }
+        for (int i = 0; i < n_tokens; ++i) {
+            const float diff = max_diff(llama_get_logits(ctx) + i*n_vocab, ref_logits.data() + i*n_vocab, n_vocab);
+            if (diff > tolerance) {
+                fprintf(stderr, "%s: logits_all: row %d differs from the reference by %f\n", __func__, i, diff);
+                ret = 1;
+            }
+        }
+        const float diff = max_diff(llama_get_embeddings(ctx), ref_embd.data(), n_embd);
+        if (diff > tolerance) {
+            fprintf(stderr, "%s: logits_all: the embedding differs from the reference by %f\n", __func__, diff);
+            ret = 1;
+        }
+        llama_free(ctx);
+    }
+
+    // batch.logits flagging every third token but not the last one, with and without logits_all
+    for (bool logits_all : { true, false }) {
+        struct llama_context * ctx = new_context(model, logits_all);
+
+        llama_batch batch = llama_batch_init(n_tokens, 0, 1);
+        batch.n_tokens = n_tokens;
+        for (int i = 0; i < n_tokens; ++i) {
+            batch.token[i]     = tokens[i];
+            batch.pos[i]       = i;
+            batch.n_seq_id[i]  = 1;
+            batch.seq_id[i][0] = 0;
+            batch.logits[i]    = i % 3 == 0 && i != n_tokens - 1;
+        }
+        if (llama_decode(ctx, batch) != 0) {
+            fprintf(stderr, "%s: flagged decode failed\n", __func__);
+            return 1;
+        }
+        for (int i = 0; i < n_tokens; ++i) {
+            if (!batch.logits[i]) {
+                continue;
+            }
+            const float diff = max_diff(llama_get_logits_ith(ctx, i), ref_logits.data() + i*n_vocab, n_vocab);
+            if (diff > tolerance) {
+                fprintf(stderr, "%s: flagged, logits_all %d: row %d differs from the reference by %f\n", __func__, logits_all, i, diff);
+                ret = 1;
+            }
+        }
+        const float diff = max_diff(llama_get_embeddings(ctx), ref_embd.data(), n_embd);
+        if (diff > tolerance) {
+            fprintf(stderr, "%s: flagged, logits_all %d: the embedding differs from the reference by %f\n", __func__, logits_all, diff);
+            ret = 1;
+        }
+        llama_batch_free(batch);
+        llama_free(ctx);
+    }
+
+    llama_free_model(model);
+    llama_backend_free();
+
+    remove(fname);
+
+    return ret;
+}
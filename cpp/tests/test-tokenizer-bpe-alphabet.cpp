@@ -0,0 +1,114 @@
+// loads a byte-level BPE vocab with a normal token outside of the byte-level alphabet,
+// like the CJK tokens some converted vocabs carry verbatim
+
+#include "ggml.h"
+#include "llama.h"
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+static const char * fname = "test-tokenizer-bpe-alphabet.gguf";
+
+static std::string codepoint_to_utf8(int cp) {
+    std::string s;
+    if (cp < 0x80) {
+        s += (char) cp;
+    } else {
+        s += (char) (0xc0 | (cp >> 6));
+        s += (char) (0x80 | (cp & 0x3f));
+    }
+    return s;
+}
+
+static void write_vocab(void) {
+    // gpt-2 bytes_to_unicode
+    std::vector<std::string> byte_to_unicode(256);
+    int n = 0;
+    for (int b = 0; b < 256; ++b) {
+        const bool printable = (b >= '!' && b <= '~') || (b >= 0xa1 && b <= 0xac) || (b >= 0xae && b <= 0xff);
+        byte_to_unicode[b] = codepoint_to_utf8(printable ? b : 256 + n++);
+    }
+
+    std::vector<std::string> tokens = byte_to_unicode;
+    tokens.push_back("\xe4\xb8\xad"); // U+4E2D
+    tokens.push_back("<|endoftext|>");
+
+    std::vector<int32_t> types(tokens.size(), LLAMA_TOKEN_TYPE_NORMAL);
+    types.back() = LLAMA_TOKEN_TYPE_CONTROL;
+
+    std::vector<const char *> token_ptrs;
+    for (const auto & token : tokens) {
+        token_ptrs.push_back(token.c_str());
+    }
+    const char * merges[] = { "h e" };
+
+    struct lm_gguf_context * ctx = lm_gguf_init_empty();
+    lm_gguf_set_val_str(ctx, "general.architecture", "llama");
+    lm_gguf_set_val_u32(ctx, "llama.context_length", 128);
+    lm_gguf_set_val_u32(ctx, "llama.embedding_length", 64);
+    lm_gguf_set_val_u32(ctx, "llama.feed_forward_length", 128);
+    lm_gguf_set_val_u32(ctx, "llama.attention.head_count", 4);
+    lm_gguf_set_val_u32(ctx, "llama.block_count", 1);
+    lm_gguf_set_val_f32(ctx, "llama.attention.layer_norm_rms_epsilon", 1e-5f);
+    lm_gguf_set_val_str(ctx, "tokenizer.ggml.model", "gpt2");
+    lm_gguf_set_arr_str(ctx, "tokenizer.ggml.tokens", token_ptrs.data(), token_ptrs.size());
+    lm_gguf_set_arr_data(ctx, "tokenizer.ggml.token_type", LM_GGUF_TYPE_INT32, types.data(), types.size());
+    lm_gguf_set_arr_str(ctx, "tokenizer.ggml.merges", merges, 1);
+    lm_gguf_set_val_u32(ctx, "tokenizer.ggml.bos_token_id", tokens.size() - 1);
+    lm_gguf_set_val_u32(ctx, "tokenizer.ggml.eos_token_id", tokens.size() - 1);
+    lm_gguf_write_to_file(ctx, fname, false);
+    lm_gguf_free(ctx);
+}
+
+static std::string token_to_piece(const struct llama_model * model, llama_token token) {
+    std::vector<char> buf(16);
+    int n = llama_token_to_piece(model, token, buf.data(), buf.size());
+    if (n < 0) {
+        buf.resize(-n);
+        n = llama_token_to_piece(model, token, buf.data(), buf.size());
+    }
+    return std::string(buf.data(), n);
+}
+
+int main(void) {
+    write_vocab();
+
+    llama_backend_init(false);
+
+    auto mparams = llama_model_default_params();
+    mparams.vocab_only = true;
+
+    struct llama_model * model = llama_load_model_from_file(fname, mparams);
+    if (model == NULL) {
+        fprintf(stderr, "%s: failed to load the vocab\n", __func__);
+        return 1;
+    }
+
+    int ret = 0;
+
+    // the token outside of the alphabet keeps its raw text
+    const std::string piece = token_to_piece(model, 256);
+    if (piece != "\xe4\xb8\xad") {
+        fprintf(stderr, "%s: piece of token 256 is '%s', expected the raw token text\n", __func__, piece.c_str());
+        ret = 1;
+    }
+
+    // the byte-level tokens around it still decode to their bytes
+    for (int b = 0; b < 256; ++b) {
+        const std::string byte_piece = token_to_piece(model, b);
+        if (byte_piece.size() != 1 || (unsigned char) byte_piece[0] != b) {
+            fprintf(stderr, "%s: piece of token %d does not decode to its byte\n", __func__, b);
+            ret = 1;
+            break;
+        }
+    }
+
+    llama_free_model(model);
+    llama_backend_free();
+
+    remove(fname);
+
+    return ret;
+}
@@ -1,5 +1,6 @@
 ﻿#pragma once
 
+#include <algorithm>
 #include <cassert>
 #include <stdexcept>
 #include <vector>
@@ -290,15 +291,6 @@ static uint32_t codepoint_from_utf8(const std::string & utf8, size_t & offset) {
     throw std::invalid_argument("invalid string");
 }
 
-static std::vector<uint32_t> codepoints_from_utf8(const std::string & utf8) {
-    std::vector<uint32_t> result;
-    size_t offset = 0;
-    while (offset < utf8.size()) {
-        result.push_back(codepoint_from_utf8(utf8, offset));
-    }
-    return result;
-}
-
 static std::vector<uint16_t> codepoint_to_utf16(uint32_t cp) {
     std::vector<uint16_t> result;
     if (/* 0x0000 <= cp && */ cp <= 0xffff) {
@@ -357,49 +349,72 @@ static std::vector<uint32_t> codepoints_from_utf16(const std::vector<uint16_t> &
 #define CODEPOINT_TYPE_SYMBOL 6
 #define CODEPOINT_TYPE_CONTROL 7
 
-static std::unordered_map<uint32_t, int> codepoint_type_map() {
-    std::unordered_map<uint32_t, int> codepoint_types;
-    for (auto p : digit_ranges) {
-        for(auto i = p.first; i <= p.second; ++ i)
-            codepoint_types[i] = CODEPOINT_TYPE_DIGIT;
-    }
-    for(auto p : letter_ranges) {
-        for(auto i = p.first; i <= p.second; ++ i)
-            codepoint_types[i] = CODEPOINT_TYPE_LETTER;
-    }
-    for(auto p : whitespace_ranges) {
-        for(auto i = p.first; i <= p.second; ++ i)
-            codepoint_types[i] = CODEPOINT_TYPE_WHITESPACE;
-    }
-    for(auto p : accent_mark_ranges) {
-        for(auto i = p.first; i <= p.second; ++ i)
-            codepoint_types[i] = CODEPOINT_TYPE_ACCENT_MARK;
-    }
-    for(auto p : punctuation_ranges) {
-        for(auto i = p.first; i <= p.second; ++ i)
-            codepoint_types[i] = CODEPOINT_TYPE_PUNCTUATION;
-    }
-    for (auto p : symbol_ranges) {
-        for (auto i = p.first; i <= p.second; ++i)
-            codepoint_types[i] = CODEPOINT_TYPE_SYMBOL;
+// the codepoint type ranges flattened for lookups: one byte per codepoint of the basic multilingual plane,
+// runs of equal type above it. Read-only after construction, so safe to use from several threads
+struct codepoint_type_table {
+    struct range {
+        uint32_t first;
+        uint32_t last;
+        int      type;
+    };
+
+    std::vector<uint8_t> bmp;
+    std::vector<range>   ranges;
+
+    codepoint_type_table() {
+        // filled in this order, a codepoint listed under several types keeps the last one
+        const std::pair<const std::vector<std::pair<uint32_t, uint32_t>> *, int> types[] = {
+            { &digit_ranges,       CODEPOINT_TYPE_DIGIT       },
+            { &letter_ranges,      CODEPOINT_TYPE_LETTER      },
+            { &whitespace_ranges,  CODEPOINT_TYPE_WHITESPACE  },
+            { &accent_mark_ranges, CODEPOINT_TYPE_ACCENT_MARK },
+            { &punctuation_ranges, CODEPOINT_TYPE_PUNCTUATION },
+            { &symbol_ranges,      CODEPOINT_TYPE_SYMBOL      },
+            { &control_ranges,     CODEPOINT_TYPE_CONTROL     },
+        };
+
+        uint32_t n_codepoints = 0x10000;
+        for (const auto & t : types) {
+            for (const auto & p : *t.first) {
+                n_codepoints = std::max(n_codepoints, p.second + 1);
+            }
+        }
+
+        std::vector<uint8_t> all(n_codepoints, CODEPOINT_TYPE_UNIDENTIFIED);
+        for (const auto & t : types) {
+            for (const auto & p : *t.first) {
+                std::fill(all.begin() + p.first, all.begin() + p.second + 1, (uint8_t) t.second);
+            }
+        }
+
+        bmp.assign(all.begin(), all.begin() + 0x10000);
+        for (uint32_t cp = 0x10000; cp < n_codepoints; ++cp) {
+            if (all[cp] == CODEPOINT_TYPE_UNIDENTIFIED) {
+                continue;
+            }
+            if (!ranges.empty() && ranges.back().last + 1 == cp && ranges.back().type == all[cp]) {
+                ranges.back().last = cp;
+            } else {
+                ranges.push_back({cp, cp, all[cp]});
+            }
+        }
     }
-    for(auto p : control_ranges) {
-        for(auto i = p.first; i <= p.second; ++ i)
-            codepoint_types[i] = CODEPOINT_TYPE_CONTROL;
+
+    int type(uint32_t cp) const {
+        if (cp < 0x10000) {
+            return bmp[cp];
+        }
+        auto it = std::upper_bound(ranges.begin(), ranges.end(), cp, [](uint32_t c, const range & r) { return c < r.first; });
+        if (it == ranges.begin() || cp > (--it)->last) {
+            return CODEPOINT_TYPE_UNIDENTIFIED;
+        }
+        return it->type;
     }
-    return codepoint_types;
-}
+};
 
 static int codepoint_type(uint32_t cp) {
-    static std::unordered_map<uint32_t, int> codepoint_types = codepoint_type_map();
-    return codepoint_types[cp];
-}
-
-static int codepoint_type(const std::string & utf8) {
-    if (utf8.length() == 0)
-        return CODEPOINT_TYPE_UNIDENTIFIED;
-    size_t offset = 0;
-    return codepoint_type(codepoint_from_utf8(utf8, offset));
+    static const codepoint_type_table table;
+    return table.type(cp);
 }
 
 static std::unordered_map<uint8_t, std::string> bytes_to_unicode_map_bpe() {
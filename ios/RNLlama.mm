@@ -8,11 +8,56 @@
 @implementation RNLlama
 
 NSMutableDictionary *llamaContexts;
+NSMutableDictionary *llamaLoadingContexts; // contextId -> cancelled
 double llamaContextLimit = 1;
 dispatch_queue_t llamaDQueue;
 
+// guards llamaContexts and llamaLoadingContexts, which are also used from the loading and background queues
+static NSObject *llamaContextsLock() {
+    static NSObject *lock;
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        lock = [[NSObject alloc] init];
+    });
+    return lock;
+}
+
+static RNLlamaContext *llamaContextForId(double contextId) {
+    @synchronized (llamaContextsLock()) {
+        return [[llamaContexts[[NSNumber numberWithDouble:contextId]] retain] autorelease];
+    }
+}
+
 RCT_EXPORT_MODULE()
 
+- (instancetype)init {
+    self = [super init];
+    if (self) {
+        [[NSNotificationCenter defaultCenter] addObserver:self
+                                                 selector:@selector(applicationDidEnterBackground:)
+                                                     name:UIApplicationDidEnterBackgroundNotification
+                                                   object:nil];
+    }
+    return self;
+}
+
+- (void)dealloc {
+    [[NSNotificationCenter defaultCenter] removeObserver:self];
+    [super dealloc];
+}
+
+- (void)applicationDidEnterBackground:(NSNotification *)notification {
+    @synchronized (llamaContextsLock()) {
+        if (llamaContexts == nil || [llamaContexts count] == 0) {
+            return;
+        }
+    }
+    // release the compute buffers and the free KV cache pages of the idle contexts while in the background
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0), ^{
+        rnllama::memory_manager().trim_idle();
+    });
+}
+
 RCT_EXPORT_METHOD(setContextLimit:(double)limit
                  withResolver:(RCTPromiseResolveBlock)resolve
                  withRejecter:(RCTPromiseRejectBlock)reject)
@@ -21,7 +66,27 @@ RCT_EXPORT_METHOD(setContextLimit:(double)limit
     resolve(nil);
 }
 
-RCT_EXPORT_METHOD(initContext:(NSDictionary *)contextParams
+RCT_EXPORT_METHOD(setMemoryBudget:(double)budgetMb
+                 withResolver:(RCTPromiseResolveBlock)resolve
+                 withRejecter:(RCTPromiseRejectBlock)reject)
+{
+    // idle contexts over the budget are evicted to session files in the temporary directory
+    NSString *evictDir = [NSTemporaryDirectory() stringByAppendingPathComponent:@"rnllama"];
+    [[NSFileManager defaultManager] createDirectoryAtPath:evictDir withIntermediateDirectories:YES attributes:nil error:nil];
+    rnllama::memory_manager().set_budget((size_t) (budgetMb * 1024 * 1024), [evictDir UTF8String]);
+    resolve(nil);
+}
+
+RCT_EXPORT_METHOD(setIdleTrimTimeout:(double)timeoutMs
+                 withResolver:(RCTPromiseResolveBlock)resolve
+                 withRejecter:(RCTPromiseRejectBlock)reject)
+{
+    rnllama::memory_manager().set_idle_timeout((int64_t) timeoutMs);
+    resolve(nil);
+}
+
+RCT_EXPORT_METHOD(initContext:(double)contextId
+                 withContextParams:(NSDictionary *)contextParams
                  withResolver:(RCTPromiseResolveBlock)resolve
                  withRejecter:(RCTPromiseRejectBlock)reject)
 {
@@ -29,39 +94,98 @@ RCT_EXPORT_METHOD(initContext:(NSDictionary *)contextParams
       llamaDQueue = dispatch_queue_create("com.rnllama", DISPATCH_QUEUE_SERIAL);
     }
 
-    if (llamaContexts == nil) {
-        llamaContexts = [[NSMutableDictionary alloc] init];
-    }
+    NSNumber *contextIdNumber = [NSNumber numberWithDouble:contextId];
+    BOOL useProgressCallback = [contextParams[@"use_progress_callback"] boolValue];
 
-    if (llamaContextLimit > 0 && [llamaContexts count] >= llamaContextLimit) {
-        reject(@"llama_error", @"Context limit reached", nil);
-        return;
-    }
+    // a loading context takes its slot of the limit until the load fails or is cancelled
+    @synchronized (llamaContextsLock()) {
+        if (llamaContexts == nil) {
+            llamaContexts = [[NSMutableDictionary alloc] init];
+        }
+        if (llamaLoadingContexts == nil) {
+            llamaLoadingContexts = [[NSMutableDictionary alloc] init];
+        }
 
-    RNLlamaContext *context = [RNLlamaContext initWithParams:contextParams];
-    if (![context isModelLoaded]) {
-        reject(@"llama_cpp_error", @"Failed to load the model", nil);
-        return;
+        if (llamaContextLimit > 0 && [llamaContexts count] + [llamaLoadingContexts count] >= llamaContextLimit) {
+            reject(@"llama_error", @"Context limit reached", nil);
+            return;
+        }
+        if (llamaContexts[contextIdNumber] != nil || llamaLoadingContexts[contextIdNumber] != nil) {
+            reject(@"llama_error", @"Context id already in use", nil);
+            return;
+        }
+        llamaLoadingContexts[contextIdNumber] = @NO;
     }
 
-    double contextId = (double) arc4random_uniform(1000000);
+    // load off the module queue, so that cancelInitContext can run meanwhile
+    dispatch_async(dispatch_get_global_queue(QOS_CLASS_USER_INITIATED, 0), ^{
+        __block int lastProgress = -1;
+        RNLlamaContext *context = [RNLlamaContext initWithParams:contextParams
+            onProgress:^BOOL(int progress) {
+                if (useProgressCallback && progress != lastProgress) {
+                    lastProgress = progress;
+                    dispatch_async(dispatch_get_main_queue(), ^{
+                        [self sendEventWithName:@"@RNLlama_onInitContextProgress"
+                            body:@{
+                                @"contextId": contextIdNumber,
+                                @"progress": @(progress)
+                            }
+                        ];
+                    });
+                }
+                @synchronized (llamaContextsLock()) {
+                    return ![llamaLoadingContexts[contextIdNumber] boolValue];
+                }
+            }
+        ];
 
-    NSNumber *contextIdNumber = [NSNumber numberWithDouble:contextId];
-    [llamaContexts setObject:context forKey:contextIdNumber];
+        // the slot goes from the loading to the loaded contexts, or is released, in one step
+        BOOL cancelled;
+        BOOL loaded = [context isModelLoaded];
+        @synchronized (llamaContextsLock()) {
+            cancelled = [llamaLoadingContexts[contextIdNumber] boolValue];
+            [llamaLoadingContexts removeObjectForKey:contextIdNumber];
+            if (!cancelled && loaded) {
+                [llamaContexts setObject:context forKey:contextIdNumber];
+            }
+        }
+        if (cancelled) {
+            [context invalidate];
+            reject(@"llama_error", @"Context initialization cancelled", nil);
+            return;
+        }
+        if (!loaded) {
+            reject(@"llama_cpp_error", @"Failed to load the model", nil);
+            return;
+        }
 
-    resolve(@{
-        @"contextId": contextIdNumber,
-        @"gpu": @([context isMetalEnabled]),
-        @"reasonNoGPU": [context reasonNoMetal],
+        resolve(@{
+            @"contextId": contextIdNumber,
+            @"gpu": @([context isMetalEnabled]),
+            @"reasonNoGPU": [context reasonNoMetal],
+        });
     });
 }
 
+RCT_EXPORT_METHOD(cancelInitContext:(double)contextId
+                 withResolver:(RCTPromiseResolveBlock)resolve
+                 withRejecter:(RCTPromiseRejectBlock)reject)
+{
+    NSNumber *contextIdNumber = [NSNumber numberWithDouble:contextId];
+    @synchronized (llamaContextsLock()) {
+        if (llamaLoadingContexts[contextIdNumber] != nil) {
+            llamaLoadingContexts[contextIdNumber] = @YES;
+        }
+    }
+    resolve(nil);
+}
+
 RCT_EXPORT_METHOD(loadSession:(double)contextId
                  withFilePath:(NSString *)filePath
                  withResolver:(RCTPromiseResolveBlock)resolve
                  withRejecter:(RCTPromiseRejectBlock)reject)
 {
-    RNLlamaContext *context = llamaContexts[[NSNumber numberWithDouble:contextId]];
+    RNLlamaContext *context = llamaContextForId(contextId);
     if (context == nil) {
         reject(@"llama_error", @"Context not found", nil);
         return;
@@ -87,7 +211,7 @@ RCT_EXPORT_METHOD(saveSession:(double)contextId
                  withResolver:(RCTPromiseResolveBlock)resolve
                  withRejecter:(RCTPromiseRejectBlock)reject)
 {
-    RNLlamaContext *context = llamaContexts[[NSNumber numberWithDouble:contextId]];
+    RNLlamaContext *context = llamaContextForId(contextId);
     if (context == nil) {
         reject(@"llama_error", @"Context not found", nil);
         return;
@@ -110,6 +234,7 @@ RCT_EXPORT_METHOD(saveSession:(double)contextId
 
 - (NSArray *)supportedEvents {
   return@[
+    @"@RNLlama_onInitContextProgress",
     @"@RNLlama_onToken",
   ];
 }
@@ -119,7 +244,7 @@ RCT_EXPORT_METHOD(completion:(double)contextId
                  withResolver:(RCTPromiseResolveBlock)resolve
                  withRejecter:(RCTPromiseRejectBlock)reject)
 {
-    RNLlamaContext *context = llamaContexts[[NSNumber numberWithDouble:contextId]];
+    RNLlamaContext *context = llamaContextForId(contextId);
     if (context == nil) {
         reject(@"llama_error", @"Context not found", nil);
         return;
@@ -159,7 +284,7 @@ RCT_EXPORT_METHOD(stopCompletion:(double)contextId
                  withResolver:(RCTPromiseResolveBlock)resolve
                  withRejecter:(RCTPromiseRejectBlock)reject)
 {
-    RNLlamaContext *context = llamaContexts[[NSNumber numberWithDouble:contextId]];
+    RNLlamaContext *context = llamaContextForId(contextId);
     if (context == nil) {
         reject(@"llama_error", @"Context not found", nil);
         return;
@@ -173,7 +298,7 @@ RCT_EXPORT_METHOD(tokenize:(double)contextId
                   withResolver:(RCTPromiseResolveBlock)resolve
                   withRejecter:(RCTPromiseRejectBlock)reject)
 {
-    RNLlamaContext *context = llamaContexts[[NSNumber numberWithDouble:contextId]];
+    RNLlamaContext *context = llamaContextForId(contextId);
     if (context == nil) {
         reject(@"llama_error", @"Context not found", nil);
         return;
@@ -188,7 +313,7 @@ RCT_EXPORT_METHOD(detokenize:(double)contextId
                   withResolver:(RCTPromiseResolveBlock)resolve
                   withRejecter:(RCTPromiseRejectBlock)reject)
 {
-    RNLlamaContext *context = llamaContexts[[NSNumber numberWithDouble:contextId]];
+    RNLlamaContext *context = llamaContextForId(contextId);
     if (context == nil) {
         reject(@"llama_error", @"Context not found", nil);
         return;
@@ -201,7 +326,7 @@ RCT_EXPORT_METHOD(embedding:(double)contextId
                   withResolver:(RCTPromiseResolveBlock)resolve
                   withRejecter:(RCTPromiseRejectBlock)reject)
 {
-    RNLlamaContext *context = llamaContexts[[NSNumber numberWithDouble:contextId]];
+    RNLlamaContext *context = llamaContextForId(contextId);
     if (context == nil) {
         reject(@"llama_error", @"Context not found", nil);
         return;
@@ -219,7 +344,12 @@ RCT_EXPORT_METHOD(releaseContext:(double)contextId
                  withResolver:(RCTPromiseResolveBlock)resolve
                  withRejecter:(RCTPromiseRejectBlock)reject)
 {
-    RNLlamaContext *context = llamaContexts[[NSNumber numberWithDouble:contextId]];
+    RNLlamaContext *context;
+    @synchronized (llamaContextsLock()) {
+        NSNumber *contextIdNumber = [NSNumber numberWithDouble:contextId];
+        context = [llamaContexts[contextIdNumber] retain];
+        [llamaContexts removeObjectForKey:contextIdNumber];
+    }
     if (context == nil) {
         reject(@"llama_error", @"Context not found", nil);
         return;
@@ -227,7 +357,7 @@ RCT_EXPORT_METHOD(releaseContext:(double)contextId
     [context stopCompletion];
     dispatch_barrier_sync(llamaDQueue, ^{});
     [context invalidate];
-    [llamaContexts removeObjectForKey:[NSNumber numberWithDouble:contextId]];
+    [context release];
     resolve(nil);
 }
 
@@ -240,20 +370,29 @@ RCT_EXPORT_METHOD(releaseAllContexts:(RCTPromiseResolveBlock)resolve
 
 
 - (void)invalidate {
-    if (llamaContexts == nil) {
-        return;
+    NSArray *contexts;
+    @synchronized (llamaContextsLock()) {
+        if (llamaContexts == nil) {
+            return;
+        }
+
+        // the contexts still loading are invalidated once their load returns
+        for (NSNumber *contextId in [llamaLoadingContexts allKeys]) {
+            llamaLoadingContexts[contextId] = @YES;
+        }
+
+        contexts = [[llamaContexts allValues] retain];
+        [llamaContexts removeAllObjects];
+        [llamaContexts release];
+        llamaContexts = nil;
     }
 
-    for (NSNumber *contextId in llamaContexts) {
-        RNLlamaContext *context = llamaContexts[contextId];
+    for (RNLlamaContext *context in contexts) {
         [context stopCompletion];
         dispatch_barrier_sync(llamaDQueue, ^{});
         [context invalidate];
     }
-
-    [llamaContexts removeAllObjects];
-    [llamaContexts release];
-    llamaContexts = nil;
+    [contexts release];
 
     if (llamaDQueue != nil) {
         dispatch_release(llamaDQueue);
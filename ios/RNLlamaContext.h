@@ -12,7 +12,7 @@
     rnllama::llama_rn_context * llama;
 }
 
-+ (instancetype)initWithParams:(NSDictionary *)params;
++ (instancetype)initWithParams:(NSDictionary *)params onProgress:(BOOL (^)(int progress))onProgress;
 - (bool)isMetalEnabled;
 - (NSString *)reasonNoMetal;
 - (bool)isModelLoaded;
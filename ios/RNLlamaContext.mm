@@ -3,7 +3,7 @@
 
 @implementation RNLlamaContext
 
-+ (instancetype)initWithParams:(NSDictionary *)params {
++ (instancetype)initWithParams:(NSDictionary *)params onProgress:(BOOL (^)(int progress))onProgress {
     // llama_backend_init(false);
     gpt_params defaultParams;
 
@@ -16,6 +16,9 @@
     if (params[@"embedding"] && [params[@"embedding"] boolValue]) {
         defaultParams.embedding = true;
     }
+    if (params[@"embedding_only"] && [params[@"embedding_only"] boolValue]) {
+        defaultParams.embedding_only = true;
+    }
 
     if (params[@"n_ctx"]) defaultParams.n_ctx = [params[@"n_ctx"] intValue];
     if (params[@"use_mlock"]) defaultParams.use_mlock = [params[@"use_mlock"]boolValue];
@@ -68,6 +71,13 @@
     if (params[@"rope_freq_base"]) defaultParams.rope_freq_base = [params[@"rope_freq_base"] floatValue];
     if (params[@"rope_freq_scale"]) defaultParams.rope_freq_scale = [params[@"rope_freq_scale"] floatValue];
 
+    if (params[@"flash_attn"]) defaultParams.flash_attn = [params[@"flash_attn"] boolValue];
+
+    if (params[@"repack_weights"]) defaultParams.repack_weights = [params[@"repack_weights"] boolValue];
+    if (params[@"stream_budget_mb"]) defaultParams.stream_budget_mb = [params[@"stream_budget_mb"] intValue];
+    if (params[@"compute_cap_mb"]) defaultParams.compute_cap_mb = [params[@"compute_cap_mb"] intValue];
+    if (params[@"model_cache_path"]) defaultParams.model_cache_path = [params[@"model_cache_path"] UTF8String];
+
     int nThreads = params[@"n_threads"] ? [params[@"n_threads"] intValue] : 0;
     const int maxThreads = (int) [[NSProcessInfo processInfo] processorCount];
     // Use 2 threads by default on 4-core devices, 4 threads on more cores
@@ -78,7 +88,14 @@
     if (context->llama == nullptr) {
         context->llama = new rnllama::llama_rn_context();
     }
+    if (onProgress) {
+        // progress in percent, returning NO cancels the load
+        context->llama->on_load_progress = [onProgress](float progress) {
+            return (bool) onProgress((int) (progress * 100));
+        };
+    }
     context->is_model_loaded = context->llama->loadModel(defaultParams);
+    context->llama->on_load_progress = nullptr;
     context->is_metal_enabled = isMetalEnabled;
     context->reason_no_metal = reasonNoMetal;
     return context;
@@ -125,6 +142,11 @@
 - (NSDictionary *)completion:(NSDictionary *)params
     onToken:(void (^)(NSMutableDictionary * tokenResult))onToken
 {
+    rnllama::llama_rn_context_use use(llama);
+    if (!use.ok) {
+        @throw [NSException exceptionWithName:@"LlamaException" reason:@"Failed to restore the evicted context" userInfo:nil];
+    }
+
     llama->rewind();
 
     llama_reset_timings(llama->ctx);
@@ -133,6 +155,13 @@
 
     llama->params.prompt = [prompt UTF8String];
 
+    if (params[@"prompt_segments"]) {
+        NSArray *promptSegments = params[@"prompt_segments"];
+        for (NSString *s in promptSegments) {
+            llama->prompt_segments.push_back([s UTF8String]);
+        }
+    }
+
     if (params[@"n_threads"]) {
         int nThreads = params[@"n_threads"] ? [params[@"n_threads"] intValue] : llama->params.n_threads;
         const int maxThreads = (int) [[NSProcessInfo processInfo] processorCount];
@@ -211,14 +240,10 @@
         if (token_with_probs.tok == -1 || llama->multibyte_pending > 0) {
             continue;
         }
-        const std::string token_text = llama_token_to_piece(llama->ctx, token_with_probs.tok);
-
         size_t pos = std::min(sent_count, llama->generated_text.size());
 
-        const std::string str_test = llama->generated_text.substr(pos);
         bool is_stop_full = false;
-        size_t stop_pos =
-            llama->findStoppingStrings(str_test, token_text.size(), rnllama::STOP_FULL);
+        size_t stop_pos = llama->findStoppingStrings(pos, rnllama::STOP_FULL);
         if (stop_pos != std::string::npos) {
             is_stop_full = true;
             llama->generated_text.erase(
@@ -227,8 +252,7 @@
             pos = std::min(sent_count, llama->generated_text.size());
         } else {
             is_stop_full = false;
-            stop_pos = llama->findStoppingStrings(str_test, token_text.size(),
-                rnllama::STOP_PARTIAL);
+            stop_pos = llama->findStoppingStrings(pos, rnllama::STOP_PARTIAL);
         }
 
         if (
@@ -295,7 +319,11 @@
 }
 
 - (NSArray *)tokenize:(NSString *)text {
-    const std::vector<llama_token> toks = llama_tokenize(llama->ctx, [text UTF8String], false);
+    rnllama::llama_rn_context_use use(llama);
+    if (!use.ok) {
+        @throw [NSException exceptionWithName:@"LlamaException" reason:@"Failed to restore the evicted context" userInfo:nil];
+    }
+    const std::vector<llama_token> toks = llama_tokenize(llama->ctx, [text UTF8String], false, false, llama->params.n_threads);
     NSMutableArray *result = [[NSMutableArray alloc] init];
     for (llama_token tok : toks) {
         [result addObject:@(tok)];
@@ -304,6 +332,10 @@
 }
 
 - (NSString *)detokenize:(NSArray *)tokens {
+    rnllama::llama_rn_context_use use(llama);
+    if (!use.ok) {
+        @throw [NSException exceptionWithName:@"LlamaException" reason:@"Failed to restore the evicted context" userInfo:nil];
+    }
     std::vector<llama_token> toks;
     for (NSNumber *tok in tokens) {
         toks.push_back([tok intValue]);
@@ -316,6 +348,10 @@
     if (llama->params.embedding != true) {
         @throw [NSException exceptionWithName:@"LlamaException" reason:@"Embedding is not enabled" userInfo:nil];
     }
+    rnllama::llama_rn_context_use use(llama);
+    if (!use.ok) {
+        @throw [NSException exceptionWithName:@"LlamaException" reason:@"Failed to restore the evicted context" userInfo:nil];
+    }
 
     llama->rewind();
 
@@ -346,6 +382,10 @@
     if (![[NSFileManager defaultManager] fileExistsAtPath:path]) {
         @throw [NSException exceptionWithName:@"LlamaException" reason:@"Session file does not exist" userInfo:nil];
     }
+    rnllama::llama_rn_context_use use(llama);
+    if (!use.ok) {
+        @throw [NSException exceptionWithName:@"LlamaException" reason:@"Failed to restore the evicted context" userInfo:nil];
+    }
 
     size_t n_token_count_out = 0;
     llama->embd.resize(llama->params.n_ctx);
@@ -364,6 +404,10 @@
     if (!path || [path length] == 0) {
         @throw [NSException exceptionWithName:@"LlamaException" reason:@"Session path is empty" userInfo:nil];
     }
+    rnllama::llama_rn_context_use use(llama);
+    if (!use.ok) {
+        @throw [NSException exceptionWithName:@"LlamaException" reason:@"Failed to restore the evicted context" userInfo:nil];
+    }
     std::vector<llama_token> session_tokens = llama->embd;
     int default_size = session_tokens.size();
     int save_size = size > 0 && size <= default_size ? size : default_size;
@@ -7,6 +7,7 @@ if (!NativeModules.RNLlama) {
       gpu: false,
       reasonNoGPU: 'Test',
     })),
+    cancelInitContext: jest.fn(() => Promise.resolve()),
 
     completion: jest.fn(async (contextId, jobId) => {
       const testResult = {
@@ -150,6 +151,9 @@ if (!NativeModules.RNLlama) {
     })),
     saveSession: jest.fn(async () => 1),
 
+    setMemoryBudget: jest.fn(() => Promise.resolve()),
+    setIdleTrimTimeout: jest.fn(() => Promise.resolve()),
+
     releaseContext: jest.fn(() => Promise.resolve()),
     releaseAllContexts: jest.fn(() => Promise.resolve()),
 
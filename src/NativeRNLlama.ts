@@ -4,8 +4,10 @@ import { TurboModuleRegistry } from 'react-native';
 export type NativeContextParams = {
   model: string
   is_model_asset?: boolean
+  use_progress_callback?: boolean // emit @RNLlama_onInitContextProgress events while the model is loaded
 
   embedding?: boolean
+  embedding_only?: boolean // skip the output layer, completion is not available
 
   n_ctx?: number
   n_batch?: number
@@ -24,10 +26,18 @@ export type NativeContextParams = {
 
   rope_freq_base?: number
   rope_freq_scale?: number
+
+  flash_attn?: boolean // fused attention kernel, CPU only (ignored with Metal)
+  repack_weights?: boolean // repack Q4_0/Q8_0/Q4_K weights for faster CPU matmul, not memory-mapped (ignored with Metal)
+  use_hugepages?: boolean // back the weights, KV cache and compute buffer with transparent huge pages where the kernel allows (Android only)
+  stream_budget_mb?: number // > 0: stream the layer weights from the mapped file, keeping about this many MB resident (mmap, no mlock, no GPU)
+  compute_cap_mb?: number // > 0: cap the compute buffer, prompts are evaluated in micro-batches that fit
+  model_cache_path?: string // file for the prepared-model cache (vocab tables, compute buffer sizes), reused by later loads of the same model
 }
 
 export type NativeCompletionParams = {
   prompt: string
+  prompt_segments?: Array<string> // used instead of prompt, each segment is tokenized separately and cached
   grammar?: string
   stop?: Array<string> // -> antiprompt
 
@@ -113,7 +123,10 @@ export type NativeSessionLoadResult = {
 
 export interface Spec extends TurboModule {
   setContextLimit(limit: number): Promise<void>;
-  initContext(params: NativeContextParams): Promise<NativeLlamaContext>;
+  setMemoryBudget(budgetMb: number): Promise<void>;
+  setIdleTrimTimeout(timeoutMs: number): Promise<void>;
+  initContext(contextId: number, params: NativeContextParams): Promise<NativeLlamaContext>;
+  cancelInitContext(contextId: number): Promise<void>;
 
   loadSession(contextId: number, filepath: string): Promise<NativeSessionLoadResult>;
   saveSession(contextId: number, filepath: string, size: number): Promise<number>;
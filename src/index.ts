@@ -15,6 +15,7 @@ import { SchemaGrammarConverter, convertJsonSchemaToGrammar } from './grammar'
 
 export { SchemaGrammarConverter, convertJsonSchemaToGrammar }
 
+const EVENT_ON_INIT_CONTEXT_PROGRESS = '@RNLlama_onInitContextProgress'
 const EVENT_ON_TOKEN = '@RNLlama_onToken'
 
 let EventEmitter: NativeEventEmitter | DeviceEventEmitterStatic
@@ -36,6 +37,11 @@ type TokenNativeEvent = {
   tokenResult: TokenData
 }
 
+type InitContextProgressNativeEvent = {
+  contextId: number
+  progress: number
+}
+
 export type ContextParams = NativeContextParams
 
 export type CompletionParams = Omit<NativeCompletionParams, 'emit_partial_completion'>
@@ -125,20 +131,67 @@ export async function setContextLimit(limit: number): Promise<void> {
   return RNLlama.setContextLimit(limit)
 }
 
-export async function initLlama({
-  model,
-  is_model_asset: isModelAsset,
-  ...rest
-}: ContextParams): Promise<LlamaContext> {
+/**
+ * Limit the memory held by the models and contexts (0 for no limit).
+ * Idle contexts over the budget are saved to a session file and freed, least recently used first,
+ * and restored transparently on their next use.
+ */
+export async function setMemoryBudget(budgetMb: number): Promise<void> {
+  return RNLlama.setMemoryBudget(budgetMb)
+}
+
+/**
+ * Trim the contexts left idle for timeoutMs (0 to disable): their compute buffers and the free pages
+ * of their KV cache are released, and allocated again by the next call.
+ * Idle contexts are always trimmed when the app goes to the background.
+ */
+export async function setIdleTrimTimeout(timeoutMs: number): Promise<void> {
+  return RNLlama.setIdleTrimTimeout(timeoutMs)
+}
+
+let contextIdCounter = 0
+
+/**
+ * Load a model and create a context for it.
+ * `onProgress` is called with the loading progress in percent; returning `false` from it cancels
+ * the load, the weights read so far are freed and the returned promise is rejected.
+ */
+export async function initLlama(
+  {
+    model,
+    is_model_asset: isModelAsset,
+    ...rest
+  }: ContextParams,
+  onProgress?: (progress: number) => boolean | void,
+): Promise<LlamaContext> {
   let path = model
   if (path.startsWith('file://')) path = path.slice(7)
-  const { contextId, gpu, reasonNoGPU } =
-    await RNLlama.initContext({
+
+  // known before the native side answers, so that progress events and cancellation can refer to it
+  const contextId = Math.floor(Math.random() * 100000) * 1000 + (contextIdCounter % 1000)
+  contextIdCounter += 1
+
+  let progressListener: any = onProgress && EventEmitter.addListener(
+    EVENT_ON_INIT_CONTEXT_PROGRESS,
+    (evt: InitContextProgressNativeEvent) => {
+      if (evt.contextId !== contextId) return
+      if (onProgress(evt.progress) === false) {
+        RNLlama.cancelInitContext(contextId)
+      }
+    },
+  )
+  try {
+    const { contextId: id, gpu, reasonNoGPU } = await RNLlama.initContext(contextId, {
       model: path,
       is_model_asset: !!isModelAsset,
+      use_progress_callback: !!onProgress,
       ...rest,
     })
-  return new LlamaContext({ contextId, gpu, reasonNoGPU })
+    return new LlamaContext({ contextId: id, gpu, reasonNoGPU })
+  } finally {
+    progressListener?.remove()
+    progressListener = null
+  }
 }
 
 export async function releaseAllLlama(): Promise<void> {